@@ -0,0 +1,2048 @@
+// Host-side benchmark for the visitor/copy pipeline.
+//
+// Runs the measure, copy, and print passes over a corpus of keymaps and reports the
+// time per keymap and the memory requested via AllocMem().
+//
+// Usage: bench [-t <ms per benchmark>]
+
+#include "bench.h"
+#include "corpus.h"
+#include "visit.h"
+#include "copykeymap.h"
+#include "image.h"
+#include "imagefile.h"
+#include "hunkfile.h"
+#include "hunkstream.h"
+#include "convert.h"
+#include "visitors/measure.h"
+#include "visitors/copy.h"
+#include "visitors/print.h"
+#include "visitors/flatten.h"
+#include "visitors/reverse.h"
+#include "visitors/fingerprint.h"
+#include "translate.h"
+#include "patch.h"
+#include "overlay.h"
+#include "cache.h"
+#include "arena.h"
+#include "copystats.h"
+#include "keyset.h"
+#include "layout.h"
+#include <devices/inputevent.h>
+#include <proto/exec.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+static double targetNs = 200e6;     // Time to spend on each benchmark
+static int savedStdout = -1;        // Real stdout while print benchmarks are running
+
+ULONG benchCopySize;
+
+static ULONG translateSink;         // Accumulates results so lookups are not optimized away
+
+double nowNs(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+// Runs 'pfnBench' repeatedly (doubling the iteration count) until at least 'targetNs'
+// have elapsed.  Returns the average ns per iteration and the AllocMem() statistics of
+// the final round in '*pMem'.
+double runBenchmark(BenchFn pfnBench, struct KeyMap* pKeyMap, HostMemStats* pMem) {
+    for (ULONG iterations = 1; ; iterations <<= 1) {
+        memset(&hostMemStats, 0, sizeof(hostMemStats));
+        benchCopySize = 0;
+
+        const double start = nowNs();
+        pfnBench(pKeyMap, iterations);
+        const double elapsed = nowNs() - start;
+
+        if (elapsed >= targetNs || iterations >= (1UL << 30)) {
+            *pMem = hostMemStats;
+            pMem->allocCount /= iterations;
+            pMem->allocBytes /= iterations;
+            return elapsed / iterations;
+        }
+    }
+}
+
+void printResult(const char* pKeymap, const char* pBench, double ns, const HostMemStats* pMem) {
+    fprintf(stderr, "%-14s %-12s %12.1f %10lu %8lu %8lu\n", pKeymap, pBench, ns, pMem->allocBytes, pMem->allocCount, benchCopySize);
+}
+
+void printHeader(const char* pTitle) {
+    fprintf(stderr, "\n%s\n", pTitle);
+    fprintf(stderr, "%-14s %-12s %12s %10s %8s %8s\n", "keymap", "benchmark", "ns/keymap", "bytes", "allocs", "size");
+}
+
+void beginQuiet(void) {
+    fflush(stdout);
+    savedStdout = dup(STDOUT_FILENO);
+    const int devNull = open("/dev/null", O_WRONLY);
+    dup2(devNull, STDOUT_FILENO);
+    close(devNull);
+}
+
+void endQuiet(void) {
+    fflush(stdout);
+    dup2(savedStdout, STDOUT_FILENO);
+    close(savedStdout);
+}
+
+static void benchMeasure(struct KeyMap* pKeyMap, ULONG iterations) {
+    for (ULONG i = 0; i < iterations; i++) {
+        Sizes sizes = { 0 };
+        visit(pKeyMap, &sizes, MeasureVisitor);
+    }
+}
+
+static void benchCopy(struct KeyMap* pKeyMap, ULONG iterations) {
+    for (ULONG i = 0; i < iterations; i++) {
+        Sizes sizes;
+        struct KeyMap* pCopy = copyKeymap(pKeyMap, &sizes);
+        benchCopySize = calcCopySize(&sizes);
+        freeKeymap(pCopy, &sizes);
+    }
+}
+
+static void benchCopyDedup(struct KeyMap* pKeyMap, ULONG iterations) {
+    for (ULONG i = 0; i < iterations; i++) {
+        Sizes sizes;
+        struct KeyMap* pCopy = copyKeymapDedup(pKeyMap, &sizes);
+        benchCopySize = calcCopySize(&sizes);
+        freeKeymap(pCopy, &sizes);
+    }
+}
+
+// Fingerprints 'pKeyMap' (the check that lets the CLI skip copying an installed copy),
+// after verifying that every kind of copy has the same fingerprint as the source.
+static void benchFingerprint(struct KeyMap* pKeyMap, ULONG iterations) {
+    const ULONG expected = fingerprintKeymap(pKeyMap);
+    struct KeyMap* (*const copyFns[])(struct KeyMap*, Sizes*) = { copyKeymap, copyKeymapDedup };
+
+    for (int f = 0; f < (int)(sizeof(copyFns) / sizeof(copyFns[0])); f++) {
+        Sizes sizes;
+        struct KeyMap* pCopy = copyFns[f](pKeyMap, &sizes);
+        if (fingerprintKeymap(pCopy) != expected) {
+            fprintf(stderr, "fingerprint mismatch for copy %d\n", f);
+            exit(1);
+        }
+
+        // The fingerprint of any subset of keys must also match.
+        KeyFilter filter;
+        initKeyFilter(&filter, VISIT_STRING | VISIT_DEAD);
+        selectKeys(&filter, 0x10, 0x4F);
+        const UBYTE deadCharTableBytes = measureDeadCharTableBytes(pKeyMap);
+        if (fingerprintKeys(pCopy, &filter, deadCharTableBytes) != fingerprintKeys(pKeyMap, &filter, deadCharTableBytes)) {
+            fprintf(stderr, "filtered fingerprint mismatch for copy %d\n", f);
+            exit(1);
+        }
+        freeKeymap(pCopy, &sizes);
+    }
+
+    memset(&hostMemStats, 0, sizeof(hostMemStats));
+    for (ULONG i = 0; i < iterations; i++) {
+        translateSink += fingerprintKeymap(pKeyMap);
+    }
+}
+
+static void benchPrintFormat(struct KeyMap* pKeyMap, ULONG iterations, UBYTE format) {
+    Sizes sizes = { 0 };
+    visit(pKeyMap, &sizes, MeasureVisitor);
+
+    PrintContext print;
+    beginQuiet();
+    for (ULONG i = 0; i < iterations; i++) {
+        beginPrint(&print, pKeyMap, format, sizes.deadCharTableBytes);
+        visit(pKeyMap, &print, PrintVisitor);
+        endPrint(&print);
+    }
+    endQuiet();
+}
+
+static void benchPrint(struct KeyMap* pKeyMap, ULONG iterations) {
+    benchPrintFormat(pKeyMap, iterations, PRINT_TEXT);
+}
+
+static char printCapture[PRINT_BUFFER_SIZE];
+static ULONG printCaptured;
+
+static void capturePrint(const char* pChars, ULONG length) {
+    memcpy(printCapture + printCaptured, pChars, length);
+    printCaptured += length;
+}
+
+// Checks the JSON chars of a normal key (whose digits come from a lookup table) before
+// timing the JSON format.
+static void benchPrintJson(struct KeyMap* pKeyMap, ULONG iterations) {
+    static const char expected[] = "\"type\":\"normal\",\"chars\":[9,10,100,255]}\n";
+
+    PrintContext print;
+    beginPrint(&print, pKeyMap, PRINT_JSON, /* deadCharTableBytes: */ 0);
+    print.pfnSink = capturePrint;
+    printCaptured = 0;
+    PrintVisitor.pfnNormal(&print, /* rawKey: */ 0x20, /* kmType: */ 0, 0xFF640A09);
+    endPrint(&print);
+
+    if (printCaptured < sizeof(expected) - 1
+        || memcmp(printCapture + printCaptured - (sizeof(expected) - 1), expected, sizeof(expected) - 1) != 0) {
+        fprintf(stderr, "print-json mismatch\n");
+        exit(1);
+    }
+
+    benchPrintFormat(pKeyMap, iterations, PRINT_JSON);
+}
+
+// The traversal benchmarks compare the generic visit() (indirect calls through a Visitor)
+// against the DEFINE_VISIT() specializations of the same handlers.
+static void benchVisitMeasure(struct KeyMap* pKeyMap, ULONG iterations) {
+    for (ULONG i = 0; i < iterations; i++) {
+        Sizes sizes = { 0 };
+        visitMeasure(pKeyMap, &sizes);
+    }
+}
+
+// Measures only the dead keys (see measureDeadCharTableBytes()), which is all that
+// fingerprintKeymap() and diffKeymaps() need from a full measure.
+static void benchMeasureDead(struct KeyMap* pKeyMap, ULONG iterations) {
+    Sizes sizes = { 0 };
+    visitMeasure(pKeyMap, &sizes);
+    if (measureDeadCharTableBytes(pKeyMap) != sizes.deadCharTableBytes) {
+        fprintf(stderr, "deadCharTableBytes mismatch\n");
+        exit(1);
+    }
+
+    for (ULONG i = 0; i < iterations; i++) {
+        translateSink += measureDeadCharTableBytes(pKeyMap);
+    }
+}
+
+// Repeatedly copies the kmEntries and string/dead tables of 'pKeyMap' into the buffer of
+// an existing copy (so that only the traversal is measured).
+static void benchCopyTables(struct KeyMap* pKeyMap, ULONG iterations, BOOL specialized) {
+    Sizes sizes;
+    struct KeyMap* pCopy = copyKeymap(pKeyMap, &sizes);
+    UBYTE* pBuffer = (UBYTE*) pCopy + calcCopySize(&sizes) - calcBufferSize(&sizes);
+
+    for (ULONG i = 0; i < iterations; i++) {
+        CopyContext copy = { 0 };
+        copy.pKmEntry = pCopy->km_LoKeyMap;
+        copy.pBuffer = pBuffer;
+        copy.deadCharTableBytes = sizes.deadCharTableBytes;
+
+        if (specialized) {
+            visitCopyLo(pKeyMap, &copy);
+            copy.pKmEntry = pCopy->km_HiKeyMap;
+            visitCopyHi(pKeyMap, &copy);
+        } else {
+            visitLo(pKeyMap, &copy, CopyVisitor);
+            copy.pKmEntry = pCopy->km_HiKeyMap;
+            visitHi(pKeyMap, &copy, CopyVisitor);
+        }
+    }
+
+    freeKeymap(pCopy, &sizes);
+}
+
+static void benchGenericCopyTables(struct KeyMap* pKeyMap, ULONG iterations) {
+    benchCopyTables(pKeyMap, iterations, /* specialized: */ FALSE);
+}
+
+static void benchVisitCopyTables(struct KeyMap* pKeyMap, ULONG iterations) {
+    benchCopyTables(pKeyMap, iterations, /* specialized: */ TRUE);
+}
+
+static void benchVisitPrint(struct KeyMap* pKeyMap, ULONG iterations) {
+    Sizes sizes = { 0 };
+    visit(pKeyMap, &sizes, MeasureVisitor);
+
+    PrintContext print;
+    beginQuiet();
+    for (ULONG i = 0; i < iterations; i++) {
+        beginPrint(&print, pKeyMap, PRINT_TEXT, sizes.deadCharTableBytes);
+        visitPrint(pKeyMap, &print);
+        endPrint(&print);
+    }
+    endQuiet();
+}
+
+// The image benchmarks compare loading a prepared keymap image against copying the
+// keymap.  'imageSizes'/'pSavedImage'/'imagePath' are prepared by prepareImage().
+static Sizes imageSizes;
+static UBYTE* pSavedImage;
+static char imagePath[] = "/tmp/keymap-bench-XXXXXX";
+
+static void prepareImage(struct KeyMap* pKeyMap) {
+    struct KeyMap* pCopy = copyKeymap(pKeyMap, &imageSizes);
+    const ULONG imageSize = calcImageSize(&imageSizes);
+
+    free(pSavedImage);
+    pSavedImage = malloc(imageSize);
+    writeImage(pCopy, &imageSizes, pSavedImage);
+
+    writeImageFile(imagePath, pCopy, &imageSizes);
+    freeKeymap(pCopy, &imageSizes);
+}
+
+// Checks that relocateImage() rejects an image whose string/dead tables reach beyond the
+// block, and leaves the rejected image unchanged.  The first string/dead kmEntry of the lo
+// map is moved to the last byte of the block (within the block, but its descriptors are not).
+static void verifyImageBounds(void) {
+    const ULONG imageSize = calcImageSize(&imageSizes);
+    const ULONG blockSize = imageSize - sizeof(ImageHeader);
+    UBYTE* pBlock = pSavedImage + sizeof(ImageHeader);
+    const ULONG* pFields = (const ULONG*) pBlock;
+    const UBYTE* pTypes = pBlock + pFields[0];
+
+    int k = 0;
+    while (k < LO_MAP_LENGTH && ((pTypes[k] & KCF_NOP) || !(pTypes[k] & (KCF_STRING | KCF_DEAD)))) {
+        k++;
+    }
+    if (k == LO_MAP_LENGTH) {
+        return;
+    }
+
+    UBYTE* pImage = malloc(imageSize);
+    memcpy(pImage, pSavedImage, imageSize);
+    ((ULONG*)(pImage + sizeof(ImageHeader) + pFields[1]))[k] = blockSize - 1;
+
+    UBYTE* pCorrupt = malloc(imageSize);
+    memcpy(pCorrupt, pImage, imageSize);
+
+    if (relocateImage(pImage, imageSize) != NULL || memcmp(pImage, pCorrupt, imageSize) != 0) {
+        fprintf(stderr, "relocateImage bounds mismatch\n");
+        exit(1);
+    }
+
+    free(pCorrupt);
+    free(pImage);
+}
+
+static void benchImageWrite(struct KeyMap* pKeyMap, ULONG iterations) {
+    Sizes sizes;
+    struct KeyMap* pCopy = copyKeymap(pKeyMap, &sizes);
+    UBYTE* pImage = malloc(calcImageSize(&sizes));
+
+    for (ULONG i = 0; i < iterations; i++) {
+        writeImage(pCopy, &sizes, pImage);
+    }
+
+    free(pImage);
+    freeKeymap(pCopy, &sizes);
+}
+
+// Simulates loading with a single read: one allocation, one memcpy, one fixup pass.
+static void benchImageLoad(struct KeyMap* pKeyMap, ULONG iterations) {
+    const ULONG imageSize = calcImageSize(&imageSizes);
+
+    for (ULONG i = 0; i < iterations; i++) {
+        UBYTE* pImage = AllocMem(imageSize, MEMF_PUBLIC);
+        memcpy(pImage, pSavedImage, imageSize);
+
+        struct KeyMap* pLoaded = relocateImage(pImage, imageSize);
+        if (pLoaded == NULL) {
+            fprintf(stderr, "invalid image\n");
+            exit(1);
+        }
+
+        benchCopySize = imageSize;
+        FreeMem(pImage, imageSize);
+    }
+}
+
+static void benchImageMap(struct KeyMap* pKeyMap, ULONG iterations) {
+    for (ULONG i = 0; i < iterations; i++) {
+        MappedImage mapped;
+        if (mapImageFile(imagePath, &mapped) == NULL) {
+            fprintf(stderr, "cannot map %s\n", imagePath);
+            exit(1);
+        }
+
+        benchCopySize = mapped.size;
+        unmapImageFile(&mapped);
+    }
+}
+
+// Translates a key by decoding the KeyMap directly (the way a lookup works without a
+// FlatTable).  Used as the baseline for the FlatTable benchmarks and to verify them.
+static UBYTE translateDirect(struct KeyMap* pKeyMap, UBYTE rawKey, UBYTE quals, UBYTE* pOut) {
+    const BOOL isLo = rawKey < LO_MAP_LENGTH;
+    const UBYTE index = rawKey & (LO_MAP_LENGTH - 1);
+    const UBYTE type = isLo ? pKeyMap->km_LoKeyMapTypes[index] : pKeyMap->km_HiKeyMapTypes[index];
+    const ULONG entry = isLo ? pKeyMap->km_LoKeyMap[index] : pKeyMap->km_HiKeyMap[index];
+    const UBYTE* pCaps = isLo ? pKeyMap->km_LoCapsable : pKeyMap->km_HiCapsable;
+
+    UBYTE effective = quals & (FQ_SHIFT | FQ_ALT | FQ_CONTROL);
+    if ((quals & FQ_CAPSLOCK) && ((pCaps[index >> 3] >> (index & 7)) & 1)) {
+        effective |= FQ_SHIFT;
+    }
+
+    if (type & KCF_NOP) {
+        return 0;
+    } else if (type & KCF_STRING) {
+        const UBYTE* pDesc = (const UBYTE*) entry;
+        const UBYTE n = calcEntryIndex(type, effective);
+        const UBYTE len = pDesc[n << 1];
+        memcpy(pOut, pDesc + pDesc[(n << 1) + 1], len);
+        return len;
+    } else if (type & KCF_DEAD) {
+        const UBYTE* pDesc = (const UBYTE*) entry;
+        const UBYTE n = calcEntryIndex(type, effective);
+        switch (pDesc[n << 1]) {
+            case 0:         *pOut = pDesc[(n << 1) + 1]; return 1;
+            case DPF_DEAD:  return 0;
+            default:        *pOut = pDesc[pDesc[(n << 1) + 1]]; return 1;
+        }
+    } else if ((type & KC_VANILLA) == KC_VANILLA) {
+        *pOut = (UBYTE)(entry >> (calcEntryIndex(KCF_SHIFT | KCF_ALT, effective) << 3));
+        if (effective & FQ_CONTROL) {
+            *pOut &= 0x9F;
+        }
+        return 1;
+    } else {
+        *pOut = (UBYTE)(entry >> (calcEntryIndex(type, effective) << 3));
+        return 1;
+    }
+}
+
+static void verifyFlatTable(struct KeyMap* pKeyMap, const FlatTable* pTable) {
+    UBYTE expected[0x100];
+
+    for (UBYTE rawKey = 0; rawKey < FLAT_KEYS; rawKey++) {
+        for (UBYTE quals = 0; quals < FLAT_QUALS; quals++) {
+            const UBYTE* pActual;
+            const UBYTE len = translateKey(pTable, rawKey, quals, &pActual);
+            if (len != translateDirect(pKeyMap, rawKey, quals, expected) || memcmp(pActual, expected, len) != 0) {
+                fprintf(stderr, "FlatTable mismatch: key %02x quals %x\n", rawKey, quals);
+                exit(1);
+            }
+        }
+    }
+}
+
+static void benchFlatBuild(struct KeyMap* pKeyMap, ULONG iterations) {
+    for (ULONG i = 0; i < iterations; i++) {
+        FlatTable* pTable = buildFlatTable(pKeyMap);
+        benchCopySize = pTable->blockSize;
+        freeFlatTable(pTable);
+    }
+}
+
+// Checks the FlatTable of a keymap whose string keys share one long string across all of
+// their entries, which a copy (and so the pool) holds once per key rather than per entry.
+#define SHARED_STRING_LENGTH 200
+
+static void verifySharedStringFlat(KeymapBuilder* pBuilder) {
+    UBYTE desc[16];
+    UBYTE chars[SHARED_STRING_LENGTH];
+    for (int b = 0; b < SHARED_STRING_LENGTH; b++) {
+        chars[b] = 'a' + b % 26;
+    }
+    for (int n = 0; n < 8; n++) {
+        desc[n << 1] = SHARED_STRING_LENGTH;
+        desc[(n << 1) + 1] = sizeof(desc);
+    }
+
+    builderReset(pBuilder);
+    for (UBYTE rawKey = 0x10; rawKey < 0x14; rawKey++) {
+        setTable(pBuilder, rawKey, KCF_STRING | KC_VANILLA, desc, chars, sizeof(chars));
+    }
+
+    FlatTable* pTable = buildFlatTable(&pBuilder->keyMap);
+    if (pTable == NULL) {
+        fprintf(stderr, "buildFlatTable() failed for shared strings\n");
+        exit(1);
+    }
+    verifyFlatTable(&pBuilder->keyMap, pTable);
+    freeFlatTable(pTable);
+}
+
+// Translates every raw key with every qualifier combination.
+
+static void benchTranslateDirect(struct KeyMap* pKeyMap, ULONG iterations) {
+    UBYTE out[0x100];
+
+    for (ULONG i = 0; i < iterations; i++) {
+        for (UBYTE rawKey = 0; rawKey < FLAT_KEYS; rawKey++) {
+            for (UBYTE quals = 0; quals < FLAT_QUALS; quals++) {
+                translateSink += translateDirect(pKeyMap, rawKey, quals, out);
+            }
+        }
+    }
+}
+
+static void benchTranslateFlat(struct KeyMap* pKeyMap, ULONG iterations) {
+    FlatTable* pTable = buildFlatTable(pKeyMap);
+    verifyFlatTable(pKeyMap, pTable);
+
+    for (ULONG i = 0; i < iterations; i++) {
+        for (UBYTE rawKey = 0; rawKey < FLAT_KEYS; rawKey++) {
+            for (UBYTE quals = 0; quals < FLAT_QUALS; quals++) {
+                const UBYTE* pBytes;
+                translateSink += translateKey(pTable, rawKey, quals, &pBytes);
+            }
+        }
+    }
+
+    freeFlatTable(pTable);
+}
+
+static void benchReverseBuild(struct KeyMap* pKeyMap, ULONG iterations) {
+    for (ULONG i = 0; i < iterations; i++) {
+        ReverseIndex* pIndex = buildReverseIndex(pKeyMap);
+        benchCopySize = pIndex->blockSize;
+        freeReverseIndex(pIndex);
+    }
+}
+
+// Finds a key stroke producing 'ch' by translating every raw key/qualifier combination (the
+// way a lookup works without a ReverseIndex).  Returns the raw key, or NO_DEAD_KEY if none.
+static UBYTE findCharScan(struct KeyMap* pKeyMap, UBYTE ch, UBYTE* pQuals) {
+    UBYTE out[0x100];
+
+    for (UBYTE quals = 0; quals <= (FQ_SHIFT | FQ_ALT | FQ_CONTROL); quals++) {
+        for (UBYTE rawKey = 0; rawKey < FLAT_KEYS; rawKey++) {
+            if (translateDirect(pKeyMap, rawKey, quals, out) == 1 && out[0] == ch) {
+                *pQuals = quals;
+                return rawKey;
+            }
+        }
+    }
+
+    return NO_DEAD_KEY;
+}
+
+// Checks that every stroke in the index without a dead key produces its chars, and that
+// every output of the keymap can be found.
+static void verifyReverseIndex(struct KeyMap* pKeyMap, const ReverseIndex* pIndex) {
+    UBYTE out[0x100];
+
+    for (ULONG i = 0; i < pIndex->numStrokes; i++) {
+        const KeyStroke* pStroke = &pIndex->pStrokes[i];
+        const UBYTE* pChars = pStroke->pString != NULL ? pStroke->pString : &pStroke->ch;
+
+        if (pStroke->deadKey == NO_DEAD_KEY
+            && (translateDirect(pKeyMap, pStroke->rawKey, pStroke->quals, out) != pStroke->length
+                || memcmp(out, pChars, pStroke->length) != 0)) {
+            fprintf(stderr, "ReverseIndex mismatch: key %02x quals %x\n", pStroke->rawKey, pStroke->quals);
+            exit(1);
+        }
+    }
+
+    for (UBYTE rawKey = 0; rawKey < FLAT_KEYS; rawKey++) {
+        for (UBYTE quals = 0; quals <= (FQ_SHIFT | FQ_ALT | FQ_CONTROL); quals++) {
+            const UBYTE len = translateDirect(pKeyMap, rawKey, quals, out);
+            const KeyStroke* pStroke = findString(pIndex, out, len);
+
+            if (len > 0 && (pStroke == NULL || pStroke->deadKey != NO_DEAD_KEY)) {
+                fprintf(stderr, "ReverseIndex missing output of key %02x quals %x\n", rawKey, quals);
+                exit(1);
+            }
+        }
+    }
+}
+
+// Looks up every char.
+static void benchFindScan(struct KeyMap* pKeyMap, ULONG iterations) {
+    for (ULONG i = 0; i < iterations; i++) {
+        for (int ch = 0; ch < 0x100; ch++) {
+            UBYTE quals;
+            translateSink += findCharScan(pKeyMap, (UBYTE) ch, &quals);
+        }
+    }
+}
+
+static void benchFindIndex(struct KeyMap* pKeyMap, ULONG iterations) {
+    ReverseIndex* pIndex = buildReverseIndex(pKeyMap);
+    verifyReverseIndex(pKeyMap, pIndex);
+
+    for (ULONG i = 0; i < iterations; i++) {
+        for (int ch = 0; ch < 0x100; ch++) {
+            const KeyStroke* pStroke = findChar(pIndex, (UBYTE) ch);
+            translateSink += pStroke != NULL ? pStroke->rawKey : NO_DEAD_KEY;
+        }
+    }
+
+    freeReverseIndex(pIndex);
+}
+
+// The event benchmarks translate a recorded stream of random key strokes (built from the
+// ReverseIndex, so that dead key combinations are included) and verify the output.
+#define NUM_STROKES 1024
+#define MAX_EVENTS (NUM_STROKES * 4)
+
+static KeyEvent events[MAX_EVENTS];
+static ULONG numEvents;
+static UBYTE expectedOut[NUM_STROKES * 0x100];
+static ULONG expectedLength;
+static UBYTE eventOut[NUM_STROKES * 0x100];
+
+static UWORD toQualifier(UBYTE quals) {
+    return ((quals & FQ_SHIFT) ? IEQUALIFIER_LSHIFT : 0)
+        | ((quals & FQ_ALT) ? IEQUALIFIER_LALT : 0)
+        | ((quals & FQ_CONTROL) ? IEQUALIFIER_CONTROL : 0);
+}
+
+static void addKeyPress(UBYTE rawKey, UBYTE quals) {
+    const UWORD qualifier = toQualifier(quals);
+    events[numEvents].code = rawKey;
+    events[numEvents++].qualifier = qualifier;
+    events[numEvents].code = rawKey | IECODE_UP_PREFIX;
+    events[numEvents++].qualifier = qualifier;
+}
+
+static void prepareEvents(struct KeyMap* pKeyMap) {
+    ReverseIndex* pIndex = buildReverseIndex(pKeyMap);
+    numEvents = 0;
+    expectedLength = 0;
+    srand(1);
+
+    for (int i = 0; i < NUM_STROKES; i++) {
+        const KeyStroke* pStroke = &pIndex->pStrokes[rand() % pIndex->numStrokes];
+
+        if (pStroke->deadKey != NO_DEAD_KEY) {
+            addKeyPress(pStroke->deadKey, pStroke->deadQuals);
+        }
+        addKeyPress(pStroke->rawKey, pStroke->quals);
+
+        memcpy(expectedOut + expectedLength, pStroke->pString != NULL ? pStroke->pString : &pStroke->ch, pStroke->length);
+        expectedLength += pStroke->length;
+    }
+
+    freeReverseIndex(pIndex);
+}
+
+static void verifyEvents(ULONG length) {
+    if (length != expectedLength || memcmp(eventOut, expectedOut, length) != 0) {
+        fprintf(stderr, "translateEvents() output mismatch\n");
+        exit(1);
+    }
+}
+
+// Translates the whole stream with one call.
+static void benchEventsBatch(struct KeyMap* pKeyMap, ULONG iterations) {
+    FlatTable* pTable = buildFlatTable(pKeyMap);
+    Translator translator;
+    initTranslator(&translator, pTable);
+
+    ULONG length = 0;
+    for (ULONG i = 0; i < iterations; i++) {
+        ULONG consumed;
+        length = translateEvents(&translator, events, numEvents, eventOut, sizeof(eventOut), &consumed);
+    }
+
+    verifyEvents(length);
+    freeFlatTable(pTable);
+}
+
+// Translates the stream one event at a time (the way events arrive from the input handler).
+static void benchEventsSingle(struct KeyMap* pKeyMap, ULONG iterations) {
+    FlatTable* pTable = buildFlatTable(pKeyMap);
+    Translator translator;
+    initTranslator(&translator, pTable);
+
+    ULONG length = 0;
+    for (ULONG i = 0; i < iterations; i++) {
+        length = 0;
+        for (ULONG e = 0; e < numEvents; e++) {
+            ULONG consumed;
+            length += translateEvents(&translator, &events[e], 1, eventOut + length, sizeof(eventOut) - length, &consumed);
+        }
+    }
+
+    verifyEvents(length);
+    freeFlatTable(pTable);
+}
+
+// The patch benchmarks compare rebuilding a copy of an edited keymap against diffing and
+// patching an existing copy.  The 'small' edit changes a normal key and shortens a string
+// (so the patch applies in place), the 'grow' edit adds a string that does not fit.
+static KeymapBuilder* pSmallEdit;
+static KeymapBuilder* pGrowEdit;
+static KeymapPatch* pSmallPatch;
+static KeymapPatch* pGrowPatch;
+
+static void editKeymap(KeymapBuilder* pBuilder, int index, BOOL grow) {
+    buildCorpusKeymap(pBuilder, index);
+    setNormal(pBuilder, 0x10, KCF_SHIFT, ENTRY2('z', 'Z'));
+
+    UBYTE chars[8][30];
+    const UBYTE* ppStrings[8];
+    UBYTE lengths[8];
+
+    for (int n = 0; n < 8; n++) {
+        memset(chars[n], 'a' + n, sizeof(chars[n]));
+        ppStrings[n] = chars[n];
+        lengths[n] = grow ? sizeof(chars[n]) : 1;
+    }
+
+    setString(pBuilder, 0x50, grow ? KC_VANILLA : KC_NOQUAL, ppStrings, lengths);
+}
+
+// Checks that 'pCopy' is identical to 'pExpected'.
+static void verifyPatched(struct KeyMap* pCopy, struct KeyMap* pExpected) {
+    KeymapPatch* pRemaining = diffKeymaps(pCopy, pExpected);
+    if (pRemaining->numKeys != 0) {
+        fprintf(stderr, "applyPatch() mismatch: %u keys differ\n", pRemaining->numKeys);
+        exit(1);
+    }
+    freePatch(pRemaining);
+}
+
+static void preparePatches(struct KeyMap* pKeyMap, int index) {
+    editKeymap(pSmallEdit, index, /* grow: */ FALSE);
+    editKeymap(pGrowEdit, index, /* grow: */ TRUE);
+
+    if (pSmallPatch != NULL) { freePatch(pSmallPatch); }
+    if (pGrowPatch != NULL) { freePatch(pGrowPatch); }
+
+    pSmallPatch = diffKeymaps(pKeyMap, &pSmallEdit->keyMap);
+    pGrowPatch = diffKeymaps(pKeyMap, &pGrowEdit->keyMap);
+}
+
+static void benchRebuild(struct KeyMap* pKeyMap, ULONG iterations) {
+    benchCopy(&pSmallEdit->keyMap, iterations);
+}
+
+static void benchDiff(struct KeyMap* pKeyMap, ULONG iterations) {
+    for (ULONG i = 0; i < iterations; i++) {
+        KeymapPatch* pPatch = diffKeymaps(pKeyMap, &pSmallEdit->keyMap);
+        benchCopySize = pPatch->blockSize;
+        freePatch(pPatch);
+    }
+}
+
+static void benchPatch(struct KeyMap* pKeyMap, ULONG iterations, const KeymapPatch* pPatch, struct KeyMap* pExpected) {
+    Sizes sizes;
+    struct KeyMap* pCopy = copyKeymap(pKeyMap, &sizes);
+    struct KeyMap* pPatched = pCopy;
+
+    memset(&hostMemStats, 0, sizeof(hostMemStats));
+    for (ULONG i = 0; i < iterations; i++) {
+        Sizes newSizes;
+        pPatched = applyPatch(pCopy, &sizes, pPatch, &newSizes);
+
+        if (pPatched != pCopy) {
+            if (i + 1 == iterations) {
+                verifyPatched(pPatched, pExpected);
+            }
+            freeKeymap(pPatched, &newSizes);
+        }
+    }
+
+    if (pPatched == pCopy) {
+        verifyPatched(pCopy, pExpected);
+    }
+    freeKeymap(pCopy, &sizes);
+}
+
+static void benchPatchSmall(struct KeyMap* pKeyMap, ULONG iterations) {
+    benchCopySize = pSmallPatch->blockSize;
+    benchPatch(pKeyMap, iterations, pSmallPatch, &pSmallEdit->keyMap);
+}
+
+static void benchPatchGrow(struct KeyMap* pKeyMap, ULONG iterations) {
+    benchCopySize = pGrowPatch->blockSize;
+    benchPatch(pKeyMap, iterations, pGrowPatch, &pGrowEdit->keyMap);
+}
+
+// The overlay benchmarks compare rebuilding a copy of an edited keymap against building a
+// copy-on-write overlay of the base keymap with only the edited keys.  The overrides are
+// the keys that diffKeymaps() finds changed by the edit.
+#define MAX_OVERRIDES 8
+
+static KeyOverride smallOverrides[MAX_OVERRIDES];
+static KeyOverride growOverrides[MAX_OVERRIDES];
+static int numSmallOverrides;
+static int numGrowOverrides;
+
+static int collectOverrides(struct KeyMap* pBase, struct KeyMap* pEdit, KeyOverride* pOverrides) {
+    KeymapPatch* pPatch = diffKeymaps(pBase, pEdit);
+    const int numKeys = pPatch->numKeys < MAX_OVERRIDES ? pPatch->numKeys : MAX_OVERRIDES;
+
+    for (int i = 0; i < numKeys; i++) {
+        const UBYTE rawKey = pPatch->pKeys[i].rawKey;
+        pOverrides[i].rawKey = rawKey;
+        pOverrides[i].kmType = pPatch->pKeys[i].kmType;
+        pOverrides[i].flags = pPatch->pKeys[i].flags;
+        pOverrides[i].deadCharTableBytes = measureDeadCharTableBytes(pEdit);
+        pOverrides[i].kmEntry = rawKey < LO_MAP_LENGTH
+            ? pEdit->km_LoKeyMap[rawKey]
+            : pEdit->km_HiKeyMap[rawKey - LO_MAP_LENGTH];
+    }
+
+    freePatch(pPatch);
+    return numKeys;
+}
+
+// A dead key with a larger dead index than any corpus keymap, so the DPF_MOD tables of the
+// base keymap's dead keys must be padded in the overlay.
+#define BIG_DEAD_INDEX 9
+
+static const UBYTE bigDeadTable[] = {
+    DPF_DEAD, BIG_DEAD_INDEX,
+    DPF_MOD,  4,
+    'a', 'b', 'c', 'd', 'e', 'f', 'g', 'h', 'i', 'j',
+};
+
+// Returns TRUE if the dead table 'pDest' matches 'pSrc', with each DPF_MOD table of
+// 'srcDeadBytes' padded with zeros to 'destDeadBytes'.
+static BOOL sameDeadTable(const UBYTE* pDest, const UBYTE* pSrc, int numEntries, UBYTE srcDeadBytes, UBYTE destDeadBytes) {
+    for (int n = 0; n < numEntries; n++) {
+        if (pDest[n << 1] != pSrc[n << 1]) {
+            return FALSE;
+        }
+
+        if (pSrc[n << 1] != DPF_MOD) {
+            if (pDest[(n << 1) + 1] != pSrc[(n << 1) + 1]) {
+                return FALSE;
+            }
+            continue;
+        }
+
+        const UBYTE* pTable = pDest + pDest[(n << 1) + 1];
+        if (memcmp(pTable, pSrc + pSrc[(n << 1) + 1], srcDeadBytes) != 0) {
+            return FALSE;
+        }
+        for (int b = srcDeadBytes; b < destDeadBytes; b++) {
+            if (pTable[b] != 0) {
+                return FALSE;
+            }
+        }
+    }
+    return TRUE;
+}
+
+// Checks that overriding every dead key of 'pBase' that has DPF_MOD entries with itself
+// (so that each table is copied into the overlay) keeps its accent tables byte for byte.
+static void verifyModOverlay(struct KeyMap* pBase) {
+    KeyOverride overrides[LO_MAP_LENGTH + HI_MAP_LENGTH];
+    int numOverrides = 0;
+    const UBYTE deadCharTableBytes = measureDeadCharTableBytes(pBase);
+
+    for (UBYTE rawKey = 0; rawKey < LO_MAP_LENGTH + HI_MAP_LENGTH; rawKey++) {
+        const BOOL isHi = rawKey >= LO_MAP_LENGTH;
+        const UBYTE index = isHi ? rawKey - LO_MAP_LENGTH : rawKey;
+        const UBYTE type = (isHi ? pBase->km_HiKeyMapTypes : pBase->km_LoKeyMapTypes)[index];
+        const ULONG kmEntry = (isHi ? pBase->km_HiKeyMap : pBase->km_LoKeyMap)[index];
+        if ((type & KCF_NOP) || (type & KCF_STRING) || !(type & KCF_DEAD)) {
+            continue;
+        }
+
+        BOOL anyMod = FALSE;
+        for (int n = 0; n < calcNumEntries(type); n++) {
+            anyMod = anyMod || ((const UBYTE*) kmEntry)[n << 1] == DPF_MOD;
+        }
+        if (!anyMod) {
+            continue;
+        }
+
+        KeyOverride* pOverride = &overrides[numOverrides++];
+        pOverride->rawKey = rawKey;
+        pOverride->kmType = type;
+        pOverride->flags = (testKeyBit(pBase->km_LoCapsable, pBase->km_HiCapsable, rawKey) ? PKF_CAPSABLE : 0)
+            | (testKeyBit(pBase->km_LoRepeatable, pBase->km_HiRepeatable, rawKey) ? PKF_REPEATABLE : 0);
+        pOverride->deadCharTableBytes = deadCharTableBytes;
+        pOverride->kmEntry = kmEntry;
+    }
+
+    if (numOverrides == 0) {
+        return;
+    }
+
+    OverlayInfo info;
+    struct KeyMap* pOverlay = buildOverlay(pBase, overrides, numOverrides, &info);
+    BOOL ok = pOverlay != NULL && info.copiedTables == numOverrides;
+
+    for (int i = 0; i < numOverrides && ok; i++) {
+        const UBYTE rawKey = overrides[i].rawKey;
+        const ULONG destEntry = rawKey < LO_MAP_LENGTH ? pOverlay->km_LoKeyMap[rawKey] : pOverlay->km_HiKeyMap[rawKey - LO_MAP_LENGTH];
+        ok = sameDeadTable((const UBYTE*) destEntry, (const UBYTE*) overrides[i].kmEntry, calcNumEntries(overrides[i].kmType), deadCharTableBytes, deadCharTableBytes);
+    }
+
+    if (!ok) {
+        fprintf(stderr, "buildOverlay() DPF_MOD table mismatch\n");
+        exit(1);
+    }
+
+    verifyPatched(pOverlay, pBase);
+    freeOverlay(pOverlay, &info);
+}
+
+// Checks that the overlay with 'bigDeadTable' at raw key 0x22 keeps every other key of
+// 'pBase', with each DPF_MOD table padded with zeros to BIG_DEAD_INDEX + 1 bytes.
+static void verifyDeadOverlay(struct KeyMap* pBase) {
+    KeyOverride override = { 0x22, KCF_DEAD | KCF_SHIFT, 0, BIG_DEAD_INDEX + 1, (ULONG) bigDeadTable };
+    OverlayInfo info;
+    struct KeyMap* pOverlay = buildOverlay(pBase, &override, 1, &info);
+
+    Sizes baseSizes = { 0 };
+    Sizes overlaySizes = { 0 };
+    visitMeasure(pBase, &baseSizes);
+    visitMeasure(pOverlay, &overlaySizes);
+
+    BOOL ok = overlaySizes.deadCharTableBytes == BIG_DEAD_INDEX + 1;
+    for (UBYTE rawKey = 0; rawKey < LO_MAP_LENGTH + HI_MAP_LENGTH && ok; rawKey++) {
+        const BOOL isHi = rawKey >= LO_MAP_LENGTH;
+        const UBYTE index = isHi ? rawKey - LO_MAP_LENGTH : rawKey;
+        const UBYTE type = (isHi ? pBase->km_HiKeyMapTypes : pBase->km_LoKeyMapTypes)[index];
+        const UBYTE destType = (isHi ? pOverlay->km_HiKeyMapTypes : pOverlay->km_LoKeyMapTypes)[index];
+        const ULONG srcEntry = (isHi ? pBase->km_HiKeyMap : pBase->km_LoKeyMap)[index];
+        const ULONG destEntry = (isHi ? pOverlay->km_HiKeyMap : pOverlay->km_LoKeyMap)[index];
+        const UBYTE* pSrc = (const UBYTE*) srcEntry;
+        const UBYTE* pDest = (const UBYTE*) destEntry;
+
+        if (rawKey == override.rawKey) {
+            ok = destType == override.kmType && memcmp(pDest, bigDeadTable, sizeof(bigDeadTable)) == 0;
+            continue;
+        }
+
+        ok = destType == type;
+        if ((type & KCF_NOP) || !(type & KCF_DEAD)) {
+            ok = ok && srcEntry == destEntry;
+            continue;
+        }
+
+        ok = ok && sameDeadTable(pDest, pSrc, calcNumEntries(type), baseSizes.deadCharTableBytes, overlaySizes.deadCharTableBytes);
+    }
+
+    if (!ok) {
+        fprintf(stderr, "buildOverlay() dead table mismatch\n");
+        exit(1);
+    }
+
+    freeOverlay(pOverlay, &info);
+}
+
+static void prepareOverlays(struct KeyMap* pKeyMap) {
+    numSmallOverrides = collectOverrides(pKeyMap, &pSmallEdit->keyMap, smallOverrides);
+    numGrowOverrides = collectOverrides(pKeyMap, &pGrowEdit->keyMap, growOverrides);
+    verifyDeadOverlay(pKeyMap);
+    verifyModOverlay(pKeyMap);
+}
+
+static void benchOverlay(struct KeyMap* pKeyMap, ULONG iterations, const KeyOverride* pOverrides, int numOverrides, struct KeyMap* pExpected) {
+    for (ULONG i = 0; i < iterations; i++) {
+        OverlayInfo info;
+        struct KeyMap* pOverlay = buildOverlay(pKeyMap, pOverrides, numOverrides, &info);
+        benchCopySize = info.blockSize;
+
+        if (i + 1 == iterations) {
+            verifyPatched(pOverlay, pExpected);
+        }
+        freeOverlay(pOverlay, &info);
+    }
+}
+
+static void benchOverlaySmall(struct KeyMap* pKeyMap, ULONG iterations) {
+    benchOverlay(pKeyMap, iterations, smallOverrides, numSmallOverrides, &pSmallEdit->keyMap);
+}
+
+static void benchOverlayGrow(struct KeyMap* pKeyMap, ULONG iterations) {
+    benchOverlay(pKeyMap, iterations, growOverrides, numGrowOverrides, &pGrowEdit->keyMap);
+}
+
+static void benchRebuildGrow(struct KeyMap* pKeyMap, ULONG iterations) {
+    benchCopy(&pGrowEdit->keyMap, iterations);
+}
+
+static const Benchmark overlays[] = {
+    { "rebuild",       benchRebuild },
+    { "overlay-small", benchOverlaySmall },
+    { "rebuild-grow",  benchRebuildGrow },
+    { "overlay-grow",  benchOverlayGrow },
+};
+
+static const Benchmark patches[] = {
+    { "rebuild",      benchRebuild },
+    { "diff",         benchDiff },
+    { "patch-small",  benchPatchSmall },
+    { "patch-grow",   benchPatchGrow },
+};
+
+// The cache benchmarks cycle through the corpus keymaps, comparing a full copy per switch
+// against switching to a copy prepared in a KeymapCache.
+// The stress benchmarks measure and copy the synthetic keymaps of buildStressKeymap(), from
+// a few small tables up to the largest the format allows, to show how copying scales with
+// the bytes of string/dead tables.
+#define NUM_STRESS_SEEDS 32
+#define STRESS_SEED 1
+#define STRESS_BAR_WIDTH 40
+
+static const Benchmark stressBenchmarks[] = {
+    { "measure",    benchMeasure },
+    { "copy",       benchCopy },
+    { "copy-dedup", benchCopyDedup },
+};
+
+typedef struct {
+    ULONG stringBytes;          // String descriptors and chars
+    ULONG deadBytes;            // Dead descriptors and DPF_MOD tables
+    ULONG copySize;
+    ULONG allocBytes;
+    double measureNs;
+    double copyNs;
+} StressResult;
+
+static StressResult stressResults[NUM_STRESS_PROFILES];
+
+// Checks that every seed of 'pProfile' yields a keymap that fits 8-bit offsets and that
+// every kind of copy has the fingerprint of the source.
+static void verifyStressProfile(KeymapBuilder* pBuilder, const StressProfile* pProfile) {
+    for (ULONG seed = 1; seed <= NUM_STRESS_SEEDS; seed++) {
+        buildStressKeymap(pBuilder, pProfile, seed);
+
+        Sizes sizes = { 0 };
+        visitMeasure(&pBuilder->keyMap, &sizes);
+        finishMeasure(&sizes, &pBuilder->keyMap);
+        if (sizes.overflowTables != 0) {
+            fprintf(stderr, "%s (seed %lu) does not fit 8-bit offsets\n", pProfile->pName, seed);
+            exit(1);
+        }
+
+        benchFingerprint(&pBuilder->keyMap, /* iterations: */ 0);
+    }
+}
+
+static void recordStressSizes(struct KeyMap* pKeyMap, StressResult* pResult) {
+    Sizes sizes = { 0 };
+    visitMeasure(pKeyMap, &sizes);
+    finishMeasure(&sizes, pKeyMap);
+
+    pResult->stringBytes = (sizes.stringEntries << 1) + sizes.stringBytes;
+    pResult->deadBytes = (sizes.deadEntries << 1) + sizes.deadTableBytes;
+}
+
+// Charts the copy time of each profile against its string/dead table bytes.
+static void reportStressScaling(void) {
+    double maxNs = 0;
+    for (int p = 0; p < NUM_STRESS_PROFILES; p++) {
+        maxNs = stressResults[p].copyNs > maxNs ? stressResults[p].copyNs : maxNs;
+    }
+
+    fprintf(stderr, "\nstress scaling (seed %d; copy time against string/dead table bytes)\n", STRESS_SEED);
+    fprintf(stderr, "%-14s %8s %8s %8s %10s %10s %10s %7s\n", "profile", "string", "dead", "size", "alloc", "measure", "copy", "ns/KB");
+    for (int p = 0; p < NUM_STRESS_PROFILES; p++) {
+        const StressResult* pResult = &stressResults[p];
+        const ULONG tableBytes = pResult->stringBytes + pResult->deadBytes;
+
+        fprintf(stderr, "%-14s %8lu %8lu %8lu %10lu %10.1f %10.1f %7.1f ",
+            stressProfiles[p].pName, pResult->stringBytes, pResult->deadBytes, pResult->copySize,
+            pResult->allocBytes, pResult->measureNs, pResult->copyNs,
+            tableBytes > 0 ? pResult->copyNs * 1024 / tableBytes : 0.0);
+
+        const int bar = (int)(pResult->copyNs * STRESS_BAR_WIDTH / maxNs + 0.5);
+        for (int i = 0; i < bar; i++) {
+            fputc('#', stderr);
+        }
+        fputc('\n', stderr);
+    }
+}
+
+static KeymapBuilder* pCorpus[NUM_CORPUS_KEYMAPS];
+static KeymapCache switchCache;
+static ULONG evictBudget;           // Fits only the two most recent corpus keymaps
+
+static void benchSwitchCopy(struct KeyMap* pKeyMap, ULONG iterations) {
+    for (ULONG i = 0; i < iterations; i++) {
+        Sizes sizes;
+        struct KeyMap* pCopy = copyKeymap(&pCorpus[i % NUM_CORPUS_KEYMAPS]->keyMap, &sizes);
+        benchCopySize = calcCopySize(&sizes);
+        freeKeymap(pCopy, &sizes);
+    }
+}
+
+static void benchSwitchCached(struct KeyMap* pKeyMap, ULONG iterations) {
+    for (ULONG i = 0; i < iterations; i++) {
+        struct KeyMap* pCopy = findCachedKeymap(&switchCache, corpusKeymapNames[i % NUM_CORPUS_KEYMAPS]);
+        pinCachedKeymap(&switchCache, pCopy);
+    }
+    benchCopySize = switchCache.usedBytes;
+}
+
+// Cycles through the corpus with a budget that only fits two of the keymaps, so every
+// switch misses, copies, and evicts.  Each switch is a CACHE= run of main.c: the copy is
+// added and installed.
+static void benchSwitchEvict(struct KeyMap* pKeyMap, ULONG iterations) {
+    KeymapCache cache;
+    initCache(&cache, evictBudget);
+
+    for (ULONG i = 0; i < iterations; i++) {
+        const int k = i % NUM_CORPUS_KEYMAPS;
+        pinCachedKeymap(&cache, addCachedKeymap(&cache, corpusKeymapNames[k], &pCorpus[k]->keyMap));
+    }
+
+    benchCopySize = cache.usedBytes;
+    releaseInstalled(&cache);
+    flushCache(&cache);
+}
+
+// Fills 'switchCache' with the corpus keymaps and checks that a budget of the two most
+// recent keymaps keeps exactly those, whether or not they are installed.
+static void prepareSwitchCache(void) {
+    initCache(&switchCache, ~0UL);
+    for (int k = 0; k < NUM_CORPUS_KEYMAPS; k++) {
+        pCorpus[k] = builderCreate();
+        buildCorpusKeymap(pCorpus[k], k);
+        addCachedKeymap(&switchCache, corpusKeymapNames[k], &pCorpus[k]->keyMap);
+    }
+
+    const CachedKeymap* pHead = switchCache.pHead;
+    const ULONG budget = sizeof(CachedKeymap) * 2 + calcCopySize(&pHead->sizes) + calcCopySize(&pHead->pNext->sizes);
+
+    KeymapCache cache;
+    initCache(&cache, budget);
+    for (int k = 0; k < NUM_CORPUS_KEYMAPS; k++) {
+        addCachedKeymap(&cache, corpusKeymapNames[k], &pCorpus[k]->keyMap);
+    }
+
+    if (cache.numEntries != 2
+        || findCachedKeymap(&cache, corpusKeymapNames[0]) != NULL
+        || findCachedKeymap(&cache, corpusKeymapNames[NUM_CORPUS_KEYMAPS - 1]) == NULL) {
+        fprintf(stderr, "KeymapCache eviction mismatch\n");
+        exit(1);
+    }
+
+    flushCache(&cache);
+
+    // The same budget holds when every copy is installed, as by successive CACHE= runs of
+    // main.c (addCachedKeymap() and pinCachedKeymap()): only the current default is
+    // protected, so the copies installed earlier are evicted.
+    initCache(&cache, budget);
+    for (int k = 0; k < NUM_CORPUS_KEYMAPS; k++) {
+        pinCachedKeymap(&cache, addCachedKeymap(&cache, corpusKeymapNames[k], &pCorpus[k]->keyMap));
+    }
+
+    if (cache.numEntries != 2
+        || cache.usedBytes > budget
+        || findCachedKeymap(&cache, corpusKeymapNames[0]) != NULL
+        || findCachedKeymap(&cache, corpusKeymapNames[NUM_CORPUS_KEYMAPS - 1]) == NULL) {
+        fprintf(stderr, "KeymapCache installed eviction mismatch\n");
+        exit(1);
+    }
+
+    // A USE= run (findCachedKeymap() and pinCachedKeymap()) switches back without copying.
+    // The current default survives even a budget it exceeds, until another copy replaces it.
+    struct KeyMap* pUsed = findCachedKeymap(&cache, corpusKeymapNames[NUM_CORPUS_KEYMAPS - 2]);
+    cache.budget = 0;
+    pinCachedKeymap(&cache, pUsed);
+
+    if (pUsed == NULL
+        || cache.numEntries != 1
+        || findCachedKeymap(&cache, corpusKeymapNames[NUM_CORPUS_KEYMAPS - 2]) != pUsed) {
+        fprintf(stderr, "KeymapCache current default mismatch\n");
+        exit(1);
+    }
+
+    flushCache(&cache);
+    if (cache.numEntries != 1) {
+        fprintf(stderr, "KeymapCache flush mismatch\n");
+        exit(1);
+    }
+
+    releaseInstalled(&cache);
+    flushCache(&cache);
+
+    // Copies that have never been installed are evicted before ones that have, even when
+    // they were used more recently.
+    initCache(&cache, ~0UL);
+    pinCachedKeymap(&cache, addCachedKeymap(&cache, corpusKeymapNames[0], &pCorpus[0]->keyMap));
+    addCachedKeymap(&cache, corpusKeymapNames[1], &pCorpus[1]->keyMap);
+    struct KeyMap* pCurrent = addCachedKeymap(&cache, corpusKeymapNames[2], &pCorpus[2]->keyMap);
+    cache.budget = cache.usedBytes - 1;
+    pinCachedKeymap(&cache, pCurrent);
+
+    if (cache.numEntries != 2
+        || findCachedKeymap(&cache, corpusKeymapNames[1]) != NULL
+        || findCachedKeymap(&cache, corpusKeymapNames[0]) == NULL) {
+        fprintf(stderr, "KeymapCache eviction order mismatch\n");
+        exit(1);
+    }
+
+    releaseInstalled(&cache);
+    flushCache(&cache);
+
+    // An entry whose fingerprint collides with a different keymap is not reused for it.
+    initCache(&cache, ~0UL);
+    struct KeyMap* pFirst = addCachedKeymap(&cache, corpusKeymapNames[0], &pCorpus[0]->keyMap);
+    cache.pHead->fingerprint = fingerprintKeymap(&pCorpus[1]->keyMap);
+    struct KeyMap* pSecond = addCachedKeymap(&cache, corpusKeymapNames[1], &pCorpus[1]->keyMap);
+
+    if (pSecond == pFirst
+        || cache.numEntries != 2
+        || findCachedKeymap(&cache, corpusKeymapNames[0]) != pFirst
+        || fingerprintKeymap(pSecond) != fingerprintKeymap(&pCorpus[1]->keyMap)) {
+        fprintf(stderr, "KeymapCache fingerprint collision mismatch\n");
+        exit(1);
+    }
+
+    flushCache(&cache);
+    evictBudget = budget;
+}
+
+#define BATCH_SIZE 32
+
+// Copies a batch of keymaps (cycling through the corpus) with one AllocMem() each, then
+// frees them.
+static void benchBatchAlloc(struct KeyMap* pKeyMap, ULONG iterations) {
+    struct KeyMap* pCopies[BATCH_SIZE];
+    Sizes sizes[BATCH_SIZE];
+
+    for (ULONG i = 0; i < iterations; i++) {
+        for (int b = 0; b < BATCH_SIZE; b++) {
+            pCopies[b] = copyKeymap(&pCorpus[b % NUM_CORPUS_KEYMAPS]->keyMap, &sizes[b]);
+        }
+        for (int b = 0; b < BATCH_SIZE; b++) {
+            freeKeymap(pCopies[b], &sizes[b]);
+        }
+    }
+}
+
+// Measures the same batch, copies it into one arena, then frees the arena.
+static void benchBatchArena(struct KeyMap* pKeyMap, ULONG iterations) {
+    Sizes sizes[BATCH_SIZE];
+
+    for (ULONG i = 0; i < iterations; i++) {
+        ULONG arenaSize = 0;
+        for (int b = 0; b < BATCH_SIZE; b++) {
+            measureKeymap(&pCorpus[b % NUM_CORPUS_KEYMAPS]->keyMap, &sizes[b]);
+            arenaSize += ARENA_ALIGN(calcCopySize(&sizes[b]));
+        }
+
+        KeymapArena arena;
+        if (!initArena(&arena, arenaSize)) {
+            fprintf(stderr, "initArena failed\n");
+            exit(1);
+        }
+
+        for (int b = 0; b < BATCH_SIZE; b++) {
+            copyKeymapToArena(&arena, &pCorpus[b % NUM_CORPUS_KEYMAPS]->keyMap, &sizes[b]);
+        }
+
+        benchCopySize = arena.used;
+        freeArena(&arena);
+    }
+}
+
+// Measures and copies the same batch into one arena that is reset (rather than freed and
+// allocated again) between batches, as a tool converting batch after batch would.
+static void benchBatchReuse(struct KeyMap* pKeyMap, ULONG iterations) {
+    Sizes sizes[BATCH_SIZE];
+    KeymapArena arena = { 0 };
+
+    for (ULONG i = 0; i < iterations; i++) {
+        ULONG arenaSize = 0;
+        for (int b = 0; b < BATCH_SIZE; b++) {
+            measureKeymap(&pCorpus[b % NUM_CORPUS_KEYMAPS]->keyMap, &sizes[b]);
+            arenaSize += ARENA_ALIGN(calcCopySize(&sizes[b]));
+        }
+
+        if (arenaSize > arena.size) {
+            freeArena(&arena);
+            if (!initArena(&arena, arenaSize)) {
+                fprintf(stderr, "initArena failed\n");
+                exit(1);
+            }
+        } else {
+            resetArena(&arena);
+        }
+
+        for (int b = 0; b < BATCH_SIZE; b++) {
+            copyKeymapToArena(&arena, &pCorpus[b % NUM_CORPUS_KEYMAPS]->keyMap, &sizes[b]);
+        }
+
+        benchCopySize = arena.used;
+    }
+
+    freeArena(&arena);
+}
+
+// Checks that every keymap copied into an arena matches its source and that the arena is
+// filled exactly, also once it has been reset.
+static void verifyArena(void) {
+    Sizes sizes[NUM_CORPUS_KEYMAPS];
+    ULONG arenaSize = 0;
+    for (int k = 0; k < NUM_CORPUS_KEYMAPS; k++) {
+        measureKeymap(&pCorpus[k]->keyMap, &sizes[k]);
+        arenaSize += ARENA_ALIGN(calcCopySize(&sizes[k]));
+    }
+
+    KeymapArena arena;
+    initArena(&arena, arenaSize);
+
+    for (int k = 0; k < NUM_CORPUS_KEYMAPS; k++) {
+        struct KeyMap* pCopy = copyKeymapToArena(&arena, &pCorpus[k]->keyMap, &sizes[k]);
+        if (pCopy == NULL || ((ULONG) pCopy & (sizeof(ULONG) - 1)) != 0
+            || fingerprintKeymap(pCopy) != fingerprintKeymap(&pCorpus[k]->keyMap)) {
+            fprintf(stderr, "KeymapArena copy mismatch (%s)\n", corpusKeymapNames[k]);
+            exit(1);
+        }
+    }
+
+    if (arena.used != arena.size || copyKeymapToArena(&arena, &pCorpus[0]->keyMap, &sizes[0]) != NULL) {
+        fprintf(stderr, "KeymapArena size mismatch\n");
+        exit(1);
+    }
+
+    // A reset arena holds the same batch again (in reverse order this time), and is cleared
+    // like a new one.
+    resetArena(&arena);
+    for (ULONG i = 0; i < arena.size; i++) {
+        if (arena.pBlock[i] != 0) {
+            fprintf(stderr, "KeymapArena reset mismatch\n");
+            exit(1);
+        }
+    }
+
+    for (int k = NUM_CORPUS_KEYMAPS - 1; k >= 0; k--) {
+        struct KeyMap* pCopy = copyKeymapToArena(&arena, &pCorpus[k]->keyMap, &sizes[k]);
+        if (pCopy == NULL || fingerprintKeymap(pCopy) != fingerprintKeymap(&pCorpus[k]->keyMap)) {
+            fprintf(stderr, "KeymapArena reuse mismatch (%s)\n", corpusKeymapNames[k]);
+            exit(1);
+        }
+    }
+
+    freeArena(&arena);
+}
+
+#define NUM_KEYMAP_FILES 64
+
+static char keymapDir[] = "/tmp/keymap-bench-XXXXXX";
+static char* keymapPaths[NUM_KEYMAP_FILES];
+static int numConvertThreads;
+
+// Writes NUM_KEYMAP_FILES keymap files (cycling through the corpus) to a temporary directory.
+static void prepareKeymapFiles(void) {
+    if (mkdtemp(keymapDir) == NULL) {
+        fprintf(stderr, "mkdtemp failed\n");
+        exit(1);
+    }
+
+    for (int i = 0; i < NUM_KEYMAP_FILES; i++) {
+        const int k = i % NUM_CORPUS_KEYMAPS;
+        keymapPaths[i] = malloc(sizeof(keymapDir) + 16);
+        sprintf(keymapPaths[i], "%s/km%02d", keymapDir, i);
+
+        if (!writeHunkKeymap(keymapPaths[i], &pCorpus[k]->keyMap, corpusKeymapNames[k])) {
+            fprintf(stderr, "writeHunkKeymap failed\n");
+            exit(1);
+        }
+    }
+
+    numConvertThreads = (int) sysconf(_SC_NPROCESSORS_ONLN);
+}
+
+static void removeKeymapFiles(void) {
+    for (int i = 0; i < NUM_KEYMAP_FILES; i++) {
+        unlink(keymapPaths[i]);
+        free(keymapPaths[i]);
+    }
+    rmdir(keymapDir);
+}
+
+// Converts the keymap files with 'numThreads' worker threads, checking every result.
+static void benchConvert(ULONG iterations, int numThreads) {
+    ConvertOptions options = { 0 };
+    options.numThreads = numThreads;
+
+    ConvertJob jobs[NUM_KEYMAP_FILES];
+    for (ULONG i = 0; i < iterations; i++) {
+        memset(jobs, 0, sizeof(jobs));
+        for (int j = 0; j < NUM_KEYMAP_FILES; j++) {
+            jobs[j].pPath = keymapPaths[j];
+        }
+
+        if (convertKeymaps(jobs, NUM_KEYMAP_FILES, &options) != 0
+            || jobs[0].fingerprint != fingerprintKeymap(&pCorpus[0]->keyMap)) {
+            fprintf(stderr, "convertKeymaps mismatch (%s)\n", jobs[0].pError != NULL ? jobs[0].pError : "fingerprint");
+            exit(1);
+        }
+    }
+}
+
+static void benchConvertSerial(struct KeyMap* pKeyMap, ULONG iterations) {
+    benchConvert(iterations, 1);
+}
+
+static void benchConvertParallel(struct KeyMap* pKeyMap, ULONG iterations) {
+    benchConvert(iterations, numConvertThreads);
+}
+
+static const Benchmark conversions[] = {
+    { "convert-1",   benchConvertSerial },
+    { "convert-n",   benchConvertParallel },
+};
+
+// The loading benchmarks compare reading a whole keymap file, parsing it into hunks, and
+// copying the result against streaming the file straight into the copy (see
+// streamHunkKeymap()).  'streamPath' is written by prepareStreamFile().
+static char streamPath[] = "/tmp/keymap-bench-XXXXXX";
+static ULONG streamFileSize;
+static ULONG parsePeakBytes;            // Heap used by read+copy: the file, the hunks, their relocations, and the copy
+
+static const ULONG streamChunkSizes[] = { STREAM_MIN_CHUNK_SIZE, 64, 256, STREAM_MAX_CHUNK_SIZE };
+
+// Checks that streaming the file at 'pPath' yields exactly copyKeymap() of the keymap it
+// parses to, or fails with the same error as parsing.  Also checks that a failed stream
+// leaves nothing allocated.
+static void verifyStream(const char* pPath, ULONG chunkSize, const char* pLabel) {
+    HunkKeymap keymap;
+    const BOOL parsed = readHunkKeymap(pPath, &keymap);
+
+    const ULONG allocs = hostMemStats.allocCount;
+    const ULONG frees = hostMemStats.freeCount;
+    Sizes sizes;
+    StreamInfo info;
+    struct KeyMap* pStream = streamHunkKeymap(pPath, chunkSize, &sizes, &info);
+
+    if (!parsed) {
+        if (pStream != NULL || info.pError == NULL || strcmp(info.pError, keymap.pError) != 0
+            || hostMemStats.allocCount - allocs != hostMemStats.freeCount - frees) {
+            fprintf(stderr, "streamHunkKeymap mismatch for %s (chunk %lu): %s vs. %s\n", pLabel, chunkSize,
+                info.pError != NULL ? info.pError : "loaded", keymap.pError);
+            exit(1);
+        }
+        freeHunkKeymap(&keymap);
+        return;
+    }
+
+    Sizes copySizes;
+    struct KeyMap* pCopy = copyKeymap(&keymap.keyMap, &copySizes);
+    const ULONG bufferSize = calcBufferSize(&copySizes);
+
+    if (pStream == NULL || pCopy == NULL
+        || memcmp(&sizes, &copySizes, sizeof(Sizes)) != 0
+        || strcmp(info.name, keymap.name) != 0
+        || fingerprintKeymap(pStream) != fingerprintKeymap(&keymap.keyMap)
+        || memcmp((UBYTE*) pStream + calcCopySize(&sizes) - bufferSize, (UBYTE*) pCopy + calcCopySize(&copySizes) - bufferSize, bufferSize) != 0) {
+        fprintf(stderr, "streamHunkKeymap mismatch for %s (chunk %lu): %s\n", pLabel, chunkSize,
+            info.pError != NULL ? info.pError : "copy differs");
+        exit(1);
+    }
+
+    freeKeymap(pCopy, &copySizes);
+    freeKeymap(pStream, &sizes);
+    freeHunkKeymap(&keymap);
+}
+
+// Writes 'pKeyMap' to 'streamPath', checks streaming it at every chunk size (and every
+// truncation of the file), and records the heap used by read+copy.
+static void prepareStreamFile(struct KeyMap* pKeyMap, const char* pName) {
+    if (!writeHunkKeymap(streamPath, pKeyMap, pName)) {
+        fprintf(stderr, "writeHunkKeymap failed\n");
+        exit(1);
+    }
+
+    for (int c = 0; c < (int)(sizeof(streamChunkSizes) / sizeof(streamChunkSizes[0])); c++) {
+        verifyStream(streamPath, streamChunkSizes[c], pName);
+    }
+
+    HunkKeymap keymap;
+    readHunkKeymap(streamPath, &keymap);
+    Sizes sizes;
+    measureKeymap(&keymap.keyMap, &sizes);
+
+    FILE* pFile = fopen(streamPath, "rb");
+    fseek(pFile, 0, SEEK_END);
+    streamFileSize = ftell(pFile);
+    UBYTE* pData = malloc(streamFileSize);
+    fseek(pFile, 0, SEEK_SET);
+    fread(pData, 1, streamFileSize, pFile);
+    fclose(pFile);
+
+    parsePeakBytes = streamFileSize + calcCopySize(&sizes);
+    for (ULONG h = 0; h < keymap.numHunks; h++) {
+        parsePeakBytes += (keymap.pHunkSizes[h] + 1) << 1;
+    }
+    freeHunkKeymap(&keymap);
+
+    // Every truncation must be rejected, for the same reason as by parseHunkKeymap().
+    char truncatedPath[sizeof(streamPath) + 8];
+    sprintf(truncatedPath, "%s.cut", streamPath);
+    for (ULONG length = 0; length < streamFileSize; length += 3) {
+        pFile = fopen(truncatedPath, "wb");
+        fwrite(pData, 1, length, pFile);
+        fclose(pFile);
+        verifyStream(truncatedPath, STREAM_MIN_CHUNK_SIZE, pName);
+    }
+    unlink(truncatedPath);
+    free(pData);
+}
+
+static void benchReadCopy(struct KeyMap* pKeyMap, ULONG iterations) {
+    for (ULONG i = 0; i < iterations; i++) {
+        HunkKeymap keymap;
+        if (!readHunkKeymap(streamPath, &keymap)) {
+            fprintf(stderr, "readHunkKeymap failed: %s\n", keymap.pError);
+            exit(1);
+        }
+
+        Sizes sizes;
+        struct KeyMap* pCopy = copyKeymap(&keymap.keyMap, &sizes);
+        benchCopySize = calcCopySize(&sizes);
+        freeKeymap(pCopy, &sizes);
+        freeHunkKeymap(&keymap);
+    }
+}
+
+static void benchStreamChunk(ULONG iterations, ULONG chunkSize) {
+    for (ULONG i = 0; i < iterations; i++) {
+        Sizes sizes;
+        StreamInfo info;
+        struct KeyMap* pCopy = streamHunkKeymap(streamPath, chunkSize, &sizes, &info);
+        if (pCopy == NULL) {
+            fprintf(stderr, "streamHunkKeymap failed: %s\n", info.pError);
+            exit(1);
+        }
+
+        benchCopySize = calcCopySize(&sizes);
+        freeKeymap(pCopy, &sizes);
+    }
+}
+
+static void benchStream(struct KeyMap* pKeyMap, ULONG iterations) {
+    benchStreamChunk(iterations, STREAM_CHUNK_SIZE);
+}
+
+static void benchStreamSmall(struct KeyMap* pKeyMap, ULONG iterations) {
+    benchStreamChunk(iterations, 64);
+}
+
+static const Benchmark loads[] = {
+    { "read+copy",   benchReadCopy },
+    { "stream",      benchStream },
+    { "stream-64",   benchStreamSmall },
+};
+
+// Reports the heap used by each way of loading the file, and the reads of a stream.
+static void reportStream(void) {
+    Sizes sizes;
+    StreamInfo info;
+    struct KeyMap* pCopy = streamHunkKeymap(streamPath, STREAM_CHUNK_SIZE, &sizes, &info);
+    fprintf(stderr, "%-14s %-12s %12lu file bytes, heap %lu (read+copy) vs. %lu (stream), %lu reads of %d bytes\n", "", "",
+        streamFileSize, parsePeakBytes, calcCopySize(&sizes), info.chunkReads, STREAM_CHUNK_SIZE);
+    freeKeymap(pCopy, &sizes);
+}
+
+static void runLoads(struct KeyMap* pKeyMap, const char* pName) {
+    prepareStreamFile(pKeyMap, pName);
+
+    for (int b = 0; b < (int)(sizeof(loads) / sizeof(loads[0])); b++) {
+        HostMemStats mem;
+        const double ns = runBenchmark(loads[b].pfnBench, NULL, &mem);
+        printResult(pName, loads[b].pName, ns, &mem);
+    }
+    reportStream();
+}
+
+// The audit benchmarks summarize the capsable/repeatable settings of a batch of keymaps
+// (variants of the corpus with some bits flipped), once key by key and once with KeySets.
+#define NUM_AUDIT_KEYMAPS 256
+
+typedef struct {
+    ULONG capsable;             // Capsable keys, summed over the batch
+    ULONG repeatable;           // Repeatable keys, summed over the batch
+    ULONG capsNoRepeat;         // Capsable keys that do not repeat, summed over the batch
+    ULONG changed;              // Keys whose bits differ from the first keymap, summed over the batch
+    ULONG alwaysCapsable;       // Keys capsable in every keymap
+    ULONG everCapsable;         // Keys capsable in any keymap
+} CapsAudit;
+
+static struct KeyMap auditKeymaps[NUM_AUDIT_KEYMAPS];
+static KeyMapTables auditTables[NUM_AUDIT_KEYMAPS];
+static CapsAudit expectedAudit;
+
+static void auditByKey(CapsAudit* pAudit) {
+    memset(pAudit, 0, sizeof(CapsAudit));
+    const struct KeyMap* pFirst = &auditKeymaps[0];
+
+    for (UBYTE rawKey = 0; rawKey < LO_MAP_LENGTH + HI_MAP_LENGTH; rawKey++) {
+        const BOOL firstCaps = testKeyBit(pFirst->km_LoCapsable, pFirst->km_HiCapsable, rawKey);
+        const BOOL firstReps = testKeyBit(pFirst->km_LoRepeatable, pFirst->km_HiRepeatable, rawKey);
+        BOOL always = TRUE;
+        BOOL ever = FALSE;
+
+        for (int a = 0; a < NUM_AUDIT_KEYMAPS; a++) {
+            const struct KeyMap* pKeyMap = &auditKeymaps[a];
+            const BOOL caps = testKeyBit(pKeyMap->km_LoCapsable, pKeyMap->km_HiCapsable, rawKey);
+            const BOOL reps = testKeyBit(pKeyMap->km_LoRepeatable, pKeyMap->km_HiRepeatable, rawKey);
+
+            pAudit->capsable += caps;
+            pAudit->repeatable += reps;
+            pAudit->capsNoRepeat += caps && !reps;
+            pAudit->changed += caps != firstCaps || reps != firstReps;
+            always = always && caps;
+            ever = ever || caps;
+        }
+
+        pAudit->alwaysCapsable += always;
+        pAudit->everCapsable += ever;
+    }
+}
+
+static void auditByKeySet(CapsAudit* pAudit) {
+    memset(pAudit, 0, sizeof(CapsAudit));
+
+    KeySet firstCaps;
+    KeySet firstReps;
+    loadCapsable(&firstCaps, &auditKeymaps[0]);
+    loadRepeatable(&firstReps, &auditKeymaps[0]);
+
+    KeySet always = firstCaps;
+    KeySet ever = firstCaps;
+
+    for (int a = 0; a < NUM_AUDIT_KEYMAPS; a++) {
+        KeySet caps;
+        KeySet reps;
+        KeySet scratch;
+        KeySet changed;
+        loadCapsable(&caps, &auditKeymaps[a]);
+        loadRepeatable(&reps, &auditKeymaps[a]);
+
+        pAudit->capsable += countKeys(&caps);
+        pAudit->repeatable += countKeys(&reps);
+
+        subtractKeys(&scratch, &caps, &reps);
+        pAudit->capsNoRepeat += countKeys(&scratch);
+
+        xorKeys(&changed, &caps, &firstCaps);
+        xorKeys(&scratch, &reps, &firstReps);
+        unionKeys(&changed, &changed, &scratch);
+        pAudit->changed += countKeys(&changed);
+
+        intersectKeys(&always, &always, &caps);
+        unionKeys(&ever, &ever, &caps);
+    }
+
+    pAudit->alwaysCapsable = countKeys(&always);
+    pAudit->everCapsable = countKeys(&ever);
+}
+
+// Fills the batch with variants of the corpus keymaps, each with a few capsable/repeatable
+// bits flipped, and computes the expected audit.
+static void prepareAudit(void) {
+    srand(1);
+
+    for (int a = 0; a < NUM_AUDIT_KEYMAPS; a++) {
+        const KeymapBuilder* pSource = pCorpus[a % NUM_CORPUS_KEYMAPS];
+        KeyMapTables* pTables = &auditTables[a];
+        struct KeyMap* pKeyMap = &auditKeymaps[a];
+
+        *pTables = pSource->tables;
+        *pKeyMap = pSource->keyMap;
+        pKeyMap->km_LoCapsable = pTables->loCapsable;
+        pKeyMap->km_HiCapsable = pTables->hiCapsable;
+        pKeyMap->km_LoRepeatable = pTables->loRepeatable;
+        pKeyMap->km_HiRepeatable = pTables->hiRepeatable;
+
+        for (int flip = 0; flip < 8; flip++) {
+            const UBYTE rawKey = rand() % (LO_MAP_LENGTH + HI_MAP_LENGTH);
+            UBYTE* pLo = (flip & 1) ? pTables->loCapsable : pTables->loRepeatable;
+            UBYTE* pHi = (flip & 1) ? pTables->hiCapsable : pTables->hiRepeatable;
+            setKeyBit(pLo, pHi, rawKey, !testKeyBit(pLo, pHi, rawKey));
+        }
+    }
+
+    auditByKey(&expectedAudit);
+
+    // Also check that storeKeySet() round-trips the arrays.
+    for (int a = 0; a < NUM_AUDIT_KEYMAPS; a++) {
+        KeySet caps;
+        UBYTE lo[LO_CAPS_BYTE_SIZE];
+        UBYTE hi[HI_CAPS_BYTE_SIZE];
+        loadCapsable(&caps, &auditKeymaps[a]);
+        storeKeySet(&caps, lo, hi);
+
+        if (memcmp(lo, auditTables[a].loCapsable, sizeof(lo)) != 0 || memcmp(hi, auditTables[a].hiCapsable, sizeof(hi)) != 0) {
+            fprintf(stderr, "storeKeySet mismatch for keymap %d\n", a);
+            exit(1);
+        }
+    }
+}
+
+static void benchAudit(ULONG iterations, void (*pfnAudit)(CapsAudit*)) {
+    CapsAudit audit;
+    for (ULONG i = 0; i < iterations; i++) {
+        pfnAudit(&audit);
+        translateSink += audit.changed;
+    }
+
+    if (memcmp(&audit, &expectedAudit, sizeof(CapsAudit)) != 0) {
+        fprintf(stderr, "caps/repeat audit mismatch\n");
+        exit(1);
+    }
+}
+
+static void benchAuditByKey(struct KeyMap* pKeyMap, ULONG iterations) {
+    benchAudit(iterations, auditByKey);
+}
+
+static void benchAuditByKeySet(struct KeyMap* pKeyMap, ULONG iterations) {
+    benchAudit(iterations, auditByKeySet);
+}
+
+static const Benchmark audits[] = {
+    { "audit-keys",   benchAuditByKey },
+    { "audit-keyset", benchAuditByKeySet },
+};
+
+static const Benchmark batches[] = {
+    { "batch-alloc", benchBatchAlloc },
+    { "batch-arena", benchBatchArena },
+    { "batch-reuse", benchBatchReuse },
+};
+
+static const Benchmark switches[] = {
+    { "switch-copy",  benchSwitchCopy },
+    { "switch-cache", benchSwitchCached },
+    { "switch-evict", benchSwitchEvict },
+};
+
+static const Benchmark eventTranslations[] = {
+    { "events-1x1",   benchEventsSingle },
+    { "events-batch", benchEventsBatch },
+};
+
+static const Benchmark reverseLookups[] = {
+    { "rev-build",    benchReverseBuild },
+    { "find-scan",    benchFindScan },
+    { "find-index",   benchFindIndex },
+};
+
+static const Benchmark translations[] = {
+    { "flat-build",       benchFlatBuild },
+    { "xlate-direct",     benchTranslateDirect },
+    { "xlate-flat",       benchTranslateFlat },
+};
+
+static const Benchmark images[] = {
+    { "copy",        benchCopy },
+    { "image-write", benchImageWrite },
+    { "image-load",  benchImageLoad },
+    { "image-mmap",  benchImageMap },
+};
+
+static const Benchmark traversals[] = {
+    { "measure",         benchMeasure },
+    { "visitMeasure",    benchVisitMeasure },
+    { "measure-dead",    benchMeasureDead },
+    { "copy-tables",     benchGenericCopyTables },
+    { "visitCopy",       benchVisitCopyTables },
+    { "print",           benchPrint },
+    { "visitPrint",      benchVisitPrint },
+};
+
+// Checks that planDeadRuns() clips each DPF_MOD table to the next offset in its key: a
+// descriptor with tables at 20, 24, 24, 32 and 60 (8 bytes each) is copied as the runs
+// 20..40 (the table at 32 continues the clipped ones) and 60..68.
+static void verifyDeadRuns(void) {
+    const UBYTE table[8 << 1] = {
+        DPF_MOD, 24, 0, 'a', DPF_MOD, 20, DPF_MOD, 32, DPF_MOD, 60, DPF_MOD, 24, DPF_DEAD, 1, 0, 'c',
+    };
+
+    DeadRun runs[8];
+    const int numRuns = planDeadRuns(table, 8, /* deadCharTableBytes: */ 8, runs);
+    if (numRuns != 2
+        || runs[0].start != 20 || runs[0].end != 40
+        || runs[1].start != 60 || runs[1].end != 68
+        || calcModTableBytes(table, 8, 8) != 28) {
+        fprintf(stderr, "planDeadRuns mismatch\n");
+        exit(1);
+    }
+}
+
+// Reports the DPF_MOD dead table bytes copied for 'pKeyMap' by each copy mode, compared to
+// reserving 'deadCharTableBytes' for every DPF_MOD entry.
+static void reportDeadTables(const char* pName, struct KeyMap* pKeyMap) {
+    Sizes sizes;
+    struct KeyMap* pCopy = copyKeymap(pKeyMap, &sizes);
+    const int flatBytes = sizes.deadCharTableBytes * sizes.modEntries;
+    const int exactBytes = sizes.deadTableBytes;
+    freeKeymap(pCopy, &sizes);
+
+    pCopy = copyKeymapDedup(pKeyMap, &sizes);
+    const int dedupBytes = sizes.deadTableBytes;
+    freeKeymap(pCopy, &sizes);
+
+    fprintf(stderr, "%-14s %8d %8d %8d %8d %8d\n", pName, sizes.modEntries, flatBytes, exactBytes, dedupBytes, flatBytes - exactBytes);
+}
+
+#ifdef COPYKEYMAP_STATS
+#define STATS_COPIES 1000
+
+// Copies 'pKeyMap' STATS_COPIES times with 'pfnCopy' and reports the average ticks of each
+// phase and the per-copy counts (see copystats.h).
+static void reportCopyStats(const char* pName, const char* pMode, struct KeyMap* pKeyMap, struct KeyMap* (*pfnCopy)(struct KeyMap*, Sizes*)) {
+    beginCopyStats();
+    for (int i = 0; i < STATS_COPIES; i++) {
+        Sizes sizes;
+        struct KeyMap* pCopy = pfnCopy(pKeyMap, &sizes);
+        freeKeymap(pCopy, &sizes);
+    }
+    endCopyStats();
+
+    const CopyStats* pStats = &copyStats;
+    const ULONG n = pStats->copies;
+    fprintf(stderr, "%-14s %-10s %8llu %8llu %8llu %8llu | %4lu %4lu %4lu %4lu %4lu %4lu | %5lu %5lu %5lu %5lu %5lu | %3lu %5lu\n",
+        pName, pMode,
+        pStats->ticks[STAT_MEASURE] / n, pStats->ticks[STAT_TABLES] / n, pStats->ticks[STAT_LO] / n, pStats->ticks[STAT_HI] / n,
+        pStats->normalKeys / n, pStats->stringKeys / n, pStats->deadKeys / n, pStats->nopKeys / n, pStats->modEntries / n, pStats->sharedTables / n,
+        pStats->structBytes / n, pStats->stringDescBytes / n, pStats->stringCharBytes / n, pStats->deadDescBytes / n, pStats->modTableBytes / n,
+        pStats->alignPadBytes / n, pStats->deadSlackBytes / n);
+}
+
+static void reportAllCopyStats(KeymapBuilder* pBuilder) {
+    fprintf(stderr, "\ncopy statistics (per copy: ticks per phase | keys by type | bytes by category | slack)\n");
+    fprintf(stderr, "%-14s %-10s %8s %8s %8s %8s | %4s %4s %4s %4s %4s %4s | %5s %5s %5s %5s %5s | %3s %5s\n",
+        "keymap", "mode", "measure", "tables", "lo", "hi",
+        "norm", "str", "dead", "nop", "mod", "shrd",
+        "fixed", "sdesc", "chars", "ddesc", "modtb",
+        "pad", "dslck");
+
+    for (int k = 0; k < NUM_CORPUS_KEYMAPS; k++) {
+        buildCorpusKeymap(pBuilder, k);
+        reportCopyStats(corpusKeymapNames[k], "copy", &pBuilder->keyMap, copyKeymap);
+        reportCopyStats(corpusKeymapNames[k], "copy-dedup", &pBuilder->keyMap, copyKeymapDedup);
+    }
+}
+#endif
+
+static const Benchmark benchmarks[] = {
+    { "measure", benchMeasure },
+    { "fingerprint", benchFingerprint },
+    { "copy",    benchCopy },
+    { "copy-dedup", benchCopyDedup },
+    { "print",   benchPrint },
+    { "print-json", benchPrintJson },
+};
+
+int main(int argc, char** argv) {
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-t") == 0 && i + 1 < argc) {
+            targetNs = atof(argv[++i]) * 1e6;
+        } else {
+            fprintf(stderr, "Usage: %s [-t <ms per benchmark>]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    KeymapBuilder* pBuilder = builderCreate();
+
+    printHeader("visitor/copy pipeline");
+    for (int k = 0; k < NUM_CORPUS_KEYMAPS; k++) {
+        buildCorpusKeymap(pBuilder, k);
+
+        for (int b = 0; b < (int)(sizeof(benchmarks) / sizeof(benchmarks[0])); b++) {
+            HostMemStats mem;
+            const double ns = runBenchmark(benchmarks[b].pfnBench, &pBuilder->keyMap, &mem);
+            printResult(corpusKeymapNames[k], benchmarks[b].pName, ns, &mem);
+        }
+    }
+
+#ifdef COPYKEYMAP_STATS
+    reportAllCopyStats(pBuilder);
+#endif
+
+    verifyDeadRuns();
+    fprintf(stderr, "\ndead table sizing (bytes of DPF_MOD tables per copy)\n");
+    fprintf(stderr, "%-14s %8s %8s %8s %8s %8s\n", "keymap", "mod", "flat", "exact", "dedup", "saved");
+    for (int k = 0; k < NUM_CORPUS_KEYMAPS; k++) {
+        buildCorpusKeymap(pBuilder, k);
+        reportDeadTables(corpusKeymapNames[k], &pBuilder->keyMap);
+    }
+
+    printHeader("generic vs. specialized traversal");
+    for (int k = 0; k < NUM_CORPUS_KEYMAPS; k++) {
+        buildCorpusKeymap(pBuilder, k);
+
+        for (int b = 0; b < (int)(sizeof(traversals) / sizeof(traversals[0])); b++) {
+            HostMemStats mem;
+            const double ns = runBenchmark(traversals[b].pfnBench, &pBuilder->keyMap, &mem);
+            printResult(corpusKeymapNames[k], traversals[b].pName, ns, &mem);
+        }
+    }
+
+    const int fd = mkstemp(imagePath);
+    if (fd >= 0) {
+        close(fd);
+    }
+
+    printHeader("keymap images");
+    for (int k = 0; k < NUM_CORPUS_KEYMAPS; k++) {
+        buildCorpusKeymap(pBuilder, k);
+        prepareImage(&pBuilder->keyMap);
+        verifyImageBounds();
+
+        for (int b = 0; b < (int)(sizeof(images) / sizeof(images[0])); b++) {
+            HostMemStats mem;
+            const double ns = runBenchmark(images[b].pfnBench, &pBuilder->keyMap, &mem);
+            printResult(corpusKeymapNames[k], images[b].pName, ns, &mem);
+        }
+    }
+
+    unlink(imagePath);
+
+    printHeader("key translation (ns per 120 keys x 16 qualifier combinations)");
+    verifySharedStringFlat(pBuilder);
+    for (int k = 0; k < NUM_CORPUS_KEYMAPS; k++) {
+        buildCorpusKeymap(pBuilder, k);
+
+        for (int b = 0; b < (int)(sizeof(translations) / sizeof(translations[0])); b++) {
+            HostMemStats mem;
+            const double ns = runBenchmark(translations[b].pfnBench, &pBuilder->keyMap, &mem);
+            printResult(corpusKeymapNames[k], translations[b].pName, ns, &mem);
+        }
+    }
+
+    printHeader("reverse lookup (ns per 256 chars)");
+    for (int k = 0; k < NUM_CORPUS_KEYMAPS; k++) {
+        buildCorpusKeymap(pBuilder, k);
+
+        for (int b = 0; b < (int)(sizeof(reverseLookups) / sizeof(reverseLookups[0])); b++) {
+            HostMemStats mem;
+            const double ns = runBenchmark(reverseLookups[b].pfnBench, &pBuilder->keyMap, &mem);
+            printResult(corpusKeymapNames[k], reverseLookups[b].pName, ns, &mem);
+        }
+    }
+
+    printHeader("event translation (ns per stream of 1024 random key strokes)");
+    for (int k = 0; k < NUM_CORPUS_KEYMAPS; k++) {
+        buildCorpusKeymap(pBuilder, k);
+        prepareEvents(&pBuilder->keyMap);
+
+        for (int b = 0; b < (int)(sizeof(eventTranslations) / sizeof(eventTranslations[0])); b++) {
+            HostMemStats mem;
+            const double ns = runBenchmark(eventTranslations[b].pfnBench, &pBuilder->keyMap, &mem);
+            printResult(corpusKeymapNames[k], eventTranslations[b].pName, ns, &mem);
+            fprintf(stderr, "%-14s %-12s %12.1f M events/s (%lu events)\n", "", "", numEvents * 1e3 / ns, numEvents);
+        }
+    }
+
+    pSmallEdit = builderCreate();
+    pGrowEdit = builderCreate();
+
+    printHeader("keymap patches (size = patch size)");
+    for (int k = 0; k < NUM_CORPUS_KEYMAPS; k++) {
+        buildCorpusKeymap(pBuilder, k);
+        preparePatches(&pBuilder->keyMap, k);
+
+        for (int b = 0; b < (int)(sizeof(patches) / sizeof(patches[0])); b++) {
+            HostMemStats mem;
+            const double ns = runBenchmark(patches[b].pfnBench, &pBuilder->keyMap, &mem);
+            printResult(corpusKeymapNames[k], patches[b].pName, ns, &mem);
+        }
+    }
+
+    freePatch(pSmallPatch);
+    freePatch(pGrowPatch);
+
+    printHeader("keymap overlays (size = overlay block size)");
+    for (int k = 0; k < NUM_CORPUS_KEYMAPS; k++) {
+        buildCorpusKeymap(pBuilder, k);
+        editKeymap(pSmallEdit, k, /* grow: */ FALSE);
+        editKeymap(pGrowEdit, k, /* grow: */ TRUE);
+        prepareOverlays(&pBuilder->keyMap);
+
+        for (int b = 0; b < (int)(sizeof(overlays) / sizeof(overlays[0])); b++) {
+            HostMemStats mem;
+            const double ns = runBenchmark(overlays[b].pfnBench, &pBuilder->keyMap, &mem);
+            printResult(corpusKeymapNames[k], overlays[b].pName, ns, &mem);
+        }
+    }
+
+    builderDestroy(pSmallEdit);
+    builderDestroy(pGrowEdit);
+
+    printHeader("stress keymaps (seed 1; size = copy size)");
+    for (int p = 0; p < NUM_STRESS_PROFILES; p++) {
+        const StressProfile* pProfile = &stressProfiles[p];
+        StressResult* pResult = &stressResults[p];
+
+        verifyStressProfile(pBuilder, pProfile);
+        buildStressKeymap(pBuilder, pProfile, STRESS_SEED);
+        recordStressSizes(&pBuilder->keyMap, pResult);
+
+        for (int b = 0; b < (int)(sizeof(stressBenchmarks) / sizeof(stressBenchmarks[0])); b++) {
+            HostMemStats mem;
+            const double ns = runBenchmark(stressBenchmarks[b].pfnBench, &pBuilder->keyMap, &mem);
+            printResult(pProfile->pName, stressBenchmarks[b].pName, ns, &mem);
+
+            if (stressBenchmarks[b].pfnBench == benchMeasure) {
+                pResult->measureNs = ns;
+            } else if (stressBenchmarks[b].pfnBench == benchCopy) {
+                pResult->copyNs = ns;
+                pResult->copySize = benchCopySize;
+                pResult->allocBytes = mem.allocBytes;
+            }
+        }
+    }
+    reportStressScaling();
+
+    printHeader("layout switching (ns per switch, cycling through the corpus)");
+    prepareSwitchCache();
+    for (int b = 0; b < (int)(sizeof(switches) / sizeof(switches[0])); b++) {
+        HostMemStats mem;
+        const double ns = runBenchmark(switches[b].pfnBench, NULL, &mem);
+        printResult("corpus", switches[b].pName, ns, &mem);
+    }
+
+    printHeader("batch copies (ns per batch of 32 keymaps, cycling through the corpus)");
+    verifyArena();
+    for (int b = 0; b < (int)(sizeof(batches) / sizeof(batches[0])); b++) {
+        HostMemStats mem;
+        const double ns = runBenchmark(batches[b].pfnBench, NULL, &mem);
+        printResult("corpus", batches[b].pName, ns, &mem);
+    }
+
+    printHeader("caps/repeat audit (ns per batch of 256 keymaps)");
+    prepareAudit();
+    for (int b = 0; b < (int)(sizeof(audits) / sizeof(audits[0])); b++) {
+        HostMemStats mem;
+        const double ns = runBenchmark(audits[b].pfnBench, NULL, &mem);
+        printResult("corpus", audits[b].pName, ns, &mem);
+    }
+    fprintf(stderr, "%-14s %-12s %12lu capsable, %lu repeatable, %lu changed keys\n", "", "",
+        expectedAudit.capsable, expectedAudit.repeatable, expectedAudit.changed);
+
+    printHeader("keymap file conversion (ns per directory of 64 keymap files)");
+    prepareKeymapFiles();
+    for (int b = 0; b < (int)(sizeof(conversions) / sizeof(conversions[0])); b++) {
+        HostMemStats mem;
+        const double ns = runBenchmark(conversions[b].pfnBench, NULL, &mem);
+        printResult("corpus", conversions[b].pName, ns, &mem);
+    }
+    fprintf(stderr, "%-14s %-12s %12d threads\n", "", "convert-n", numConvertThreads);
+    removeKeymapFiles();
+
+    const int streamFd = mkstemp(streamPath);
+    if (streamFd >= 0) {
+        close(streamFd);
+    }
+
+    printHeader("keymap file loading (ns per keymap file; bytes = AllocMem() only)");
+    for (int k = 0; k < NUM_CORPUS_KEYMAPS; k++) {
+        buildCorpusKeymap(pBuilder, k);
+        runLoads(&pBuilder->keyMap, corpusKeymapNames[k]);
+    }
+    for (int p = 0; p < NUM_STRESS_PROFILES; p++) {
+        buildStressKeymap(pBuilder, &stressProfiles[p], STRESS_SEED);
+        runLoads(&pBuilder->keyMap, stressProfiles[p].pName);
+    }
+
+    unlink(streamPath);
+
+    releaseInstalled(&switchCache);
+    flushCache(&switchCache);
+    for (int k = 0; k < NUM_CORPUS_KEYMAPS; k++) {
+        builderDestroy(pCorpus[k]);
+    }
+
+    free(pSavedImage);
+    builderDestroy(pBuilder);
+    return 0;
+}
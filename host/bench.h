@@ -0,0 +1,28 @@
+#ifndef BENCH_H
+#define BENCH_H
+
+#include <exec/types.h>
+#include <proto/exec.h>
+#include <proto/keymap.h>
+
+// A benchmark runs 'iterations' passes of some operation over 'pKeyMap'.
+typedef void (*BenchFn)(struct KeyMap* pKeyMap, ULONG iterations);
+
+typedef struct {
+    const char* pName;
+    BenchFn pfnBench;
+} Benchmark;
+
+// Benchmarks that copy a keymap record the size of the copy here.
+extern ULONG benchCopySize;
+
+double nowNs(void);
+double runBenchmark(BenchFn pfnBench, struct KeyMap* pKeyMap, HostMemStats* pMem);
+void printHeader(const char* pTitle);
+void printResult(const char* pKeymap, const char* pBench, double ns, const HostMemStats* pMem);
+
+// Redirects stdout to /dev/null (e.g., while benchmarking the PrintVisitor).
+void beginQuiet(void);
+void endQuiet(void);
+
+#endif
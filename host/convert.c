@@ -0,0 +1,153 @@
+#include "convert.h"
+#include "copykeymap.h"
+#include "visit.h"
+#include "visitors/fingerprint.h"
+#include "visitors/print.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+
+// Output of the PrintVisitor for the keymap being converted by this thread.
+static __thread FILE* pPrintFile;
+
+static void writePrintFile(const char* pChars, ULONG length) {
+    fwrite(pChars, 1, length, pPrintFile);
+}
+
+// Returns the last component of 'pPath'.
+static const char* baseName(const char* pPath) {
+    const char* pSlash = strrchr(pPath, '/');
+    return pSlash != NULL ? pSlash + 1 : pPath;
+}
+
+static BOOL printToFile(const ConvertOptions* pOptions, const char* pPath, struct KeyMap* pKeyMap, const Sizes* pSizes) {
+    char path[1024];
+    snprintf(path, sizeof(path), "%s/%s.%s", pOptions->pPrintDir, baseName(pPath), pOptions->format == PRINT_JSON ? "jsonl" : "txt");
+
+    pPrintFile = fopen(path, "w");
+    if (pPrintFile == NULL) {
+        return FALSE;
+    }
+
+    PrintContext print;
+    beginPrint(&print, pKeyMap, pOptions->format, pSizes->deadCharTableBytes);
+    print.pfnSink = writePrintFile;
+    visitPrint(pKeyMap, &print);
+    endPrint(&print);
+
+    return fclose(pPrintFile) == 0;
+}
+
+// Checks that 'pCopy' (or NULL if copying failed) has the expected fingerprint, and frees it.
+static const char* checkCopy(struct KeyMap* pCopy, const Sizes* pSizes, ULONG fingerprint, ULONG* pCopySize) {
+    if (pCopy == NULL) {
+        return pSizes->overflowTables > 0 ? "table does not fit 8-bit offsets" : "out of memory";
+    }
+
+    const BOOL matches = fingerprintKeymap(pCopy) == fingerprint;
+    *pCopySize = calcCopySize(pSizes);
+    freeKeymap(pCopy, pSizes);
+    return matches ? NULL : "copy differs from source";
+}
+
+// Regenerates the keymap as a keymap file and checks that it parses back to the same keymap.
+static const char* regenerate(const ConvertOptions* pOptions, ConvertJob* pJob, struct KeyMap* pKeyMap) {
+    char path[1024];
+    snprintf(path, sizeof(path), "%s/%s", pOptions->pHunkDir, baseName(pJob->pPath));
+
+    if (!writeHunkKeymap(path, pKeyMap, pJob->name)) {
+        return "cannot write keymap file";
+    }
+
+    HunkKeymap regenerated;
+    const BOOL parsed = readHunkKeymap(path, &regenerated);
+    const BOOL matches = parsed && fingerprintKeymap(&regenerated.keyMap) == pJob->fingerprint;
+    freeHunkKeymap(&regenerated);
+
+    return matches ? NULL : "regenerated keymap file differs";
+}
+
+static const char* convertKeymap(const ConvertOptions* pOptions, ConvertJob* pJob) {
+    HunkKeymap keymap;
+    if (!readHunkKeymap(pJob->pPath, &keymap)) {
+        freeHunkKeymap(&keymap);
+        return keymap.pError;
+    }
+
+    struct KeyMap* pKeyMap = &keymap.keyMap;
+    strcpy(pJob->name, keymap.name);
+    pJob->fingerprint = fingerprintKeymap(pKeyMap);
+
+    Sizes sizes;
+    const char* pError = checkCopy(copyKeymap(pKeyMap, &sizes), &sizes, pJob->fingerprint, &pJob->copySize);
+
+    Sizes dedupSizes;
+    if (pError == NULL) {
+        pError = checkCopy(copyKeymapDedup(pKeyMap, &dedupSizes), &dedupSizes, pJob->fingerprint, &pJob->dedupSize);
+    }
+
+    if (pError == NULL && pOptions->pPrintDir != NULL && !printToFile(pOptions, pJob->pPath, pKeyMap, &sizes)) {
+        pError = "cannot write printed keymap";
+    }
+
+    if (pError == NULL && pOptions->pHunkDir != NULL) {
+        pError = regenerate(pOptions, pJob, pKeyMap);
+    }
+
+    freeHunkKeymap(&keymap);
+    return pError;
+}
+
+// The jobs shared by the worker threads.  Each worker claims the next unconverted job until
+// none are left.
+typedef struct {
+    ConvertJob* pJobs;
+    int numJobs;
+    int nextJob;
+    const ConvertOptions* pOptions;
+} JobQueue;
+
+static void* convertWorker(void* pArg) {
+    JobQueue* pQueue = pArg;
+
+    for (;;) {
+        const int j = __atomic_fetch_add(&pQueue->nextJob, 1, __ATOMIC_RELAXED);
+        if (j >= pQueue->numJobs) {
+            return NULL;
+        }
+
+        ConvertJob* pJob = &pQueue->pJobs[j];
+        pJob->pError = convertKeymap(pQueue->pOptions, pJob);
+    }
+}
+
+int convertKeymaps(ConvertJob* pJobs, int numJobs, const ConvertOptions* pOptions) {
+    JobQueue queue = { pJobs, numJobs, 0, pOptions };
+
+    int numThreads = pOptions->numThreads < numJobs ? pOptions->numThreads : numJobs;
+    if (numThreads <= 1) {
+        convertWorker(&queue);
+    } else {
+        pthread_t threads[numThreads];
+        int started = 0;
+        while (started < numThreads && pthread_create(&threads[started], NULL, convertWorker, &queue) == 0) {
+            started++;
+        }
+
+        // If no thread could be started, convert on this thread instead.
+        if (started == 0) {
+            convertWorker(&queue);
+        }
+        for (int t = 0; t < started; t++) {
+            pthread_join(threads[t], NULL);
+        }
+    }
+
+    int failed = 0;
+    for (int j = 0; j < numJobs; j++) {
+        if (pJobs[j].pError != NULL) {
+            failed++;
+        }
+    }
+    return failed;
+}
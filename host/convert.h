@@ -0,0 +1,31 @@
+#ifndef CONVERT_H
+#define CONVERT_H
+
+#include <exec/types.h>
+#include "hunkfile.h"
+
+typedef struct {
+    const char* pPrintDir;      // If not NULL, each keymap is printed to <pPrintDir>/<file>.txt (or .jsonl)
+    const char* pHunkDir;       // If not NULL, each keymap is regenerated as a keymap file in <pHunkDir>
+    UBYTE format;               // PRINT_TEXT or PRINT_JSON
+    int numThreads;             // Number of worker threads (1 converts on the calling thread)
+} ConvertOptions;
+
+// One keymap file to convert, and the result.
+typedef struct {
+    const char* pPath;
+    const char* pError;         // NULL if the keymap was converted and validated
+    char name[KEYMAP_NAME_LENGTH];
+    ULONG fingerprint;          // See fingerprintKeymap()
+    ULONG copySize;             // calcCopySize() of copyKeymap()
+    ULONG dedupSize;            // calcCopySize() of copyKeymapDedup()
+} ConvertJob;
+
+// Converts the keymap file of each job on a pool of worker threads.  Each file is parsed,
+// measured, copied (plain and deduplicated), and fingerprinted, and the copies are checked
+// against the source.  Depending on 'pOptions', the keymap is also printed and regenerated
+// as a keymap file (which is parsed again and checked).  Returns the number of jobs that
+// failed.
+int convertKeymaps(ConvertJob* pJobs, int numJobs, const ConvertOptions* pOptions);
+
+#endif
@@ -0,0 +1,537 @@
+#include "corpus.h"
+#include "visit.h"
+#include "keyset.h"
+#include "layout.h"
+#include <proto/exec.h>
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+KeymapBuilder* builderCreate(void) {
+    KeymapBuilder* pBuilder = malloc(sizeof(KeymapBuilder));
+    pBuilder->pData = malloc(BUILDER_DATA_SIZE);
+    builderReset(pBuilder);
+    return pBuilder;
+}
+
+void builderDestroy(KeymapBuilder* pBuilder) {
+    free(pBuilder->pData);
+    free(pBuilder);
+}
+
+void builderReset(KeymapBuilder* pBuilder) {
+    KeyMapTables* pTables = &pBuilder->tables;
+    memset(pTables, 0, sizeof(KeyMapTables));
+    memset(pTables->loKeyMapTypes, KCF_NOP, LO_TYPE_LENGTH);
+    memset(pTables->hiKeyMapTypes, KCF_NOP, HI_TYPE_LENGTH);
+
+    struct KeyMap* pKeyMap = &pBuilder->keyMap;
+    pKeyMap->km_LoKeyMapTypes   = pTables->loKeyMapTypes;
+    pKeyMap->km_LoKeyMap        = pTables->loKeyMap;
+    pKeyMap->km_LoCapsable      = pTables->loCapsable;
+    pKeyMap->km_LoRepeatable    = pTables->loRepeatable;
+    pKeyMap->km_HiKeyMapTypes   = pTables->hiKeyMapTypes;
+    pKeyMap->km_HiKeyMap        = pTables->hiKeyMap;
+    pKeyMap->km_HiCapsable      = pTables->hiCapsable;
+    pKeyMap->km_HiRepeatable    = pTables->hiRepeatable;
+
+    pBuilder->pNext = pBuilder->pData;
+}
+
+ULONG builderDataBytes(const KeymapBuilder* pBuilder) {
+    return pBuilder->pNext - pBuilder->pData;
+}
+
+static void setKey(KeymapBuilder* pBuilder, UBYTE rawKey, UBYTE kmType, ULONG kmEntry) {
+    KeyMapTables* pTables = &pBuilder->tables;
+
+    if (rawKey < LO_MAP_LENGTH) {
+        pTables->loKeyMapTypes[rawKey] = kmType;
+        pTables->loKeyMap[rawKey] = kmEntry;
+    } else {
+        assert(rawKey < LO_MAP_LENGTH + HI_MAP_LENGTH);
+        pTables->hiKeyMapTypes[rawKey - LO_MAP_LENGTH] = kmType;
+        pTables->hiKeyMap[rawKey - LO_MAP_LENGTH] = kmEntry;
+    }
+}
+
+void setNormal(KeymapBuilder* pBuilder, UBYTE rawKey, UBYTE kmType, ULONG kmEntry) {
+    assert((kmType & (KCF_STRING | KCF_DEAD)) == 0);
+    setKey(pBuilder, rawKey, kmType, kmEntry);
+}
+
+void setString(KeymapBuilder* pBuilder, UBYTE rawKey, UBYTE kmType, const UBYTE* const* ppStrings, const UBYTE* pLengths) {
+    const int numEntries = calcNumEntries(kmType);
+    UBYTE* pDesc = pBuilder->pNext;
+    UBYTE* pChars = pDesc + (numEntries << 1);
+
+    for (int n = 0; n < numEntries; n++) {
+        const ULONG offset = pChars - pDesc;
+        assert(offset <= 0xFF);
+
+        *(pDesc + (n << 1))     = pLengths[n];
+        *(pDesc + (n << 1) + 1) = (UBYTE) offset;
+        memcpy(pChars, ppStrings[n], pLengths[n]);
+        pChars += pLengths[n];
+    }
+
+    assert(pChars <= pBuilder->pData + BUILDER_DATA_SIZE);
+    pBuilder->pNext = pChars;
+    setKey(pBuilder, rawKey, KCF_STRING | kmType, (ULONG) pDesc);
+}
+
+void setDead(KeymapBuilder* pBuilder, UBYTE rawKey, UBYTE kmType, const DeadEntry* pEntries) {
+    const int numEntries = calcNumEntries(kmType);
+    UBYTE* pDesc = pBuilder->pNext;
+    UBYTE* pTables = pDesc + (numEntries << 1);
+
+    for (int n = 0; n < numEntries; n++) {
+        const DeadEntry* pEntry = &pEntries[n];
+        *(pDesc + (n << 1)) = pEntry->kind;
+
+        if (pEntry->kind == DPF_MOD) {
+            // Entries passing the same table share it (as in keymaps where, e.g., the
+            // shifted and unshifted entries are modified the same way).
+            int shared = 0;
+            while (shared < n && !(pEntries[shared].kind == DPF_MOD && pEntries[shared].pTable == pEntry->pTable)) {
+                shared++;
+            }
+
+            if (shared < n) {
+                *(pDesc + (n << 1) + 1) = *(pDesc + (shared << 1) + 1);
+                continue;
+            }
+
+            const ULONG offset = pTables - pDesc;
+            assert(offset <= 0xFF);
+
+            *(pDesc + (n << 1) + 1) = (UBYTE) offset;
+            memcpy(pTables, pEntry->pTable, pEntry->tableLength);
+            pTables += pEntry->tableLength;
+        } else {
+            *(pDesc + (n << 1) + 1) = pEntry->value;
+        }
+    }
+
+    assert(pTables <= pBuilder->pData + BUILDER_DATA_SIZE);
+    pBuilder->pNext = pTables;
+    setKey(pBuilder, rawKey, KCF_DEAD | kmType, (ULONG) pDesc);
+}
+
+void setTable(KeymapBuilder* pBuilder, UBYTE rawKey, UBYTE kmType, const UBYTE* pDesc, const UBYTE* pData, UWORD dataLength) {
+    assert(kmType & (KCF_STRING | KCF_DEAD));
+    const int descBytes = calcNumEntries(kmType) << 1;
+    UBYTE* pTable = pBuilder->pNext;
+
+    if (kmType & KCF_STRING) {
+        for (int n = 0; n < descBytes; n += 2) {
+            assert(pDesc[n + 1] >= descBytes && pDesc[n + 1] + pDesc[n] <= descBytes + dataLength);
+        }
+    }
+
+    assert(pTable + descBytes + dataLength <= pBuilder->pData + BUILDER_DATA_SIZE);
+    memcpy(pTable, pDesc, descBytes);
+    memcpy(pTable + descBytes, pData, dataLength);
+    pBuilder->pNext = pTable + descBytes + dataLength;
+    setKey(pBuilder, rawKey, kmType, (ULONG) pTable);
+}
+
+void setCapsable(KeymapBuilder* pBuilder, UBYTE rawKey, BOOL capsable) {
+    setKeyBit(pBuilder->tables.loCapsable, pBuilder->tables.hiCapsable, rawKey, capsable);
+}
+
+void setRepeatable(KeymapBuilder* pBuilder, UBYTE rawKey, BOOL repeatable) {
+    setKeyBit(pBuilder->tables.loRepeatable, pBuilder->tables.hiRepeatable, rawKey, repeatable);
+}
+
+// Unshifted, shifted, alt, and shift+alt chars for the low keymap.  Keys with a 0
+// unshifted char are left as KCF_NOP.
+static const UBYTE usaLo[LO_MAP_LENGTH][4] = {
+    /* 00 */ { '`', '~',  0x60, 0x7E }, { '1', '!',  0xB9, 0xA1 }, { '2', '@',  0xB2, 0x40 }, { '3', '#',  0xB3, 0xA3 },
+    /* 04 */ { '4', '$',  0xA2, 0xA4 }, { '5', '%',  0xBC, 0xBD }, { '6', '^',  0xBE, 0xAC }, { '7', '&',  0xB7, 0xB1 },
+    /* 08 */ { '8', '*',  0xAB, 0xBB }, { '9', '(',  0xAD, 0xAD }, { '0', ')',  0xBA, 0xB0 }, { '-', '_',  0x2D, 0x5F },
+    /* 0C */ { '=', '+',  0x3D, 0x2B }, { '\\','|',  0x5C, 0x7C }, { 0 },                    { '0', '0',  '0',  '0'  },
+    /* 10 */ { 'q', 'Q',  0xE5, 0xC5 }, { 'w', 'W',  0xB0, 0xB0 }, { 'e', 'E',  0xA9, 0xA9 }, { 'r', 'R',  0xAE, 0xAE },
+    /* 14 */ { 't', 'T',  0xFE, 0xDE }, { 'y', 'Y',  0xA4, 0xA5 }, { 'u', 'U',  0xB5, 0xB5 }, { 'i', 'I',  0xA1, 0xA6 },
+    /* 18 */ { 'o', 'O',  0xF8, 0xD8 }, { 'p', 'P',  0xB6, 0xB6 }, { '[', '{',  0x5B, 0x7B }, { ']', '}',  0x5D, 0x7D },
+    /* 1C */ { 0 },                    { '1', '1',  '1',  '1'  }, { '2', '2',  '2',  '2'  }, { '3', '3',  '3',  '3'  },
+    /* 20 */ { 'a', 'A',  0xE6, 0xC6 }, { 's', 'S',  0xDF, 0xA7 }, { 'd', 'D',  0xF0, 0xD0 }, { 'f', 'F',  0,    0    },
+    /* 24 */ { 'g', 'G',  0,    0    }, { 'h', 'H',  0,    0    }, { 'j', 'J',  0,    0    }, { 'k', 'K',  0,    0    },
+    /* 28 */ { 'l', 'L',  0xA3, 0xA3 }, { ';', ':',  0x3B, 0x3A }, { '\'','"',  0x27, 0x22 }, { 0 },
+    /* 2C */ { 0 },                    { '4', '4',  '4',  '4'  }, { '5', '5',  '5',  '5'  }, { '6', '6',  '6',  '6'  },
+    /* 30 */ { 0 },                    { 'z', 'Z',  0xB1, 0xAC }, { 'x', 'X',  0xD7, 0xF7 }, { 'c', 'C',  0xE7, 0xC7 },
+    /* 34 */ { 'v', 'V',  0xAA, 0xAA }, { 'b', 'B',  0xBA, 0xBA }, { 'n', 'N',  0xAD, 0xAF }, { 'm', 'M',  0xB8, 0xB8 },
+    /* 38 */ { ',', '<',  0x2C, 0x3C }, { '.', '>',  0x2E, 0x3E }, { '/', '?',  0x2F, 0x3F }, { 0 },
+    /* 3C */ { '.', '.',  '.',  '.'  }, { '7', '7',  '7',  '7'  }, { '8', '8',  '8',  '8'  }, { '9', '9',  '9',  '9'  },
+};
+
+// Dead char tables for the DPF_MOD keys: unprefixed, followed by the char produced after
+// each of the five dead keys (1 = acute, 2 = grave, 3 = circumflex, 4 = tilde, 5 = umlaut).
+#define USA_DEAD_TABLE_BYTES 6
+
+typedef struct {
+    UBYTE rawKey;
+    UBYTE lower[USA_DEAD_TABLE_BYTES];
+    UBYTE upper[USA_DEAD_TABLE_BYTES];
+} UsaModKey;
+
+static const UsaModKey usaModKeys[] = {
+    { 0x20, { 'a', 0xE1, 0xE0, 0xE2, 0xE3, 0xE4 }, { 'A', 0xC1, 0xC0, 0xC2, 0xC3, 0xC4 } },
+    { 0x12, { 'e', 0xE9, 0xE8, 0xEA, 'e',  0xEB }, { 'E', 0xC9, 0xC8, 0xCA, 'E',  0xCB } },
+    { 0x17, { 'i', 0xED, 0xEC, 0xEE, 'i',  0xEF }, { 'I', 0xCD, 0xCC, 0xCE, 'I',  0xCF } },
+    { 0x18, { 'o', 0xF3, 0xF2, 0xF4, 0xF5, 0xF6 }, { 'O', 0xD3, 0xD2, 0xD4, 0xD5, 0xD6 } },
+    { 0x16, { 'u', 0xFA, 0xF9, 0xFB, 'u',  0xFC }, { 'U', 0xDA, 0xD9, 0xDB, 'U',  0xDC } },
+    { 0x36, { 'n', 'n',  'n',  'n',  0xF1, 'n'  }, { 'N', 'N',  'N',  'N',  0xD1, 'N'  } },
+    { 0x15, { 'y', 0xFD, 'y',  'y',  'y',  0xFF }, { 'Y', 0xDD, 'Y',  'Y',  'Y',  'Y'  } },
+};
+
+static void setUsaString(KeymapBuilder* pBuilder, UBYTE rawKey, UBYTE kmType, const char* pNormal, const char* pShifted) {
+    const UBYTE* ppStrings[2] = { (const UBYTE*) pNormal, (const UBYTE*) pShifted };
+    const UBYTE lengths[2] = { (UBYTE) strlen(pNormal), pShifted != NULL ? (UBYTE) strlen(pShifted) : 0 };
+    setString(pBuilder, rawKey, kmType, ppStrings, lengths);
+}
+
+void buildUsaKeymap(KeymapBuilder* pBuilder) {
+    builderReset(pBuilder);
+
+    // Low keymap: letters are KC_VANILLA (control clears bits 5/6), everything else
+    // is shift/alt qualified.  The numeric keypad is unqualified.
+    for (UBYTE rawKey = 0; rawKey < LO_MAP_LENGTH; rawKey++) {
+        const UBYTE* pChars = usaLo[rawKey];
+        if (pChars[0] == 0) {
+            continue;
+        }
+
+        const BOOL isLetter = ('a' <= pChars[0]) && (pChars[0] <= 'z');
+        const BOOL isKeypad = (pChars[0] == pChars[1]) && (pChars[1] == pChars[2]);
+        const UBYTE kmType = isLetter
+            ? KC_VANILLA
+            : isKeypad
+                ? KC_NOQUAL
+                : KCF_SHIFT | KCF_ALT;
+
+        setNormal(pBuilder, rawKey, kmType, ENTRY4(pChars[0], pChars[1], pChars[2], pChars[3]));
+        setCapsable(pBuilder, rawKey, isLetter);
+        setRepeatable(pBuilder, rawKey, TRUE);
+    }
+
+    // Alt-f/g/h/j/k are the dead keys (acute, grave, circumflex, tilde, umlaut).
+    for (UBYTE index = 1; index <= 5; index++) {
+        const UBYTE rawKey = 0x22 + index;
+        const DeadEntry entries[4] = {
+            { 0,        usaLo[rawKey][0] },
+            { 0,        usaLo[rawKey][1] },
+            { DPF_DEAD, index },
+            { DPF_DEAD, index },
+        };
+        setDead(pBuilder, rawKey, KCF_SHIFT | KCF_ALT, entries);
+    }
+
+    // Vowels (and 'n'/'y') are modified by a preceding dead key.
+    for (int i = 0; i < (int)(sizeof(usaModKeys) / sizeof(usaModKeys[0])); i++) {
+        const UsaModKey* pKey = &usaModKeys[i];
+        const DeadEntry entries[4] = {
+            { DPF_MOD,  0, pKey->lower, USA_DEAD_TABLE_BYTES },
+            { DPF_MOD,  0, pKey->upper, USA_DEAD_TABLE_BYTES },
+            { 0,        usaLo[pKey->rawKey][2] },
+            { 0,        usaLo[pKey->rawKey][3] },
+        };
+        setDead(pBuilder, pKey->rawKey, KCF_SHIFT | KCF_ALT, entries);
+    }
+
+    // High keymap
+    setNormal(pBuilder, 0x40, KCF_ALT, ENTRY2(' ', 0xA0));          // Space
+    setNormal(pBuilder, 0x41, KC_NOQUAL, ENTRY1(0x08));             // Backspace
+    setNormal(pBuilder, 0x42, KC_NOQUAL, ENTRY1(0x09));             // Tab
+    setNormal(pBuilder, 0x43, KC_NOQUAL, ENTRY1(0x0D));             // Keypad Enter
+    setNormal(pBuilder, 0x44, KC_NOQUAL, ENTRY1(0x0D));             // Return
+    setNormal(pBuilder, 0x45, KC_NOQUAL, ENTRY1(0x1B));             // Esc
+    setNormal(pBuilder, 0x46, KC_NOQUAL, ENTRY1(0x7F));             // Del
+    setNormal(pBuilder, 0x4A, KC_NOQUAL, ENTRY1('-'));              // Keypad -
+
+    setUsaString(pBuilder, 0x4C, KCF_SHIFT, "\x9b" "A", "\x9b" "T");    // Up
+    setUsaString(pBuilder, 0x4D, KCF_SHIFT, "\x9b" "B", "\x9b" "S");    // Down
+    setUsaString(pBuilder, 0x4E, KCF_SHIFT, "\x9b" "C", "\x9b" " @");   // Right
+    setUsaString(pBuilder, 0x4F, KCF_SHIFT, "\x9b" "D", "\x9b" " A");   // Left
+
+    // F1-F10
+    static const char* const fkeys[10][2] = {
+        { "\x9b" "0~", "\x9b" "10~" }, { "\x9b" "1~", "\x9b" "11~" }, { "\x9b" "2~", "\x9b" "12~" },
+        { "\x9b" "3~", "\x9b" "13~" }, { "\x9b" "4~", "\x9b" "14~" }, { "\x9b" "5~", "\x9b" "15~" },
+        { "\x9b" "6~", "\x9b" "16~" }, { "\x9b" "7~", "\x9b" "17~" }, { "\x9b" "8~", "\x9b" "18~" },
+        { "\x9b" "9~", "\x9b" "19~" },
+    };
+    for (UBYTE i = 0; i < 10; i++) {
+        setUsaString(pBuilder, 0x50 + i, KCF_SHIFT, fkeys[i][0], fkeys[i][1]);
+    }
+
+    setNormal(pBuilder, 0x5A, KC_NOQUAL, ENTRY1('('));              // Keypad (
+    setNormal(pBuilder, 0x5B, KC_NOQUAL, ENTRY1(')'));              // Keypad )
+    setNormal(pBuilder, 0x5C, KC_NOQUAL, ENTRY1('/'));              // Keypad /
+    setNormal(pBuilder, 0x5D, KC_NOQUAL, ENTRY1('*'));              // Keypad *
+    setNormal(pBuilder, 0x5E, KC_NOQUAL, ENTRY1('+'));              // Keypad +
+    setUsaString(pBuilder, 0x5F, KC_NOQUAL, "\x9b" "?~", NULL);     // Help
+
+    for (UBYTE rawKey = 0x40; rawKey < 0x50; rawKey++) {
+        setRepeatable(pBuilder, rawKey, rawKey != 0x45);
+    }
+}
+
+void buildStringKeymap(KeymapBuilder* pBuilder, UBYTE numQuals, UBYTE stringLength) {
+    static const UBYTE quals[] = { KC_NOQUAL, KCF_SHIFT, KCF_SHIFT | KCF_ALT, KCF_SHIFT | KCF_ALT | KCF_CONTROL };
+    assert(numQuals < sizeof(quals));
+
+    builderReset(pBuilder);
+
+    UBYTE chars[8][0xFF];
+    const UBYTE* ppStrings[8];
+    UBYTE lengths[8];
+
+    for (UBYTE rawKey = 0; rawKey < LO_MAP_LENGTH + HI_MAP_LENGTH; rawKey++) {
+        for (int n = 0; n < 8; n++) {
+            for (int i = 0; i < stringLength; i++) {
+                chars[n][i] = (UBYTE)(0x20 + ((rawKey + n * 7 + i) % 0x5F));
+            }
+            ppStrings[n] = chars[n];
+            lengths[n] = stringLength;
+        }
+
+        setString(pBuilder, rawKey, quals[numQuals], ppStrings, lengths);
+        setRepeatable(pBuilder, rawKey, TRUE);
+    }
+}
+
+void buildDeadKeymap(KeymapBuilder* pBuilder, UBYTE maxIndex) {
+    builderReset(pBuilder);
+
+    UBYTE table[0x10];
+    assert(maxIndex < sizeof(table));
+
+    for (UBYTE rawKey = 0; rawKey < LO_MAP_LENGTH + HI_MAP_LENGTH; rawKey++) {
+        if (rawKey & 1) {
+            for (int i = 0; i <= maxIndex; i++) {
+                table[i] = (UBYTE)(0xA0 + ((rawKey + i) % 0x60));
+            }
+
+            const DeadEntry entries[2] = {
+                { DPF_MOD, 0, table, (UBYTE)(maxIndex + 1) },
+                { DPF_MOD, 0, table, (UBYTE)(maxIndex + 1) },
+            };
+            setDead(pBuilder, rawKey, KCF_SHIFT, entries);
+        } else {
+            const DeadEntry entries[2] = {
+                { DPF_DEAD, (UBYTE)(1 + ((rawKey >> 1) % maxIndex)) },
+                { 0,        (UBYTE)('a' + (rawKey % 26)) },
+            };
+            setDead(pBuilder, rawKey, KCF_SHIFT, entries);
+        }
+    }
+}
+
+const StressProfile stressProfiles[NUM_STRESS_PROFILES] = {
+    //  name           strings  dead  quals  min len  max len  dead value  mod %
+    { "stress-xs",       12,      6,    1,       1,       8,     0x05,       30 },
+    { "stress-s",        30,     12,    2,       4,      16,     0x0F,       30 },
+    { "stress-m",        50,     20,    2,       8,      48,     0x37,       40 },
+    { "stress-l",        70,     30,    3,      16,     128,     0x7F,       50 },
+    { "stress-xl",       60,     60,    3,     128,     255,     0xFF,       80 },
+    { "strings-max",    120,      0,    3,     240,     255,     0x00,        0 },
+    { "dead-max",         0,    120,    3,       0,       0,     0xFF,      100 },
+};
+
+// xorshift32: small, fast, and the same sequence on every host.
+static ULONG nextRandom(ULONG* pState) {
+    ULONG x = *pState;
+    x ^= (x << 13) & 0xFFFFFFFFUL;
+    x ^= x >> 17;
+    x ^= (x << 5) & 0xFFFFFFFFUL;
+    return *pState = x;
+}
+
+// Returns a random number in [min, max].
+static int randomRange(ULONG* pState, int min, int max) {
+    return min + (int)(nextRandom(pState) % (ULONG)(max - min + 1));
+}
+
+// Returns 'numQuals' of KCF_SHIFT/KCF_ALT/KCF_CONTROL, chosen at random.
+static UBYTE randomQuals(ULONG* pState, int numQuals) {
+    static const UBYTE quals[3] = { KCF_SHIFT, KCF_ALT, KCF_CONTROL };
+    UBYTE kmType = 0;
+
+    while (numQuals > 0) {
+        const UBYTE qual = quals[randomRange(pState, 0, 2)];
+        if (!(kmType & qual)) {
+            kmType |= qual;
+            numQuals--;
+        }
+    }
+    return kmType;
+}
+
+// Sets a KCF_STRING key with random strings of 'minLength'..'maxLength' chars.  The strings
+// follow each other if they fit 8-bit offsets.  Otherwise they are random (overlapping)
+// windows of one block of chars, as in keymaps that pack long macro strings.
+static void setStressString(KeymapBuilder* pBuilder, ULONG* pState, UBYTE rawKey, UBYTE kmType, const StressProfile* pProfile) {
+    const int numEntries = calcNumEntries(kmType);
+    const int descBytes = numEntries << 1;
+    UBYTE desc[16];
+    UBYTE chars[0x200];
+
+    int lengths[8];
+    int longest = 0;
+    int inOrderEnd = descBytes;
+    BOOL inOrder = TRUE;
+
+    for (int n = 0; n < numEntries; n++) {
+        lengths[n] = randomRange(pState, pProfile->minStringLength, pProfile->maxStringLength);
+        longest = lengths[n] > longest ? lengths[n] : longest;
+        inOrder = inOrder && inOrderEnd <= MAX_TABLE_OFFSET;
+        inOrderEnd += lengths[n];
+    }
+
+    int dataLength = 0;
+    for (int n = 0; n < numEntries; n++) {
+        int offset;
+        if (inOrder) {
+            offset = dataLength;
+            dataLength += lengths[n];
+        } else {
+            offset = randomRange(pState, 0, MAX_TABLE_OFFSET - descBytes);
+            dataLength = MAX_TABLE_OFFSET - descBytes + longest;
+        }
+        desc[n << 1] = (UBYTE) lengths[n];
+        desc[(n << 1) + 1] = (UBYTE)(descBytes + offset);
+    }
+
+    assert(dataLength <= (int) sizeof(chars));
+    for (int i = 0; i < dataLength; i++) {
+        chars[i] = (UBYTE) randomRange(pState, 0x20, 0x7E);
+    }
+
+    setTable(pBuilder, rawKey, KCF_STRING | kmType, desc, chars, dataLength);
+}
+
+// Returns the size of the DPF_MOD tables of a keymap whose largest dead key has the
+// DPF_DEAD value 'deadValue' (see measureDead()).
+static int calcStressTableBytes(UBYTE deadValue) {
+    return (deadValue >> DP_2DFACSHIFT)
+        ? (deadValue >> DP_2DFACSHIFT) * (deadValue & DP_2DINDEXMASK)
+        : deadValue + 1;
+}
+
+// Returns a random DPF_DEAD value whose dead tables are no larger than those of 'deadValue'.
+static UBYTE randomDeadValue(ULONG* pState, UBYTE deadValue) {
+    if (deadValue >> DP_2DFACSHIFT) {
+        return (UBYTE)((randomRange(pState, 1, deadValue >> DP_2DFACSHIFT) << DP_2DFACSHIFT)
+            | randomRange(pState, 1, deadValue & DP_2DINDEXMASK));
+    }
+    return (UBYTE) randomRange(pState, 0, deadValue);
+}
+
+// Sets a KCF_DEAD key with random plain, DPF_DEAD, and DPF_MOD entries ('modPercent' of them
+// DPF_MOD).  The DPF_MOD tables start at random offsets, so neighbouring tables overlap.
+// If 'isFirst', the first entry is a DPF_DEAD entry with the profile's 'deadValue', which
+// sets the DPF_MOD table size of the keymap.
+static void setStressDead(KeymapBuilder* pBuilder, ULONG* pState, UBYTE rawKey, UBYTE kmType, const StressProfile* pProfile, BOOL isFirst) {
+    const int numEntries = calcNumEntries(kmType);
+    const int descBytes = numEntries << 1;
+    const int tableBytes = calcStressTableBytes(pProfile->deadValue);
+    const int maxOffset = descBytes + tableBytes < MAX_TABLE_OFFSET
+        ? descBytes + tableBytes
+        : MAX_TABLE_OFFSET;
+    UBYTE desc[16];
+    UBYTE tables[0x200];
+    int dataLength = 0;
+
+    for (int n = 0; n < numEntries; n++) {
+        UBYTE kind;
+        UBYTE value;
+
+        if (n == 0 && isFirst) {
+            kind = DPF_DEAD;
+            value = pProfile->deadValue;
+        } else if (randomRange(pState, 0, 99) < pProfile->modPercent) {
+            kind = DPF_MOD;
+            value = (UBYTE) randomRange(pState, descBytes, maxOffset);
+            if (value - descBytes + tableBytes > dataLength) {
+                dataLength = value - descBytes + tableBytes;
+            }
+        } else if (randomRange(pState, 0, 1)) {
+            kind = DPF_DEAD;
+            value = randomDeadValue(pState, pProfile->deadValue);
+        } else {
+            kind = 0;
+            value = (UBYTE) randomRange(pState, 0x20, 0xFF);
+        }
+
+        desc[n << 1] = kind;
+        desc[(n << 1) + 1] = value;
+    }
+
+    assert(dataLength <= (int) sizeof(tables));
+    for (int i = 0; i < dataLength; i++) {
+        tables[i] = (UBYTE) randomRange(pState, 0x20, 0xFF);
+    }
+
+    setTable(pBuilder, rawKey, KCF_DEAD | kmType, desc, tables, dataLength);
+}
+
+void buildStressKeymap(KeymapBuilder* pBuilder, const StressProfile* pProfile, ULONG seed) {
+    assert(pProfile->stringKeys + pProfile->deadKeys <= LO_MAP_LENGTH + HI_MAP_LENGTH);
+    assert(pProfile->numQuals <= 3);
+
+    builderReset(pBuilder);
+    ULONG state = seed != 0 ? seed : 1;
+
+    // Shuffle the raw keys, then assign string keys, dead keys, and normal keys in turn.
+    UBYTE keys[LO_MAP_LENGTH + HI_MAP_LENGTH];
+    for (int i = 0; i < (int) sizeof(keys); i++) {
+        keys[i] = (UBYTE) i;
+    }
+    for (int i = sizeof(keys) - 1; i > 0; i--) {
+        const int j = randomRange(&state, 0, i);
+        const UBYTE swap = keys[i];
+        keys[i] = keys[j];
+        keys[j] = swap;
+    }
+
+    for (int i = 0; i < (int) sizeof(keys); i++) {
+        const UBYTE rawKey = keys[i];
+
+        if (i < pProfile->stringKeys) {
+            setStressString(pBuilder, &state, rawKey, randomQuals(&state, pProfile->numQuals), pProfile);
+        } else if (i < pProfile->stringKeys + pProfile->deadKeys) {
+            setStressDead(pBuilder, &state, rawKey, randomQuals(&state, pProfile->numQuals), pProfile, i == pProfile->stringKeys);
+        } else {
+            setNormal(pBuilder, rawKey, randomQuals(&state, randomRange(&state, 0, 3)), nextRandom(&state) & 0xFFFFFFFFUL);
+        }
+
+        setCapsable(pBuilder, rawKey, randomRange(&state, 0, 1));
+        setRepeatable(pBuilder, rawKey, randomRange(&state, 0, 1));
+    }
+}
+
+const char* const corpusKeymapNames[NUM_CORPUS_KEYMAPS] = {
+    "usa",
+    "strings-2q",
+    "strings-3q",
+    "dead-5",
+};
+
+void buildCorpusKeymap(KeymapBuilder* pBuilder, int index) {
+    switch (index) {
+        case 0:
+            buildUsaKeymap(pBuilder);
+            break;
+        case 1:
+            buildStringKeymap(pBuilder, /* numQuals: */ 2, /* stringLength: */ 8);
+            break;
+        case 2:
+            buildStringKeymap(pBuilder, /* numQuals: */ 3, /* stringLength: */ 24);
+            break;
+        default:
+            assert(index == 3);
+            buildDeadKeymap(pBuilder, /* maxIndex: */ 5);
+            break;
+    }
+}
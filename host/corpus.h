@@ -0,0 +1,97 @@
+#ifndef CORPUS_H
+#define CORPUS_H
+
+#include <exec/types.h>
+#include <proto/keymap.h>
+#include "keymaptable.h"
+
+#define BUILDER_DATA_SIZE 0x40000   // Space for string/dead tables (enough for worst case keymaps)
+
+// A KeymapBuilder owns a KeyMap, its fixed-size tables, and a bump-allocated area for
+// string/dead tables.  It is used by the host build to construct keymaps in memory
+// without keymap.library.
+typedef struct {
+    struct KeyMap keyMap;
+    KeyMapTables tables;
+    UBYTE* pData;           // Start of string/dead table area
+    UBYTE* pNext;           // Next free byte in string/dead table area
+} KeymapBuilder;
+
+// A dead table entry as passed to setDead().  For DPF_MOD entries, 'pTable' points to
+// 'tableLength' bytes to append after the descriptor.  (Entries of one key with the same
+// 'pTable' share a single copy.)
+typedef struct {
+    UBYTE kind;             // 0, DPF_DEAD, or DPF_MOD
+    UBYTE value;            // Char (kind = 0) or dead index (kind = DPF_DEAD)
+    const UBYTE* pTable;    // Dead char table (kind = DPF_MOD)
+    UBYTE tableLength;
+} DeadEntry;
+
+// Helpers to pack the (up to) four chars of a normal key into a kmEntry.  The low
+// byte is the unqualified char.
+#define ENTRY1(a)           ((ULONG)(UBYTE)(a))
+#define ENTRY2(a, b)        (ENTRY1(a) | ((ULONG)(UBYTE)(b) << 8))
+#define ENTRY4(a, b, c, d)  (ENTRY2(a, b) | ((ULONG)(UBYTE)(c) << 16) | ((ULONG)(UBYTE)(d) << 24))
+
+KeymapBuilder* builderCreate(void);
+void builderDestroy(KeymapBuilder* pBuilder);
+
+// Resets the builder to an empty keymap (every key KCF_NOP).
+void builderReset(KeymapBuilder* pBuilder);
+
+// Number of string/dead table bytes used so far.
+ULONG builderDataBytes(const KeymapBuilder* pBuilder);
+
+void setNormal(KeymapBuilder* pBuilder, UBYTE rawKey, UBYTE kmType, ULONG kmEntry);
+void setString(KeymapBuilder* pBuilder, UBYTE rawKey, UBYTE kmType, const UBYTE* const* ppStrings, const UBYTE* pLengths);
+void setDead(KeymapBuilder* pBuilder, UBYTE rawKey, UBYTE kmType, const DeadEntry* pEntries);
+// Sets a string/dead key whose table is laid out by the caller: 'pDesc' holds the
+// descriptors (with offsets from the start of the table, as in a keymap) and 'pData' the
+// 'dataLength' bytes that follow them.  (Lets generators overlap strings and DPF_MOD tables.)
+void setTable(KeymapBuilder* pBuilder, UBYTE rawKey, UBYTE kmType, const UBYTE* pDesc, const UBYTE* pData, UWORD dataLength);
+void setCapsable(KeymapBuilder* pBuilder, UBYTE rawKey, BOOL capsable);
+void setRepeatable(KeymapBuilder* pBuilder, UBYTE rawKey, BOOL repeatable);
+
+// Populates 'pBuilder' with a replica of the standard 'usa' keymap, including its
+// cursor/function key strings and the alt-f/g/h/j/k dead keys.
+void buildUsaKeymap(KeymapBuilder* pBuilder);
+
+// Populates 'pBuilder' with a keymap in which every key is a KCF_STRING key with
+// 'numQuals' qualifier bits and strings of 'stringLength' bytes.
+void buildStringKeymap(KeymapBuilder* pBuilder, UBYTE numQuals, UBYTE stringLength);
+
+// Populates 'pBuilder' with a keymap in which every key is a KCF_DEAD key, alternating
+// between DPF_DEAD keys (indices 1..'maxIndex') and DPF_MOD keys.
+void buildDeadKeymap(KeymapBuilder* pBuilder, UBYTE maxIndex);
+
+// Parameters of a synthetic keymap built by buildStressKeymap().
+typedef struct {
+    const char* pName;
+    UBYTE stringKeys;       // Number of KCF_STRING keys (of 120)
+    UBYTE deadKeys;         // Number of KCF_DEAD keys (the remaining keys are normal keys)
+    UBYTE numQuals;         // Qualifier bits of each string/dead key (0-3)
+    UBYTE minStringLength;
+    UBYTE maxStringLength;  // Up to 255 (strings that do not fit 8-bit offsets overlap)
+    UBYTE deadValue;        // DPF_DEAD value that sets the DPF_MOD table size (double-dead if >= 0x10)
+    UBYTE modPercent;       // Share of the dead entries that are DPF_MOD
+} StressProfile;
+
+// Profiles from a few small string/dead keys up to the largest keymaps the format allows:
+// every key KCF_STRING | KC_VANILLA with 240-255 char strings ('strings-max'), or
+// KCF_DEAD | KC_VANILLA with overlapping 225-byte double-dead tables ('dead-max').
+#define NUM_STRESS_PROFILES 7
+
+extern const StressProfile stressProfiles[NUM_STRESS_PROFILES];
+
+// Populates 'pBuilder' with a random but valid keymap of the given profile.  The same
+// 'seed' always produces the same keymap.
+void buildStressKeymap(KeymapBuilder* pBuilder, const StressProfile* pProfile, ULONG seed);
+
+// The benchmark corpus: the 'usa' replica plus synthetic string- and dead-heavy keymaps.
+#define NUM_CORPUS_KEYMAPS 4
+
+extern const char* const corpusKeymapNames[NUM_CORPUS_KEYMAPS];
+
+void buildCorpusKeymap(KeymapBuilder* pBuilder, int index);
+
+#endif
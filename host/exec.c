@@ -0,0 +1,34 @@
+#include <proto/exec.h>
+#include <stdlib.h>
+#include <string.h>
+
+HostMemStats hostMemStats;
+
+APTR AllocMem(ULONG byteSize, ULONG requirements) {
+    APTR pMem = (requirements & MEMF_CLEAR)
+        ? calloc(1, byteSize)
+        : malloc(byteSize);
+
+    // The statistics are updated atomically, as the batch converter allocates from several
+    // threads.
+    if (pMem != NULL) {
+        __atomic_add_fetch(&hostMemStats.allocCount, 1, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&hostMemStats.allocBytes, byteSize, __ATOMIC_RELAXED);
+
+        const ULONG liveBytes = __atomic_add_fetch(&hostMemStats.liveBytes, byteSize, __ATOMIC_RELAXED);
+        ULONG peakBytes = __atomic_load_n(&hostMemStats.peakBytes, __ATOMIC_RELAXED);
+        while (liveBytes > peakBytes
+               && !__atomic_compare_exchange_n(&hostMemStats.peakBytes, &peakBytes, liveBytes, TRUE, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+        }
+    }
+
+    return pMem;
+}
+
+void FreeMem(APTR memoryBlock, ULONG byteSize) {
+    if (memoryBlock != NULL) {
+        __atomic_add_fetch(&hostMemStats.freeCount, 1, __ATOMIC_RELAXED);
+        __atomic_sub_fetch(&hostMemStats.liveBytes, byteSize, __ATOMIC_RELAXED);
+        free(memoryBlock);
+    }
+}
@@ -0,0 +1,390 @@
+#include "hunkfile.h"
+#include "copykeymap.h"
+#include "visit.h"
+#include "visitors/measure.h"
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define MAX_HUNKS           255     // Relocation targets are recorded in a UBYTE (+1)
+#define NUM_KEYS            (LO_MAP_LENGTH + HI_MAP_LENGTH)
+
+static void writeBE32(UBYTE* p, ULONG value) {
+    p[0] = (UBYTE)(value >> 24);
+    p[1] = (UBYTE)(value >> 16);
+    p[2] = (UBYTE)(value >> 8);
+    p[3] = (UBYTE) value;
+}
+
+// A parse of a file held in memory.  'ppTargets' holds the relocations of each hunk,
+// indexed by the byte offset of the relocated longword (0 if the longword is not relocated,
+// otherwise the target hunk + 1).
+typedef struct {
+    const UBYTE* pFile;
+    HunkKeymap* pKeymap;
+    HunkWalk walk;
+    UBYTE** ppTargets;
+} Parse;
+
+static BOOL readMemory(void* pContext, ULONG position, UBYTE* pDest, ULONG length) {
+    const Parse* pParse = pContext;
+    if (position > pParse->walk.fileSize || length > pParse->walk.fileSize - position) {
+        return FALSE;
+    }
+    memcpy(pDest, pParse->pFile + position, length);
+    return TRUE;
+}
+
+static void recordReloc(void* pContext, ULONG h, ULONG offset, ULONG target) {
+    Parse* pParse = pContext;
+    if (pParse->ppTargets[h] == NULL) {
+        pParse->ppTargets[h] = calloc(1, pParse->walk.pHunks[h].size + 1);
+    }
+    pParse->ppTargets[h][offset] = (UBYTE)(target + 1);
+}
+
+// Copies the contents of every hunk walked by walkHunks() into memory.
+static void loadHunks(Parse* pParse) {
+    HunkKeymap* pKeymap = pParse->pKeymap;
+    pKeymap->numHunks = pParse->walk.numHunks;
+    pKeymap->ppHunks = calloc(pKeymap->numHunks, sizeof(UBYTE*));
+    pKeymap->pHunkSizes = calloc(pKeymap->numHunks, sizeof(ULONG));
+
+    for (ULONG h = 0; h < pKeymap->numHunks; h++) {
+        const HunkInfo* pHunk = &pParse->walk.pHunks[h];
+        pKeymap->pHunkSizes[h] = pHunk->size;
+        pKeymap->ppHunks[h] = calloc(1, pHunk->size + 1);
+        memcpy(pKeymap->ppHunks[h], pParse->pFile + pHunk->position, pHunk->dataBytes);
+    }
+}
+
+// Reads the relocated pointer at 'offset' in hunk 'h', which must point at least 'length'
+// bytes before the end of its target hunk.
+static BOOL readPointer(Parse* pParse, ULONG h, ULONG offset, ULONG length, HunkPointer* pPointer) {
+    const HunkKeymap* pKeymap = pParse->pKeymap;
+    const BOOL inHunk = offset + 4 <= pKeymap->pHunkSizes[h];
+    const UBYTE target = inHunk && pParse->ppTargets[h] != NULL ? pParse->ppTargets[h][offset] : 0;
+    const ULONG value = inHunk ? readBE32(pKeymap->ppHunks[h] + offset) : 0;
+
+    return resolvePointer(&pParse->walk, h, offset, target, value, length, pPointer);
+}
+
+static UBYTE* hostAddress(const HunkKeymap* pKeymap, const HunkPointer* pPointer) {
+    return pKeymap->ppHunks[pPointer->hunk] + pPointer->offset;
+}
+
+// Reads one map (types and kmEntries) of the KeyMap.  'pRemaining' receives the number of
+// bytes from each string/dead table to the end of its hunk.
+static BOOL readMap(Parse* pParse, const HunkPointer* pTypes, const HunkPointer* pMap, UBYTE* pDestTypes, ULONG* pDestMap, int mapSize, ULONG* pRemaining) {
+    HunkKeymap* pKeymap = pParse->pKeymap;
+    memcpy(pDestTypes, hostAddress(pKeymap, pTypes), mapSize);
+
+    for (int i = 0; i < mapSize; i++) {
+        const UBYTE type = pDestTypes[i];
+        const ULONG offset = pMap->offset + (i << 2);
+
+        if ((type & KCF_NOP) || !(type & (KCF_STRING | KCF_DEAD))) {
+            pDestMap[i] = readBE32(pKeymap->ppHunks[pMap->hunk] + offset);
+            pRemaining[i] = 0;
+            continue;
+        }
+
+        HunkPointer table;
+        if (!readPointer(pParse, pMap->hunk, offset, calcNumEntries(type) << 1, &table)) {
+            return FALSE;
+        }
+
+        const UBYTE* pTable = hostAddress(pKeymap, &table);
+        const ULONG remaining = hunkRemaining(&pParse->walk, &table);
+        if (!checkTable(&pParse->walk, type, pTable, remaining)) {
+            return FALSE;
+        }
+
+        pDestMap[i] = (ULONG) pTable;
+        pRemaining[i] = remaining;
+    }
+
+    return TRUE;
+}
+
+// Checks that the DPF_MOD tables of every dead table lie within their hunk.  (The rest of the
+// string/dead tables were checked by readMap(), but the size of the DPF_MOD tables is only
+// known once the whole keymap has been measured.)
+static BOOL checkTables(Parse* pParse, const ULONG* pRemaining) {
+    HunkKeymap* pKeymap = pParse->pKeymap;
+    Sizes sizes = { 0 };
+    visitMeasure(&pKeymap->keyMap, &sizes);
+
+    for (int k = 0; k < NUM_KEYS; k++) {
+        const UBYTE type = k < LO_MAP_LENGTH ? pKeymap->tables.loKeyMapTypes[k] : pKeymap->tables.hiKeyMapTypes[k - LO_MAP_LENGTH];
+        const ULONG kmEntry = k < LO_MAP_LENGTH ? pKeymap->tables.loKeyMap[k] : pKeymap->tables.hiKeyMap[k - LO_MAP_LENGTH];
+        if ((type & KCF_NOP) || (type & KCF_STRING) || !(type & KCF_DEAD)) {
+            continue;
+        }
+
+        if (!checkModTables(&pParse->walk, (const UBYTE*) kmEntry, calcNumEntries(type), sizes.deadCharTableBytes, pRemaining[k])) {
+            return FALSE;
+        }
+    }
+
+    return TRUE;
+}
+
+// Builds the KeyMap from the KeyMapNode at the start of the first hunk.
+static BOOL readKeymapNode(Parse* pParse) {
+    HunkKeymap* pKeymap = pParse->pKeymap;
+
+    ULONG node = 0;
+    if (readBE32(pKeymap->ppHunks[0]) == KEYMAP_STUB) {
+        node = 4;
+    }
+
+    // ln_Name
+    HunkPointer name;
+    if (!readPointer(pParse, 0, node + KEYMAP_NAME_OFFSET, 0, &name)) {
+        return FALSE;
+    }
+
+    const ULONG nameLength = hunkRemaining(&pParse->walk, &name);
+    strncpy(pKeymap->name, (const char*) hostAddress(pKeymap, &name),
+            nameLength < KEYMAP_NAME_LENGTH - 1 ? nameLength : KEYMAP_NAME_LENGTH - 1);
+
+    // The struct KeyMap follows the node: 8 pointers in the order of its fields.
+    HunkPointer fields[KEYMAP_FIELDS];
+    for (int i = 0; i < KEYMAP_FIELDS; i++) {
+        if (!readPointer(pParse, 0, node + KEYMAP_NODE_SIZE + (i << 2), keymapFieldLengths[i], &fields[i])) {
+            return FALSE;
+        }
+    }
+
+    KeyMapTables* pTables = &pKeymap->tables;
+    struct KeyMap* pKeyMap = &pKeymap->keyMap;
+    pKeyMap->km_LoKeyMapTypes   = pTables->loKeyMapTypes;
+    pKeyMap->km_LoKeyMap        = pTables->loKeyMap;
+    pKeyMap->km_LoCapsable      = pTables->loCapsable;
+    pKeyMap->km_LoRepeatable    = pTables->loRepeatable;
+    pKeyMap->km_HiKeyMapTypes   = pTables->hiKeyMapTypes;
+    pKeyMap->km_HiKeyMap        = pTables->hiKeyMap;
+    pKeyMap->km_HiCapsable      = pTables->hiCapsable;
+    pKeyMap->km_HiRepeatable    = pTables->hiRepeatable;
+
+    memcpy(pTables->loCapsable,   hostAddress(pKeymap, &fields[2]), LO_CAPS_BYTE_SIZE);
+    memcpy(pTables->loRepeatable, hostAddress(pKeymap, &fields[3]), LO_REPS_BYTE_SIZE);
+    memcpy(pTables->hiCapsable,   hostAddress(pKeymap, &fields[6]), HI_CAPS_BYTE_SIZE);
+    memcpy(pTables->hiRepeatable, hostAddress(pKeymap, &fields[7]), HI_REPS_BYTE_SIZE);
+
+    ULONG remaining[NUM_KEYS];
+    return readMap(pParse, &fields[0], &fields[1], pTables->loKeyMapTypes, pTables->loKeyMap, LO_MAP_LENGTH, remaining)
+        && readMap(pParse, &fields[4], &fields[5], pTables->hiKeyMapTypes, pTables->hiKeyMap, HI_MAP_LENGTH, remaining + LO_MAP_LENGTH)
+        && checkTables(pParse, remaining);
+}
+
+BOOL parseHunkKeymap(const UBYTE* pFile, ULONG size, HunkKeymap* pKeymap) {
+    memset(pKeymap, 0, sizeof(HunkKeymap));
+
+    Parse parse;
+    memset(&parse, 0, sizeof(parse));
+    parse.pFile = pFile;
+    parse.pKeymap = pKeymap;
+    parse.ppTargets = calloc(MAX_HUNKS, sizeof(UBYTE*));
+    parse.walk.pfnRead = readMemory;
+    parse.walk.pContext = &parse;
+    parse.walk.fileSize = size;
+    parse.walk.pHunks = calloc(MAX_HUNKS, sizeof(HunkInfo));
+    parse.walk.maxHunks = MAX_HUNKS;
+    parse.walk.pfnReloc = recordReloc;
+
+    const BOOL walked = walkHunks(&parse.walk);
+    if (walked) {
+        loadHunks(&parse);
+    }
+
+    const BOOL parsed = walked && readKeymapNode(&parse);
+    pKeymap->pError = parsed ? NULL : parse.walk.pError;
+
+    for (ULONG h = 0; h < MAX_HUNKS; h++) {
+        free(parse.ppTargets[h]);
+    }
+    free(parse.ppTargets);
+    free(parse.walk.pHunks);
+
+    return parsed;
+}
+
+BOOL readHunkKeymap(const char* pPath, HunkKeymap* pKeymap) {
+    memset(pKeymap, 0, sizeof(HunkKeymap));
+
+    FILE* pFile = fopen(pPath, "rb");
+    if (pFile == NULL) {
+        pKeymap->pError = "cannot open file";
+        return FALSE;
+    }
+
+    fseek(pFile, 0, SEEK_END);
+    const long size = ftell(pFile);
+    fseek(pFile, 0, SEEK_SET);
+
+    UBYTE* pData = malloc(size > 0 ? size : 1);
+    const BOOL read = fread(pData, 1, size, pFile) == (size_t) size;
+    fclose(pFile);
+
+    BOOL parsed = FALSE;
+    if (read) {
+        parsed = parseHunkKeymap(pData, size, pKeymap);
+    } else {
+        pKeymap->pError = "cannot read file";
+    }
+
+    free(pData);
+    return parsed;
+}
+
+void freeHunkKeymap(HunkKeymap* pKeymap) {
+    for (ULONG h = 0; h < pKeymap->numHunks; h++) {
+        free(pKeymap->ppHunks[h]);
+    }
+    free(pKeymap->ppHunks);
+    free(pKeymap->pHunkSizes);
+    pKeymap->ppHunks = NULL;
+    pKeymap->pHunkSizes = NULL;
+    pKeymap->numHunks = 0;
+}
+
+static LONG preadFile(void* pContext, ULONG position, UBYTE* pDest, ULONG length) {
+    return pread(*(const int*) pContext, pDest, length, position);
+}
+
+struct KeyMap* streamHunkKeymap(const char* pPath, ULONG chunkSize, Sizes* pSizes, StreamInfo* pInfo) {
+    // The file is read with unbuffered I/O, so the chunk is the only copy of it in memory.
+    int file = open(pPath, O_RDONLY);
+    struct stat status;
+    if (file < 0 || fstat(file, &status) != 0) {
+        if (file >= 0) {
+            close(file);
+        }
+        memset(pInfo, 0, sizeof(StreamInfo));
+        memset(pSizes, 0, sizeof(Sizes));
+        pInfo->pError = "cannot open file";
+        return NULL;
+    }
+
+    struct KeyMap* pCopy = streamKeymapFile(preadFile, &file, status.st_size, chunkSize, pSizes, pInfo);
+    close(file);
+    return pCopy;
+}
+
+// Writes a map (kmEntries) to the hunk at 'pMap'.  String/dead kmEntries are written as
+// offsets into the hunk (their tables follow the fixed-size tables at 'tablesOffset') and
+// recorded in 'pRelocs'.
+static void writeMap(UBYTE* pHunk, ULONG mapOffset, const UBYTE* pTypes, const ULONG* pMap, int mapSize,
+                     const UBYTE* pBuffer, ULONG bufferOffset, ULONG* pRelocs, ULONG* pNumRelocs) {
+    for (int i = 0; i < mapSize; i++) {
+        const UBYTE type = pTypes[i];
+        ULONG value = pMap[i];
+
+        if (!(type & KCF_NOP) && (type & (KCF_STRING | KCF_DEAD))) {
+            value = bufferOffset + ((const UBYTE*) pMap[i] - pBuffer);
+            pRelocs[(*pNumRelocs)++] = mapOffset + (i << 2);
+        }
+
+        writeBE32(pHunk + mapOffset + (i << 2), value);
+    }
+}
+
+BOOL writeHunkKeymap(const char* pPath, struct KeyMap* pKeyMap, const char* pName) {
+    // Compact the string/dead tables into a single buffer by copying the keymap.
+    Sizes sizes;
+    struct KeyMap* pCopy = copyKeymap(pKeyMap, &sizes);
+    if (pCopy == NULL) {
+        return FALSE;
+    }
+
+    const ULONG bufferSize = calcBufferSize(&sizes);
+    const UBYTE* pBuffer = (const UBYTE*) pCopy + calcCopySize(&sizes) - bufferSize;
+
+    // The hunk holds the KeyMapNode, the fixed-size tables (longword arrays first), the
+    // string/dead tables, and the name:
+    //
+    //      0   KeyMapNode (struct Node + struct KeyMap), padded to a longword
+    //      48  lo/hi kmEntries, lo/hi types, lo/hi capsable, lo/hi repeatable
+    //          string & dead tables
+    //          name
+    //
+    const ULONG loMapOffset = 48;
+    const ULONG hiMapOffset = loMapOffset + (LO_MAP_LENGTH << 2);
+    const ULONG loTypesOffset = hiMapOffset + (HI_MAP_LENGTH << 2);
+    const ULONG hiTypesOffset = loTypesOffset + LO_TYPE_LENGTH;
+    const ULONG loCapsOffset = hiTypesOffset + HI_TYPE_LENGTH;
+    const ULONG loRepsOffset = loCapsOffset + LO_CAPS_BYTE_SIZE;
+    const ULONG hiCapsOffset = loRepsOffset + LO_REPS_BYTE_SIZE;
+    const ULONG hiRepsOffset = hiCapsOffset + HI_CAPS_BYTE_SIZE;
+    const ULONG bufferOffset = hiRepsOffset + HI_REPS_BYTE_SIZE;
+    const ULONG nameOffset = bufferOffset + bufferSize;
+    const ULONG hunkSize = (nameOffset + strlen(pName) + 1 + 3) & ~3;
+
+    UBYTE* pHunk = calloc(1, hunkSize);
+    ULONG relocs[9 + NUM_KEYS];
+    ULONG numRelocs = 0;
+
+    relocs[numRelocs++] = 10;
+    writeBE32(pHunk + 10, nameOffset);
+
+    const ULONG fieldOffsets[8] = {
+        loTypesOffset, loMapOffset, loCapsOffset, loRepsOffset,
+        hiTypesOffset, hiMapOffset, hiCapsOffset, hiRepsOffset,
+    };
+    for (int i = 0; i < 8; i++) {
+        relocs[numRelocs++] = KEYMAP_NODE_SIZE + (i << 2);
+        writeBE32(pHunk + KEYMAP_NODE_SIZE + (i << 2), fieldOffsets[i]);
+    }
+
+    writeMap(pHunk, loMapOffset, pCopy->km_LoKeyMapTypes, pCopy->km_LoKeyMap, LO_MAP_LENGTH, pBuffer, bufferOffset, relocs, &numRelocs);
+    writeMap(pHunk, hiMapOffset, pCopy->km_HiKeyMapTypes, pCopy->km_HiKeyMap, HI_MAP_LENGTH, pBuffer, bufferOffset, relocs, &numRelocs);
+
+    memcpy(pHunk + loTypesOffset, pCopy->km_LoKeyMapTypes, LO_TYPE_LENGTH);
+    memcpy(pHunk + hiTypesOffset, pCopy->km_HiKeyMapTypes, HI_TYPE_LENGTH);
+    memcpy(pHunk + loCapsOffset,  pCopy->km_LoCapsable,    LO_CAPS_BYTE_SIZE);
+    memcpy(pHunk + loRepsOffset,  pCopy->km_LoRepeatable,  LO_REPS_BYTE_SIZE);
+    memcpy(pHunk + hiCapsOffset,  pCopy->km_HiCapsable,    HI_CAPS_BYTE_SIZE);
+    memcpy(pHunk + hiRepsOffset,  pCopy->km_HiRepeatable,  HI_REPS_BYTE_SIZE);
+    memcpy(pHunk + bufferOffset,  pBuffer,                 bufferSize);
+    strcpy((char*) pHunk + nameOffset, pName);
+
+    freeKeymap(pCopy, &sizes);
+
+    // HUNK_HEADER, HUNK_DATA, HUNK_RELOC32, HUNK_END
+    const ULONG fileSize = (8 + 5 + numRelocs) * 4 + hunkSize;
+    UBYTE* pFileData = malloc(fileSize);
+    UBYTE* p = pFileData;
+
+    const ULONG header[] = { HUNK_HEADER, 0, 1, 0, 0, hunkSize >> 2, HUNK_DATA, hunkSize >> 2 };
+    for (int i = 0; i < 8; i++, p += 4) {
+        writeBE32(p, header[i]);
+    }
+    memcpy(p, pHunk, hunkSize);
+    p += hunkSize;
+
+    writeBE32(p, HUNK_RELOC32);     p += 4;
+    writeBE32(p, numRelocs);        p += 4;
+    writeBE32(p, 0);                p += 4;     // Target hunk
+    for (ULONG i = 0; i < numRelocs; i++, p += 4) {
+        writeBE32(p, relocs[i]);
+    }
+    writeBE32(p, 0);                p += 4;
+    writeBE32(p, HUNK_END);         p += 4;
+
+    free(pHunk);
+
+    FILE* pFile = fopen(pPath, "wb");
+    const BOOL written = pFile != NULL && fwrite(pFileData, 1, fileSize, pFile) == fileSize;
+    if (pFile != NULL && fclose(pFile) != 0) {
+        free(pFileData);
+        return FALSE;
+    }
+
+    free(pFileData);
+    return written;
+}
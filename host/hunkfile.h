@@ -0,0 +1,41 @@
+#ifndef HUNKFILE_H
+#define HUNKFILE_H
+
+#include <exec/types.h>
+#include <proto/keymap.h>
+#include "keymaptable.h"
+#include "hunk.h"
+#include "hunkstream.h"
+
+// A keymap read from a keymap file (see hunk.h).  On the host, the KeyMap and its kmEntries
+// are rebuilt in 'tables' as native ULONGs and pointers, while the string/dead tables (which
+// only hold bytes) are used in place in the loaded hunks.
+typedef struct {
+    struct KeyMap keyMap;
+    KeyMapTables tables;
+    UBYTE** ppHunks;                    // Contents of each hunk
+    ULONG* pHunkSizes;                  // Size of each hunk in bytes
+    ULONG numHunks;
+    char name[KEYMAP_NAME_LENGTH];      // ln_Name of the KeyMapNode
+    const char* pError;                 // Why the file was rejected (if it was)
+} HunkKeymap;
+
+// Parses the keymap file in 'pFile'.  Every pointer, string table, and dead table is
+// bounds-checked against its hunk (with the checks of hunk.h that streamKeymapFile() also
+// uses).  Returns FALSE (with 'pError' set) if the file is not a valid keymap file.  The keymap is released with freeHunkKeymap() either way.
+BOOL parseHunkKeymap(const UBYTE* pFile, ULONG size, HunkKeymap* pKeymap);
+
+// Reads and parses the keymap file 'pPath'.
+BOOL readHunkKeymap(const char* pPath, HunkKeymap* pKeymap);
+
+void freeHunkKeymap(HunkKeymap* pKeymap);
+
+// Streams the keymap file 'pPath' into a copy with streamKeymapFile(), reading it with
+// pread() (so the chunk is the only copy of the file in memory).
+struct KeyMap* streamHunkKeymap(const char* pPath, ULONG chunkSize, Sizes* pSizes, StreamInfo* pInfo);
+
+// Writes 'pKeyMap' as a keymap file with a single HUNK_DATA hunk named 'pName'.
+// Returns FALSE on failure.
+BOOL writeHunkKeymap(const char* pPath, struct KeyMap* pKeyMap, const char* pName);
+
+#endif
@@ -0,0 +1,65 @@
+#include "imagefile.h"
+#include "image.h"
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+BOOL writeImageFile(const char* pPath, const struct KeyMap* pCopy, const Sizes* pSizes) {
+    const ULONG size = calcImageSize(pSizes);
+    UBYTE* pImage = malloc(size);
+    writeImage(pCopy, pSizes, pImage);
+
+    FILE* pFile = fopen(pPath, "wb");
+    const BOOL written = pFile != NULL && fwrite(pImage, 1, size, pFile) == size;
+    if (pFile != NULL && fclose(pFile) != 0) {
+        free(pImage);
+        return FALSE;
+    }
+
+    free(pImage);
+    return written;
+}
+
+struct KeyMap* mapImageFile(const char* pPath, MappedImage* pMapped) {
+    pMapped->pMapping = NULL;
+    pMapped->size = 0;
+
+    const int fd = open(pPath, O_RDONLY);
+    if (fd < 0) {
+        return NULL;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size == 0) {
+        close(fd);
+        return NULL;
+    }
+
+    // MAP_PRIVATE so that relocation writes to private copies of the pages rather than
+    // the file.
+    void* pMapping = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (pMapping == MAP_FAILED) {
+        return NULL;
+    }
+
+    struct KeyMap* pKeyMap = relocateImage(pMapping, st.st_size);
+    if (pKeyMap == NULL) {
+        munmap(pMapping, st.st_size);
+        return NULL;
+    }
+
+    pMapped->pMapping = pMapping;
+    pMapped->size = st.st_size;
+    return pKeyMap;
+}
+
+void unmapImageFile(MappedImage* pMapped) {
+    if (pMapped->pMapping != NULL) {
+        munmap(pMapped->pMapping, pMapped->size);
+        pMapped->pMapping = NULL;
+    }
+}
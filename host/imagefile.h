@@ -0,0 +1,24 @@
+#ifndef IMAGEFILE_H
+#define IMAGEFILE_H
+
+#include <exec/types.h>
+#include <proto/keymap.h>
+#include <stddef.h>
+#include "visitors/measure.h"
+
+// A keymap image file mapped into memory by mapImageFile().
+typedef struct {
+    void* pMapping;
+    size_t size;
+} MappedImage;
+
+// Writes an image of 'pCopy' (see writeImage()) to 'pPath'.  Returns FALSE on failure.
+BOOL writeImageFile(const char* pPath, const struct KeyMap* pCopy, const Sizes* pSizes);
+
+// Maps the image file 'pPath' copy-on-write and relocates it in place.  Returns the
+// KeyMap, or NULL if the file cannot be mapped or is not a valid image.
+struct KeyMap* mapImageFile(const char* pPath, MappedImage* pMapped);
+
+void unmapImageFile(MappedImage* pMapped);
+
+#endif
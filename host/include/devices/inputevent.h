@@ -0,0 +1,17 @@
+// Minimal stand-in for the NDK's <devices/inputevent.h> used by the native host build.
+
+#ifndef DEVICES_INPUTEVENT_H
+#define DEVICES_INPUTEVENT_H
+
+#include <exec/types.h>
+
+#define IECODE_UP_PREFIX        0x80
+
+#define IEQUALIFIER_LSHIFT      0x0001
+#define IEQUALIFIER_RSHIFT      0x0002
+#define IEQUALIFIER_CAPSLOCK    0x0004
+#define IEQUALIFIER_CONTROL     0x0008
+#define IEQUALIFIER_LALT        0x0010
+#define IEQUALIFIER_RALT        0x0020
+
+#endif
@@ -0,0 +1,32 @@
+// Minimal stand-in for the NDK's <exec/types.h> used by the native host build.
+//
+// Only the types referenced by the keymap sources are provided.  Note that ULONG is
+// 'unsigned long' so that, as on the Amiga, a ULONG kmEntry is wide enough to hold a
+// pointer to a string/dead table (64-bit on LP64 hosts).
+
+#ifndef EXEC_TYPES_H
+#define EXEC_TYPES_H
+
+#include <stddef.h>
+
+typedef unsigned char   UBYTE;
+typedef signed char     BYTE;
+typedef unsigned short  UWORD;
+typedef signed short    WORD;
+typedef unsigned long   ULONG;
+typedef signed long     LONG;
+typedef void*           APTR;
+typedef char*           STRPTR;
+typedef short           BOOL;
+
+#define VOID    void
+
+#ifndef TRUE
+#define TRUE    1
+#endif
+
+#ifndef FALSE
+#define FALSE   0
+#endif
+
+#endif
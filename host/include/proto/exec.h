@@ -0,0 +1,25 @@
+// Minimal stand-in for the NDK's <proto/exec.h> used by the native host build.
+//
+// AllocMem()/FreeMem() are implemented on top of the C heap by host/exec.c, which also
+// keeps running totals so the benchmarks can report how much memory was requested.
+
+#ifndef PROTO_EXEC_H
+#define PROTO_EXEC_H
+
+#include <exec/types.h>
+#include <exec/memory.h>
+
+typedef struct {
+    ULONG allocCount;       // Number of AllocMem() calls
+    ULONG allocBytes;       // Sum of byte sizes passed to AllocMem()
+    ULONG freeCount;        // Number of FreeMem() calls
+    ULONG liveBytes;        // Bytes currently allocated
+    ULONG peakBytes;        // High water mark of 'liveBytes'
+} HostMemStats;
+
+extern HostMemStats hostMemStats;
+
+APTR AllocMem(ULONG byteSize, ULONG requirements);
+void FreeMem(APTR memoryBlock, ULONG byteSize);
+
+#endif
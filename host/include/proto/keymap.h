@@ -0,0 +1,10 @@
+// Minimal stand-in for the NDK's <proto/keymap.h> used by the native host build.
+// (keymap.library itself is not available on the host.)
+
+#ifndef PROTO_KEYMAP_H
+#define PROTO_KEYMAP_H
+
+#include <exec/types.h>
+#include <devices/keymap.h>
+
+#endif
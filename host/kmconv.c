@@ -0,0 +1,139 @@
+// Host-side batch converter for keymap files.
+//
+// Parses each keymap file (the AmigaDOS load files of DEVS:Keymaps), copies it with the
+// same code as CopyKeymap, and checks the copies against the source.  Directories are
+// expanded to the files they contain.  The files are converted in parallel, and a line
+// per file (and a total) is reported in the order given.
+//
+// Usage: kmconv [-j <threads>] [-p <dir>] [-f text|json] [-r <dir>] <file|dir>...
+//
+//      -j      Number of worker threads (default: one per CPU)
+//      -p      Print each keymap to <dir>/<file>.txt (or .jsonl with -f json)
+//      -r      Regenerate each keymap as a keymap file in <dir> (and check it)
+
+#include "convert.h"
+#include "visitors/print.h"
+#include <dirent.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static ConvertJob* pJobs;
+static int numJobs;
+static int maxJobs;
+
+static void addJob(const char* pPath) {
+    if (numJobs == maxJobs) {
+        maxJobs = maxJobs ? maxJobs << 1 : 256;
+        pJobs = realloc(pJobs, maxJobs * sizeof(ConvertJob));
+    }
+
+    memset(&pJobs[numJobs], 0, sizeof(ConvertJob));
+    pJobs[numJobs++].pPath = pPath;
+}
+
+static int compareNames(const void* pA, const void* pB) {
+    return strcmp(*(char* const*) pA, *(char* const*) pB);
+}
+
+// Adds a job for every regular file in 'pDir', in name order.
+static BOOL addDirectory(const char* pDir) {
+    DIR* pDirectory = opendir(pDir);
+    if (pDirectory == NULL) {
+        return FALSE;
+    }
+
+    char** ppPaths = NULL;
+    int numPaths = 0;
+
+    struct dirent* pEntry;
+    while ((pEntry = readdir(pDirectory)) != NULL) {
+        const size_t length = strlen(pDir) + strlen(pEntry->d_name) + 2;
+        char* pPath = malloc(length);
+        snprintf(pPath, length, "%s/%s", pDir, pEntry->d_name);
+
+        struct stat st;
+        if (pEntry->d_name[0] == '.' || stat(pPath, &st) != 0 || !S_ISREG(st.st_mode)) {
+            free(pPath);
+            continue;
+        }
+
+        ppPaths = realloc(ppPaths, (numPaths + 1) * sizeof(char*));
+        ppPaths[numPaths++] = pPath;
+    }
+    closedir(pDirectory);
+
+    qsort(ppPaths, numPaths, sizeof(char*), compareNames);
+    for (int i = 0; i < numPaths; i++) {
+        addJob(ppPaths[i]);
+    }
+    free(ppPaths);
+    return TRUE;
+}
+
+static int usage(const char* pProgram) {
+    fprintf(stderr, "Usage: %s [-j <threads>] [-p <dir>] [-f text|json] [-r <dir>] <file|dir>...\n", pProgram);
+    return 2;
+}
+
+int main(int argc, char** argv) {
+    ConvertOptions options = { 0 };
+    options.format = PRINT_TEXT;
+    options.numThreads = (int) sysconf(_SC_NPROCESSORS_ONLN);
+
+    int i = 1;
+    for (; i < argc && argv[i][0] == '-'; i++) {
+        if (i + 1 >= argc) {
+            return usage(argv[0]);
+        }
+
+        if (strcmp(argv[i], "-j") == 0) {
+            options.numThreads = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-p") == 0) {
+            options.pPrintDir = argv[++i];
+        } else if (strcmp(argv[i], "-r") == 0) {
+            options.pHunkDir = argv[++i];
+        } else if (strcmp(argv[i], "-f") == 0) {
+            const char* pFormat = argv[++i];
+            if (strcmp(pFormat, "json") == 0) {
+                options.format = PRINT_JSON;
+            } else if (strcmp(pFormat, "text") != 0) {
+                return usage(argv[0]);
+            }
+        } else {
+            return usage(argv[0]);
+        }
+    }
+
+    if (i == argc) {
+        return usage(argv[0]);
+    }
+
+    for (; i < argc; i++) {
+        struct stat st;
+        if (stat(argv[i], &st) == 0 && S_ISDIR(st.st_mode)) {
+            if (!addDirectory(argv[i])) {
+                perror(argv[i]);
+                return 2;
+            }
+        } else {
+            addJob(argv[i]);
+        }
+    }
+
+    const int failed = convertKeymaps(pJobs, numJobs, &options);
+
+    for (int j = 0; j < numJobs; j++) {
+        const ConvertJob* pJob = &pJobs[j];
+        if (pJob->pError != NULL) {
+            printf("%s: error: %s\n", pJob->pPath, pJob->pError);
+        } else {
+            printf("%s: %s fingerprint=%08lx copy=%lu dedup=%lu\n", pJob->pPath, pJob->name, pJob->fingerprint, pJob->copySize, pJob->dedupSize);
+        }
+    }
+
+    printf("%d keymaps, %d converted, %d failed\n", numJobs, numJobs - failed, failed);
+    return failed > 0 ? 1 : 0;
+}
@@ -0,0 +1,42 @@
+#include "arena.h"
+#include <exec/types.h>
+#include <proto/exec.h>
+#include <string.h>
+
+BOOL initArena(KeymapArena* pArena, ULONG size) {
+    memset(pArena, 0, sizeof(KeymapArena));
+    if (size == 0) {
+        return TRUE;
+    }
+
+    pArena->pBlock = AllocMem(size, MEMF_CLEAR | MEMF_PUBLIC);
+    if (pArena->pBlock == NULL) {
+        return FALSE;
+    }
+
+    pArena->size = size;
+    return TRUE;
+}
+
+APTR allocArena(KeymapArena* pArena, ULONG size) {
+    const ULONG aligned = ARENA_ALIGN(size);
+    if (aligned > pArena->size - pArena->used) {
+        return NULL;
+    }
+
+    APTR pMem = pArena->pBlock + pArena->used;
+    pArena->used += aligned;
+    return pMem;
+}
+
+void resetArena(KeymapArena* pArena) {
+    memset(pArena->pBlock, 0, pArena->used);
+    pArena->used = 0;
+}
+
+void freeArena(KeymapArena* pArena) {
+    if (pArena->pBlock != NULL) {
+        FreeMem(pArena->pBlock, pArena->size);
+    }
+    memset(pArena, 0, sizeof(KeymapArena));
+}
@@ -0,0 +1,36 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <exec/types.h>
+
+// Allocations from an arena are rounded up to a ULONG (a longword on the Amiga) so that the
+// pointers and kmEntries of every KeyMap placed in it are aligned.  (On the host, where a
+// ULONG is 8 bytes, rounding to 4 left most copies misaligned.)
+#define ARENA_ALIGN(x) ((((ULONG) x) + sizeof(ULONG) - 1) & ~(sizeof(ULONG) - 1))
+
+// A KeymapArena is a single AllocMem() block in which many keymap copies are placed one
+// after the other (see copyKeymapToArena()) and released together with one FreeMem().
+// Batch tools measure every keymap first, so the arena is sized exactly and Exec's free
+// list is only searched once, however many keymaps are copied.
+typedef struct {
+    UBYTE* pBlock;
+    ULONG size;
+    ULONG used;
+} KeymapArena;
+
+// Allocates an arena of 'size' bytes (the sum of ARENA_ALIGN() of each allocation to be
+// made from it).  Returns FALSE if the allocation fails.
+BOOL initArena(KeymapArena* pArena, ULONG size);
+
+// Returns the next 'size' bytes of the arena, or NULL if the arena is full.
+APTR allocArena(KeymapArena* pArena, ULONG size);
+
+// Releases everything allocated from the arena but keeps its block, so that the next batch
+// (of at most 'size' bytes) is copied without another AllocMem().  The released bytes are
+// cleared, as they would be in a new arena.
+void resetArena(KeymapArena* pArena);
+
+// Releases the arena and everything allocated from it.
+void freeArena(KeymapArena* pArena);
+
+#endif
@@ -0,0 +1,208 @@
+#include "cache.h"
+#include "copykeymap.h"
+#include "patch.h"
+#include "visitors/fingerprint.h"
+#include <proto/exec.h>
+#include <string.h>
+
+static ULONG entrySize(const CachedKeymap* pEntry) {
+    return sizeof(CachedKeymap) + calcCopySize(&pEntry->sizes);
+}
+
+static void unlinkEntry(KeymapCache* pCache, CachedKeymap* pEntry) {
+    if (pEntry->pPrev != NULL) {
+        pEntry->pPrev->pNext = pEntry->pNext;
+    } else {
+        pCache->pHead = pEntry->pNext;
+    }
+
+    if (pEntry->pNext != NULL) {
+        pEntry->pNext->pPrev = pEntry->pPrev;
+    } else {
+        pCache->pTail = pEntry->pPrev;
+    }
+}
+
+static void linkHead(KeymapCache* pCache, CachedKeymap* pEntry) {
+    pEntry->pPrev = NULL;
+    pEntry->pNext = pCache->pHead;
+
+    if (pCache->pHead != NULL) {
+        pCache->pHead->pPrev = pEntry;
+    } else {
+        pCache->pTail = pEntry;
+    }
+    pCache->pHead = pEntry;
+}
+
+static void touchEntry(KeymapCache* pCache, CachedKeymap* pEntry) {
+    if (pCache->pHead != pEntry) {
+        unlinkEntry(pCache, pEntry);
+        linkHead(pCache, pEntry);
+    }
+}
+
+static void freeEntry(KeymapCache* pCache, CachedKeymap* pEntry) {
+    unlinkEntry(pCache, pEntry);
+    pCache->usedBytes -= entrySize(pEntry);
+    pCache->numEntries--;
+
+    freeKeymap(pEntry->pCopy, &pEntry->sizes);
+    FreeMem(pEntry, sizeof(CachedKeymap));
+}
+
+static void setName(CachedKeymap* pEntry, const char* pName) {
+    strncpy(pEntry->name, pName, CACHE_NAME_LENGTH - 1);
+    pEntry->name[CACHE_NAME_LENGTH - 1] = '\0';
+}
+
+static CachedKeymap* findByName(KeymapCache* pCache, const char* pName) {
+    for (CachedKeymap* pEntry = pCache->pHead; pEntry != NULL; pEntry = pEntry->pNext) {
+        if (strncmp(pEntry->name, pName, CACHE_NAME_LENGTH - 1) == 0) {
+            return pEntry;
+        }
+    }
+    return NULL;
+}
+
+// Compares the keys of 'pEntry's copy with 'pSrc' (a matching fingerprint alone may be a
+// collision).  A failed comparison counts as a mismatch, so that 'pSrc' is copied.
+static BOOL sameContent(const CachedKeymap* pEntry, struct KeyMap* pSrc) {
+    KeymapPatch* pPatch = diffKeymaps(pEntry->pCopy, pSrc);
+    if (pPatch == NULL) {
+        return FALSE;
+    }
+
+    const BOOL same = pPatch->numKeys == 0;
+    freePatch(pPatch);
+    return same;
+}
+
+static CachedKeymap* findByContent(KeymapCache* pCache, ULONG fingerprint, struct KeyMap* pSrc) {
+    for (CachedKeymap* pEntry = pCache->pHead; pEntry != NULL; pEntry = pEntry->pNext) {
+        if (pEntry->fingerprint == fingerprint && sameContent(pEntry, pSrc)) {
+            return pEntry;
+        }
+    }
+    return NULL;
+}
+
+static BOOL isDefault(const KeymapCache* pCache, const CachedKeymap* pEntry) {
+    return pEntry->installed != 0 && pEntry->installed == pCache->generation;
+}
+
+// Returns the entry to evict next: the least recently used entry that has never been
+// installed, or else the one installed longest ago.  Neither the current default keymap
+// nor 'pKeep' is returned.  Returns NULL if nothing can be evicted.
+static CachedKeymap* findVictim(KeymapCache* pCache, const CachedKeymap* pKeep) {
+    CachedKeymap* pOldest = NULL;
+
+    for (CachedKeymap* pEntry = pCache->pTail; pEntry != NULL; pEntry = pEntry->pPrev) {
+        if (pEntry == pKeep || isDefault(pCache, pEntry)) {
+            continue;
+        }
+        if (pEntry->installed == 0) {
+            return pEntry;
+        }
+        if (pOldest == NULL || pEntry->installed < pOldest->installed) {
+            pOldest = pEntry;
+        }
+    }
+    return pOldest;
+}
+
+// Evicts entries (other than 'pKeep') until the cache is within its budget.
+static void evict(KeymapCache* pCache, const CachedKeymap* pKeep) {
+    while (pCache->usedBytes > pCache->budget) {
+        CachedKeymap* pVictim = findVictim(pCache, pKeep);
+        if (pVictim == NULL) {
+            break;
+        }
+        freeEntry(pCache, pVictim);
+    }
+}
+
+void initCache(KeymapCache* pCache, ULONG budget) {
+    memset(pCache, 0, sizeof(KeymapCache));
+    pCache->budget = budget;
+}
+
+struct KeyMap* findCachedKeymap(KeymapCache* pCache, const char* pName) {
+    CachedKeymap* pEntry = findByName(pCache, pName);
+    if (pEntry == NULL) {
+        return NULL;
+    }
+
+    touchEntry(pCache, pEntry);
+    return pEntry->pCopy;
+}
+
+struct KeyMap* addCachedKeymap(KeymapCache* pCache, const char* pName, struct KeyMap* pSrc) {
+    const ULONG fingerprint = fingerprintKeymap(pSrc);
+
+    // The name now refers to 'pSrc's content.  An older entry with this name keeps its copy
+    // (it may be installed) but loses the name.
+    CachedKeymap* pEntry = findByContent(pCache, fingerprint, pSrc);
+    CachedKeymap* pNamed = findByName(pCache, pName);
+    if (pNamed != NULL && pNamed != pEntry) {
+        pNamed->name[0] = '\0';
+    }
+
+    if (pEntry != NULL) {
+        setName(pEntry, pName);
+        touchEntry(pCache, pEntry);
+        return pEntry->pCopy;
+    }
+
+    pEntry = AllocMem(sizeof(CachedKeymap), MEMF_CLEAR | MEMF_PUBLIC);
+    if (pEntry == NULL) {
+        return NULL;
+    }
+
+    pEntry->pCopy = copyKeymap(pSrc, &pEntry->sizes);
+    if (pEntry->pCopy == NULL) {
+        FreeMem(pEntry, sizeof(CachedKeymap));
+        return NULL;
+    }
+
+    pEntry->fingerprint = fingerprint;
+    setName(pEntry, pName);
+
+    linkHead(pCache, pEntry);
+    pCache->usedBytes += entrySize(pEntry);
+    pCache->numEntries++;
+
+    evict(pCache, pEntry);
+    return pEntry->pCopy;
+}
+
+void pinCachedKeymap(KeymapCache* pCache, struct KeyMap* pKeyMap) {
+    pCache->generation++;
+
+    for (CachedKeymap* pEntry = pCache->pHead; pEntry != NULL; pEntry = pEntry->pNext) {
+        if (pEntry->pCopy == pKeyMap) {
+            pEntry->installed = pCache->generation;
+        }
+    }
+
+    evict(pCache, /* pKeep: */ NULL);
+}
+
+void flushCache(KeymapCache* pCache) {
+    CachedKeymap* pEntry = pCache->pHead;
+
+    while (pEntry != NULL) {
+        CachedKeymap* pNext = pEntry->pNext;
+
+        if (!isDefault(pCache, pEntry)) {
+            freeEntry(pCache, pEntry);
+        }
+
+        pEntry = pNext;
+    }
+}
+
+void releaseInstalled(KeymapCache* pCache) {
+    // No entry was installed in the new generation.
+    pCache->generation++;
+}
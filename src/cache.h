@@ -0,0 +1,60 @@
+#ifndef CACHE_H
+#define CACHE_H
+
+#include <exec/types.h>
+#include <proto/keymap.h>
+#include "visitors/measure.h"
+
+#define CACHE_NAME_LENGTH 32
+
+// A copied keymap block held by a KeymapCache.
+typedef struct CachedKeymap {
+    struct CachedKeymap* pNext;     // Next less recently used entry
+    struct CachedKeymap* pPrev;     // Next more recently used entry
+    struct KeyMap* pCopy;           // Copy made by copyKeymap()
+    Sizes sizes;                    // Needed to free 'pCopy'
+    ULONG fingerprint;              // Content hash of 'pCopy' (see fingerprintKeymap())
+    ULONG installed;                // Generation in which 'pCopy' was last installed (0 if never)
+    char name[CACHE_NAME_LENGTH];   // Empty if the name has been reassigned to newer content
+} CachedKeymap;
+
+// A cache of prepared keymap copies, so that switching between layouts is a single
+// SetKeyMapDefault() of a cached copy.  Entries are evicted when the copies exceed 'budget'
+// bytes: first the least recently used copies that have never been installed, then the
+// copies installed longest ago, as consoles opened under those may still be using them.
+// The current default keymap is never evicted (so it alone may exceed the budget).
+typedef struct {
+    CachedKeymap* pHead;            // Most recently used
+    CachedKeymap* pTail;            // Least recently used
+    ULONG budget;
+    ULONG usedBytes;                // Sum of the entry and copy sizes
+    ULONG generation;               // Incremented by each pinCachedKeymap()
+    UWORD numEntries;
+} KeymapCache;
+
+void initCache(KeymapCache* pCache, ULONG budget);
+
+// Returns the copy cached as 'pName' (marking it most recently used), or NULL if there
+// is none.
+struct KeyMap* findCachedKeymap(KeymapCache* pCache, const char* pName);
+
+// Returns a cached copy of 'pSrc' named 'pName', copying it only if no entry has the same
+// content.  (An existing entry with the same fingerprint is compared key by key, and
+// renamed if it matches.)  Least recently used
+// entries are evicted to stay within the budget.  Returns NULL if the allocation fails.
+struct KeyMap* addCachedKeymap(KeymapCache* pCache, const char* pName, struct KeyMap* pSrc);
+
+// Records 'pKeyMap' (which must be the installed default keymap) as the current default,
+// which protects it from eviction until another copy is pinned.  The previous default
+// becomes evictable, so entries are evicted if the cache is over its budget.
+void pinCachedKeymap(KeymapCache* pCache, struct KeyMap* pKeyMap);
+
+// Frees every entry other than the current default keymap.
+void flushCache(KeymapCache* pCache);
+
+// Forgets which copy is the current default, so that it can be evicted or flushed.  Only
+// for when it can no longer be in use (e.g. on the host, or once the default keymap has
+// been restored to one outside the cache).
+void releaseInstalled(KeymapCache* pCache);
+
+#endif
@@ -0,0 +1,211 @@
+#include "copykeymap.h"
+#include "arena.h"
+#include "visit.h"
+#include "visitors/measure.h"
+#include "visitors/copy.h"
+#include "copystats.h"
+#include <proto/exec.h>
+#include <assert.h>
+#include <string.h>
+#include "keymaptable.h"
+
+#define ALIGN16(x) ((((ULONG) x) + 1) & ~1)
+
+// There are three pieces to the KeyMap we need to copy:
+//
+//  - The keymap struct itself (8 pointers = 32B)
+//  - The fixed size tables pointed to by the keymap struct containing the maps, types, capsable
+//    and repeatable arrays for the lo and hi maps (630B)
+//  - The string and dead char entries pointed to by KCF_STRING and KCF_DEAD entries.
+//    (size calculated below)
+//
+static const ULONG keymapSize = ALIGN16(sizeof(struct KeyMap));    // 8 pointers = 32B
+static const ULONG tablesSize = ALIGN16(sizeof(KeyMapTables));     // 8 arrays, totaling 630B
+
+ULONG calcBufferSize(const Sizes* pSizes) {
+    return (pSizes->stringEntries << 1)                     // Each KCF_STRING = 2 bytes (UBYTE length, UBYTE offset)
+        + pSizes->stringBytes                               // Sum of KCF_STRING lengths
+        + (pSizes->deadEntries << 1)                        // Each KCF_DEAD = 2 bytes (UBYTE kind, UBYTE char/index/offset)
+        + pSizes->deadTableBytes;                           // DPF_MOD dead char tables (see planDeadRuns())
+}
+
+ULONG calcCopySize(const Sizes* pSizes) {
+    return keymapSize           // 32B
+        + tablesSize            // 630B
+        + calcBufferSize(pSizes);   // variable length
+}
+
+KeyMapTables* initKeymapBlock(struct KeyMap* pDestKeyMap, struct KeyMap* pSrc) {
+    KeyMapTables* pDestTables = (KeyMapTables*)(((UBYTE*) pDestKeyMap) + keymapSize);
+
+    // Initialize the KeyMap struct with the addresses of the fixed-size map, type,
+    // capsable, and repeatable tables.
+    pDestKeyMap->km_LoKeyMapTypes   = pDestTables->loKeyMapTypes;
+    pDestKeyMap->km_LoKeyMap        = pDestTables->loKeyMap;
+    pDestKeyMap->km_LoCapsable      = pDestTables->loCapsable;
+    pDestKeyMap->km_LoRepeatable    = pDestTables->loRepeatable;
+    pDestKeyMap->km_HiKeyMapTypes   = pDestTables->hiKeyMapTypes;
+    pDestKeyMap->km_HiKeyMap        = pDestTables->hiKeyMap;
+    pDestKeyMap->km_HiCapsable      = pDestTables->hiCapsable;
+    pDestKeyMap->km_HiRepeatable    = pDestTables->hiRepeatable;
+
+    // The hi/lo type, capsable, and repeatable tables do not contain pointers and
+    // can simply be memcpy'ed.
+    memcpy(pDestKeyMap->km_LoKeyMapTypes, pSrc->km_LoKeyMapTypes, LO_TYPE_LENGTH);
+    memcpy(pDestKeyMap->km_LoCapsable,    pSrc->km_LoCapsable,    LO_CAPS_BYTE_SIZE);
+    memcpy(pDestKeyMap->km_LoRepeatable,  pSrc->km_LoRepeatable,  LO_REPS_BYTE_SIZE);
+    memcpy(pDestKeyMap->km_HiKeyMapTypes, pSrc->km_HiKeyMapTypes, HI_TYPE_LENGTH);
+    memcpy(pDestKeyMap->km_HiCapsable,    pSrc->km_HiCapsable,    HI_CAPS_BYTE_SIZE);
+    memcpy(pDestKeyMap->km_HiRepeatable,  pSrc->km_HiRepeatable,  HI_REPS_BYTE_SIZE);
+
+    return pDestTables;
+}
+
+// Records the per-copy statistics that follow from the measurements alone: the fixed-size
+// part of the block, the ALIGN16() padding, and the DPF_MOD table bytes saved by sizing the
+// tables exactly instead of reserving 'deadCharTableBytes' per DPF_MOD entry.  (The
+// per-key counts are recorded by the CopyVisitor.)
+static void addBlockStats(const Sizes* pSizes) {
+    STATS_ADD(copies, 1);
+    STATS_ADD(structBytes, sizeof(struct KeyMap) + sizeof(KeyMapTables));
+    STATS_ADD(alignPadBytes, (keymapSize - sizeof(struct KeyMap)) + (tablesSize - sizeof(KeyMapTables)));
+    STATS_ADD(deadSlackBytes, pSizes->modEntries * pSizes->deadCharTableBytes - pSizes->deadTableBytes);
+}
+
+static BOOL measureKeymapWith(struct KeyMap* pSrc, Sizes* pSizes, InternTable* pIntern) {
+    // To calculate the amount of memory required to hold a copy of the keymap,
+    // we use a visitor to walk the keymap and count the following quantities:
+    //
+    //  - The number of KCF_STRING entries
+    //  - The total number of characters referenced by the KCF_STRING entries
+    //  - The number of KCF_DEAD entries
+    //  - The number of KCF_DEAD entries that are DPF_MOD
+    //  - The size of the dead char table for each DPF_MOD entry
+    //  - The exact number of dead char table bytes once shared/overlapping tables are merged
+    //
+    // (See the measure visitor for more details.)
+    // When deduplicating, identical tables are only counted once.  (See the InternTable.)
+    //
+    // Measuring also plans the layout of each string/dead table (see layout.h).  If a table
+    // cannot be laid out with 8-bit offsets, the keymap cannot be copied.
+    STATS_BEGIN(STAT_MEASURE);
+    memset(pSizes, 0, sizeof(Sizes));
+    pSizes->pIntern = pIntern;
+    visitMeasure(pSrc, /* pContext: */ pSizes);
+    finishMeasure(pSizes, pSrc);
+    pSizes->pIntern = NULL;
+    STATS_END(STAT_MEASURE);
+
+    return pSizes->overflowTables == 0;
+}
+
+BOOL measureKeymap(struct KeyMap* pSrc, Sizes* pSizes) {
+    return measureKeymapWith(pSrc, pSizes, /* pIntern: */ NULL);
+}
+
+// Copies 'pSrc' (measured as 'pSizes') into the block at 'pDestKeyMap', which must hold
+// calcCopySize(pSizes) bytes.
+static void copyIntoBlock(struct KeyMap* pSrc, const Sizes* pSizes, InternTable* pIntern, struct KeyMap* pDestKeyMap) {
+    // The block holds a contiguous copy of the keymap, with pointers into the memory for
+    // the various table as follows:
+    //
+    //      pDestKeyMap -> +-----------------------+
+    //                     |           32B         |
+    //      pDestTables -> +-----------------------+
+    //                     |                       |
+    //                     |          630B         |
+    //                     |                       |
+    //      pDestBuffer -> +-----------------------+
+    //                     |                       |
+    //                     | String & Dead Tables  |
+    //                     |                       |
+    //                     +-----------------------+
+    //
+    const ULONG bufferSize = calcBufferSize(pSizes);
+
+    STATS_BEGIN(STAT_TABLES);
+    KeyMapTables* pDestTables = initKeymapBlock(pDestKeyMap, pSrc);
+    STATS_END(STAT_TABLES);
+    addBlockStats(pSizes);
+
+    UBYTE* pDestBuffer = ((UBYTE*) pDestTables) + tablesSize;
+    const UBYTE* pDestBufferStart = pDestBuffer;
+
+    // The hi/lo map entries contain pointers to string/dead tables.  To copy these,
+    // we use a visitor that walks the map entries, inspects the associated type,
+    // and appends copies of referenced string/dead tables to the preallocated buffer
+    // that begins at 'pDestBuffer'.  See the copy visitor for more details.
+    CopyContext copy = { 0 };
+    copy.pKmEntry = pDestTables->loKeyMap;                  // Next KmEntry to write
+    copy.pBuffer = pDestBuffer;                             // Next available space for string/dead table
+    copy.deadCharTableBytes = pSizes->deadCharTableBytes;   // Size of dead table (per DPF_MOD entry)
+    copy.pIntern = pIntern;                                 // Tables interned by the MeasureVisitor
+
+    // Copy the map entries and string/dead tables for the low map.
+    STATS_BEGIN(STAT_LO);
+    visitCopyLo(pSrc, &copy);
+    STATS_END(STAT_LO);
+
+    // Sanity check that CopyVisitor advanced pKmEntry to the end of the low map.
+    assert((copy.pKmEntry - pDestKeyMap->km_LoKeyMap) == LO_MAP_LENGTH);
+
+    // Copy the map entries and string/dead tables for the high map.
+    copy.pKmEntry = pDestTables->hiKeyMap;                  // Update 'pKmEntry' to start of high map.
+    STATS_BEGIN(STAT_HI);
+    visitCopyHi(pSrc, &copy);
+    STATS_END(STAT_HI);
+
+    // Sanity check that CopyVisitor advanced pKmEntry to the end of the high map.
+    assert(copy.pKmEntry - pDestKeyMap->km_HiKeyMap == HI_MAP_LENGTH);
+
+    // Sanity check that the total number of bytes used by the CopyVisitor for
+    // string/dead tables matches the sum calculated by the MeasureVisitor.
+    assert(copy.pBuffer == pDestBufferStart + bufferSize);
+}
+
+static struct KeyMap* copyKeymapWith(struct KeyMap* pSrc, Sizes* pSizes, InternTable* pIntern) {
+    if (!measureKeymapWith(pSrc, pSizes, pIntern)) {
+        return NULL;
+    }
+
+    // Allocate a contiguous block of memory to hold the copy of the keymap.
+    struct KeyMap* pDestKeyMap = AllocMem(calcCopySize(pSizes), MEMF_CLEAR | MEMF_PUBLIC);
+    if (pDestKeyMap == NULL) {
+        return NULL;
+    }
+
+    copyIntoBlock(pSrc, pSizes, pIntern, pDestKeyMap);
+    return pDestKeyMap;
+}
+
+struct KeyMap* copyKeymapToArena(KeymapArena* pArena, struct KeyMap* pSrc, const Sizes* pSizes) {
+    struct KeyMap* pDestKeyMap = allocArena(pArena, calcCopySize(pSizes));
+    if (pDestKeyMap == NULL) {
+        return NULL;
+    }
+
+    copyIntoBlock(pSrc, pSizes, /* pIntern: */ NULL, pDestKeyMap);
+    return pDestKeyMap;
+}
+
+struct KeyMap* copyKeymap(struct KeyMap* pSrc, Sizes* pSizes) {
+    return copyKeymapWith(pSrc, pSizes, /* pIntern: */ NULL);
+}
+
+struct KeyMap* copyKeymapDedup(struct KeyMap* pSrc, Sizes* pSizes) {
+    // The InternTable is too large for the stack of a typical Amiga process.
+    InternTable* pIntern = AllocMem(sizeof(InternTable), MEMF_ANY);
+    if (pIntern == NULL) {
+        return NULL;
+    }
+
+    initIntern(pIntern);
+    struct KeyMap* pCopy = copyKeymapWith(pSrc, pSizes, pIntern);
+
+    FreeMem(pIntern, sizeof(InternTable));
+    return pCopy;
+}
+
+void freeKeymap(struct KeyMap* pCopy, const Sizes* pSizes) {
+    FreeMem(pCopy, calcCopySize(pSizes));
+}
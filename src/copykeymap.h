@@ -0,0 +1,46 @@
+#ifndef COPYKEYMAP_H
+#define COPYKEYMAP_H
+
+#include <exec/types.h>
+#include <proto/keymap.h>
+#include "visitors/measure.h"
+#include "arena.h"
+#include "keymaptable.h"
+
+// Returns the size of the string/dead table buffer described by 'pSizes'.
+ULONG calcBufferSize(const Sizes* pSizes);
+
+// Returns the size of the contiguous block allocated by copyKeymap() for a keymap
+// described by 'pSizes'.
+ULONG calcCopySize(const Sizes* pSizes);
+
+// Initializes the KeyMap struct at the start of a newly allocated block (of calcCopySize()
+// bytes) with the addresses of the fixed-size tables that follow it, and copies the tables
+// that do not contain pointers from 'pSrc'.  Returns the address of the tables.  The
+// kmEntries and the string/dead table buffer (the last calcBufferSize() bytes of the block)
+// are left to the caller.
+KeyMapTables* initKeymapBlock(struct KeyMap* pDestKeyMap, struct KeyMap* pSrc);
+
+// Copies 'pSrc' into a single contiguous block allocated with AllocMem().  On return,
+// 'pSizes' holds the MeasureVisitor results for 'pSrc', which are needed to free the
+// copy with freeKeymap().  Returns NULL if the allocation fails, or if a string/dead table
+// cannot be laid out with 8-bit offsets (in which case 'pSizes->overflowTables' is set).
+struct KeyMap* copyKeymap(struct KeyMap* pSrc, Sizes* pSizes);
+
+// Same as copyKeymap(), but KCF_STRING/KCF_DEAD keys whose tables are identical share a
+// single copy of the table.  The result is freed with freeKeymap().
+struct KeyMap* copyKeymapDedup(struct KeyMap* pSrc, Sizes* pSizes);
+
+// Measures 'pSrc' as copyKeymap() would, without copying it.  Returns FALSE if a string/dead
+// table cannot be laid out with 8-bit offsets (see 'pSizes->overflowTables').
+BOOL measureKeymap(struct KeyMap* pSrc, Sizes* pSizes);
+
+// Copies 'pSrc', previously measured by measureKeymap() into 'pSizes', to the next
+// ARENA_ALIGN(calcCopySize(pSizes)) bytes of 'pArena'.  The copy is released along with the
+// arena by freeArena() (not freeKeymap()).  Returns NULL if the arena is full.
+struct KeyMap* copyKeymapToArena(KeymapArena* pArena, struct KeyMap* pSrc, const Sizes* pSizes);
+
+// Releases a keymap previously returned by copyKeymap().
+void freeKeymap(struct KeyMap* pCopy, const Sizes* pSizes);
+
+#endif
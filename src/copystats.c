@@ -0,0 +1,77 @@
+#include "copystats.h"
+
+#ifdef COPYKEYMAP_STATS
+
+#include <string.h>
+
+CopyStats copyStats;
+
+#ifdef HOST_BUILD
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#else
+#include <time.h>
+#endif
+
+StatTicks readStatTicks(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    // No portable cycle counter, so fall back to nanoseconds.
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (StatTicks) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+#endif
+}
+
+BOOL beginCopyStats(void) {
+    memset(&copyStats, 0, sizeof(copyStats));
+    return TRUE;
+}
+
+void endCopyStats(void) { }
+
+#else
+
+#include <proto/exec.h>
+#include <proto/timer.h>
+#include <devices/timer.h>
+
+// ReadEClock() only needs the device base, which any unit of timer.device provides.
+struct Device* TimerBase;
+static struct timerequest timerRequest;
+
+StatTicks readStatTicks(void) {
+    if (TimerBase == NULL) {
+        return 0;
+    }
+
+    struct EClockVal eclock;
+    ReadEClock(&eclock);
+    return ((StatTicks) eclock.ev_hi << 32) | eclock.ev_lo;
+}
+
+BOOL beginCopyStats(void) {
+    memset(&copyStats, 0, sizeof(copyStats));
+
+    if (TimerBase == NULL) {
+        if (OpenDevice(TIMERNAME, UNIT_ECLOCK, (struct IORequest*) &timerRequest, 0) != 0) {
+            return FALSE;
+        }
+        TimerBase = timerRequest.tr_node.io_Device;
+    }
+
+    return TRUE;
+}
+
+void endCopyStats(void) {
+    if (TimerBase != NULL) {
+        CloseDevice((struct IORequest*) &timerRequest);
+        TimerBase = NULL;
+    }
+}
+
+#endif
+
+#endif
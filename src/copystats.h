@@ -0,0 +1,69 @@
+#ifndef COPYSTATS_H
+#define COPYSTATS_H
+
+#include <exec/types.h>
+
+// Optional instrumentation of copyKeymap() and friends.  Building with -DCOPYKEYMAP_STATS
+// (STATS=1 with either Makefile) accumulates per-phase timings and per-category counts in
+// 'copyStats'.  Otherwise the STATS_*() macros expand to nothing and none of this exists.
+//
+// Timings are read from the time stamp counter on the host and from the E-clock of
+// timer.device on the Amiga (see beginCopyStats()).  The totals are not synchronized, so
+// only collect them from one thread at a time.
+#ifdef COPYKEYMAP_STATS
+
+typedef unsigned long long StatTicks;
+
+enum {
+    STAT_MEASURE,       // Measuring (or staging) the source keymap
+    STAT_TABLES,        // Initializing the KeyMap and memcpy'ing the type/capsable/repeatable tables
+    STAT_LO,            // Copying the lo map entries and their string/dead tables
+    STAT_HI,            // Copying the hi map entries and their string/dead tables
+    STAT_PHASES
+};
+
+typedef struct {
+    ULONG copies;                   // Number of keymaps copied
+    StatTicks ticks[STAT_PHASES];   // Ticks spent in each phase
+
+    ULONG normalKeys;               // kmEntries copied as-is
+    ULONG stringKeys;               // KCF_STRING keys
+    ULONG deadKeys;                 // KCF_DEAD keys
+    ULONG nopKeys;                  // KCF_NOP keys
+    ULONG modEntries;               // DPF_MOD entries of the KCF_DEAD keys
+    ULONG sharedTables;             // String/dead tables shared with an earlier copy (dedup)
+
+    ULONG structBytes;              // KeyMap struct and fixed-size tables
+    ULONG stringDescBytes;          // String descriptors (2B per entry)
+    ULONG stringCharBytes;          // String chars
+    ULONG deadDescBytes;            // Dead descriptors (2B per entry)
+    ULONG modTableBytes;            // DPF_MOD tables
+
+    ULONG alignPadBytes;            // Bytes added by ALIGN16() of the struct and tables
+    ULONG deadSlackBytes;           // Bytes 'deadCharTableBytes' per DPF_MOD entry would add over the exact tables
+} CopyStats;
+
+extern CopyStats copyStats;
+
+// Returns the current value of the cycle counter (0 if it is not available).
+StatTicks readStatTicks(void);
+
+// Clears 'copyStats' and, on the Amiga, opens timer.device for readStatTicks().
+BOOL beginCopyStats(void);
+
+// Releases what beginCopyStats() opened.  'copyStats' is left intact.
+void endCopyStats(void);
+
+#define STATS_BEGIN(phase)      const StatTicks statStart##phase = readStatTicks()
+#define STATS_END(phase)        (copyStats.ticks[phase] += readStatTicks() - statStart##phase)
+#define STATS_ADD(field, n)     (copyStats.field += (n))
+
+#else
+
+#define STATS_BEGIN(phase)
+#define STATS_END(phase)        ((void) 0)
+#define STATS_ADD(field, n)     ((void) 0)
+
+#endif
+
+#endif
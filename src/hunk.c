@@ -0,0 +1,275 @@
+#include "hunk.h"
+#include "keymaptable.h"
+#include "visit.h"
+#include <proto/keymap.h>
+
+const ULONG keymapFieldLengths[KEYMAP_FIELDS] = {
+    LO_TYPE_LENGTH, LO_MAP_LENGTH << 2, LO_CAPS_BYTE_SIZE, LO_REPS_BYTE_SIZE,
+    HI_TYPE_LENGTH, HI_MAP_LENGTH << 2, HI_CAPS_BYTE_SIZE, HI_REPS_BYTE_SIZE,
+};
+
+ULONG readBE32(const UBYTE* p) {
+    return ((ULONG) p[0] << 24) | ((ULONG) p[1] << 16) | ((ULONG) p[2] << 8) | p[3];
+}
+
+static BOOL fail(HunkWalk* pWalk, const char* pError) {
+    pWalk->pError = pError;
+    return FALSE;
+}
+
+// Reads big-endian words and longwords sequentially from the file.
+typedef struct {
+    HunkWalk* pWalk;
+    ULONG position;
+} Cursor;
+
+static BOOL readLong(Cursor* pCursor, ULONG* pValue) {
+    UBYTE bytes[4];
+    if (pCursor->pWalk->fileSize - pCursor->position < 4
+        || !pCursor->pWalk->pfnRead(pCursor->pWalk->pContext, pCursor->position, bytes, 4)) {
+        return FALSE;
+    }
+    *pValue = readBE32(bytes);
+    pCursor->position += 4;
+    return TRUE;
+}
+
+static BOOL readWord(Cursor* pCursor, ULONG* pValue) {
+    UBYTE bytes[2];
+    if (pCursor->pWalk->fileSize - pCursor->position < 2
+        || !pCursor->pWalk->pfnRead(pCursor->pWalk->pContext, pCursor->position, bytes, 2)) {
+        return FALSE;
+    }
+    *pValue = ((ULONG) bytes[0] << 8) | bytes[1];
+    pCursor->position += 2;
+    return TRUE;
+}
+
+static BOOL skipLongs(Cursor* pCursor, ULONG count) {
+    if ((pCursor->pWalk->fileSize - pCursor->position) / 4 < count) {
+        return FALSE;
+    }
+    pCursor->position += count * 4;
+    return TRUE;
+}
+
+// Reads the HUNK_HEADER and records the size of each hunk it declares.
+static BOOL readHeader(Cursor* pCursor) {
+    HunkWalk* pWalk = pCursor->pWalk;
+
+    ULONG type;
+    if (!readLong(pCursor, &type) || type != HUNK_HEADER) {
+        return fail(pWalk, "not an AmigaDOS load file");
+    }
+
+    // Skip the resident library names (never used by keymaps, but allowed).
+    for (;;) {
+        ULONG count;
+        if (!readLong(pCursor, &count)) {
+            return fail(pWalk, "truncated hunk header");
+        }
+        if (count == 0) {
+            break;
+        }
+        if (!skipLongs(pCursor, count)) {
+            return fail(pWalk, "truncated hunk header");
+        }
+    }
+
+    ULONG tableSize, first, last;
+    if (!readLong(pCursor, &tableSize) || !readLong(pCursor, &first) || !readLong(pCursor, &last)) {
+        return fail(pWalk, "truncated hunk header");
+    }
+    if (last < first || last - first + 1 > pWalk->maxHunks) {
+        return fail(pWalk, "bad hunk count");
+    }
+
+    pWalk->numHunks = last - first + 1;
+
+    for (ULONG h = 0; h < pWalk->numHunks; h++) {
+        ULONG sizeLong;
+        if (!readLong(pCursor, &sizeLong)) {
+            return fail(pWalk, "truncated hunk header");
+        }
+
+        // If both memory flags are set, the memory attributes follow in another longword.
+        ULONG attributes;
+        if ((sizeLong >> 30) == 3 && !readLong(pCursor, &attributes)) {
+            return fail(pWalk, "truncated hunk header");
+        }
+
+        const ULONG size = (sizeLong & HUNK_TYPE_MASK) << 2;
+        if (size > MAX_HUNK_SIZE) {
+            return fail(pWalk, "hunk too large");
+        }
+
+        HunkInfo* pHunk = &pWalk->pHunks[h];
+        pHunk->size = size;
+        pHunk->position = 0;
+        pHunk->dataBytes = 0;
+    }
+
+    return TRUE;
+}
+
+// Reads a HUNK_RELOC32 (or, with 'isShort', HUNK_RELOC32SHORT) block for hunk 'h'.
+static BOOL readRelocs(Cursor* pCursor, ULONG h, BOOL isShort) {
+    HunkWalk* pWalk = pCursor->pWalk;
+    BOOL (*pfnRead)(Cursor*, ULONG*) = isShort ? readWord : readLong;
+
+    for (;;) {
+        ULONG count, target;
+        if (!pfnRead(pCursor, &count)) {
+            return fail(pWalk, "truncated relocations");
+        }
+        if (count == 0) {
+            break;
+        }
+        if (!pfnRead(pCursor, &target) || target >= pWalk->numHunks) {
+            return fail(pWalk, "bad relocation target");
+        }
+
+        for (ULONG i = 0; i < count; i++) {
+            ULONG offset;
+            if (!pfnRead(pCursor, &offset)) {
+                return fail(pWalk, "truncated relocations");
+            }
+            if (offset + 4 > pWalk->pHunks[h].size) {
+                return fail(pWalk, "relocation outside hunk");
+            }
+            if (pWalk->pfnReloc != NULL) {
+                pWalk->pfnReloc(pWalk->pContext, h, offset, target);
+            }
+        }
+    }
+
+    // Short relocation blocks are padded to a longword.
+    if (isShort && (pCursor->position & 2)) {
+        pCursor->position += 2;
+    }
+    return TRUE;
+}
+
+BOOL walkHunks(HunkWalk* pWalk) {
+    Cursor cursor = { pWalk, 0 };
+
+    if (pWalk->fileSize == 0) {
+        return fail(pWalk, "cannot read file");
+    }
+    if (!readHeader(&cursor)) {
+        return FALSE;
+    }
+
+    ULONG h = 0;
+    while (h < pWalk->numHunks) {
+        ULONG type, count;
+        if (!readLong(&cursor, &type)) {
+            return fail(pWalk, "truncated hunk");
+        }
+
+        switch (type & HUNK_TYPE_MASK) {
+            case HUNK_NAME:
+            case HUNK_DEBUG:
+                if (!readLong(&cursor, &count) || !skipLongs(&cursor, count)) {
+                    return fail(pWalk, "truncated hunk");
+                }
+                break;
+            case HUNK_CODE:
+            case HUNK_DATA: {
+                if (!readLong(&cursor, &count)) {
+                    return fail(pWalk, "truncated hunk");
+                }
+                const ULONG bytes = (count & HUNK_TYPE_MASK) << 2;
+                if (bytes > pWalk->pHunks[h].size || pWalk->fileSize - cursor.position < bytes) {
+                    return fail(pWalk, "hunk larger than declared");
+                }
+                pWalk->pHunks[h].position = cursor.position;
+                pWalk->pHunks[h].dataBytes = bytes;
+                cursor.position += bytes;
+                break;
+            }
+            case HUNK_BSS:
+                if (!readLong(&cursor, &count)) {
+                    return fail(pWalk, "truncated hunk");
+                }
+                break;
+            case HUNK_RELOC32:
+                if (!readRelocs(&cursor, h, /* isShort: */ FALSE)) {
+                    return FALSE;
+                }
+                break;
+            case HUNK_RELOC32SHORT:
+            case HUNK_DREL32:
+                if (!readRelocs(&cursor, h, /* isShort: */ TRUE)) {
+                    return FALSE;
+                }
+                break;
+            case HUNK_SYMBOL:
+                for (;;) {
+                    if (!readLong(&cursor, &count)) {
+                        return fail(pWalk, "truncated symbols");
+                    }
+                    if (count == 0) {
+                        break;
+                    }
+                    if (!skipLongs(&cursor, (count & 0xFFFFFF) + 1)) {
+                        return fail(pWalk, "truncated symbols");
+                    }
+                }
+                break;
+            case HUNK_END:
+                h++;
+                break;
+            default:
+                return fail(pWalk, "unsupported hunk type");
+        }
+    }
+
+    return pWalk->pHunks[0].size >= KEYMAP_NODE_SIZE + (KEYMAP_FIELDS << 2)
+        || fail(pWalk, "hunk too small for a KeyMapNode");
+}
+
+BOOL resolvePointer(HunkWalk* pWalk, ULONG h, ULONG offset, UBYTE target, ULONG value, ULONG length, HunkPointer* pPointer) {
+    if (offset + 4 > pWalk->pHunks[h].size) {
+        return fail(pWalk, "pointer outside hunk");
+    }
+    if (target == 0) {
+        return fail(pWalk, "pointer is not relocated");
+    }
+
+    pPointer->hunk = target - 1;
+    pPointer->offset = value;
+    if (pPointer->offset > pWalk->pHunks[pPointer->hunk].size
+        || length > pWalk->pHunks[pPointer->hunk].size - pPointer->offset) {
+        return fail(pWalk, "pointer outside hunk");
+    }
+    return TRUE;
+}
+
+ULONG hunkRemaining(const HunkWalk* pWalk, const HunkPointer* pPointer) {
+    return pWalk->pHunks[pPointer->hunk].size - pPointer->offset;
+}
+
+BOOL checkTable(HunkWalk* pWalk, UBYTE kmType, const UBYTE* pTable, ULONG remaining) {
+    for (int n = 0; n < calcNumEntries(kmType); n++) {
+        const UBYTE first = pTable[n << 1];
+        const UBYTE offset = pTable[(n << 1) + 1];
+
+        if ((kmType & KCF_STRING) && offset + first > remaining) {
+            return fail(pWalk, "string outside hunk");
+        }
+        if (!(kmType & KCF_STRING) && first != 0 && first != DPF_DEAD && first != DPF_MOD) {
+            return fail(pWalk, "bad dead key kind");
+        }
+    }
+    return TRUE;
+}
+
+BOOL checkModTables(HunkWalk* pWalk, const UBYTE* pTable, int numEntries, UBYTE deadCharTableBytes, ULONG remaining) {
+    for (int n = 0; n < numEntries; n++) {
+        if (pTable[n << 1] == DPF_MOD && pTable[(n << 1) + 1] + deadCharTableBytes > remaining) {
+            return fail(pWalk, "dead table outside hunk");
+        }
+    }
+    return TRUE;
+}
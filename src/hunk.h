@@ -0,0 +1,94 @@
+#ifndef HUNK_H
+#define HUNK_H
+
+#include <exec/types.h>
+
+// AmigaDOS load file hunk types (the flag bits 30/31 are masked off).
+#define HUNK_NAME           0x3E8
+#define HUNK_CODE           0x3E9
+#define HUNK_DATA           0x3EA
+#define HUNK_BSS            0x3EB
+#define HUNK_RELOC32        0x3EC
+#define HUNK_SYMBOL         0x3F0
+#define HUNK_DEBUG          0x3F1
+#define HUNK_END            0x3F2
+#define HUNK_HEADER         0x3F3
+#define HUNK_DREL32         0x3F7   // Treated as HUNK_RELOC32SHORT in load files
+#define HUNK_RELOC32SHORT   0x3FC
+
+#define HUNK_TYPE_MASK      0x3FFFFFFF
+#define MAX_HUNK_SIZE       0x100000    // Far larger than any keymap
+
+// A keymap file (the load file of DEVS:Keymaps) is a single hunk (or several) starting with
+// a KeyMapNode, in which every pointer is a big-endian longword relocated by HUNK_RELOC32.
+// The node may be preceded by KEYMAP_STUB.
+#define KEYMAP_NODE_SIZE    14          // struct Node on the Amiga (ln_Succ, ln_Pred, ln_Type, ln_Pri, ln_Name)
+#define KEYMAP_NAME_OFFSET  10          // ln_Name within the node
+#define KEYMAP_STUB         0x70004E75  // MOVEQ #0,D0 / RTS
+#define KEYMAP_FIELDS       8           // Pointers of the struct KeyMap following the node
+#define KEYMAP_NAME_LENGTH  64
+
+// The number of bytes each pointer of the struct KeyMap must reach, in the order of its fields.
+extern const ULONG keymapFieldLengths[KEYMAP_FIELDS];
+
+// Reads 'length' bytes at 'position' of a file into 'pDest'.  Returns FALSE if they cannot
+// all be read.
+typedef BOOL (*HunkReadFn)(void* pContext, ULONG position, UBYTE* pDest, ULONG length);
+
+// Where a hunk is in a load file.
+typedef struct {
+    ULONG size;             // Size declared by the HUNK_HEADER
+    ULONG position;         // File offset of the HUNK_CODE/HUNK_DATA contents
+    ULONG dataBytes;        // Bytes of contents in the file (the rest of the hunk is zeros)
+} HunkInfo;
+
+// A pass over a load file, shared by every reader of keymap files so that they accept and
+// reject exactly the same files.  The caller sets the fields up to 'maxHunks' (and
+// 'pfnReloc', which may be NULL), and walkHunks() fills in the rest.
+typedef struct {
+    HunkReadFn pfnRead;
+    void* pContext;         // Passed to 'pfnRead' and 'pfnReloc'
+    ULONG fileSize;
+    HunkInfo* pHunks;       // Receives the location of each hunk
+    ULONG maxHunks;         // Capacity of 'pHunks'
+
+    // Called for every relocated longword: at byte 'offset' of hunk 'h', relocated to
+    // hunk 'target'.
+    void (*pfnReloc)(void* pContext, ULONG h, ULONG offset, ULONG target);
+
+    ULONG numHunks;
+    const char* pError;     // Why the file was rejected (if it was)
+} HunkWalk;
+
+// Reads the hunk structure of the file, calling 'pfnReloc' for each relocation.  Returns
+// FALSE (with 'pError' set) if the file is not a load file of at most 'maxHunks' hunks.
+BOOL walkHunks(HunkWalk* pWalk);
+
+// Reads a big-endian longword.
+ULONG readBE32(const UBYTE* p);
+
+// A pointer in the hunks of a walked file: the hunk it points into, and the offset within it.
+typedef struct {
+    ULONG hunk;
+    ULONG offset;
+} HunkPointer;
+
+// Resolves the longword 'value' at byte 'offset' of hunk 'h', with 'target' the hunk it is
+// relocated to + 1 (0 if it is not relocated).  It must lie within hunk 'h' and point at
+// least 'length' bytes before the end of its target hunk.  Returns FALSE (with 'pError' set)
+// otherwise.
+BOOL resolvePointer(HunkWalk* pWalk, ULONG h, ULONG offset, UBYTE target, ULONG value, ULONG length, HunkPointer* pPointer);
+
+// Returns the number of bytes from 'pPointer' to the end of its hunk.
+ULONG hunkRemaining(const HunkWalk* pWalk, const HunkPointer* pPointer);
+
+// Checks the descriptors of the string/dead table 'pTable' of a key of type 'kmType', which
+// starts 'remaining' bytes before the end of its hunk: every string lies within the hunk and
+// every dead entry is of a known kind.  Returns FALSE (with 'pError' set) otherwise.
+BOOL checkTable(HunkWalk* pWalk, UBYTE kmType, const UBYTE* pTable, ULONG remaining);
+
+// Checks that the DPF_MOD tables of the dead table 'pTable' lie within its hunk, once the
+// 'deadCharTableBytes' of the whole keymap is known.
+BOOL checkModTables(HunkWalk* pWalk, const UBYTE* pTable, int numEntries, UBYTE deadCharTableBytes, ULONG remaining);
+
+#endif
@@ -0,0 +1,429 @@
+#include "hunkstream.h"
+#include "copykeymap.h"
+#include "keymaptable.h"
+#include "layout.h"
+#include "visit.h"
+#include "visitors/copy.h"
+#include <proto/exec.h>
+#include <assert.h>
+#include <string.h>
+
+#define NUM_KEYS            (LO_MAP_LENGTH + HI_MAP_LENGTH)
+#define NODE_REGION         (4 + KEYMAP_NODE_SIZE + (KEYMAP_FIELDS << 2))   // Stub, node and KeyMap pointers
+
+// Every byte a string/dead table can reference: its descriptors, and the chars/DPF_MOD
+// tables they place within MAX_TABLE_OFFSET bytes of it (at most 255 + 256 bytes).
+#define TABLE_WINDOW        ((MAX_TABLE_OFFSET + 1) << 1)
+
+// The relocations wanted from a pass over the file: the target hunk + 1 of each longword of
+// hunk 'hunk' relocated at byte offset 'start'..'start + length - 1' (0 if not relocated).
+typedef struct {
+    ULONG hunk;
+    ULONG start;
+    ULONG length;
+    UBYTE* pTargets;
+} RelocQuery;
+
+// Reads the file through a single chunk-sized buffer.  Any range of the file can be read,
+// but the file itself is only read on a miss, a whole (aligned) chunk at a time.
+typedef struct {
+    StreamReadFn pfnRead;
+    void* pContext;
+    UBYTE* pChunk;
+    ULONG chunkSize;
+    ULONG chunkStart;       // File offset of pChunk[0]
+    ULONG chunkLength;      // Bytes held in pChunk (0 before the first read)
+    HunkWalk walk;
+    HunkInfo hunks[STREAM_MAX_HUNKS];
+    RelocQuery* pQueries;   // Answered by the current pass
+    int numQueries;
+    StreamInfo* pInfo;
+} HunkStream;
+
+// The part of the keymap held in memory: the fixed-size arrays, with the kmEntries of the
+// normal/KCF_NOP keys.  The kmEntry of each string/dead key holds the offset of its table in
+// the hunk recorded in 'tableHunks'.
+typedef struct {
+    struct KeyMap keyMap;
+    KeyMapTables tables;
+    UBYTE tableHunks[NUM_KEYS];
+} StreamKeymap;
+
+static BOOL fail(HunkStream* pStream, const char* pError) {
+    pStream->pInfo->pError = pError;
+    return FALSE;
+}
+
+// Fails with the error of the last walkHunks(), resolvePointer(), or check.
+static BOOL failWalk(HunkStream* pStream) {
+    return fail(pStream, pStream->walk.pError);
+}
+
+static BOOL readBytes(void* pContext, ULONG position, UBYTE* pDest, ULONG length) {
+    HunkStream* pStream = pContext;
+    const ULONG fileSize = pStream->walk.fileSize;
+    if (position > fileSize || length > fileSize - position) {
+        return FALSE;
+    }
+
+    while (length > 0) {
+        if (position < pStream->chunkStart || position - pStream->chunkStart >= pStream->chunkLength) {
+            const ULONG start = position - position % pStream->chunkSize;
+            const ULONG want = fileSize - start < pStream->chunkSize ? fileSize - start : pStream->chunkSize;
+
+            if (pStream->pfnRead(pStream->pContext, start, pStream->pChunk, want) != (LONG) want) {
+                pStream->chunkLength = 0;
+                return FALSE;
+            }
+            pStream->chunkStart = start;
+            pStream->chunkLength = want;
+            pStream->pInfo->chunkReads++;
+            pStream->pInfo->bytesRead += want;
+        }
+
+        const ULONG offset = position - pStream->chunkStart;
+        const ULONG count = pStream->chunkLength - offset < length ? pStream->chunkLength - offset : length;
+        memcpy(pDest, pStream->pChunk + offset, count);
+        pDest += count;
+        position += count;
+        length -= count;
+    }
+
+    return TRUE;
+}
+
+static void recordReloc(void* pContext, ULONG h, ULONG offset, ULONG target) {
+    HunkStream* pStream = pContext;
+
+    for (int q = 0; q < pStream->numQueries; q++) {
+        RelocQuery* pQuery = &pStream->pQueries[q];
+        if (pQuery->hunk == h && offset - pQuery->start < pQuery->length) {
+            pQuery->pTargets[offset - pQuery->start] = (UBYTE)(target + 1);
+        }
+    }
+}
+
+// Makes a pass over the whole file: records where the contents of each hunk are, and
+// answers 'pQueries'.
+static BOOL walkFile(HunkStream* pStream, RelocQuery* pQueries, int numQueries) {
+    for (int q = 0; q < numQueries; q++) {
+        memset(pQueries[q].pTargets, 0, pQueries[q].length);
+    }
+
+    pStream->pQueries = pQueries;
+    pStream->numQueries = numQueries;
+    return walkHunks(&pStream->walk) || failWalk(pStream);
+}
+
+// Reads 'length' bytes at 'offset' in hunk 'h' (which the caller has checked lie within the
+// hunk).  Bytes beyond the contents in the file are zeros.
+static BOOL readHunkBytes(HunkStream* pStream, ULONG h, ULONG offset, UBYTE* pDest, ULONG length) {
+    const HunkInfo* pHunk = &pStream->hunks[h];
+    ULONG inFile = offset < pHunk->dataBytes ? pHunk->dataBytes - offset : 0;
+    if (inFile > length) {
+        inFile = length;
+    }
+
+    memset(pDest + inFile, 0, length - inFile);
+    return inFile == 0
+        || readBytes(pStream, pHunk->position + offset, pDest, inFile)
+        || fail(pStream, "cannot read file");
+}
+
+// Reads the relocated pointer at 'offset' in the hunk of 'pQuery' (which must cover it).  It
+// must point at least 'length' bytes before the end of its target hunk.
+static BOOL readPointer(HunkStream* pStream, const RelocQuery* pQuery, ULONG offset, ULONG length, HunkPointer* pPointer) {
+    assert(offset - pQuery->start < pQuery->length);
+
+    UBYTE bytes[4] = { 0 };
+    if (offset + 4 <= pStream->hunks[pQuery->hunk].size && !readHunkBytes(pStream, pQuery->hunk, offset, bytes, 4)) {
+        return FALSE;
+    }
+
+    return resolvePointer(&pStream->walk, pQuery->hunk, offset, pQuery->pTargets[offset - pQuery->start], readBE32(bytes), length, pPointer)
+        || failWalk(pStream);
+}
+
+static UBYTE typeOf(const StreamKeymap* pKeymap, UBYTE rawKey) {
+    return rawKey < LO_MAP_LENGTH
+        ? pKeymap->tables.loKeyMapTypes[rawKey]
+        : pKeymap->tables.hiKeyMapTypes[rawKey - LO_MAP_LENGTH];
+}
+
+static ULONG entryOf(const StreamKeymap* pKeymap, UBYTE rawKey) {
+    return rawKey < LO_MAP_LENGTH
+        ? pKeymap->tables.loKeyMap[rawKey]
+        : pKeymap->tables.hiKeyMap[rawKey - LO_MAP_LENGTH];
+}
+
+static BOOL isTableType(UBYTE kmType) {
+    return !(kmType & KCF_NOP) && (kmType & (KCF_STRING | KCF_DEAD));
+}
+
+static BOOL isDeadType(UBYTE kmType) {
+    return isTableType(kmType) && !(kmType & KCF_STRING);
+}
+
+// Reads one map of kmEntries at 'pQuery' (whose relocations have been read).  Normal/KCF_NOP
+// kmEntries are kept, and string/dead kmEntries are resolved to the location of their table.
+static BOOL readMap(HunkStream* pStream, StreamKeymap* pKeymap, const RelocQuery* pQuery, ULONG* pDestMap, int mapSize, UBYTE rawKey) {
+    UBYTE entries[LO_MAP_LENGTH << 2];
+    if (!readHunkBytes(pStream, pQuery->hunk, pQuery->start, entries, mapSize << 2)) {
+        return FALSE;
+    }
+
+    for (int i = 0; i < mapSize; i++, rawKey++) {
+        const UBYTE type = typeOf(pKeymap, rawKey);
+
+        if (!isTableType(type)) {
+            pDestMap[i] = readBE32(entries + (i << 2));
+            continue;
+        }
+
+        HunkPointer table;
+        if (!readPointer(pStream, pQuery, pQuery->start + (i << 2), calcNumEntries(type) << 1, &table)) {
+            return FALSE;
+        }
+
+        pKeymap->tableHunks[rawKey] = (UBYTE) table.hunk;
+        pDestMap[i] = table.offset;
+    }
+
+    return TRUE;
+}
+
+// Reads the KeyMapNode at the start of the first hunk, and everything but the string/dead
+// tables of the KeyMap it holds.  (Passes 1 and 2.)
+static BOOL readKeymapNode(HunkStream* pStream, StreamKeymap* pKeymap) {
+    UBYTE nodeTargets[NODE_REGION];
+    RelocQuery nodeQuery = { 0, 0, NODE_REGION, nodeTargets };
+    if (!walkFile(pStream, &nodeQuery, 1)) {
+        return FALSE;
+    }
+
+    ULONG node = 0;
+    UBYTE stub[4];
+    if (!readHunkBytes(pStream, 0, 0, stub, 4)) {
+        return FALSE;
+    }
+    if (readBE32(stub) == KEYMAP_STUB) {
+        node = 4;
+    }
+
+    // ln_Name
+    HunkPointer name;
+    if (!readPointer(pStream, &nodeQuery, node + KEYMAP_NAME_OFFSET, 0, &name)) {
+        return FALSE;
+    }
+
+    char* pName = pStream->pInfo->name;
+    const ULONG nameRemaining = hunkRemaining(&pStream->walk, &name);
+    const ULONG nameLength = nameRemaining < KEYMAP_NAME_LENGTH - 1 ? nameRemaining : KEYMAP_NAME_LENGTH - 1;
+    if (!readHunkBytes(pStream, name.hunk, name.offset, (UBYTE*) pName, nameLength)) {
+        return FALSE;
+    }
+    pName[nameLength] = '\0';
+
+    // The struct KeyMap follows the node: 8 pointers in the order of its fields.
+    HunkPointer fields[KEYMAP_FIELDS];
+    for (int i = 0; i < KEYMAP_FIELDS; i++) {
+        if (!readPointer(pStream, &nodeQuery, node + KEYMAP_NODE_SIZE + (i << 2), keymapFieldLengths[i], &fields[i])) {
+            return FALSE;
+        }
+    }
+
+    KeyMapTables* pTables = &pKeymap->tables;
+    struct KeyMap* pKeyMap = &pKeymap->keyMap;
+    pKeyMap->km_LoKeyMapTypes   = pTables->loKeyMapTypes;
+    pKeyMap->km_LoKeyMap        = pTables->loKeyMap;
+    pKeyMap->km_LoCapsable      = pTables->loCapsable;
+    pKeyMap->km_LoRepeatable    = pTables->loRepeatable;
+    pKeyMap->km_HiKeyMapTypes   = pTables->hiKeyMapTypes;
+    pKeyMap->km_HiKeyMap        = pTables->hiKeyMap;
+    pKeyMap->km_HiCapsable      = pTables->hiCapsable;
+    pKeyMap->km_HiRepeatable    = pTables->hiRepeatable;
+
+    UBYTE* const pArrays[KEYMAP_FIELDS] = {
+        pTables->loKeyMapTypes, NULL, pTables->loCapsable, pTables->loRepeatable,
+        pTables->hiKeyMapTypes, NULL, pTables->hiCapsable, pTables->hiRepeatable,
+    };
+    for (int i = 0; i < KEYMAP_FIELDS; i++) {
+        if (pArrays[i] != NULL && !readHunkBytes(pStream, fields[i].hunk, fields[i].offset, pArrays[i], keymapFieldLengths[i])) {
+            return FALSE;
+        }
+    }
+
+    // Pass 2: now that the maps are known, collect their relocations.
+    UBYTE loTargets[LO_MAP_LENGTH << 2];
+    UBYTE hiTargets[HI_MAP_LENGTH << 2];
+    RelocQuery mapQueries[2] = {
+        { fields[1].hunk, fields[1].offset, LO_MAP_LENGTH << 2, loTargets },
+        { fields[5].hunk, fields[5].offset, HI_MAP_LENGTH << 2, hiTargets },
+    };
+
+    return walkFile(pStream, mapQueries, 2)
+        && readMap(pStream, pKeymap, &mapQueries[0], pTables->loKeyMap, LO_MAP_LENGTH, /* rawKey: */ 0)
+        && readMap(pStream, pKeymap, &mapQueries[1], pTables->hiKeyMap, HI_MAP_LENGTH, /* rawKey: */ LO_MAP_LENGTH);
+}
+
+// Returns the number of bytes of the table of 'rawKey' that may be read: up to the end of
+// its hunk, and no more than its 8-bit offsets can reach.
+static ULONG calcWindowBytes(const HunkStream* pStream, const StreamKeymap* pKeymap, UBYTE rawKey) {
+    const HunkPointer table = { pKeymap->tableHunks[rawKey], entryOf(pKeymap, rawKey) };
+    const ULONG remaining = hunkRemaining(&pStream->walk, &table);
+    return remaining < TABLE_WINDOW ? remaining : TABLE_WINDOW;
+}
+
+// Reads the string/dead table of 'rawKey' into 'pWindow': its descriptors, then the bytes
+// they reference (with 'deadCharTableBytes' per DPF_MOD entry, which may be 0 to read the
+// descriptors of a dead table only).  Nothing beyond the window of the table is read, so
+// the descriptors are checked by the caller.
+static BOOL readTable(HunkStream* pStream, const StreamKeymap* pKeymap, UBYTE rawKey, UBYTE deadCharTableBytes, UBYTE* pWindow) {
+    const ULONG hunk = pKeymap->tableHunks[rawKey];
+    const ULONG offset = entryOf(pKeymap, rawKey);
+    const UBYTE type = typeOf(pKeymap, rawKey);
+    const int numEntries = calcNumEntries(type);
+
+    if (!readHunkBytes(pStream, hunk, offset, pWindow, numEntries << 1)) {
+        return FALSE;
+    }
+
+    ULONG extent = numEntries << 1;
+    for (int n = 0; n < numEntries; n++) {
+        const UBYTE first = pWindow[n << 1];
+        const UBYTE entryOffset = pWindow[(n << 1) + 1];
+        const ULONG end = (type & KCF_STRING) ? entryOffset + first
+            : first == DPF_MOD ? entryOffset + deadCharTableBytes
+            : 0;
+        extent = end > extent ? end : extent;
+    }
+
+    const ULONG windowBytes = calcWindowBytes(pStream, pKeymap, rawKey);
+    if (extent > windowBytes) {
+        extent = windowBytes;
+    }
+
+    return readHunkBytes(pStream, hunk, offset + (numEntries << 1), pWindow + (numEntries << 1), extent - (numEntries << 1));
+}
+
+// Measures the string/dead tables as measureKeymap() would, checking them against their
+// hunk as parseHunkKeymap() does.  (Pass 3.)
+static BOOL measureTables(HunkStream* pStream, const StreamKeymap* pKeymap, Sizes* pSizes) {
+    UBYTE window[TABLE_WINDOW];
+    memset(pSizes, 0, sizeof(Sizes));
+
+    for (int k = 0; k < NUM_KEYS; k++) {
+        const UBYTE type = typeOf(pKeymap, k);
+        if (!isTableType(type)) {
+            continue;
+        }
+
+        if (!readTable(pStream, pKeymap, k, /* deadCharTableBytes: */ 0, window)) {
+            return FALSE;
+        }
+        if (!checkTable(&pStream->walk, type, window, calcWindowBytes(pStream, pKeymap, k))) {
+            return failWalk(pStream);
+        }
+
+        if (type & KCF_STRING) {
+            MeasureVisitor.pfnString(pSizes, k, calcNumEntries(type), window);
+        } else {
+            MeasureVisitor.pfnDead(pSizes, k, calcNumEntries(type), window);
+        }
+    }
+
+    // Now that the size of the DPF_MOD tables is known, check and plan them (as
+    // finishMeasure() does).
+    for (int k = 0; k < NUM_KEYS; k++) {
+        const UBYTE type = typeOf(pKeymap, k);
+        if (!isDeadType(type)) {
+            continue;
+        }
+
+        const int numEntries = calcNumEntries(type);
+        if (!readTable(pStream, pKeymap, k, /* deadCharTableBytes: */ 0, window)) {
+            return FALSE;
+        }
+        if (!checkModTables(&pStream->walk, window, numEntries, pSizes->deadCharTableBytes, calcWindowBytes(pStream, pKeymap, k))) {
+            return failWalk(pStream);
+        }
+        addModTableBytes(pSizes, window, numEntries);
+    }
+
+    return pSizes->overflowTables == 0 || fail(pStream, "table does not fit 8-bit offsets");
+}
+
+// Copies the keymap measured as 'pSizes' into a newly allocated block, as copyKeymap()
+// would.  (Pass 4.)
+static struct KeyMap* copyTables(HunkStream* pStream, StreamKeymap* pKeymap, const Sizes* pSizes) {
+    const ULONG copySize = calcCopySize(pSizes);
+    struct KeyMap* pDestKeyMap = AllocMem(copySize, MEMF_CLEAR | MEMF_PUBLIC);
+    if (pDestKeyMap == NULL) {
+        fail(pStream, "out of memory");
+        return NULL;
+    }
+
+    KeyMapTables* pDestTables = initKeymapBlock(pDestKeyMap, &pKeymap->keyMap);
+    UBYTE* pDestBuffer = ((UBYTE*) pDestKeyMap) + copySize - calcBufferSize(pSizes);
+
+    CopyContext copy = { 0 };
+    copy.pBuffer = pDestBuffer;
+    copy.deadCharTableBytes = pSizes->deadCharTableBytes;
+
+    UBYTE window[TABLE_WINDOW];
+
+    for (int k = 0; k < NUM_KEYS; k++) {
+        if (k == 0 || k == LO_MAP_LENGTH) {
+            copy.pKmEntry = k == 0 ? pDestTables->loKeyMap : pDestTables->hiKeyMap;
+        }
+
+        const UBYTE type = typeOf(pKeymap, k);
+
+        if (type & KCF_NOP) {
+            CopyVisitor.pfnNop(&copy, k, type, entryOf(pKeymap, k));
+        } else if (!isTableType(type)) {
+            CopyVisitor.pfnNormal(&copy, k, type, entryOf(pKeymap, k));
+        } else if (!readTable(pStream, pKeymap, k, pSizes->deadCharTableBytes, window)) {
+            FreeMem(pDestKeyMap, copySize);
+            return NULL;
+        } else if (type & KCF_STRING) {
+            CopyVisitor.pfnString(&copy, k, calcNumEntries(type), window);
+        } else {
+            CopyVisitor.pfnDead(&copy, k, calcNumEntries(type), window);
+        }
+    }
+
+    // Sanity check that the CopyVisitor filled the buffer measured by the MeasureVisitor.
+    assert(copy.pKmEntry - pDestTables->hiKeyMap == HI_MAP_LENGTH);
+    assert(copy.pBuffer == pDestBuffer + calcBufferSize(pSizes));
+    return pDestKeyMap;
+}
+
+struct KeyMap* streamKeymapFile(StreamReadFn pfnRead, void* pContext, ULONG fileSize, ULONG chunkSize, Sizes* pSizes, StreamInfo* pInfo) {
+    assert(chunkSize >= STREAM_MIN_CHUNK_SIZE && chunkSize <= STREAM_MAX_CHUNK_SIZE);
+    memset(pInfo, 0, sizeof(StreamInfo));
+    memset(pSizes, 0, sizeof(Sizes));
+
+    UBYTE chunk[STREAM_MAX_CHUNK_SIZE];
+    HunkStream stream;
+    memset(&stream, 0, sizeof(stream));
+    stream.pfnRead = pfnRead;
+    stream.pContext = pContext;
+    stream.pChunk = chunk;
+    stream.chunkSize = chunkSize;
+    stream.walk.pfnRead = readBytes;
+    stream.walk.pContext = &stream;
+    stream.walk.fileSize = fileSize;
+    stream.walk.pHunks = stream.hunks;
+    stream.walk.maxHunks = STREAM_MAX_HUNKS;
+    stream.walk.pfnReloc = recordReloc;
+    stream.pInfo = pInfo;
+
+    StreamKeymap keymap;
+    memset(&keymap, 0, sizeof(keymap));
+
+    return readKeymapNode(&stream, &keymap)
+        && measureTables(&stream, &keymap, pSizes)
+        ? copyTables(&stream, &keymap, pSizes)
+        : NULL;
+}
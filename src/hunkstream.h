@@ -0,0 +1,46 @@
+#ifndef HUNKSTREAM_H
+#define HUNKSTREAM_H
+
+#include <exec/types.h>
+#include <proto/keymap.h>
+#include "hunk.h"
+#include "visitors/measure.h"
+
+#define STREAM_CHUNK_SIZE       512     // Default size of each read from the file
+#define STREAM_MIN_CHUNK_SIZE   16
+#define STREAM_MAX_CHUNK_SIZE   512     // The chunk is on the stack
+#define STREAM_MAX_HUNKS        16      // Keymap files have one (or a few)
+
+typedef struct {
+    char name[KEYMAP_NAME_LENGTH];      // ln_Name of the KeyMapNode
+    ULONG chunkReads;                   // Chunks read from the file (over every pass)
+    ULONG bytesRead;                    // Total size of those chunks
+    const char* pError;                 // Why the file was rejected (if it was)
+} StreamInfo;
+
+// Reads up to 'length' bytes at 'position' of a file into 'pDest'.  Returns the number of
+// bytes read (fewer than 'length' only at the end of the file), or -1 on an error.  (pread()
+// on the host, Seek() and Read() of dos.library on the Amiga.)
+typedef LONG (*StreamReadFn)(void* pContext, ULONG position, UBYTE* pDest, ULONG length);
+
+// Loads the keymap file of 'fileSize' bytes read by 'pfnRead' straight into the block
+// copyKeymap() would make of it, without holding the file or its hunks in memory.  The file
+// is read through a single buffer of 'chunkSize' bytes (STREAM_MIN_CHUNK_SIZE..
+// STREAM_MAX_CHUNK_SIZE), in sequential passes:
+//
+//  1. The hunk structure, and the relocations of the KeyMapNode.
+//  2. The relocations of the lo/hi kmEntries (once the node says where the maps are).
+//  3. Every string/dead table, fed to the MeasureVisitor (see finishMeasure()).
+//  4. Every string/dead table again, fed to the CopyVisitor into the allocated block.
+//
+// Each table is read into a window of the bytes its 8-bit offsets can reach, so passes 3
+// and 4 never hold more than one table.  Everything is on the stack (under 3KB on the
+// Amiga).  The file is checked with the same walkHunks(), checkTable() and checkModTables()
+// as parseHunkKeymap() on the host.
+//
+// The block is the only allocation, and is freed with freeKeymap(pCopy, pSizes).  Returns
+// NULL (with 'pInfo->pError' set) if the file cannot be read or is not a valid keymap file,
+// if a table cannot be laid out with 8-bit offsets, or if the allocation fails.
+struct KeyMap* streamKeymapFile(StreamReadFn pfnRead, void* pContext, ULONG fileSize, ULONG chunkSize, Sizes* pSizes, StreamInfo* pInfo);
+
+#endif
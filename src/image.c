@@ -0,0 +1,178 @@
+#include "image.h"
+#include "copykeymap.h"
+#include "keymaptable.h"
+#include "visit.h"
+#include "visitors/measure.h"
+#include <exec/types.h>
+#include <proto/keymap.h>
+#include <assert.h>
+#include <string.h>
+
+#define NUM_KEYMAP_FIELDS 8     // The KeyMap struct is 8 pointers
+
+// Sizes of the tables referenced by the KeyMap fields (in field order).
+static const ULONG fieldSizes[NUM_KEYMAP_FIELDS] = {
+    LO_TYPE_LENGTH,                     // km_LoKeyMapTypes
+    LO_MAP_LENGTH * sizeof(ULONG),      // km_LoKeyMap
+    LO_CAPS_BYTE_SIZE,                  // km_LoCapsable
+    LO_REPS_BYTE_SIZE,                  // km_LoRepeatable
+    HI_TYPE_LENGTH,                     // km_HiKeyMapTypes
+    HI_MAP_LENGTH * sizeof(ULONG),      // km_HiKeyMap
+    HI_CAPS_BYTE_SIZE,                  // km_HiCapsable
+    HI_REPS_BYTE_SIZE,                  // km_HiRepeatable
+};
+
+ULONG calcImageSize(const Sizes* pSizes) {
+    return sizeof(ImageHeader) + calcCopySize(pSizes);
+}
+
+// Adds 'delta' to the kmEntries of the KCF_STRING/KCF_DEAD keys of one map.
+static void rebaseTable(const UBYTE* pKmType, ULONG* pKmEntry, int mapSize, ULONG delta) {
+    const UBYTE* pKmStop = pKmType + mapSize;
+
+    for (; pKmType < pKmStop; pKmType++, pKmEntry++) {
+        const UBYTE kind = *pKmType & (KCF_NOP | KCF_STRING | KCF_DEAD);
+
+        if (kind == KCF_STRING || kind == KCF_DEAD) {
+            *pKmEntry += delta;
+        }
+    }
+}
+
+void writeImage(const struct KeyMap* pCopy, const Sizes* pSizes, UBYTE* pImage) {
+    assert(sizeof(struct KeyMap) == NUM_KEYMAP_FIELDS * sizeof(ULONG));
+
+    const ULONG blockSize = calcCopySize(pSizes);
+
+    ImageHeader* pHeader = (ImageHeader*) pImage;
+    pHeader->magic = IMAGE_MAGIC;
+    pHeader->version = IMAGE_VERSION;
+    pHeader->ulongSize = sizeof(ULONG);
+    pHeader->reserved = 0;
+    pHeader->blockSize = blockSize;
+
+    UBYTE* pBlock = pImage + sizeof(ImageHeader);
+    memcpy(pBlock, pCopy, blockSize);
+
+    // Replace the addresses in the KeyMap fields and the kmEntries with offsets from
+    // the start of the block.
+    const ULONG base = (ULONG) pCopy;
+    ULONG* pFields = (ULONG*) pBlock;
+    for (int i = 0; i < NUM_KEYMAP_FIELDS; i++) {
+        assert(pFields[i] - base + fieldSizes[i] <= blockSize);
+        pFields[i] -= base;
+    }
+
+    rebaseTable(pCopy->km_LoKeyMapTypes, (ULONG*)(pBlock + pFields[1]), LO_MAP_LENGTH, -base);
+    rebaseTable(pCopy->km_HiKeyMapTypes, (ULONG*)(pBlock + pFields[5]), HI_MAP_LENGTH, -base);
+}
+
+// Validates the string/dead tables of one map of an image that has not been relocated: each
+// table must lie within the block together with the strings it references, and its dead
+// entries must be of a known kind.  The dead tables are measured into 'pSizes' so that the
+// DPF_MOD tables can be checked by validateModTables() once 'deadCharTableBytes' is known.
+static BOOL validateTables(const UBYTE* pBlock, ULONG blockSize, const UBYTE* pKmType, const ULONG* pKmEntry, int mapSize, Sizes* pSizes) {
+    for (int i = 0; i < mapSize; i++) {
+        const UBYTE kind = pKmType[i] & (KCF_NOP | KCF_STRING | KCF_DEAD);
+        if (kind != KCF_STRING && kind != KCF_DEAD) {
+            continue;
+        }
+
+        const int numEntries = calcNumEntries(pKmType[i]);
+        if (pKmEntry[i] > blockSize || (ULONG)(numEntries << 1) > blockSize - pKmEntry[i]) {
+            return FALSE;
+        }
+
+        const UBYTE* pTable = pBlock + pKmEntry[i];
+        const ULONG remaining = blockSize - pKmEntry[i];
+        for (int n = 0; n < numEntries; n++) {
+            const UBYTE first = pTable[n << 1];
+            const UBYTE offset = pTable[(n << 1) + 1];
+
+            if (kind == KCF_STRING && offset + first > remaining) {
+                return FALSE;
+            }
+            if (kind == KCF_DEAD && first != 0 && first != DPF_DEAD && first != DPF_MOD) {
+                return FALSE;
+            }
+        }
+
+        if (kind == KCF_DEAD) {
+            MeasureVisitor.pfnDead(pSizes, i, numEntries, pTable);
+        }
+    }
+
+    return TRUE;
+}
+
+// Validates that the DPF_MOD tables of one map (checked by validateTables()) lie within the
+// block.
+static BOOL validateModTables(const UBYTE* pBlock, ULONG blockSize, const UBYTE* pKmType, const ULONG* pKmEntry, int mapSize, UBYTE deadCharTableBytes) {
+    for (int i = 0; i < mapSize; i++) {
+        if ((pKmType[i] & (KCF_NOP | KCF_STRING | KCF_DEAD)) != KCF_DEAD) {
+            continue;
+        }
+
+        const UBYTE* pTable = pBlock + pKmEntry[i];
+        for (int n = 0; n < calcNumEntries(pKmType[i]); n++) {
+            if (pTable[n << 1] == DPF_MOD && pTable[(n << 1) + 1] + deadCharTableBytes > blockSize - pKmEntry[i]) {
+                return FALSE;
+            }
+        }
+    }
+
+    return TRUE;
+}
+
+struct KeyMap* relocateImage(UBYTE* pImage, ULONG imageSize) {
+    const ImageHeader* pHeader = (const ImageHeader*) pImage;
+
+    if (imageSize < sizeof(ImageHeader)
+        || pHeader->magic != IMAGE_MAGIC
+        || pHeader->version != IMAGE_VERSION
+        || pHeader->ulongSize != sizeof(ULONG)
+        || pHeader->blockSize != imageSize - sizeof(ImageHeader)
+        || pHeader->blockSize < sizeof(struct KeyMap)) {
+        return NULL;
+    }
+
+    UBYTE* pBlock = pImage + sizeof(ImageHeader);
+    const ULONG base = (ULONG) pBlock;
+    const ULONG blockSize = pHeader->blockSize;
+
+    // Validate everything before relocating anything, so that a rejected image is left as
+    // it was.
+    ULONG* pFields = (ULONG*) pBlock;
+    for (int i = 0; i < NUM_KEYMAP_FIELDS; i++) {
+        if (pFields[i] > blockSize || fieldSizes[i] > blockSize - pFields[i]) {
+            return NULL;
+        }
+    }
+
+    // The kmEntries are read as ULONGs.
+    if (pFields[1] % sizeof(ULONG) != 0 || pFields[5] % sizeof(ULONG) != 0) {
+        return NULL;
+    }
+
+    const UBYTE* pLoTypes = pBlock + pFields[0];
+    const UBYTE* pHiTypes = pBlock + pFields[4];
+    ULONG* pLoMap = (ULONG*)(pBlock + pFields[1]);
+    ULONG* pHiMap = (ULONG*)(pBlock + pFields[5]);
+
+    Sizes sizes;
+    memset(&sizes, 0, sizeof(Sizes));
+    if (!validateTables(pBlock, blockSize, pLoTypes, pLoMap, LO_MAP_LENGTH, &sizes)
+        || !validateTables(pBlock, blockSize, pHiTypes, pHiMap, HI_MAP_LENGTH, &sizes)
+        || !validateModTables(pBlock, blockSize, pLoTypes, pLoMap, LO_MAP_LENGTH, sizes.deadCharTableBytes)
+        || !validateModTables(pBlock, blockSize, pHiTypes, pHiMap, HI_MAP_LENGTH, sizes.deadCharTableBytes)) {
+        return NULL;
+    }
+
+    for (int i = 0; i < NUM_KEYMAP_FIELDS; i++) {
+        pFields[i] += base;
+    }
+    rebaseTable(pLoTypes, pLoMap, LO_MAP_LENGTH, base);
+    rebaseTable(pHiTypes, pHiMap, HI_MAP_LENGTH, base);
+
+    return (struct KeyMap*) pBlock;
+}
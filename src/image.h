@@ -0,0 +1,40 @@
+#ifndef IMAGE_H
+#define IMAGE_H
+
+#include <exec/types.h>
+#include <proto/keymap.h>
+#include "visitors/measure.h"
+
+#define IMAGE_MAGIC     0x4B4D4150  // 'KMAP'
+#define IMAGE_VERSION   1
+
+// A keymap image is the block produced by copyKeymap() (KeyMap + KeyMapTables + string/dead
+// tables) preceded by an ImageHeader.  In the image, the KeyMap fields and the kmEntries of
+// KCF_STRING/KCF_DEAD keys hold offsets from the start of the block instead of addresses,
+// so the image can be saved and later relocated in place with a single linear pass.
+//
+// Images are specific to the ABI that wrote them: 'magic' detects a byte order mismatch and
+// 'ulongSize' detects a ULONG size mismatch (e.g., an image written by the 64-bit host build).
+typedef struct {
+    ULONG magic;        // IMAGE_MAGIC
+    UWORD version;      // IMAGE_VERSION
+    UBYTE ulongSize;    // sizeof(ULONG) of the writer
+    UBYTE reserved;
+    ULONG blockSize;    // Size of the block following the header
+} ImageHeader;
+
+// Returns the size of the image of a keymap copy described by 'pSizes'.
+ULONG calcImageSize(const Sizes* pSizes);
+
+// Writes the image of 'pCopy' (a block returned by one of the copyKeymap() functions with the
+// given 'pSizes') to 'pImage', which must be calcImageSize() bytes.
+void writeImage(const struct KeyMap* pCopy, const Sizes* pSizes, UBYTE* pImage);
+
+// Validates the image in 'pImage' and relocates it in place.  Every KeyMap field, and every
+// string/dead table with the strings and DPF_MOD tables it references, must lie within the
+// block; nothing is relocated until all of it has been checked.  Returns the KeyMap within
+// the image, or NULL (leaving the image unchanged) if the image is invalid.  (The memory
+// holding the image must remain valid for as long as the KeyMap is in use.)
+struct KeyMap* relocateImage(UBYTE* pImage, ULONG imageSize);
+
+#endif
@@ -0,0 +1,119 @@
+#include "intern.h"
+#include <exec/types.h>
+#include <proto/keymap.h>
+#include <assert.h>
+#include <string.h>
+
+void initIntern(InternTable* pIntern) {
+    memset(pIntern, 0, sizeof(InternTable));
+}
+
+// Hashes are computed with shifts and adds (h * 33 + byte), which are cheap on a 68000.
+#define HASH_STEP(h, b) (((h) << 5) + (h) + (b))
+
+static ULONG hashString(int numEntries, const UBYTE* pTable) {
+    ULONG hash = numEntries;
+
+    for (int n = 0; n < numEntries; n++) {
+        const UBYTE len = *(pTable + (n << 1));
+        const UBYTE* pCh = pTable + *(pTable + (n << 1) + 1);
+
+        hash = HASH_STEP(hash, len);
+        for (int i = 0; i < len; i++) {
+            hash = HASH_STEP(hash, *(pCh++));
+        }
+    }
+
+    return hash;
+}
+
+static ULONG hashDead(int numEntries, const UBYTE* pTable, UBYTE deadCharTableBytes) {
+    ULONG hash = ~numEntries;
+
+    for (int n = 0; n < numEntries; n++) {
+        const UBYTE kind = *(pTable + (n << 1));
+        const UBYTE value = *(pTable + (n << 1) + 1);
+
+        hash = HASH_STEP(hash, kind);
+        if (kind == DPF_MOD) {
+            const UBYTE* pCh = pTable + value;
+            for (int i = 0; i < deadCharTableBytes; i++) {
+                hash = HASH_STEP(hash, *(pCh++));
+            }
+        } else {
+            hash = HASH_STEP(hash, value);
+        }
+    }
+
+    return hash;
+}
+
+static BOOL equalStrings(int numEntries, const UBYTE* pLeft, const UBYTE* pRight) {
+    for (int n = 0; n < numEntries; n++) {
+        const UBYTE len = *(pLeft + (n << 1));
+        if (len != *(pRight + (n << 1))) {
+            return FALSE;
+        }
+
+        if (memcmp(pLeft + *(pLeft + (n << 1) + 1), pRight + *(pRight + (n << 1) + 1), len) != 0) {
+            return FALSE;
+        }
+    }
+
+    return TRUE;
+}
+
+static BOOL equalDead(int numEntries, const UBYTE* pLeft, const UBYTE* pRight, UBYTE deadCharTableBytes) {
+    for (int n = 0; n < numEntries; n++) {
+        const UBYTE kind = *(pLeft + (n << 1));
+        const UBYTE leftValue = *(pLeft + (n << 1) + 1);
+        const UBYTE rightValue = *(pRight + (n << 1) + 1);
+
+        if (kind != *(pRight + (n << 1))) {
+            return FALSE;
+        }
+
+        if (kind == DPF_MOD) {
+            if (memcmp(pLeft + leftValue, pRight + rightValue, deadCharTableBytes) != 0) {
+                return FALSE;
+            }
+        } else if (leftValue != rightValue) {
+            return FALSE;
+        }
+    }
+
+    return TRUE;
+}
+
+InternEntry* internTable(InternTable* pIntern, BOOL isDead, int numEntries, const UBYTE* pTable, BOOL* pAdded) {
+    const ULONG hash = isDead
+        ? hashDead(numEntries, pTable, pIntern->deadCharTableBytes)
+        : hashString(numEntries, pTable);
+
+    // Linear probing.  There are fewer tables than slots, so a free slot always exists.
+    ULONG index = hash & (INTERN_SLOTS - 1);
+    for (;;) {
+        InternEntry* pEntry = &pIntern->slots[index];
+
+        if (pEntry->pSrcTable == NULL) {
+            pEntry->pSrcTable = pTable;
+            pEntry->hash = hash;
+            pEntry->numEntries = numEntries;
+            pEntry->isDead = isDead;
+            *pAdded = TRUE;
+            return pEntry;
+        }
+
+        if (pEntry->hash == hash
+            && pEntry->numEntries == numEntries
+            && pEntry->isDead == isDead
+            && (isDead
+                ? equalDead(numEntries, pEntry->pSrcTable, pTable, pIntern->deadCharTableBytes)
+                : equalStrings(numEntries, pEntry->pSrcTable, pTable))) {
+            *pAdded = FALSE;
+            return pEntry;
+        }
+
+        index = (index + 1) & (INTERN_SLOTS - 1);
+    }
+}
@@ -0,0 +1,38 @@
+#ifndef INTERN_H
+#define INTERN_H
+
+#include <exec/types.h>
+#include "keymaptable.h"
+
+#define INTERN_SLOTS 256    // Power of 2 comfortably larger than the 120 keys in a keymap
+
+// One unique string/dead table.  Tables are compared by content (lengths, chars, kinds,
+// values, and dead char tables), never by address.
+typedef struct {
+    const UBYTE* pSrcTable;     // First source table with this content (NULL if slot is free)
+    UBYTE* pDestTable;          // Copy of the table (NULL until copied)
+    ULONG hash;
+    UBYTE numEntries;
+    BOOL isDead;
+} InternEntry;
+
+// An InternTable lets the MeasureVisitor and CopyVisitor share identical string and dead
+// tables between keys.  The MeasureVisitor interns string tables as it visits them, but
+// the content of a DPF_MOD table depends on 'deadCharTableBytes', which is not known until
+// the whole keymap has been visited.  Dead tables are therefore queued and interned by
+// finishMeasure().
+typedef struct {
+    InternEntry slots[INTERN_SLOTS];
+    const UBYTE* pPendingDead[LO_MAP_LENGTH + HI_MAP_LENGTH];
+    UBYTE pendingEntries[LO_MAP_LENGTH + HI_MAP_LENGTH];
+    UBYTE numPending;
+    UBYTE deadCharTableBytes;   // Length of each DPF_MOD table compared
+} InternTable;
+
+void initIntern(InternTable* pIntern);
+
+// Finds the entry for a table with the same content as 'pTable', adding one if there is
+// none.  '*pAdded' is set to TRUE if the entry was added.
+InternEntry* internTable(InternTable* pIntern, BOOL isDead, int numEntries, const UBYTE* pTable, BOOL* pAdded);
+
+#endif
@@ -0,0 +1,207 @@
+#include "keyset.h"
+#include <assert.h>
+#include <string.h>
+
+#define NUM_KEYS (LO_MAP_LENGTH + HI_MAP_LENGTH)
+#define WORD_MASK 0xFFFFFFFFUL      // (ULONG is 64-bit on LP64 hosts)
+
+// Index of the lowest set bit of a 32-bit word, by de Bruijn multiplication (the 68000
+// has no bit scan instruction).
+static const UBYTE lowestBitTable[32] = {
+     0,  1, 28,  2, 29, 14, 24,  3, 30, 22, 20, 15, 25, 17,  4,  8,
+    31, 27, 13, 23, 21, 19, 16,  7, 26, 12, 18,  6, 11,  5, 10,  9,
+};
+
+static UBYTE lowestBit(ULONG bits) {
+    return lowestBitTable[(((bits & -bits) * 0x077CB531UL) & WORD_MASK) >> 27];
+}
+
+// Number of set bits of a 32-bit word, counted in parallel in 2-, 4- and 8-bit fields.
+static UBYTE countBits(ULONG bits) {
+    bits = bits - ((bits >> 1) & 0x55555555UL);
+    bits = (bits & 0x33333333UL) + ((bits >> 2) & 0x33333333UL);
+    bits = (bits + (bits >> 4)) & 0x0F0F0F0FUL;
+    return ((bits * 0x01010101UL) >> 24) & 0xFF;
+}
+
+// Returns the bits of word 'w' that select the raw keys 'firstKey'..'lastKey'.
+static ULONG rangeMask(int w, UBYTE firstKey, UBYTE lastKey) {
+    const int base = w << 5;
+    if (lastKey < base || firstKey > base + 31) {
+        return 0;
+    }
+
+    const int first = firstKey > base ? firstKey - base : 0;
+    const int last = lastKey < base + 31 ? lastKey - base : 31;
+    return (WORD_MASK >> (31 - last)) & (WORD_MASK << first);
+}
+
+void clearKeySet(KeySet* pSet) {
+    memset(pSet, 0, sizeof(KeySet));
+}
+
+void addKeys(KeySet* pSet, UBYTE firstKey, UBYTE lastKey) {
+    assert(firstKey <= lastKey && lastKey < NUM_KEYS);
+
+    for (int w = 0; w < KEYSET_WORDS; w++) {
+        pSet->words[w] |= rangeMask(w, firstKey, lastKey);
+    }
+}
+
+void removeKeys(KeySet* pSet, UBYTE firstKey, UBYTE lastKey) {
+    assert(firstKey <= lastKey && lastKey < NUM_KEYS);
+
+    for (int w = 0; w < KEYSET_WORDS; w++) {
+        pSet->words[w] &= ~rangeMask(w, firstKey, lastKey);
+    }
+}
+
+void addKey(KeySet* pSet, UBYTE rawKey) {
+    assert(rawKey < NUM_KEYS);
+    pSet->words[rawKey >> 5] |= 1UL << (rawKey & 31);
+}
+
+void removeKey(KeySet* pSet, UBYTE rawKey) {
+    assert(rawKey < NUM_KEYS);
+    pSet->words[rawKey >> 5] &= ~(1UL << (rawKey & 31));
+}
+
+BOOL hasKey(const KeySet* pSet, UBYTE rawKey) {
+    return (pSet->words[rawKey >> 5] >> (rawKey & 31)) & 1;
+}
+
+void unionKeys(KeySet* pDest, const KeySet* pA, const KeySet* pB) {
+    for (int w = 0; w < KEYSET_WORDS; w++) {
+        pDest->words[w] = pA->words[w] | pB->words[w];
+    }
+}
+
+void intersectKeys(KeySet* pDest, const KeySet* pA, const KeySet* pB) {
+    for (int w = 0; w < KEYSET_WORDS; w++) {
+        pDest->words[w] = pA->words[w] & pB->words[w];
+    }
+}
+
+void subtractKeys(KeySet* pDest, const KeySet* pA, const KeySet* pB) {
+    for (int w = 0; w < KEYSET_WORDS; w++) {
+        pDest->words[w] = pA->words[w] & ~pB->words[w];
+    }
+}
+
+void xorKeys(KeySet* pDest, const KeySet* pA, const KeySet* pB) {
+    for (int w = 0; w < KEYSET_WORDS; w++) {
+        pDest->words[w] = pA->words[w] ^ pB->words[w];
+    }
+}
+
+BOOL isEmptyKeySet(const KeySet* pSet) {
+    return (pSet->words[0] | pSet->words[1] | pSet->words[2] | pSet->words[3]) == 0;
+}
+
+BOOL equalKeySets(const KeySet* pA, const KeySet* pB) {
+    return ((pA->words[0] ^ pB->words[0])
+        | (pA->words[1] ^ pB->words[1])
+        | (pA->words[2] ^ pB->words[2])
+        | (pA->words[3] ^ pB->words[3])) == 0;
+}
+
+BOOL anyKeysIn(const KeySet* pSet, UBYTE firstKey, UBYTE lastKey) {
+    assert(firstKey <= lastKey && lastKey < NUM_KEYS);
+
+    for (int w = firstKey >> 5; w <= lastKey >> 5; w++) {
+        if (pSet->words[w] & rangeMask(w, firstKey, lastKey)) {
+            return TRUE;
+        }
+    }
+    return FALSE;
+}
+
+UBYTE countKeys(const KeySet* pSet) {
+    return countBits(pSet->words[0])
+        + countBits(pSet->words[1])
+        + countBits(pSet->words[2])
+        + countBits(pSet->words[3]);
+}
+
+int nextKey(const KeySet* pSet, int rawKey) {
+    const int start = rawKey + 1;
+    if (start >= NUM_KEYS) {
+        return -1;
+    }
+
+    int w = start >> 5;
+    ULONG bits = pSet->words[w] & (WORD_MASK << (start & 31));
+
+    while (bits == 0) {
+        if (++w == KEYSET_WORDS) {
+            return -1;
+        }
+        bits = pSet->words[w];
+    }
+
+    return (w << 5) + lowestBit(bits);
+}
+
+// Packs 4 bytes of a capsable/repeatable array into a word (the first byte holds the
+// lowest keys, independent of the byte order of the CPU).
+static ULONG loadWord(const UBYTE* pBytes, int numBytes) {
+    ULONG word = 0;
+    for (int i = numBytes - 1; i >= 0; i--) {
+        word = (word << 8) | pBytes[i];
+    }
+    return word;
+}
+
+static void storeWord(ULONG word, UBYTE* pBytes, int numBytes) {
+    for (int i = 0; i < numBytes; i++, word >>= 8) {
+        pBytes[i] = (UBYTE) word;
+    }
+}
+
+void loadKeySet(KeySet* pSet, const UBYTE* pLo, const UBYTE* pHi) {
+    pSet->words[0] = loadWord(pLo, 4);
+    pSet->words[1] = loadWord(pLo + 4, LO_CAPS_BYTE_SIZE - 4);
+    pSet->words[2] = loadWord(pHi, 4);
+    pSet->words[3] = loadWord(pHi + 4, HI_CAPS_BYTE_SIZE - 4);
+}
+
+void storeKeySet(const KeySet* pSet, UBYTE* pLo, UBYTE* pHi) {
+    if (pLo != NULL) {
+        storeWord(pSet->words[0], pLo, 4);
+        storeWord(pSet->words[1], pLo + 4, LO_CAPS_BYTE_SIZE - 4);
+    }
+    if (pHi != NULL) {
+        storeWord(pSet->words[2], pHi, 4);
+        storeWord(pSet->words[3], pHi + 4, HI_CAPS_BYTE_SIZE - 4);
+    }
+}
+
+void loadCapsable(KeySet* pSet, const struct KeyMap* pKeyMap) {
+    loadKeySet(pSet, pKeyMap->km_LoCapsable, pKeyMap->km_HiCapsable);
+}
+
+void loadRepeatable(KeySet* pSet, const struct KeyMap* pKeyMap) {
+    loadKeySet(pSet, pKeyMap->km_LoRepeatable, pKeyMap->km_HiRepeatable);
+}
+
+BOOL testKeyBit(const UBYTE* pLo, const UBYTE* pHi, UBYTE rawKey) {
+    const UBYTE* pBits = rawKey < LO_MAP_LENGTH
+        ? pLo
+        : pHi;
+    const UBYTE index = rawKey & (LO_MAP_LENGTH - 1);
+    return (pBits[index >> 3] >> (index & 7)) & 1;
+}
+
+void setKeyBit(UBYTE* pLo, UBYTE* pHi, UBYTE rawKey, BOOL value) {
+    UBYTE* pBits = rawKey < LO_MAP_LENGTH
+        ? pLo
+        : pHi;
+    const UBYTE index = rawKey & (LO_MAP_LENGTH - 1);
+    const UBYTE mask = 1 << (index & 7);
+
+    if (value) {
+        pBits[index >> 3] |= mask;
+    } else {
+        pBits[index >> 3] &= ~mask;
+    }
+}
@@ -0,0 +1,65 @@
+#ifndef KEYSET_H
+#define KEYSET_H
+
+#include <exec/types.h>
+#include <proto/keymap.h>
+#include "keymaptable.h"
+
+#define KEYSET_WORDS 4
+
+// A set of raw keys (0x00-0x77): bit (rawKey & 31) of words[rawKey >> 5].  Words 0-1 hold
+// the lo map keys and words 2-3 the hi map keys, so the 1-bit-per-key capsable/repeatable
+// arrays of a KeyMap load into a KeySet as a pair (see loadKeySet()), and set operations
+// take a few word operations rather than a loop over every key.
+typedef struct {
+    ULONG words[KEYSET_WORDS];
+} KeySet;
+
+void clearKeySet(KeySet* pSet);
+
+// Adds (or removes) the raw keys 'firstKey'..'lastKey' (inclusive).
+void addKeys(KeySet* pSet, UBYTE firstKey, UBYTE lastKey);
+void removeKeys(KeySet* pSet, UBYTE firstKey, UBYTE lastKey);
+
+void addKey(KeySet* pSet, UBYTE rawKey);
+void removeKey(KeySet* pSet, UBYTE rawKey);
+BOOL hasKey(const KeySet* pSet, UBYTE rawKey);
+
+// '*pDest' = A | B, A & B, A & ~B, or A ^ B.  ('pDest' may be 'pA' or 'pB'.)
+void unionKeys(KeySet* pDest, const KeySet* pA, const KeySet* pB);
+void intersectKeys(KeySet* pDest, const KeySet* pA, const KeySet* pB);
+void subtractKeys(KeySet* pDest, const KeySet* pA, const KeySet* pB);
+void xorKeys(KeySet* pDest, const KeySet* pA, const KeySet* pB);
+
+BOOL isEmptyKeySet(const KeySet* pSet);
+BOOL equalKeySets(const KeySet* pA, const KeySet* pB);
+
+// Returns TRUE if any of the raw keys 'firstKey'..'lastKey' (inclusive) is in the set.
+BOOL anyKeysIn(const KeySet* pSet, UBYTE firstKey, UBYTE lastKey);
+
+// Returns the number of keys in the set.
+UBYTE countKeys(const KeySet* pSet);
+
+// Returns the lowest key in the set above 'rawKey', or -1 if there is none.  (Pass -1 to
+// get the first key.)  Unset keys are skipped a word at a time:
+//
+//      for (int rawKey = nextKey(&set, -1); rawKey >= 0; rawKey = nextKey(&set, rawKey)) { ... }
+//
+int nextKey(const KeySet* pSet, int rawKey);
+
+// Converts between a KeySet and a pair of lo/hi capsable or repeatable arrays (8 and 7
+// bytes, bit (rawKey & 7) of byte ((rawKey & 63) >> 3)).  storeKeySet() skips a NULL
+// 'pLo'/'pHi' (e.g., an array shared with a read-only keymap).
+void loadKeySet(KeySet* pSet, const UBYTE* pLo, const UBYTE* pHi);
+void storeKeySet(const KeySet* pSet, UBYTE* pLo, UBYTE* pHi);
+
+// The capsable/repeatable keys of 'pKeyMap'.
+void loadCapsable(KeySet* pSet, const struct KeyMap* pKeyMap);
+void loadRepeatable(KeySet* pSet, const struct KeyMap* pKeyMap);
+
+// Reads or writes the bit of one key in a pair of lo/hi capsable or repeatable arrays
+// (without loading a KeySet).
+BOOL testKeyBit(const UBYTE* pLo, const UBYTE* pHi, UBYTE rawKey);
+void setKeyBit(UBYTE* pLo, UBYTE* pHi, UBYTE rawKey, BOOL value);
+
+#endif
@@ -0,0 +1,208 @@
+#include "layout.h"
+#include <exec/types.h>
+#include <proto/keymap.h>
+#include <string.h>
+
+int planDeadRuns(const UBYTE* pTable, int numEntries, UBYTE deadCharTableBytes, DeadRun* pRuns) {
+    if (deadCharTableBytes == 0) {
+        return 0;
+    }
+
+    // Insertion sort the DPF_MOD offsets (there are at most 8).
+    UBYTE offsets[8];
+    int numOffsets = 0;
+
+    for (int n = 0; n < numEntries; n++) {
+        if (*(pTable + (n << 1)) != DPF_MOD) {
+            continue;
+        }
+
+        const UBYTE offset = *(pTable + (n << 1) + 1);
+        int i = numOffsets++;
+        for (; i > 0 && offsets[i - 1] > offset; i--) {
+            offsets[i] = offsets[i - 1];
+        }
+        offsets[i] = offset;
+    }
+
+    // Each table is clipped to the next offset in the key, since the bytes beyond it belong
+    // to the next table (or are shared with it).  The last table keeps 'deadCharTableBytes',
+    // as nothing in the descriptor says where it ends.  A table that starts where the
+    // previous one was clipped continues its run.
+    int numRuns = 0;
+    UWORD totalBytes = 0;
+    for (int i = 0; i < numOffsets; i++) {
+        const UWORD start = offsets[i];
+        UWORD end = start + deadCharTableBytes;
+        if (i + 1 < numOffsets && offsets[i + 1] < end) {
+            end = offsets[i + 1];
+        }
+
+        if (end == start) {
+            continue;       // Shares its offset with the next table
+        }
+
+        if (numRuns > 0 && start == pRuns[numRuns - 1].end) {
+            pRuns[numRuns - 1].end = end;
+        } else {
+            pRuns[numRuns].start = start;
+            pRuns[numRuns].end = end;
+            numRuns++;
+        }
+        totalBytes += end - start;
+    }
+
+    // The runs are copied after the descriptor in order, so the table that starts furthest
+    // from the descriptor is the last table of the last run, which is never clipped.
+    if (numRuns > 0 && (numEntries << 1) + totalBytes - deadCharTableBytes > MAX_TABLE_OFFSET) {
+        return -1;
+    }
+
+    return numRuns;
+}
+
+int calcModTableBytes(const UBYTE* pTable, int numEntries, UBYTE deadCharTableBytes) {
+    DeadRun runs[8];
+    const int numRuns = planDeadRuns(pTable, numEntries, deadCharTableBytes, runs);
+    if (numRuns < 0) {
+        return -1;
+    }
+
+    int bytes = 0;
+    for (int i = 0; i < numRuns; i++) {
+        bytes += runs[i].end - runs[i].start;
+    }
+    return bytes;
+}
+
+// Returns the offset of the first occurrence of the 'len' bytes at 'pFind' within the
+// 'hostLen' bytes at 'pHost', or -1 if there is none.  (Candidates are found by their first
+// char, so long unrelated strings cost about one memchr() rather than a memcmp() per char.)
+static int findBytes(const UBYTE* pHost, UBYTE hostLen, const UBYTE* pFind, UBYTE len) {
+    if (len == 0) {
+        return 0;
+    }
+    if (len > hostLen) {
+        return -1;
+    }
+
+    const UBYTE* pLast = pHost + hostLen - len;
+    for (const UBYTE* p = pHost; p <= pLast; p++) {
+        p = memchr(p, pFind[0], pLast - p + 1);
+        if (p == NULL) {
+            break;
+        }
+        if (memcmp(p + 1, pFind + 1, len - 1) == 0) {
+            return p - pHost;
+        }
+    }
+    return -1;
+}
+
+// Packs the strings of a descriptor: strings contained in another string share its chars,
+// and the remaining 'host' strings are placed shortest first.  Returns FALSE if an entry
+// would still start beyond MAX_TABLE_OFFSET.
+static BOOL packStrings(const UBYTE* pTable, int numEntries, StringLayout* pLayout) {
+    const UBYTE* pChars[8];
+    UBYTE lens[8];
+
+    for (int n = 0; n < numEntries; n++) {
+        lens[n] = *(pTable + (n << 1));
+        pChars[n] = pTable + *(pTable + (n << 1) + 1);
+    }
+
+    // Find the strings that are not contained in another (of identical strings, the first is
+    // kept) and insertion sort them by length.  Containment is transitive, so every other
+    // string is contained in one of these.
+    UBYTE hosts[8];
+    int numHosts = 0;
+
+    for (int n = 0; n < numEntries; n++) {
+        BOOL contained = FALSE;
+        for (int j = 0; j < numEntries && !contained; j++) {
+            contained = (lens[j] > lens[n] || (lens[j] == lens[n] && j < n))
+                && findBytes(pChars[j], lens[j], pChars[n], lens[n]) >= 0;
+        }
+
+        if (!contained) {
+            int i = numHosts++;
+            for (; i > 0 && lens[hosts[i - 1]] > lens[n]; i--) {
+                hosts[i] = hosts[i - 1];
+            }
+            hosts[i] = n;
+        }
+    }
+
+    UWORD hostOffsets[8];
+    UWORD offset = numEntries << 1;
+
+    for (int i = 0; i < numHosts; i++) {
+        hostOffsets[i] = offset;
+        offset += lens[hosts[i]];
+    }
+
+    pLayout->charBytes = offset - (numEntries << 1);
+
+    // Each string uses the first placed host that contains it.
+    for (int n = 0; n < numEntries; n++) {
+        int i = 0;
+        int pos = -1;
+        for (; pos < 0; i++) {
+            pos = findBytes(pChars[hosts[i]], lens[hosts[i]], pChars[n], lens[n]);
+        }
+
+        const UWORD entryOffset = hostOffsets[i - 1] + pos;
+        if (entryOffset > MAX_TABLE_OFFSET) {
+            return FALSE;
+        }
+        pLayout->offsets[n] = entryOffset;
+    }
+
+    return TRUE;
+}
+
+BOOL planStringLayout(const UBYTE* pTable, int numEntries, StringLayout* pLayout) {
+    const UWORD descriptorBytes = numEntries << 1;
+
+    // Normally the chars of each entry directly follow those of the previous entry.
+    UWORD offset = descriptorBytes;
+    int n = 0;
+    for (; n < numEntries && offset <= MAX_TABLE_OFFSET; n++) {
+        pLayout->offsets[n] = offset;
+        offset += *(pTable + (n << 1));
+    }
+
+    if (n == numEntries) {
+        pLayout->charBytes = offset - descriptorBytes;
+        pLayout->inOrder = TRUE;
+        return TRUE;
+    }
+
+    pLayout->inOrder = FALSE;
+    if (packStrings(pTable, numEntries, pLayout)) {
+        return TRUE;
+    }
+
+    // Fall back to the source layout, which can only fail if the source overlaps chars with
+    // its own descriptor.
+    UWORD end = descriptorBytes;
+    for (n = 0; n < numEntries; n++) {
+        const UBYTE len = *(pTable + (n << 1));
+        const UBYTE srcOffset = *(pTable + (n << 1) + 1);
+
+        if (len == 0) {
+            pLayout->offsets[n] = descriptorBytes;
+            continue;
+        }
+        if (srcOffset < descriptorBytes) {
+            return FALSE;
+        }
+        if (srcOffset + len > end) {
+            end = srcOffset + len;
+        }
+        pLayout->offsets[n] = srcOffset;
+    }
+
+    pLayout->charBytes = end - descriptorBytes;
+    return TRUE;
+}
@@ -0,0 +1,45 @@
+#ifndef LAYOUT_H
+#define LAYOUT_H
+
+#include <exec/types.h>
+
+// String and dead descriptors locate their chars and DPF_MOD tables with a UBYTE offset
+// from the start of the descriptor, so everything a copied descriptor references must
+// start within MAX_TABLE_OFFSET bytes of it.  The planners below decide where each string
+// and DPF_MOD table of a key goes in a copy, and report when no layout fits.
+#define MAX_TABLE_OFFSET 0xFF
+
+// A contiguous range of DPF_MOD table bytes within a dead descriptor, [start, end).
+typedef struct {
+    UWORD start;
+    UWORD end;
+} DeadRun;
+
+// Plans the copy of the DPF_MOD tables referenced by a dead descriptor.  The tables are
+// sorted by offset and each is clipped to the offset of the next (the last keeps the
+// keymap's 'deadCharTableBytes'), so tables that share an offset or overlap their neighbour
+// are copied once, and consecutive tables form a single run.  A copy of the runs preserves
+// every byte reachable through the descriptor.  Writes up to 8 runs (sorted by offset) to
+// 'pRuns' and returns the count, or -1 if the runs would place a table beyond
+// MAX_TABLE_OFFSET.
+int planDeadRuns(const UBYTE* pTable, int numEntries, UBYTE deadCharTableBytes, DeadRun* pRuns);
+
+// Returns the number of DPF_MOD table bytes needed to copy a dead descriptor (the sum of
+// its runs), or -1 if it does not fit (see planDeadRuns()).
+int calcModTableBytes(const UBYTE* pTable, int numEntries, UBYTE deadCharTableBytes);
+
+// Where the chars of each entry of a string descriptor go in a copy.
+typedef struct {
+    UBYTE offsets[8];       // Offset of each entry's chars from the start of the descriptor
+    UWORD charBytes;        // Bytes of chars following the descriptor
+    BOOL inOrder;           // TRUE if the chars are simply copied in entry order
+} StringLayout;
+
+// Plans the copy of a string descriptor.  The chars are copied in entry order unless that
+// would start an entry beyond MAX_TABLE_OFFSET (e.g. several long macro strings).  In that
+// case, strings contained in another string share its chars and the remaining strings are
+// placed shortest first, so the longest string ends the table.  If even that does not fit,
+// the source layout (which fits by construction) is kept.  Returns FALSE if no layout fits.
+BOOL planStringLayout(const UBYTE* pTable, int numEntries, StringLayout* pLayout);
+
+#endif
@@ -2,17 +2,41 @@
 #include "visitors/measure.h"
 #include "visitors/copy.h"
 #include "visitors/print.h"
+#include "visitors/fingerprint.h"
+#include "copykeymap.h"
+#include "image.h"
+#include "cache.h"
+#include "hunkstream.h"
+#include "copystats.h"
 #include <proto/exec.h>
+#include <proto/dos.h>
+#include <dos/dos.h>
+#include <dos/dosextens.h>
+#include <dos/var.h>
 #include <proto/keymap.h>
 #include <devices/conunit.h>
-#include <assert.h>
+#include <exec/semaphores.h>
 #include <string.h>
-#include "keymaptable.h"
-
-#define ALIGN16(x) ((((ULONG) x) + 1) & ~1)
 
 struct Library* KeymapBase;
 
+// Command line template for ReadArgs()
+#define TEMPLATE "DEDUP/S,SAVE/K,LOAD/K,JSON/S,FORCE/S,CACHE/K,USE/K,BUDGET/K/N,FILE/K,SOURCE/S"
+
+enum {
+    OPT_DEDUP,      // Share identical string/dead tables in the copy
+    OPT_SAVE,       // Save an image of the copy to the given file
+    OPT_LOAD,       // Install the keymap image in the given file instead of copying
+    OPT_JSON,       // Print the keymaps as JSON lines (see PrintVisitor)
+    OPT_FORCE,      // Copy and install even if the default keymap is already an installed copy
+    OPT_CACHE,      // Install a copy of the default keymap from the resident cache under the given name
+    OPT_USE,        // Install the copy cached under the given name
+    OPT_BUDGET,     // Memory budget of the resident cache in bytes
+    OPT_FILE,       // Install a copy of the given keymap file (e.g. DEVS:Keymaps/usa) instead of the default keymap
+    OPT_SOURCE,     // Also print the default keymap that was copied (before the copy)
+    OPT_COUNT
+};
+
 struct KeyMap* readKeymap() {
     struct KeyMap* pKeymap;
 
@@ -33,120 +57,356 @@ void setKeymap(struct KeyMap* pKeymap) {
     }
 }
 
-struct KeyMap* copyKeymap(struct KeyMap* pSrc) {
-    // To calculate the amount of memory required to hold a copy of the keymap,
-    // we use a visitor to walk the keymap and count the following quantities:
-    //
-    //  - The number of KCF_STRING entries
-    //  - The total number of characters referenced by the KCF_STRING entries
-    //  - The number of KCF_DEAD entries
-    //  - The number of KCF_DEAD entries that are DPF_MOD
-    //  - The size of the dead char table for each DPF_MOD entry
-    //
-    // (See the measure visitor for more details.)
-    Sizes sizes = { 0 };
-    visit(pSrc, /* pContext: */ &sizes, /* visitor: */ MeasureVisitor);
-
-    // There are three pieces to the KeyMap we need to copy:
-    //
-    //  - The keymap struct itself (8 pointers = 32B)
-    //  - The fixed size tables pointed to by the keymap struct containing the maps, types, capsable
-    //    and repeatable arrays for the lo and hi maps (630B)
-    //  - The string and dead char entries pointed to by KCF_STRING and KCF_DEAD entries.
-    //    (size calculated below)
-    //
-    const ULONG keymapSize = ALIGN16(sizeof(struct KeyMap));    // 8 pointers = 64B
-    const ULONG tablesSize = ALIGN16(sizeof(KeyMapTables));     // 8 arrays, totaling 630B
-    const ULONG bufferSize =(sizes.stringEntries << 1)  // Each KCF_STRING = 2 bytes (UBYTE length, UBYTE offset)
-        + sizes.stringBytes                             // Sum of KCF_STRING lengths
-        + (sizes.deadEntries << 1)                      // Each KCF_DEAD = 2 bytes (UBYTE kind, UBYTE char/index/offset)
-        + sizes.deadCharTableBytes * sizes.modEntries;  // Each kind=DPF_MOD points to a dead char table
-
-    const ULONG size =
-        keymapSize          // 32B
-        + tablesSize        // 630B
-        + bufferSize;       // variable length
-
-    // Allocate a contiguous block of memory to hold the copy of the keymap and compute
-    // pointers into the memory for the various table as follows:
-    //
-    //      pDestKeyMap -> +-----------------------+
-    //                     |           64B         |
-    //      pDestTables -> +-----------------------+
-    //                     |                       |
-    //                     |          630B         |
-    //                     |                       |
-    //      pDestBuffer -> +-----------------------+
-    //                     |                       |
-    //                     | String & Dead Tables  |
-    //                     |                       |
-    //                     +-----------------------+
-    //
-    struct KeyMap* pDestKeyMap = AllocMem(size, MEMF_CLEAR | MEMF_PUBLIC);
-    KeyMapTables* pDestTables = (KeyMapTables*)(((UBYTE*) pDestKeyMap) + keymapSize);
-    UBYTE* pDestBuffer = ((UBYTE*) pDestTables) + tablesSize;
-    const UBYTE* pDestBufferStart = pDestBuffer;
-
-    // Initialize the KeyMap struct with the addresses of the fixed-size map, type,
-    // capsable, and repeatable tables.
-    pDestKeyMap->km_LoKeyMapTypes   = pDestTables->loKeyMapTypes;
-    pDestKeyMap->km_LoKeyMap        = pDestTables->loKeyMap;
-    pDestKeyMap->km_LoCapsable      = pDestTables->loCapsable;
-    pDestKeyMap->km_LoRepeatable    = pDestTables->loRepeatable;
-    pDestKeyMap->km_HiKeyMapTypes   = pDestTables->hiKeyMapTypes;
-    pDestKeyMap->km_HiKeyMap        = pDestTables->hiKeyMap;
-    pDestKeyMap->km_HiCapsable      = pDestTables->hiCapsable;
-    pDestKeyMap->km_HiRepeatable    = pDestTables->hiRepeatable;
-
-    // The hi/lo type, capsable, and repeatable tables do not contain pointers and
-    // can simply be memcpy'ed.
-    memcpy(pDestKeyMap->km_LoKeyMapTypes, pSrc->km_LoKeyMapTypes, LO_TYPE_LENGTH);
-    memcpy(pDestKeyMap->km_LoCapsable,    pSrc->km_LoCapsable,    LO_CAPS_BYTE_SIZE);
-    memcpy(pDestKeyMap->km_LoRepeatable,  pSrc->km_LoRepeatable,  LO_REPS_BYTE_SIZE);
-    memcpy(pDestKeyMap->km_HiKeyMapTypes, pSrc->km_HiKeyMapTypes, HI_TYPE_LENGTH);
-    memcpy(pDestKeyMap->km_HiCapsable,    pSrc->km_HiCapsable,    HI_CAPS_BYTE_SIZE);
-    memcpy(pDestKeyMap->km_HiRepeatable,  pSrc->km_HiRepeatable,  HI_REPS_BYTE_SIZE);
-
-    // The hi/lo map entries contain pointers to string/dead tables.  To copy these,
-    // we use a visitor that walks the map entries, inspects the associated type,
-    // and appends copies of referenced string/dead tables to the preallocated buffer
-    // that begins at 'pDestBuffer'.  See the copy visitor for more details.
-    CopyContext copy = { 0 };
-    copy.pKmEntry = pDestTables->loKeyMap;                  // Next KmEntry to write
-    copy.pBuffer = pDestBuffer;                             // Next available space for string/dead table
-    copy.deadCharTableBytes = sizes.deadCharTableBytes;     // Size of dead table (per DPF_MOD entry)
-
-    // Copy the map entries and string/dead tables for the low map.
-    visitLo(pSrc, &copy, CopyVisitor);
-    
-    // Sanity check that CopyVisitor advanced pKmEntry to the end of the low map.
-    assert((copy.pKmEntry - pDestKeyMap->km_LoKeyMap) == LO_MAP_LENGTH);
-
-    // Copy the map entries and string/dead tables for the high map.
-    copy.pKmEntry = pDestTables->hiKeyMap;                  // Update 'pKmEntry' to start of high map.
-    visitHi(pSrc, &copy, CopyVisitor);
-
-    // Sanity check that CopyVisitor advanced pKmEntry to the end of the high map.
-    assert(copy.pKmEntry - pDestKeyMap->km_HiKeyMap == HI_MAP_LENGTH);
-
-    // Sanity check that the total number of bytes used by the CopyVisitor for
-    // string/dead tables matches the sum calculated by the MeasureVisitor.
-    assert(copy.pBuffer == pDestBufferStart + bufferSize);
-
-    return pDestKeyMap;
+// The keymap most recently installed by CopyKeymap, recorded in a global environment
+// variable so that later runs can skip copying it again.
+#define INSTALLED_VAR "CopyKeymap.installed"
+
+typedef struct {
+    struct KeyMap* pKeyMap;     // Address of the installed copy
+    ULONG fingerprint;          // Fingerprint of the installed copy (see fingerprintKeymap())
+} InstalledCopy;
+
+void recordInstalled(struct KeyMap* pKeyMap) {
+    InstalledCopy installed;
+    installed.pKeyMap = pKeyMap;
+    installed.fingerprint = fingerprintKeymap(pKeyMap);
+
+    SetVar(INSTALLED_VAR, (STRPTR) &installed, sizeof(installed), GVF_GLOBAL_ONLY | GVF_BINARY_VAR);
+}
+
+// Returns TRUE if 'pKeyMap' is the copy recorded by recordInstalled() and its content is
+// unchanged, in which case copying and installing it again would be redundant.
+BOOL isInstalledCopy(struct KeyMap* pKeyMap) {
+    InstalledCopy installed;
+
+    // (Without GVF_DONT_NULL_TERM, GetVar() keeps the last byte of the buffer for a NUL and
+    // never returns the whole struct.)
+    if (GetVar(INSTALLED_VAR, (STRPTR) &installed, sizeof(installed), GVF_GLOBAL_ONLY | GVF_BINARY_VAR | GVF_DONT_NULL_TERM) != sizeof(installed)) {
+        return FALSE;
+    }
+
+    return installed.pKeyMap == pKeyMap
+        && installed.fingerprint == fingerprintKeymap(pKeyMap);
+}
+
+// The resident keymap cache is created by the first run that needs it and stays in memory,
+// found by the name of its semaphore, so later runs can switch to its copies.
+#define CACHE_SEMAPHORE "CopyKeymap.cache"
+#define DEFAULT_CACHE_BUDGET 0x10000
+
+typedef struct {
+    struct SignalSemaphore semaphore;
+    KeymapCache cache;
+    char name[sizeof(CACHE_SEMAPHORE)];
+} ResidentCache;
+
+// Finds (or creates) the resident cache and obtains its semaphore.  Returns NULL if it
+// cannot be allocated.
+ResidentCache* openResidentCache(const LONG* pBudget) {
+    Forbid();
+    ResidentCache* pResident = (ResidentCache*) FindSemaphore(CACHE_SEMAPHORE);
+    if (pResident == NULL) {
+        pResident = AllocMem(sizeof(ResidentCache), MEMF_CLEAR | MEMF_PUBLIC);
+        if (pResident != NULL) {
+            strcpy(pResident->name, CACHE_SEMAPHORE);
+            pResident->semaphore.ss_Link.ln_Name = pResident->name;
+            initCache(&pResident->cache, DEFAULT_CACHE_BUDGET);
+            AddSemaphore(&pResident->semaphore);
+        }
+    }
+    Permit();
+
+    if (pResident != NULL) {
+        ObtainSemaphore(&pResident->semaphore);
+        if (pBudget != NULL) {
+            pResident->cache.budget = *pBudget;
+        }
+    }
+
+    return pResident;
+}
+
+void closeResidentCache(ResidentCache* pResident) {
+    ReleaseSemaphore(&pResident->semaphore);
+}
+
+// Installs 'pCopy' (a copy held by the resident cache) as the default keymap.
+void installCached(ResidentCache* pResident, struct KeyMap* pCopy) {
+    setKeymap(pCopy);
+    pinCachedKeymap(&pResident->cache, pCopy);
+    recordInstalled(pCopy);
+}
+
+// Loads and relocates a keymap image saved with SAVE.  The image is read with a single
+// Read() into the block that becomes the installed keymap.
+struct KeyMap* loadImageFile(STRPTR pPath) {
+    struct KeyMap* pKeyMap = NULL;
+
+    BPTR file = Open(pPath, MODE_OLDFILE);
+    if (file == 0) {
+        return NULL;
+    }
+
+    struct FileInfoBlock* pFib = AllocDosObject(DOS_FIB, NULL);
+    if (pFib != NULL && ExamineFH(file, pFib)) {
+        const ULONG size = pFib->fib_Size;
+        UBYTE* pImage = AllocMem(size, MEMF_PUBLIC);
+
+        if (pImage != NULL) {
+            if (Read(file, pImage, size) == (LONG) size) {
+                pKeyMap = relocateImage(pImage, size);
+            }
+
+            if (pKeyMap == NULL) {
+                FreeMem(pImage, size);
+            }
+        }
+    }
+
+    FreeDosObject(DOS_FIB, pFib);
+    Close(file);
+    return pKeyMap;
+}
+
+// Reads the keymap file opened as 'pContext' for streamKeymapFile().
+LONG readFileAt(void* pContext, ULONG position, UBYTE* pDest, ULONG length) {
+    const BPTR file = (BPTR) pContext;
+    if (Seek(file, position, OFFSET_BEGINNING) < 0) {
+        return -1;
+    }
+    return Read(file, pDest, length);
 }
 
+// Streams the keymap file 'pPath' straight into a copy of it (see streamKeymapFile()), so
+// that neither the file nor its hunks are ever held in memory.  Prints why the file was
+// rejected if it was.
+struct KeyMap* loadKeymapFile(STRPTR pPath, Sizes* pSizes) {
+    struct KeyMap* pKeyMap = NULL;
+
+    BPTR file = Open(pPath, MODE_OLDFILE);
+    if (file == 0) {
+        PrintFault(IoErr(), pPath);
+        return NULL;
+    }
+
+    struct FileInfoBlock* pFib = AllocDosObject(DOS_FIB, NULL);
+    if (pFib != NULL && ExamineFH(file, pFib)) {
+        StreamInfo info;
+        pKeyMap = streamKeymapFile(readFileAt, (void*) file, pFib->fib_Size, STREAM_CHUNK_SIZE, pSizes, &info);
+
+        if (pKeyMap == NULL) {
+            Printf("%s: %s\n", pPath, info.pError);
+        }
+    }
+
+    FreeDosObject(DOS_FIB, pFib);
+    Close(file);
+    return pKeyMap;
+}
+
+// Saves an image of 'pCopy' that can later be installed with LOAD.
+BOOL saveImageFile(STRPTR pPath, struct KeyMap* pCopy, const Sizes* pSizes) {
+    const ULONG size = calcImageSize(pSizes);
+    UBYTE* pImage = AllocMem(size, MEMF_ANY);
+    if (pImage == NULL) {
+        return FALSE;
+    }
+
+    writeImage(pCopy, pSizes, pImage);
+
+    BOOL saved = FALSE;
+    BPTR file = Open(pPath, MODE_NEWFILE);
+    if (file != 0) {
+        saved = Write(file, pImage, size) == (LONG) size;
+        Close(file);
+    }
+
+    FreeMem(pImage, size);
+    return saved;
+}
+
+// Writes formatted output from the PrintVisitor directly to the console.
+void writeOutput(const char* pChars, ULONG length) {
+    Write(Output(), (APTR) pChars, length);
+}
+
+// Prints 'pKeyMap' to the console.  Returns FALSE if the PrintContext cannot be allocated.
+BOOL printKeymap(struct KeyMap* pKeyMap, UBYTE format, const Sizes* pSizes) {
+    // The PrintContext includes its buffer and is too large for the stack of a typical
+    // Amiga process.
+    PrintContext* pPrint = AllocMem(sizeof(PrintContext), MEMF_ANY);
+    if (pPrint == NULL) {
+        return FALSE;
+    }
+
+    beginPrint(pPrint, pKeyMap, format, pSizes->deadCharTableBytes);
+    pPrint->pfnSink = writeOutput;
+    visitPrint(pKeyMap, pPrint);
+    endPrint(pPrint);
+
+    FreeMem(pPrint, sizeof(PrintContext));
+    return TRUE;
+}
+
+#ifdef COPYKEYMAP_STATS
+// Prints the statistics collected while copying the keymap (see copystats.h).  Ticks are
+// E-clock ticks.
+void printCopyStats(void) {
+    const CopyStats* pStats = &copyStats;
+
+    Printf("measure %lu, tables %lu, lo %lu, hi %lu ticks\n",
+        (ULONG) pStats->ticks[STAT_MEASURE], (ULONG) pStats->ticks[STAT_TABLES],
+        (ULONG) pStats->ticks[STAT_LO], (ULONG) pStats->ticks[STAT_HI]);
+    Printf("keys: %lu normal, %lu string, %lu dead, %lu nop, %lu DPF_MOD entries, %lu shared tables\n",
+        pStats->normalKeys, pStats->stringKeys, pStats->deadKeys, pStats->nopKeys, pStats->modEntries, pStats->sharedTables);
+    Printf("bytes: %lu fixed, %lu string desc, %lu chars, %lu dead desc, %lu DPF_MOD tables\n",
+        pStats->structBytes, pStats->stringDescBytes, pStats->stringCharBytes, pStats->deadDescBytes, pStats->modTableBytes);
+    Printf("slack: %lu ALIGN16 padding, %lu avoided by exact DPF_MOD tables\n",
+        pStats->alignPadBytes, pStats->deadSlackBytes);
+}
+#endif
+
 int main() {
+    LONG opts[OPT_COUNT] = { 0 };
+    struct RDArgs* pArgs = ReadArgs(TEMPLATE, opts, NULL);
+    if (pArgs == NULL) {
+        PrintFault(IoErr(), "CopyKeymap");
+        return 20;
+    }
+
+    const BOOL dedup = opts[OPT_DEDUP] != 0;
+    const STRPTR pSavePath = (STRPTR) opts[OPT_SAVE];
+    const STRPTR pLoadPath = (STRPTR) opts[OPT_LOAD];
+    const UBYTE format = opts[OPT_JSON] ? PRINT_JSON : PRINT_TEXT;
+    const BOOL force = opts[OPT_FORCE] != 0;
+    const STRPTR pCacheName = (STRPTR) opts[OPT_CACHE];
+    const STRPTR pUseName = (STRPTR) opts[OPT_USE];
+    const LONG* pBudget = (const LONG*) opts[OPT_BUDGET];
+    const STRPTR pFilePath = (STRPTR) opts[OPT_FILE];
+    const BOOL printSource = opts[OPT_SOURCE] != 0;
+
+    // Switching to a cached copy is a single SetKeyMapDefault().
+    if (pUseName != NULL) {
+        ResidentCache* pResident = openResidentCache(pBudget);
+        struct KeyMap* pCached = pResident != NULL
+            ? findCachedKeymap(&pResident->cache, pUseName)
+            : NULL;
+
+        if (pCached != NULL) {
+            installCached(pResident, pCached);
+        } else {
+            PrintFault(ERROR_OBJECT_NOT_FOUND, pUseName);
+        }
+
+        if (pResident != NULL) {
+            closeResidentCache(pResident);
+        }
+        FreeArgs(pArgs);
+        return pCached != NULL ? 0 : 20;
+    }
+
+    if (pLoadPath != NULL) {
+        struct KeyMap* pLoaded = loadImageFile(pLoadPath);
+        if (pLoaded == NULL) {
+            PrintFault(IoErr(), pLoadPath);
+            FreeArgs(pArgs);
+            return 20;
+        }
+
+        setKeymap(pLoaded);
+        recordInstalled(pLoaded);
+        FreeArgs(pArgs);
+        return 0;
+    }
+
+    // A keymap file is streamed straight into the copy to install.
+    if (pFilePath != NULL) {
+        Sizes sizes;
+        struct KeyMap* pLoaded = loadKeymapFile(pFilePath, &sizes);
+        if (pLoaded == NULL) {
+            FreeArgs(pArgs);
+            return 20;
+        }
+
+        if (pSavePath != NULL && !saveImageFile(pSavePath, pLoaded, &sizes)) {
+            PrintFault(IoErr(), pSavePath);
+        }
+
+        FreeArgs(pArgs);
+
+        printKeymap(pLoaded, format, &sizes);
+
+        setKeymap(pLoaded);
+        recordInstalled(pLoaded);
+        return 0;
+    }
+
     struct KeyMap* pSrc = readKeymap();
 
-    Sizes sizes = { 0 };
-    visit(pSrc, /* pContext: */ &sizes, /* visitor: */ MeasureVisitor);
-    visit(pSrc, /* pContext: */ &sizes, /* visitor: */ PrintVisitor);
+    if (pCacheName != NULL) {
+        ResidentCache* pResident = openResidentCache(pBudget);
+        struct KeyMap* pCached = pResident != NULL
+            ? addCachedKeymap(&pResident->cache, pCacheName, pSrc)
+            : NULL;
+
+        if (pCached != NULL) {
+            installCached(pResident, pCached);
+        } else {
+            PrintFault(ERROR_NO_FREE_STORE, pCacheName);
+        }
+
+        if (pResident != NULL) {
+            closeResidentCache(pResident);
+        }
+        FreeArgs(pArgs);
+        return pCached != NULL ? 0 : 20;
+    }
+
+    // If the default keymap is still the copy installed by a previous run, there is
+    // nothing to do (unless an image of it was requested).
+    if (!force && pSavePath == NULL && isInstalledCopy(pSrc)) {
+        PutStr("Keymap copy already installed\n");
+        FreeArgs(pArgs);
+        return 0;
+    }
+
+    // Copying the keymap also measures it, so there is no need for a separate
+    // MeasureVisitor pass before printing.
+#ifdef COPYKEYMAP_STATS
+    beginCopyStats();
+#endif
 
-    struct KeyMap* pCopy = copyKeymap(pSrc);
-    visit(pCopy, /* pContext: */ &sizes, /* visitor: */ PrintVisitor);
+    Sizes sizes;
+    struct KeyMap* pCopy = dedup
+        ? copyKeymapDedup(pSrc, &sizes)
+        : copyKeymap(pSrc, &sizes);
+
+#ifdef COPYKEYMAP_STATS
+    endCopyStats();
+    printCopyStats();
+#endif
+
+    if (pCopy == NULL) {
+        PrintFault(sizes.overflowTables > 0 ? ERROR_OBJECT_TOO_LARGE : ERROR_NO_FREE_STORE, "CopyKeymap");
+        FreeArgs(pArgs);
+        return 20;
+    }
+
+    if (pSavePath != NULL && !saveImageFile(pSavePath, pCopy, &sizes)) {
+        PrintFault(IoErr(), pSavePath);
+    }
+
+    FreeArgs(pArgs);
+
+    // Only the installed copy is printed, unless the source was requested too (e.g. to
+    // compare them).
+    if (printSource) {
+        printKeymap(pSrc, format, &sizes);
+    }
+    printKeymap(pCopy, format, &sizes);
 
     setKeymap(pCopy);
+    recordInstalled(pCopy);
 
     return 0;
 }
@@ -0,0 +1,383 @@
+#include "overlay.h"
+#include "visit.h"
+#include "layout.h"
+#include "visitors/copy.h"
+#include "visitors/measure.h"
+#include "keyset.h"
+#include <proto/exec.h>
+#include <assert.h>
+#include <stddef.h>
+#include <string.h>
+#include "keymaptable.h"
+
+#define NUM_KEYS (LO_MAP_LENGTH + HI_MAP_LENGTH)
+
+// The arrays a KeyMap points to, in the order they are placed in an overlay block.  (The
+// ULONG maps come first so that they stay longword aligned.)
+enum {
+    ARRAY_LO_MAP,
+    ARRAY_HI_MAP,
+    ARRAY_LO_TYPES,
+    ARRAY_HI_TYPES,
+    ARRAY_LO_CAPS,
+    ARRAY_HI_CAPS,
+    ARRAY_LO_REPS,
+    ARRAY_HI_REPS,
+    NUM_ARRAYS
+};
+
+static const UWORD arrayOffsets[NUM_ARRAYS] = {
+    offsetof(struct KeyMap, km_LoKeyMap),
+    offsetof(struct KeyMap, km_HiKeyMap),
+    offsetof(struct KeyMap, km_LoKeyMapTypes),
+    offsetof(struct KeyMap, km_HiKeyMapTypes),
+    offsetof(struct KeyMap, km_LoCapsable),
+    offsetof(struct KeyMap, km_HiCapsable),
+    offsetof(struct KeyMap, km_LoRepeatable),
+    offsetof(struct KeyMap, km_HiRepeatable),
+};
+
+static const UWORD arraySizes[NUM_ARRAYS] = {
+    LO_MAP_LENGTH * sizeof(ULONG),
+    HI_MAP_LENGTH * sizeof(ULONG),
+    LO_TYPE_LENGTH,
+    HI_TYPE_LENGTH,
+    LO_CAPS_BYTE_SIZE,
+    HI_CAPS_BYTE_SIZE,
+    LO_REPS_BYTE_SIZE,
+    HI_REPS_BYTE_SIZE,
+};
+
+// Returns the address of the KeyMap field that points to 'array'.
+static UBYTE** arrayField(struct KeyMap* pKeyMap, int array) {
+    return (UBYTE**)(((UBYTE*) pKeyMap) + arrayOffsets[array]);
+}
+
+static BOOL isTableType(UBYTE kmType) {
+    return !(kmType & KCF_NOP) && (kmType & (KCF_STRING | KCF_DEAD));
+}
+
+static BOOL isDeadType(UBYTE kmType) {
+    return !(kmType & KCF_NOP) && (kmType & KCF_DEAD);
+}
+
+static UBYTE* typeAddress(const struct KeyMap* pKeyMap, UBYTE rawKey) {
+    return rawKey < LO_MAP_LENGTH
+        ? &pKeyMap->km_LoKeyMapTypes[rawKey]
+        : &pKeyMap->km_HiKeyMapTypes[rawKey - LO_MAP_LENGTH];
+}
+
+static ULONG* entryAddress(const struct KeyMap* pKeyMap, UBYTE rawKey) {
+    return rawKey < LO_MAP_LENGTH
+        ? &pKeyMap->km_LoKeyMap[rawKey]
+        : &pKeyMap->km_HiKeyMap[rawKey - LO_MAP_LENGTH];
+}
+
+// How the string/dead table of a key gets into the overlay.
+enum {
+    TABLE_NONE,         // Not a string/dead key, or shared with the base keymap
+    TABLE_COPY,         // Copied by the CopyVisitor
+    TABLE_PAD,          // Copied with DPF_MOD tables padded to the overlay's size (see copyPaddedDead())
+};
+
+typedef struct {
+    const KeyOverride* pOverrides;
+    UBYTE overrideSlots[NUM_KEYS];              // 1 + index of the override of each key (0 if unchanged)
+    UBYTE tableModes[NUM_KEYS];                 // TABLE_* of each key
+    UBYTE srcDeadBytes[NUM_KEYS];               // DPF_MOD table size of each TABLE_PAD source
+    BOOL copyArrays[NUM_ARRAYS];
+    KeySet capsable;                            // Capsable keys of the overlay
+    KeySet repeatable;                          // Repeatable keys of the overlay
+    UBYTE deadCharTableBytes;                   // DPF_MOD table size of the overlay
+    ULONG bufferSize;                           // Bytes of copied string/dead tables
+} OverlayPlan;
+
+// Returns the override of 'rawKey', or NULL if it is unchanged.
+static const KeyOverride* findOverride(const OverlayPlan* pPlan, UBYTE rawKey) {
+    const UBYTE slot = pPlan->overrideSlots[rawKey];
+    return slot != 0
+        ? &pPlan->pOverrides[slot - 1]
+        : NULL;
+}
+
+// Returns the size of the copy of a string/dead table made as 'mode' (see TABLE_*), or -1
+// if it does not fit 8-bit offsets.
+static int calcOverlayTableBytes(UBYTE mode, UBYTE kmType, const UBYTE* pTable, UBYTE deadCharTableBytes) {
+    const int numEntries = calcNumEntries(kmType);
+
+    if (kmType & KCF_STRING) {
+        StringLayout layout;
+        return planStringLayout(pTable, numEntries, &layout)
+            ? (numEntries << 1) + layout.charBytes
+            : -1;
+    }
+
+    if (mode == TABLE_COPY) {
+        const int modBytes = calcModTableBytes(pTable, numEntries, deadCharTableBytes);
+        return modBytes < 0
+            ? -1
+            : (numEntries << 1) + modBytes;
+    }
+
+    int modEntries = 0;
+    for (int n = 0; n < numEntries; n++) {
+        if (*(pTable + (n << 1)) == DPF_MOD) {
+            modEntries++;
+        }
+    }
+
+    // Each padded DPF_MOD table follows the previous one.
+    if (modEntries > 0 && (numEntries << 1) + (modEntries - 1) * deadCharTableBytes > MAX_TABLE_OFFSET) {
+        return -1;
+    }
+    return (numEntries << 1) + modEntries * deadCharTableBytes;
+}
+
+// Computes the capsable or repeatable keys of the overlay in '*pResult': the 'overrideBits'
+// of the 'overridden' keys and the 'baseBits' of the others.  Sets '*pCopyLo'/'*pCopyHi'
+// if the lo/hi half differs from the base (and so must be copied).
+static void planKeyBits(const KeySet* pBaseBits, const KeySet* pOverridden, const KeySet* pOverrideBits, KeySet* pResult, BOOL* pCopyLo, BOOL* pCopyHi) {
+    subtractKeys(pResult, pBaseBits, pOverridden);
+    unionKeys(pResult, pResult, pOverrideBits);
+
+    KeySet changes;
+    xorKeys(&changes, pBaseBits, pResult);
+    *pCopyLo = anyKeysIn(&changes, 0, LO_MAP_LENGTH - 1);
+    *pCopyHi = anyKeysIn(&changes, LO_MAP_LENGTH, NUM_KEYS - 1);
+}
+
+// Decides which arrays and tables the overlay copies.  Returns FALSE if a table does not
+// fit 8-bit offsets.
+static BOOL planOverlay(struct KeyMap* pBase, const KeyOverride* pOverrides, int numOverrides, OverlayPlan* pPlan) {
+    memset(pPlan, 0, sizeof(OverlayPlan));
+    pPlan->pOverrides = pOverrides;
+    assert(numOverrides <= 0xFF);
+
+    // The DPF_MOD table size of the overrides.  (Only needed if an override is a dead key.)
+    Sizes overrideSizes = { 0 };
+    BOOL anyDead = FALSE;
+
+    KeySet overridden;
+    KeySet overrideCapsable;
+    KeySet overrideRepeatable;
+    clearKeySet(&overridden);
+    clearKeySet(&overrideCapsable);
+    clearKeySet(&overrideRepeatable);
+
+    for (int i = 0; i < numOverrides; i++) {
+        const KeyOverride* pOverride = &pOverrides[i];
+        const UBYTE rawKey = pOverride->rawKey;
+        assert(rawKey < NUM_KEYS);
+
+        pPlan->overrideSlots[rawKey] = i + 1;
+
+        const BOOL isHi = rawKey >= LO_MAP_LENGTH;
+        pPlan->copyArrays[ARRAY_LO_MAP + isHi] = TRUE;
+        pPlan->copyArrays[ARRAY_LO_TYPES + isHi] = TRUE;
+
+        // (A later override of the same key replaces the bits of an earlier one.)
+        addKey(&overridden, rawKey);
+        removeKey(&overrideCapsable, rawKey);
+        removeKey(&overrideRepeatable, rawKey);
+        if (pOverride->flags & PKF_CAPSABLE) {
+            addKey(&overrideCapsable, rawKey);
+        }
+        if (pOverride->flags & PKF_REPEATABLE) {
+            addKey(&overrideRepeatable, rawKey);
+        }
+
+        if (isDeadType(pOverride->kmType)) {
+            anyDead = TRUE;
+        }
+    }
+
+    // The capsable/repeatable arrays are only copied if an override changes one of their bits.
+    KeySet baseBits;
+    loadCapsable(&baseBits, pBase);
+    planKeyBits(&baseBits, &overridden, &overrideCapsable, &pPlan->capsable, &pPlan->copyArrays[ARRAY_LO_CAPS], &pPlan->copyArrays[ARRAY_HI_CAPS]);
+    loadRepeatable(&baseBits, pBase);
+    planKeyBits(&baseBits, &overridden, &overrideRepeatable, &pPlan->repeatable, &pPlan->copyArrays[ARRAY_LO_REPS], &pPlan->copyArrays[ARRAY_HI_REPS]);
+
+    // Measure the dead keys that make it into the overlay.  If the overrides introduce dead
+    // keys, the overlay's DPF_MOD tables must hold the largest index of the base keymap's
+    // remaining dead keys and of the overrides.  Tables sized for less are padded.
+    UBYTE baseDeadBytes = 0;
+
+    if (anyDead) {
+        // Only the dead keys of the base keymap are measured, and only the unchanged ones
+        // count towards the overlay.
+        KeyFilter keptDeadKeys;
+        initKeyFilter(&keptDeadKeys, VISIT_DEAD);
+        selectKeys(&keptDeadKeys, 0, NUM_KEYS - 1);
+        subtractKeys(&keptDeadKeys.keys, &keptDeadKeys.keys, &overridden);
+
+        for (int rawKey = nextKey(&overridden, -1); rawKey >= 0; rawKey = nextKey(&overridden, rawKey)) {
+            const KeyOverride* pOverride = findOverride(pPlan, rawKey);
+            if (isDeadType(pOverride->kmType)) {
+                MeasureVisitor.pfnDead(&overrideSizes, rawKey, calcNumEntries(pOverride->kmType), (const UBYTE*) pOverride->kmEntry);
+            }
+        }
+
+        Sizes keptBaseSizes = { 0 };
+        visitKeys(pBase, &keptDeadKeys, &keptBaseSizes, MeasureVisitor);
+
+        baseDeadBytes = measureDeadCharTableBytes(pBase);
+        pPlan->deadCharTableBytes = keptBaseSizes.deadCharTableBytes > overrideSizes.deadCharTableBytes
+            ? keptBaseSizes.deadCharTableBytes
+            : overrideSizes.deadCharTableBytes;
+
+        // The DPF_MOD tables of unchanged base keys are shared unless they are too short.
+        if (pPlan->deadCharTableBytes > baseDeadBytes && keptBaseSizes.modEntries > 0) {
+            for (UBYTE rawKey = 0; rawKey < NUM_KEYS; rawKey++) {
+                if (pPlan->overrideSlots[rawKey] == 0 && isDeadType(*typeAddress(pBase, rawKey))) {
+                    pPlan->tableModes[rawKey] = TABLE_PAD;
+                    pPlan->srcDeadBytes[rawKey] = baseDeadBytes;
+                    pPlan->copyArrays[ARRAY_LO_MAP + (rawKey >= LO_MAP_LENGTH)] = TRUE;
+                }
+            }
+        }
+    }
+
+    // Size the tables to copy.
+    for (UBYTE rawKey = 0; rawKey < NUM_KEYS; rawKey++) {
+        const KeyOverride* pOverride = findOverride(pPlan, rawKey);
+        UBYTE kmType;
+        const UBYTE* pTable;
+
+        if (pOverride != NULL) {
+            if (!isTableType(pOverride->kmType)) {
+                continue;
+            }
+
+            kmType = pOverride->kmType;
+            pTable = (const UBYTE*) pOverride->kmEntry;
+
+            // (DPF_MOD tables larger than the overlay's only lose bytes no dead key indexes.)
+            if ((kmType & KCF_STRING) || pOverride->deadCharTableBytes >= pPlan->deadCharTableBytes) {
+                pPlan->tableModes[rawKey] = TABLE_COPY;
+            } else {
+                pPlan->tableModes[rawKey] = TABLE_PAD;
+                pPlan->srcDeadBytes[rawKey] = pOverride->deadCharTableBytes;
+            }
+        } else if (pPlan->tableModes[rawKey] == TABLE_PAD) {
+            kmType = *typeAddress(pBase, rawKey);
+            pTable = (const UBYTE*) *entryAddress(pBase, rawKey);
+        } else {
+            continue;
+        }
+
+        const int bytes = calcOverlayTableBytes(pPlan->tableModes[rawKey], kmType, pTable, pPlan->deadCharTableBytes);
+        if (bytes < 0) {
+            return FALSE;
+        }
+        pPlan->bufferSize += bytes;
+    }
+
+    return TRUE;
+}
+
+struct KeyMap* buildOverlay(struct KeyMap* pBase, const KeyOverride* pOverrides, int numOverrides, OverlayInfo* pInfo) {
+    memset(pInfo, 0, sizeof(OverlayInfo));
+
+    OverlayPlan plan;
+    if (!planOverlay(pBase, pOverrides, numOverrides, &plan)) {
+        pInfo->overflow = TRUE;
+        return NULL;
+    }
+
+    // The block holds the KeyMap struct, the arrays that change, and the tables that change:
+    //
+    //      pOverlay -> +-----------------------+
+    //                  |           32B         |
+    //                  +-----------------------+
+    //                  |    Copied Arrays      |  <- ULONG maps first
+    //       pBuffer -> +-----------------------+
+    //                  | String & Dead Tables  |
+    //                  +-----------------------+
+    //
+    ULONG arraysSize = 0;
+    for (int a = 0; a < NUM_ARRAYS; a++) {
+        if (plan.copyArrays[a]) {
+            arraysSize += arraySizes[a];
+            pInfo->copiedArrays++;
+        }
+    }
+
+    pInfo->blockSize = sizeof(struct KeyMap) + arraysSize + plan.bufferSize;
+    struct KeyMap* pOverlay = AllocMem(pInfo->blockSize, MEMF_CLEAR | MEMF_PUBLIC);
+    if (pOverlay == NULL) {
+        return NULL;
+    }
+
+    // Start with the arrays of the base keymap and replace the ones that change by copies.
+    *pOverlay = *pBase;
+
+    UBYTE* pNext = (UBYTE*)(pOverlay + 1);
+    for (int a = 0; a < NUM_ARRAYS; a++) {
+        if (plan.copyArrays[a]) {
+            UBYTE** ppArray = arrayField(pOverlay, a);
+            memcpy(pNext, *ppArray, arraySizes[a]);
+            *ppArray = pNext;
+            pNext += arraySizes[a];
+        }
+    }
+
+    // (Only the copied capsable/repeatable arrays are written, as the base keymap may be
+    // read-only.)
+    storeKeySet(&plan.capsable,
+        plan.copyArrays[ARRAY_LO_CAPS] ? pOverlay->km_LoCapsable : NULL,
+        plan.copyArrays[ARRAY_HI_CAPS] ? pOverlay->km_HiCapsable : NULL);
+    storeKeySet(&plan.repeatable,
+        plan.copyArrays[ARRAY_LO_REPS] ? pOverlay->km_LoRepeatable : NULL,
+        plan.copyArrays[ARRAY_HI_REPS] ? pOverlay->km_HiRepeatable : NULL);
+
+    UBYTE* const pBuffer = pNext;
+
+    CopyContext copy = { 0 };
+    copy.pBuffer = pBuffer;
+    copy.deadCharTableBytes = plan.deadCharTableBytes;
+
+    for (UBYTE rawKey = 0; rawKey < NUM_KEYS; rawKey++) {
+        const KeyOverride* pOverride = findOverride(&plan, rawKey);
+        ULONG* pKmEntry = entryAddress(pOverlay, rawKey);
+        const UBYTE mode = plan.tableModes[rawKey];
+
+        if (pOverride != NULL) {
+            *typeAddress(pOverlay, rawKey) = pOverride->kmType;
+            *pKmEntry = pOverride->kmEntry;
+        } else if (mode == TABLE_NONE && isTableType(*typeAddress(pOverlay, rawKey))) {
+            pInfo->sharedTables++;
+        }
+
+        if (mode == TABLE_NONE) {
+            continue;
+        }
+
+        // Copy the table the kmEntry currently points to (the override's or the base's).
+        const UBYTE kmType = *typeAddress(pOverlay, rawKey);
+        const UBYTE* pSrcTable = (const UBYTE*) *pKmEntry;
+        pInfo->copiedTables++;
+
+        if (mode == TABLE_COPY) {
+            copy.pKmEntry = pKmEntry;
+            if (kmType & KCF_STRING) {
+                CopyVisitor.pfnString(&copy, rawKey, calcNumEntries(kmType), pSrcTable);
+            } else {
+                CopyVisitor.pfnDead(&copy, rawKey, calcNumEntries(kmType), pSrcTable);
+            }
+        } else {
+            *pKmEntry = (ULONG) copy.pBuffer;
+            copyPaddedDead(copy.pBuffer, pSrcTable, calcNumEntries(kmType), plan.srcDeadBytes[rawKey], plan.deadCharTableBytes);
+            copy.pBuffer += calcOverlayTableBytes(TABLE_PAD, kmType, pSrcTable, plan.deadCharTableBytes);
+        }
+    }
+
+    // Sanity check that the copied tables exactly fill the buffer.
+    assert(copy.pBuffer == pBuffer + plan.bufferSize);
+
+    return pOverlay;
+}
+
+void freeOverlay(struct KeyMap* pOverlay, const OverlayInfo* pInfo) {
+    FreeMem(pOverlay, pInfo->blockSize);
+}
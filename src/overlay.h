@@ -0,0 +1,45 @@
+#ifndef OVERLAY_H
+#define OVERLAY_H
+
+#include <exec/types.h>
+#include <proto/keymap.h>
+#include "patch.h"
+
+// The new definition of one key of an overlay.
+typedef struct {
+    UBYTE rawKey;
+    UBYTE kmType;
+    UBYTE flags;            // PKF_* bits (see patch.h)
+    UBYTE deadCharTableBytes;   // Size of each DPF_MOD table of a KCF_DEAD override (that of the keymap it was written for)
+    ULONG kmEntry;          // kmEntry for normal/KCF_NOP keys, else the address of the string/dead table
+} KeyOverride;
+
+typedef struct {
+    ULONG blockSize;        // Size of the block allocated for the overlay (see freeOverlay())
+    UWORD copiedTables;     // String/dead tables copied into the block
+    UWORD sharedTables;     // String/dead tables shared with the base keymap
+    UBYTE copiedArrays;     // Fixed-size arrays (of the 8 the KeyMap points to) copied into the block
+    BOOL overflow;          // TRUE if a table cannot be laid out with 8-bit offsets (see layout.h)
+} OverlayInfo;
+
+// Builds a copy-on-write variant of 'pBase' in which the keys in 'pOverrides' (up to 255)
+// are replaced.  A later override of the same key wins.  Only what changes is allocated:
+//
+//  - The lo/hi map and type arrays are copied if an override is in that half of the keymap,
+//    and the capsable/repeatable arrays if an override changes one of their bits.  The
+//    other arrays are shared with 'pBase'.
+//  - The string/dead tables of the overrides are copied (compacted, as by the CopyVisitor).
+//    Unchanged keys keep pointing to the tables of 'pBase'.
+//
+// The DPF_MOD tables of a KCF_DEAD override hold its 'deadCharTableBytes'.  If the
+// overlay's dead keys need larger tables than a side provides, the shorter DPF_MOD tables
+// (including those of unchanged base keys) are copied and padded (see copyPaddedDead()).
+//
+// 'pBase' must outlive the overlay.  Returns NULL if the allocation fails, or if a table
+// cannot be laid out with 8-bit offsets (in which case 'pInfo->overflow' is set).
+struct KeyMap* buildOverlay(struct KeyMap* pBase, const KeyOverride* pOverrides, int numOverrides, OverlayInfo* pInfo);
+
+// Releases an overlay returned by buildOverlay().  (The base keymap is not affected.)
+void freeOverlay(struct KeyMap* pOverlay, const OverlayInfo* pInfo);
+
+#endif
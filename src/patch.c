@@ -0,0 +1,361 @@
+#include "patch.h"
+#include "copykeymap.h"
+#include "visit.h"
+#include "visitors/copy.h"
+#include "visitors/measure.h"
+#include "keyset.h"
+#include <proto/exec.h>
+#include <assert.h>
+#include <string.h>
+#include "keymaptable.h"
+
+#define NUM_KEYS (LO_MAP_LENGTH + HI_MAP_LENGTH)
+
+// Largest possible string/dead table: 8 descriptors followed by 8 strings or dead tables
+// of up to 255 bytes each.
+#define MAX_TABLE_BYTES ((8 << 1) + 8 * 255)
+
+static BOOL isTableType(UBYTE kmType) {
+    return !(kmType & KCF_NOP) && (kmType & (KCF_STRING | KCF_DEAD));
+}
+
+static UBYTE* typeAddress(const struct KeyMap* pKeyMap, UBYTE rawKey) {
+    return rawKey < LO_MAP_LENGTH
+        ? &pKeyMap->km_LoKeyMapTypes[rawKey]
+        : &pKeyMap->km_HiKeyMapTypes[rawKey - LO_MAP_LENGTH];
+}
+
+static ULONG* entryAddress(const struct KeyMap* pKeyMap, UBYTE rawKey) {
+    return rawKey < LO_MAP_LENGTH
+        ? &pKeyMap->km_LoKeyMap[rawKey]
+        : &pKeyMap->km_HiKeyMap[rawKey - LO_MAP_LENGTH];
+}
+
+static UBYTE getFlags(const KeySet* pCapsable, const KeySet* pRepeatable, UBYTE rawKey) {
+    return (hasKey(pCapsable, rawKey) ? PKF_CAPSABLE : 0)
+        | (hasKey(pRepeatable, rawKey) ? PKF_REPEATABLE : 0);
+}
+
+static void setFlags(struct KeyMap* pKeyMap, UBYTE rawKey, UBYTE flags) {
+    setKeyBit(pKeyMap->km_LoCapsable, pKeyMap->km_HiCapsable, rawKey, (flags & PKF_CAPSABLE) != 0);
+    setKeyBit(pKeyMap->km_LoRepeatable, pKeyMap->km_HiRepeatable, rawKey, (flags & PKF_REPEATABLE) != 0);
+}
+
+// Writes the compact form of a string/dead table to 'pOut' (using the CopyVisitor) and
+// returns its size.
+static UWORD serializeTable(UBYTE kmType, const UBYTE* pSrcTable, UBYTE deadCharTableBytes, UBYTE* pOut) {
+    ULONG kmEntry;
+    CopyContext copy = { 0 };
+    copy.pKmEntry = &kmEntry;
+    copy.pBuffer = pOut;
+    copy.deadCharTableBytes = deadCharTableBytes;
+
+    if (kmType & KCF_STRING) {
+        CopyVisitor.pfnString(&copy, /* rawKey: */ 0, calcNumEntries(kmType), pSrcTable);
+    } else {
+        CopyVisitor.pfnDead(&copy, /* rawKey: */ 0, calcNumEntries(kmType), pSrcTable);
+    }
+
+    return (UWORD)(copy.pBuffer - pOut);
+}
+
+// Returns the size of a compact string/dead table (as laid out by the CopyVisitor), and
+// the number of its DPF_MOD entries in '*pModEntries'.
+static UWORD calcTableLength(UBYTE kmType, const UBYTE* pTable, UBYTE deadCharTableBytes, UBYTE* pModEntries) {
+    const int numEntries = calcNumEntries(kmType);
+    UWORD length = numEntries << 1;
+    *pModEntries = 0;
+
+    if (kmType & KCF_STRING) {
+        StringLayout layout;
+        planStringLayout(pTable, numEntries, &layout);
+        return length + layout.charBytes;
+    }
+
+    for (int n = 0; n < numEntries; n++) {
+        if (*(pTable + (n << 1)) == DPF_MOD) {
+            (*pModEntries)++;
+        }
+    }
+
+    return length + calcModTableBytes(pTable, numEntries, deadCharTableBytes);
+}
+
+// Compares 'rawKey' in both keymaps ('flagsChanged' if its capsable/repeatable bits differ).
+// If it differs, returns TRUE and sets '*pTableLength' to the size of the new key's compact
+// string/dead table (0 if none).  'pScratch' must hold 2 * MAX_TABLE_BYTES.
+static BOOL diffKey(struct KeyMap* pOld, UBYTE oldDeadBytes, struct KeyMap* pNew, UBYTE newDeadBytes, UBYTE rawKey, BOOL flagsChanged, UBYTE* pScratch, UWORD* pTableLength) {
+    const UBYTE oldType = *typeAddress(pOld, rawKey);
+    const UBYTE newType = *typeAddress(pNew, rawKey);
+    const ULONG oldEntry = *entryAddress(pOld, rawKey);
+    const ULONG newEntry = *entryAddress(pNew, rawKey);
+
+    *pTableLength = 0;
+
+    if (!isTableType(newType)) {
+        return oldType != newType
+            || oldEntry != newEntry
+            || flagsChanged;
+    }
+
+    *pTableLength = serializeTable(newType, (const UBYTE*) newEntry, newDeadBytes, pScratch);
+
+    if (oldType != newType || flagsChanged) {
+        return TRUE;
+    }
+
+    UBYTE* pOldTable = pScratch + MAX_TABLE_BYTES;
+    const UWORD oldLength = serializeTable(oldType, (const UBYTE*) oldEntry, oldDeadBytes, pOldTable);
+    return oldLength != *pTableLength || memcmp(pOldTable, pScratch, oldLength) != 0;
+}
+
+KeymapPatch* diffKeymaps(struct KeyMap* pOld, struct KeyMap* pNew) {
+    // The DPF_MOD table size of each keymap is needed to compare dead tables.  (Only the
+    // dead keys of 'pOld' need to be measured.)
+    const UBYTE oldDeadBytes = measureDeadCharTableBytes(pOld);
+    Sizes newSizes = { 0 };
+    visitMeasure(pNew, &newSizes);
+
+    // The patch holds compact copies of the new tables, so they must fit 8-bit offsets.
+    finishMeasure(&newSizes, pNew);
+    if (newSizes.overflowTables > 0) {
+        return NULL;
+    }
+
+    UBYTE* pScratch = AllocMem(MAX_TABLE_BYTES << 1, MEMF_ANY);
+    if (pScratch == NULL) {
+        return NULL;
+    }
+
+    // The keys whose capsable/repeatable bits differ, a few words at a time.
+    KeySet newCapsable;
+    KeySet newRepeatable;
+    loadCapsable(&newCapsable, pNew);
+    loadRepeatable(&newRepeatable, pNew);
+
+    KeySet flagChanges;
+    KeySet repeatChanges;
+    loadCapsable(&flagChanges, pOld);
+    loadRepeatable(&repeatChanges, pOld);
+    xorKeys(&flagChanges, &flagChanges, &newCapsable);
+    xorKeys(&repeatChanges, &repeatChanges, &newRepeatable);
+    unionKeys(&flagChanges, &flagChanges, &repeatChanges);
+
+    // First pass: find the changed keys and the size of their tables.
+    KeySet changed;
+    UWORD tableLengths[NUM_KEYS];
+    ULONG dataSize = 0;
+    clearKeySet(&changed);
+
+    for (UBYTE rawKey = 0; rawKey < NUM_KEYS; rawKey++) {
+        if (diffKey(pOld, oldDeadBytes, pNew, newSizes.deadCharTableBytes, rawKey, hasKey(&flagChanges, rawKey), pScratch, &tableLengths[rawKey])) {
+            addKey(&changed, rawKey);
+            dataSize += tableLengths[rawKey];
+        }
+    }
+
+    const UWORD numKeys = countKeys(&changed);
+
+    FreeMem(pScratch, MAX_TABLE_BYTES << 1);
+
+    // Second pass: record the changed keys in a single block.
+    //
+    //      pPatch -> +-----------------------+
+    //                |      KeymapPatch      |
+    //       pKeys -> +-----------------------+
+    //                | numKeys * KeyPatch    |
+    //       pData -> +-----------------------+
+    //                | String & Dead Tables  |
+    //                +-----------------------+
+    //
+    const ULONG blockSize = sizeof(KeymapPatch) + numKeys * sizeof(KeyPatch) + dataSize;
+    KeymapPatch* pPatch = AllocMem(blockSize, MEMF_CLEAR | MEMF_PUBLIC);
+    if (pPatch == NULL) {
+        return NULL;
+    }
+
+    pPatch->blockSize = blockSize;
+    pPatch->pKeys = (KeyPatch*)(pPatch + 1);
+    pPatch->pData = (UBYTE*)(pPatch->pKeys + numKeys);
+    pPatch->numKeys = numKeys;
+    pPatch->deadCharTableBytes = newSizes.deadCharTableBytes;
+
+    KeyPatch* pKey = pPatch->pKeys;
+    UBYTE* pData = pPatch->pData;
+
+    for (int rawKey = nextKey(&changed, -1); rawKey >= 0; rawKey = nextKey(&changed, rawKey)) {
+        pKey->rawKey = rawKey;
+        pKey->kmType = *typeAddress(pNew, rawKey);
+        pKey->flags = getFlags(&newCapsable, &newRepeatable, rawKey);
+        pKey->tableLength = tableLengths[rawKey];
+
+        if (pKey->tableLength > 0) {
+            pKey->kmEntry = pData - pPatch->pData;
+            pData += serializeTable(pKey->kmType, (const UBYTE*) *entryAddress(pNew, rawKey), newSizes.deadCharTableBytes, pData);
+        } else {
+            pKey->kmEntry = *entryAddress(pNew, rawKey);
+        }
+
+        pKey++;
+    }
+
+    assert(pData == pPatch->pData + dataSize);
+    return pPatch;
+}
+
+void freePatch(KeymapPatch* pPatch) {
+    FreeMem(pPatch, pPatch->blockSize);
+}
+
+typedef struct {
+    UBYTE rawKey;
+    ULONG kmEntry;
+} SharedSearch;
+
+static BOOL findSharedNormal(void* pContext, UBYTE rawKey, UBYTE kmType, ULONG kmEntry) { return VISIT_CONTINUE; }
+
+static BOOL findSharedTable(void* pContext, UBYTE rawKey, int numEntries, const UBYTE* pTable) {
+    const SharedSearch* pSearch = pContext;
+    return rawKey == pSearch->rawKey || (ULONG) pTable != pSearch->kmEntry;
+}
+
+static const Visitor SharedTableVisitor = {
+    findSharedNormal,
+    findSharedTable,
+    findSharedTable,
+    findSharedNormal,
+};
+
+// Returns TRUE if the string/dead table of 'rawKey' in 'pCopy' is also used by another key
+// (i.e., 'pCopy' was deduplicated).  Only string/dead keys are visited, and the search stops
+// at the first other key using the table.
+static BOOL isShared(struct KeyMap* pCopy, UBYTE rawKey) {
+    KeyFilter tableKeys;
+    initKeyFilter(&tableKeys, VISIT_STRING | VISIT_DEAD);
+    selectKeys(&tableKeys, 0, NUM_KEYS - 1);
+
+    SharedSearch search;
+    search.rawKey = rawKey;
+    search.kmEntry = *entryAddress(pCopy, rawKey);
+
+    return !visitKeys(pCopy, &tableKeys, &search, SharedTableVisitor);
+}
+
+// Returns TRUE if every table in 'pPatch' fits in the space of the table it replaces.
+// (If the copy's 'deadCharTableBytes' is larger, each DPF_MOD table is padded to it.)
+static BOOL fitsInPlace(struct KeyMap* pCopy, const Sizes* pSizes, const KeymapPatch* pPatch) {
+    if (pPatch->deadCharTableBytes > pSizes->deadCharTableBytes) {
+        return FALSE;
+    }
+
+    const UBYTE padding = pSizes->deadCharTableBytes - pPatch->deadCharTableBytes;
+
+    for (UWORD i = 0; i < pPatch->numKeys; i++) {
+        const KeyPatch* pKey = &pPatch->pKeys[i];
+        if (pKey->tableLength == 0) {
+            continue;
+        }
+
+        const UBYTE oldType = *typeAddress(pCopy, pKey->rawKey);
+        if (!isTableType(oldType) || isShared(pCopy, pKey->rawKey)) {
+            return FALSE;
+        }
+
+        UBYTE modEntries;
+        const UWORD available = calcTableLength(oldType, (const UBYTE*) *entryAddress(pCopy, pKey->rawKey), pSizes->deadCharTableBytes, &modEntries);
+        calcTableLength(pKey->kmType, pPatch->pData + pKey->kmEntry, pPatch->deadCharTableBytes, &modEntries);
+
+        const UWORD required = padding == 0
+            ? pKey->tableLength
+            : (calcNumEntries(pKey->kmType) << 1) + modEntries * pSizes->deadCharTableBytes;
+
+        if (required > available) {
+            return FALSE;
+        }
+
+        // Padding the DPF_MOD tables also moves them further from the descriptor.
+        if (padding != 0 && modEntries > 0
+                && (calcNumEntries(pKey->kmType) << 1) + (modEntries - 1) * pSizes->deadCharTableBytes > MAX_TABLE_OFFSET) {
+            return FALSE;
+        }
+    }
+
+    return TRUE;
+}
+
+static void patchInPlace(struct KeyMap* pCopy, const Sizes* pSizes, const KeymapPatch* pPatch) {
+    for (UWORD i = 0; i < pPatch->numKeys; i++) {
+        const KeyPatch* pKey = &pPatch->pKeys[i];
+        ULONG* pKmEntry = entryAddress(pCopy, pKey->rawKey);
+
+        if (pKey->tableLength > 0) {
+            UBYTE* pDest = (UBYTE*) *pKmEntry;
+            const UBYTE* pSrc = pPatch->pData + pKey->kmEntry;
+
+            if ((pKey->kmType & KCF_STRING) || pPatch->deadCharTableBytes == pSizes->deadCharTableBytes) {
+                memcpy(pDest, pSrc, pKey->tableLength);
+            } else {
+                copyPaddedDead(pDest, pSrc, calcNumEntries(pKey->kmType), pPatch->deadCharTableBytes, pSizes->deadCharTableBytes);
+            }
+        } else {
+            *pKmEntry = pKey->kmEntry;
+        }
+
+        *typeAddress(pCopy, pKey->rawKey) = pKey->kmType;
+        setFlags(pCopy, pKey->rawKey, pKey->flags);
+    }
+}
+
+// Makes a new copy of 'pCopy' with 'pPatch' applied.  The patched keymap is assembled as an
+// overlay (new fixed-size tables whose patched kmEntries point into the patch data) and
+// copied with copyKeymap().
+static struct KeyMap* patchCopy(struct KeyMap* pCopy, const KeymapPatch* pPatch, Sizes* pNewSizes) {
+    KeyMapTables* pTables = AllocMem(sizeof(KeyMapTables), MEMF_ANY);
+    if (pTables == NULL) {
+        return NULL;
+    }
+
+    struct KeyMap overlay;
+    overlay.km_LoKeyMapTypes   = pTables->loKeyMapTypes;
+    overlay.km_LoKeyMap        = pTables->loKeyMap;
+    overlay.km_LoCapsable      = pTables->loCapsable;
+    overlay.km_LoRepeatable    = pTables->loRepeatable;
+    overlay.km_HiKeyMapTypes   = pTables->hiKeyMapTypes;
+    overlay.km_HiKeyMap        = pTables->hiKeyMap;
+    overlay.km_HiCapsable      = pTables->hiCapsable;
+    overlay.km_HiRepeatable    = pTables->hiRepeatable;
+
+    memcpy(overlay.km_LoKeyMapTypes, pCopy->km_LoKeyMapTypes, LO_TYPE_LENGTH);
+    memcpy(overlay.km_LoKeyMap,      pCopy->km_LoKeyMap,      LO_MAP_LENGTH * sizeof(ULONG));
+    memcpy(overlay.km_LoCapsable,    pCopy->km_LoCapsable,    LO_CAPS_BYTE_SIZE);
+    memcpy(overlay.km_LoRepeatable,  pCopy->km_LoRepeatable,  LO_REPS_BYTE_SIZE);
+    memcpy(overlay.km_HiKeyMapTypes, pCopy->km_HiKeyMapTypes, HI_TYPE_LENGTH);
+    memcpy(overlay.km_HiKeyMap,      pCopy->km_HiKeyMap,      HI_MAP_LENGTH * sizeof(ULONG));
+    memcpy(overlay.km_HiCapsable,    pCopy->km_HiCapsable,    HI_CAPS_BYTE_SIZE);
+    memcpy(overlay.km_HiRepeatable,  pCopy->km_HiRepeatable,  HI_REPS_BYTE_SIZE);
+
+    for (UWORD i = 0; i < pPatch->numKeys; i++) {
+        const KeyPatch* pKey = &pPatch->pKeys[i];
+
+        *entryAddress(&overlay, pKey->rawKey) = pKey->tableLength > 0
+            ? (ULONG)(pPatch->pData + pKey->kmEntry)
+            : pKey->kmEntry;
+        *typeAddress(&overlay, pKey->rawKey) = pKey->kmType;
+        setFlags(&overlay, pKey->rawKey, pKey->flags);
+    }
+
+    struct KeyMap* pNewCopy = copyKeymap(&overlay, pNewSizes);
+
+    FreeMem(pTables, sizeof(KeyMapTables));
+    return pNewCopy;
+}
+
+struct KeyMap* applyPatch(struct KeyMap* pCopy, const Sizes* pSizes, const KeymapPatch* pPatch, Sizes* pNewSizes) {
+    if (fitsInPlace(pCopy, pSizes, pPatch)) {
+        patchInPlace(pCopy, pSizes, pPatch);
+        *pNewSizes = *pSizes;
+        return pCopy;
+    }
+
+    return patchCopy(pCopy, pPatch, pNewSizes);
+}
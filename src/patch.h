@@ -0,0 +1,53 @@
+#ifndef PATCH_H
+#define PATCH_H
+
+#include <exec/types.h>
+#include <proto/keymap.h>
+#include "visitors/measure.h"
+
+// KeyPatch flags
+#define PKF_CAPSABLE    0x01
+#define PKF_REPEATABLE  0x02
+
+// The new definition of one key.  String/dead tables are stored in the patch data in the
+// same compact form the CopyVisitor produces (offsets relative to the table start).
+typedef struct {
+    UBYTE rawKey;
+    UBYTE kmType;
+    UBYTE flags;            // PKF_* bits
+    UBYTE reserved;
+    UWORD tableLength;      // Size of the string/dead table in the patch data (0 for other keys)
+    ULONG kmEntry;          // kmEntry for normal/KCF_NOP keys, else offset of the table in the patch data
+} KeyPatch;
+
+// A compact description of the keys that differ between two keymaps, held in a single
+// block (the KeyPatch array is followed by the table data).
+typedef struct {
+    ULONG blockSize;
+    KeyPatch* pKeys;
+    UBYTE* pData;
+    UWORD numKeys;
+    UBYTE deadCharTableBytes;   // Size of each DPF_MOD table in the new keymap
+} KeymapPatch;
+
+// Compares 'pOld' and 'pNew' key by key (type, kmEntry, string/dead table contents, and
+// capsable/repeatable bits) and returns a patch that turns 'pOld' into 'pNew'.  Returns
+// NULL if the allocation fails, or if a table of 'pNew' cannot be laid out with 8-bit
+// offsets (see layout.h).
+KeymapPatch* diffKeymaps(struct KeyMap* pOld, struct KeyMap* pNew);
+
+void freePatch(KeymapPatch* pPatch);
+
+// Applies 'pPatch' to 'pCopy', a copy of the keymap the patch was created from (see
+// copyKeymap()) described by 'pSizes':
+//
+//  - If every patched string/dead table fits in the space of the table it replaces, 'pCopy'
+//    is updated in place and returned, and '*pNewSizes' is set to '*pSizes'.
+//  - Otherwise a new copy is returned (described by '*pNewSizes'), and 'pCopy' is left
+//    unchanged so that it can be freed once it is no longer in use.
+//
+// Returns NULL if a new copy is needed and the allocation fails.  (A patch never needs a
+// layout that does not fit, as diffKeymaps() rejects those tables.)
+struct KeyMap* applyPatch(struct KeyMap* pCopy, const Sizes* pSizes, const KeymapPatch* pPatch, Sizes* pNewSizes);
+
+#endif
@@ -0,0 +1,96 @@
+#include "translate.h"
+#include <devices/inputevent.h>
+#include <devices/keymap.h>
+#include <string.h>
+
+#define QUAL_MASK 0x3F      // The IEQUALIFIER_* bits that affect translation
+
+void resetTranslator(Translator* pTranslator) {
+    pTranslator->deadIndex = 0;
+    pTranslator->numDead = 0;
+}
+
+void initTranslator(Translator* pTranslator, const FlatTable* pTable) {
+    pTranslator->pTable = pTable;
+    resetTranslator(pTranslator);
+
+    // Precompute the mapping from IEQUALIFIER_* bits to FQ_* bits, so that each event only
+    // needs a single lookup.
+    for (UBYTE q = 0; q <= QUAL_MASK; q++) {
+        UBYTE quals = 0;
+
+        if (q & (IEQUALIFIER_LSHIFT | IEQUALIFIER_RSHIFT)) { quals |= FQ_SHIFT; }
+        if (q & (IEQUALIFIER_LALT | IEQUALIFIER_RALT))     { quals |= FQ_ALT; }
+        if (q & IEQUALIFIER_CONTROL)                       { quals |= FQ_CONTROL; }
+        if (q & IEQUALIFIER_CAPSLOCK)                      { quals |= FQ_CAPSLOCK; }
+
+        pTranslator->quals[q] = quals;
+    }
+}
+
+// Updates the pending dead key state for a DPF_DEAD key with dead key 'value'.
+static void pressDead(Translator* pTranslator, UBYTE value) {
+    const UBYTE index = value & DP_2DINDEXMASK;
+    const UBYTE factor = value >> DP_2DFACSHIFT;
+
+    if (pTranslator->numDead == 1 && factor != 0) {
+        // Double dead: the second key selects a row of 'factor' entries, the first key the
+        // column.
+        pTranslator->deadIndex = (UBYTE)(index * factor + pTranslator->deadIndex);
+        pTranslator->numDead = 2;
+    } else {
+        pTranslator->deadIndex = index;
+        pTranslator->numDead = 1;
+    }
+}
+
+ULONG translateEvents(Translator* pTranslator, const KeyEvent* pEvents, ULONG numEvents, UBYTE* pOut, ULONG outSize, ULONG* pConsumed) {
+    const FlatTable* pTable = pTranslator->pTable;
+    const UBYTE* pBytes = pTable->pBytes;
+    const UBYTE deadCharTableBytes = pTable->deadCharTableBytes;
+    UBYTE* pNext = pOut;
+    UBYTE* pStop = pOut + outSize;
+    ULONG n = 0;
+
+    for (; n < numEvents; n++) {
+        const UWORD code = pEvents[n].code;
+        if (code >= FLAT_KEYS) {
+            continue;       // Key release (IECODE_UP_PREFIX) or not a key
+        }
+
+        const FlatSlot* pSlot = FLAT_SLOT(pTable, code, pTranslator->quals[pEvents[n].qualifier & QUAL_MASK]);
+        const UBYTE* pSrc = pBytes + pSlot->offset;
+
+        if (pSlot->flags & FSF_DEAD) {
+            pressDead(pTranslator, *pSrc);
+            continue;
+        }
+
+        const UBYTE length = pSlot->length;
+        if (length == 0) {
+            continue;
+        }
+        if ((ULONG)(pStop - pNext) < length) {
+            break;
+        }
+
+        if (pSlot->flags & FSF_MOD) {
+            // Index the DPF_MOD table with the pending dead key(s).  Combinations beyond the
+            // end of the table produce the unprefixed char.
+            const UBYTE index = pTranslator->deadIndex < deadCharTableBytes
+                ? pTranslator->deadIndex
+                : 0;
+            *(pNext++) = pSrc[index];
+        } else if (length == 1) {
+            *(pNext++) = *pSrc;
+        } else {
+            memcpy(pNext, pSrc, length);
+            pNext += length;
+        }
+
+        resetTranslator(pTranslator);
+    }
+
+    *pConsumed = n;
+    return (ULONG)(pNext - pOut);
+}
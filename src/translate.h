@@ -0,0 +1,39 @@
+#ifndef TRANSLATE_H
+#define TRANSLATE_H
+
+#include <exec/types.h>
+#include "visitors/flatten.h"
+
+// A recorded raw key event, as found in an InputEvent.
+typedef struct {
+    UWORD code;         // Raw key code (IECODE_UP_PREFIX set for key releases)
+    UWORD qualifier;    // IEQUALIFIER_* bits
+} KeyEvent;
+
+// Translates streams of raw key events to chars using a FlatTable.  Dead key state is
+// carried across events (and across calls to translateEvents()):
+//
+//  - A DPF_DEAD key produces no output and becomes the pending dead key.
+//  - If the pending dead key is followed by a double dead key (one whose DPF_DEAD value has
+//    a non-zero DP_2DFACSHIFT factor), both are pending.
+//  - A DPF_MOD key produces the char of its dead table selected by the pending dead key(s),
+//    and the pending state is cleared.  Any other key that produces output also clears it.
+typedef struct {
+    const FlatTable* pTable;
+    UBYTE deadIndex;            // Dead table index selected by the pending dead key(s) (0 if none)
+    UBYTE numDead;              // Number of pending dead keys (0-2)
+    UBYTE quals[0x40];          // FQ_* bits for each combination of the low IEQUALIFIER_* bits
+} Translator;
+
+void initTranslator(Translator* pTranslator, const FlatTable* pTable);
+
+// Clears any pending dead keys.
+void resetTranslator(Translator* pTranslator);
+
+// Translates up to 'numEvents' events from 'pEvents', appending their output to 'pOut'.
+// Stops early (before the event whose output does not fit) if 'outSize' bytes would be
+// exceeded.  Sets '*pConsumed' to the number of events processed and returns the number
+// of bytes written.  Key releases and codes outside the keymap produce no output.
+ULONG translateEvents(Translator* pTranslator, const KeyEvent* pEvents, ULONG numEvents, UBYTE* pOut, ULONG outSize, ULONG* pConsumed);
+
+#endif
@@ -7,63 +7,129 @@
 //
 // (Each key has one entry for a key press with no modifiers.  Each supported shift/alt/control
 // modifier doubles the number of entries for a maximum of 8 entries.)
+const UBYTE numEntriesTable[8] = {
+    1,  // KC_NOQUAL
+    2,  // KCF_SHIFT
+    2,  // KCF_ALT
+    4,  // KCF_SHIFT | KCF_ALT
+    2,  // KCF_CONTROL
+    4,  // KCF_CONTROL | KCF_SHIFT
+    4,  // KCF_CONTROL | KCF_ALT
+    8,  // KC_VANILLA
+};
+
 UBYTE calcNumEntries(UBYTE kmType) {
-    UBYTE numEntries = 1;
-    if (kmType & KCF_SHIFT)   { numEntries <<= 1; }
-    if (kmType & KCF_ALT)     { numEntries <<= 1; }
-    if (kmType & KCF_CONTROL) { numEntries <<= 1; }
-    return numEntries;
+    return numEntriesTable[kmType & KC_VANILLA];
+}
+
+// The VISIT_* type of a key, indexed by kmType >> 5.
+static const UBYTE visitTypes[8] = {
+    VISIT_NORMAL,   // 0
+    VISIT_DEAD,     // KCF_DEAD
+    VISIT_STRING,   // KCF_STRING
+    VISIT_NOP,      // KCF_NOP (with any other bits)
+    VISIT_NOP,
+    VISIT_NOP,
+    VISIT_NOP,
+    VISIT_NOP,
+};
+
+static BOOL visitKey(void* pContext, UBYTE rawKey, UBYTE type, ULONG kmEntry, const Visitor* pVisitor) {
+    switch (type >> 5) {
+        case 0:
+            return pVisitor->pfnNormal(pContext, rawKey, type, kmEntry);
+        case 1:
+            assert(type & KCF_DEAD);
+            return pVisitor->pfnDead(pContext, rawKey, calcNumEntries(type), (UBYTE*) kmEntry);
+        case 2:
+            assert(type & KCF_STRING);
+            return pVisitor->pfnString(pContext, rawKey, calcNumEntries(type), (UBYTE*) kmEntry);
+        default:
+            assert(type == KCF_NOP);
+            return pVisitor->pfnNop(pContext, rawKey, type, kmEntry);
+    }
 }
 
-void visitTable(void* pContext, UBYTE rawKey, UBYTE* pKmType, ULONG* pKmEntry, int mapSize, Visitor visitor) {
+static BOOL visitTable(void* pContext, UBYTE rawKey, UBYTE* pKmType, ULONG* pKmEntry, int mapSize, const Visitor* pVisitor) {
     const UBYTE* pKmStop = pKmType + mapSize;
 
     for (; pKmType < pKmStop; pKmType++, pKmEntry++, rawKey++) {
-        const UBYTE type = *pKmType;
-        
-        switch (type >> 5) {
-            case 0:
-                visitor.pfnNormal(pContext, rawKey, type, *pKmEntry);
-                break;
-            case 1:
-                assert(type & KCF_DEAD);
-                visitor.pfnDead(pContext, rawKey, calcNumEntries(type), (UBYTE*) *pKmEntry);
-                break;
-            case 2:
-                assert(type & KCF_STRING);
-                visitor.pfnString(pContext, rawKey, calcNumEntries(type), (UBYTE*) *pKmEntry);
-                break;
-            default:
-                assert(type == KCF_NOP);
-                visitor.pfnNop(pContext, rawKey, type, *pKmEntry);
-                break;
+        if (!visitKey(pContext, rawKey, *pKmType, *pKmEntry, pVisitor)) {
+            return VISIT_STOP;
         }
     }
+
+    return VISIT_CONTINUE;
 }
 
-void visitLo(struct KeyMap* pKeyMap, void* pContext, Visitor visitor) {
-    visitTable(
+BOOL visitLo(struct KeyMap* pKeyMap, void* pContext, Visitor visitor) {
+    return visitTable(
         pContext,
         /* rawKey: */ 0,
         pKeyMap->km_LoKeyMapTypes,
         pKeyMap->km_LoKeyMap,
         LO_MAP_LENGTH,
-        visitor
+        &visitor
     );
 }
 
-void visitHi(struct KeyMap* pKeyMap, void* pContext, Visitor visitor) {
-    visitTable(
+BOOL visitHi(struct KeyMap* pKeyMap, void* pContext, Visitor visitor) {
+    return visitTable(
         pContext,
         /* rawKey: */ 0x40,
         pKeyMap->km_HiKeyMapTypes,
         pKeyMap->km_HiKeyMap,
         HI_MAP_LENGTH,
-        visitor
+        &visitor
     );
 }
 
-void visit(struct KeyMap* pKeyMap, void* pContext, Visitor visitor) {
-    visitLo(pKeyMap, pContext, visitor);
-    visitHi(pKeyMap, pContext, visitor);
+BOOL visit(struct KeyMap* pKeyMap, void* pContext, Visitor visitor) {
+    return visitLo(pKeyMap, pContext, visitor)
+        && visitHi(pKeyMap, pContext, visitor);
+}
+
+void initKeyFilter(KeyFilter* pFilter, UBYTE types) {
+    clearKeySet(&pFilter->keys);
+    pFilter->types = types;
+}
+
+void selectKeys(KeyFilter* pFilter, UBYTE firstKey, UBYTE lastKey) {
+    addKeys(&pFilter->keys, firstKey, lastKey);
+}
+
+void deselectKeys(KeyFilter* pFilter, UBYTE firstKey, UBYTE lastKey) {
+    removeKeys(&pFilter->keys, firstKey, lastKey);
+}
+
+BOOL visitKeys(struct KeyMap* pKeyMap, const KeyFilter* pFilter, void* pContext, Visitor visitor) {
+    // The keys of each word of the set are found by shifting out one bit per key, rather than
+    // with nextKey(), whose de Bruijn lookup each key would otherwise wait on.
+    for (int w = 0; w < KEYSET_WORDS; w++) {
+        UBYTE rawKey = w << 5;
+
+        for (ULONG bits = pFilter->keys.words[w]; bits != 0; bits >>= 1, rawKey++) {
+            if (!(bits & 1)) {
+                continue;
+            }
+
+            const UBYTE type = rawKey < LO_MAP_LENGTH
+                ? pKeyMap->km_LoKeyMapTypes[rawKey]
+                : pKeyMap->km_HiKeyMapTypes[rawKey - LO_MAP_LENGTH];
+
+            if (!(visitTypes[type >> 5] & pFilter->types)) {
+                continue;
+            }
+
+            const ULONG kmEntry = rawKey < LO_MAP_LENGTH
+                ? pKeyMap->km_LoKeyMap[rawKey]
+                : pKeyMap->km_HiKeyMap[rawKey - LO_MAP_LENGTH];
+
+            if (!visitKey(pContext, rawKey, type, kmEntry, &visitor)) {
+                return VISIT_STOP;
+            }
+        }
+    }
+
+    return VISIT_CONTINUE;
 }
@@ -3,16 +3,115 @@
 
 #include <exec/types.h>
 #include <proto/keymap.h>
+#include "keymaptable.h"
+#include "keyset.h"
+
+// Handlers return VISIT_CONTINUE, or VISIT_STOP to end the traversal at the current key.
+#define VISIT_CONTINUE  TRUE
+#define VISIT_STOP      FALSE
 
 typedef struct {
-    void (*pfnNormal)(void* pContext, UBYTE rawKey, UBYTE kmType, ULONG kmEntry);
-    void (*pfnString)(void* pContext, UBYTE rawKey, int entryCount, const UBYTE* pStringDesc);
-    void (*pfnDead)(void* pContext, UBYTE rawKey, int entryCount, const UBYTE* pDeadDesc);
-    void (*pfnNop)(void* pContext, UBYTE rawKey, UBYTE kmType, ULONG kmEntry);
+    BOOL (*pfnNormal)(void* pContext, UBYTE rawKey, UBYTE kmType, ULONG kmEntry);
+    BOOL (*pfnString)(void* pContext, UBYTE rawKey, int entryCount, const UBYTE* pStringDesc);
+    BOOL (*pfnDead)(void* pContext, UBYTE rawKey, int entryCount, const UBYTE* pDeadDesc);
+    BOOL (*pfnNop)(void* pContext, UBYTE rawKey, UBYTE kmType, ULONG kmEntry);
 } Visitor;
 
-void visit(struct KeyMap* pKeyMap, void* pContext, Visitor visitor);
-void visitLo(struct KeyMap* pKeyMap, void* pContext, Visitor visitor);
-void visitHi(struct KeyMap* pKeyMap, void* pContext, Visitor visitor);
+// Returns the number of string/dead table entries for a key of the given kmType.
+UBYTE calcNumEntries(UBYTE kmType);
+
+// Number of string/dead table entries, indexed by the qualifier bits of a kmType
+// (kmType & KC_VANILLA).
+extern const UBYTE numEntriesTable[8];
+
+// Visits every key (visitLo()/visitHi(): every key of the lo/hi map) in raw key order.
+// Returns FALSE if a handler stopped the traversal.
+BOOL visit(struct KeyMap* pKeyMap, void* pContext, Visitor visitor);
+BOOL visitLo(struct KeyMap* pKeyMap, void* pContext, Visitor visitor);
+BOOL visitHi(struct KeyMap* pKeyMap, void* pContext, Visitor visitor);
+
+// KeyFilter types: the handlers a filtered traversal calls.
+#define VISIT_NORMAL    0x01
+#define VISIT_DEAD      0x02
+#define VISIT_STRING    0x04
+#define VISIT_NOP       0x08
+#define VISIT_ALL_TYPES 0x0F
+
+// Selects the keys visited by visitKeys(): the raw keys in 'keys' whose kmType is one of
+// 'types'.
+typedef struct {
+    KeySet keys;
+    UBYTE types;        // VISIT_* bits
+} KeyFilter;
+
+// Initializes 'pFilter' to select no keys of the given VISIT_* types.
+void initKeyFilter(KeyFilter* pFilter, UBYTE types);
+
+// Adds (or removes) the raw keys 'firstKey'..'lastKey' (inclusive) to 'pFilter'.
+void selectKeys(KeyFilter* pFilter, UBYTE firstKey, UBYTE lastKey);
+void deselectKeys(KeyFilter* pFilter, UBYTE firstKey, UBYTE lastKey);
+
+// Visits the keys selected by 'pFilter' in raw key order.  Only the selected entries are
+// read.  Returns FALSE if a handler stopped the traversal.
+BOOL visitKeys(struct KeyMap* pKeyMap, const KeyFilter* pFilter, void* pContext, Visitor visitor);
+
+// DEFINE_VISIT() generates a traversal specialized for one set of handlers:
+//
+//      BOOL name(struct KeyMap* pKeyMap, void* pContext);
+//      BOOL name##Lo(struct KeyMap* pKeyMap, void* pContext);
+//      BOOL name##Hi(struct KeyMap* pKeyMap, void* pContext);
+//
+// These behave like visit()/visitLo()/visitHi(), but call the handlers directly rather
+// than through a Visitor, which lets the compiler inline them into the loop (and drop the
+// VISIT_STOP tests of handlers that always continue).  The handlers must be defined before
+// DEFINE_VISIT() is used.
+#define DEFINE_VISIT(name, pfnNormal, pfnString, pfnDead, pfnNop)                         \
+    static BOOL name##Table(void* pContext, UBYTE rawKey, const UBYTE* pKmType,             \
+                            const ULONG* pKmEntry, int mapSize) {                           \
+        const UBYTE* pKmStop = pKmType + mapSize;                                           \
+                                                                                            \
+        for (; pKmType < pKmStop; pKmType++, pKmEntry++, rawKey++) {                        \
+            const UBYTE type = *pKmType;                                                    \
+            BOOL more;                                                                      \
+                                                                                            \
+            if (type & KCF_NOP) {                                                           \
+                more = pfnNop(pContext, rawKey, type, *pKmEntry);                           \
+            } else if (type & KCF_STRING) {                                                 \
+                more = pfnString(pContext, rawKey, numEntriesTable[type & KC_VANILLA],      \
+                                 (const UBYTE*) *pKmEntry);                                 \
+            } else if (type & KCF_DEAD) {                                                   \
+                more = pfnDead(pContext, rawKey, numEntriesTable[type & KC_VANILLA],        \
+                               (const UBYTE*) *pKmEntry);                                   \
+            } else {                                                                        \
+                more = pfnNormal(pContext, rawKey, type, *pKmEntry);                        \
+            }                                                                               \
+                                                                                            \
+            if (!more) {                                                                    \
+                return VISIT_STOP;                                                          \
+            }                                                                               \
+        }                                                                                   \
+        return VISIT_CONTINUE;                                                              \
+    }                                                                                       \
+                                                                                            \
+    BOOL name##Lo(struct KeyMap* pKeyMap, void* pContext) {                                 \
+        return name##Table(pContext, /* rawKey: */ 0, pKeyMap->km_LoKeyMapTypes,            \
+                           pKeyMap->km_LoKeyMap, LO_MAP_LENGTH);                            \
+    }                                                                                       \
+                                                                                            \
+    BOOL name##Hi(struct KeyMap* pKeyMap, void* pContext) {                                 \
+        return name##Table(pContext, /* rawKey: */ 0x40, pKeyMap->km_HiKeyMapTypes,         \
+                           pKeyMap->km_HiKeyMap, HI_MAP_LENGTH);                            \
+    }                                                                                       \
+                                                                                            \
+    BOOL name(struct KeyMap* pKeyMap, void* pContext) {                                     \
+        return name##Lo(pKeyMap, pContext)                                                  \
+            && name##Hi(pKeyMap, pContext);                                                 \
+    }
+
+// Declares the functions generated by DEFINE_VISIT().
+#define DECLARE_VISIT(name)                                                                 \
+    BOOL name(struct KeyMap* pKeyMap, void* pContext);                                      \
+    BOOL name##Lo(struct KeyMap* pKeyMap, void* pContext);                                  \
+    BOOL name##Hi(struct KeyMap* pKeyMap, void* pContext);
 
 #endif
\ No newline at end of file
@@ -1,34 +1,70 @@
 #include "copy.h"
+#include "measure.h"
+#include "../copystats.h"
 #include <exec/types.h>
 #include <proto/keymap.h>
 #include <assert.h>
 #include <string.h>
 
 // 'Normal' kmEntries are copied as-is
-void copyNormal(void* pContext, UBYTE rawKey, UBYTE kmType, ULONG kmEntry) {
+BOOL copyNormal(void* pContext, UBYTE rawKey, UBYTE kmType, ULONG kmEntry) {
     CopyContext* pClone = pContext;
     *(pClone->pKmEntry++) = kmEntry;
+    STATS_ADD(normalKeys, 1);
+    return VISIT_CONTINUE;
 }
 
 // 'KCF_NOP' kmEntries are copied as-is.
-void copyNop(void* pContext, UBYTE rawKey, UBYTE kmType, ULONG kmEntry) {
+BOOL copyNop(void* pContext, UBYTE rawKey, UBYTE kmType, ULONG kmEntry) {
     CopyContext* pClone = pContext;
     *(pClone->pKmEntry++) = kmEntry;
+    STATS_ADD(nopKeys, 1);
+    return VISIT_CONTINUE;
+}
+
+// When deduplicating, returns the existing copy of a table with the same content as
+// 'pSrcTable' (writing its address to the kmEntry), or NULL if this is the first
+// occurrence.  In that case '*ppEntry' receives the entry to update once copied.
+static UBYTE* findCopy(CopyContext* pClone, BOOL isDead, int numEntries, const UBYTE* pSrcTable, InternEntry** ppEntry) {
+    *ppEntry = NULL;
+    if (pClone->pIntern == NULL) {
+        return NULL;
+    }
+
+    BOOL added;
+    InternEntry* pEntry = internTable(pClone->pIntern, isDead, numEntries, pSrcTable, &added);
+    if (pEntry->pDestTable != NULL) {
+        *(pClone->pKmEntry++) = (ULONG) pEntry->pDestTable;
+        STATS_ADD(sharedTables, 1);
+        return pEntry->pDestTable;
+    }
+
+    *ppEntry = pEntry;
+    return NULL;
 }
 
 // 'KCF_STRING' entries append a copy of the referenced string table to 'pBuffer'
 // and write the address to the kmEntry.
-void copyString(void* pContext, UBYTE rawKey, int numEntries, const UBYTE* pSrcTable) {
+BOOL copyString(void* pContext, UBYTE rawKey, int numEntries, const UBYTE* pSrcTable) {
     CopyContext* pClone = pContext;
+    STATS_ADD(stringKeys, 1);
+
+    InternEntry* pEntry;
+    if (findCopy(pClone, /* isDead: */ FALSE, numEntries, pSrcTable, &pEntry) != NULL) {
+        return VISIT_CONTINUE;
+    }
 
     // Remember the start of the src/dest string tables.  We'll need these for
     // computing the string offsets.
     const UBYTE* pSrcStart = pSrcTable;
     UBYTE* pDestTable = pClone->pBuffer;
-    const UBYTE* pDestStart = pDestTable;
+    UBYTE* const pDestStart = pDestTable;
 
     // Write the address of the string table to the kmEntry.
     *(pClone->pKmEntry++) = (ULONG) pDestStart;
+    if (pEntry != NULL) {
+        pEntry->pDestTable = pDestTable;
+    }
 
     // Bump 'pBuffer' to point to the beginning of the char data.  Entering the
     // loop, our pointers are arranged as follows:
@@ -39,25 +75,44 @@ void copyString(void* pContext, UBYTE rawKey, int numEntries, const UBYTE* pSrcT
     //        v                 v
     //        +-----------------+------------------------------+
     //        |     len/off     |           char data          |
-    //        | numEntries * 2B |           (Σ lens B)         |
+    //        | numEntries * 2B |     (layout.charBytes B)     |
     //        +-----------------+------------------------------+
     //
     // pSrcTable is advanced as we copy the string length and offsets.  pSrcStart is
-    // a const pointer used when calculating offsets into the char data.
+    // a const pointer used when calculating offsets into the char data.  The chars
+    // normally follow each other in entry order, but long strings may have been
+    // packed to fit their 8-bit offsets.  (See planStringLayout().)
+    StringLayout layout;
+    const BOOL planned = planStringLayout(pSrcTable, numEntries, &layout);
+    assert(planned);    // Tables that do not fit are rejected by finishMeasure()
+
     pClone->pBuffer += (numEntries << 1);
+    if (!layout.inOrder) {
+        memset(pClone->pBuffer, 0, layout.charBytes);
+    }
 
     for (int n = 0; n < numEntries; n++) {
         const UBYTE len = *(pDestTable++) = *(pSrcTable++);             // Copy length
-        UBYTE off = *(pDestTable++) = pClone->pBuffer - pDestStart;     // Compute offset
-        memcpy(pClone->pBuffer, pSrcStart + *(pSrcTable++), len);       // Copy bytes
-        pClone->pBuffer += len;
+        const UBYTE off = *(pDestTable++) = layout.offsets[n];          // Copy planned offset
+        memcpy(pDestStart + off, pSrcStart + *(pSrcTable++), len);           // Copy bytes
     }
+
+    pClone->pBuffer += layout.charBytes;
+    STATS_ADD(stringDescBytes, numEntries << 1);
+    STATS_ADD(stringCharBytes, layout.charBytes);
+    return VISIT_CONTINUE;
 }
 
 // 'KCF_DEAD' entries append a copy of the referenced dead table to 'pBuffer'
 // and write the address to the kmEntry.
-void copyDead(void* pContext, UBYTE rawKey, int numEntries, const UBYTE* pSrcTable) {
+BOOL copyDead(void* pContext, UBYTE rawKey, int numEntries, const UBYTE* pSrcTable) {
     CopyContext* pClone = pContext;
+    STATS_ADD(deadKeys, 1);
+
+    InternEntry* pEntry;
+    if (findCopy(pClone, /* isDead: */ TRUE, numEntries, pSrcTable, &pEntry) != NULL) {
+        return VISIT_CONTINUE;
+    }
 
     // Remember the start of the src/dest.  We'll need these for computing the
     // offsets to dead tables for DPF_MOD entries.
@@ -67,8 +122,11 @@ void copyDead(void* pContext, UBYTE rawKey, int numEntries, const UBYTE* pSrcTab
 
     // Write the address of the dead table to the kmEntry.
     *(pClone->pKmEntry++) = (ULONG) pDestStart;
+    if (pEntry != NULL) {
+        pEntry->pDestTable = pDestTable;
+    }
 
-    // Bump 'pBuffer' to point to the beginning of the char data.  Entering the
+    // Bump 'pBuffer' to point to the beginning of the dead tables.  Entering the
     // loop, our pointers are arranged as follows:
     //
     //    pSrcStart,
@@ -80,11 +138,23 @@ void copyDead(void* pContext, UBYTE rawKey, int numEntries, const UBYTE* pSrcTab
     //        | numEntries * 2B |                              |
     //        +-----------------+------------------------------+
     //
-    //
-    // pSrcTable is advanced as we copy the dead kind/value entries.  pSrcStart is
-    // a const pointer used when calculating offsets into the data tables.
+    // The DPF_MOD tables are copied as runs (see planDeadRuns()), so tables that share
+    // or overlap in the source are shared or overlap the same way in the copy.
     pClone->pBuffer += (numEntries << 1);
 
+    DeadRun runs[8];
+    UBYTE* pRunDest[8];
+    const int numRuns = planDeadRuns(pSrcTable, numEntries, pClone->deadCharTableBytes, runs);
+
+    for (int i = 0; i < numRuns; i++) {
+        const UWORD len = runs[i].end - runs[i].start;
+        pRunDest[i] = pClone->pBuffer;
+        memcpy(pClone->pBuffer, pSrcStart + runs[i].start, len);           // Copy run
+        pClone->pBuffer += len;
+        STATS_ADD(modTableBytes, len);
+    }
+    STATS_ADD(deadDescBytes, numEntries << 1);
+
     for (int n = 0; n < numEntries; n++) {
         const UBYTE kind = *(pDestTable++) = *(pSrcTable++);    // copy kind
 
@@ -95,13 +165,43 @@ void copyDead(void* pContext, UBYTE rawKey, int numEntries, const UBYTE* pSrcTab
             case DPF_DEAD:
                 *(pDestTable++) = *(pSrcTable++);               // copy index
                 break;
-            default:
+            default: {
                 assert(kind == DPF_MOD);
-                UBYTE off = *(pDestTable++) = pClone->pBuffer - pDestStart;     // Compute offset
-                const UBYTE len = pClone->deadCharTableBytes;
-                memcpy(pClone->pBuffer, pSrcStart + *(pSrcTable++), len);       // Copy table
-                pClone->pBuffer += len;
+                STATS_ADD(modEntries, 1);
+                const UBYTE srcOffset = *(pSrcTable++);
+
+                // Find the run containing the table and compute its offset in the copy.
+                // (There are no runs if the keymap has no DPF_DEAD keys.)
+                int i = 0;
+                while (i < numRuns && srcOffset >= runs[i].end) {
+                    i++;
+                }
+                *(pDestTable++) = i < numRuns
+                    ? (pRunDest[i] - pDestStart) + (srcOffset - runs[i].start)
+                    : pClone->pBuffer - pDestStart;
                 break;
+            }
+        }
+    }
+    return VISIT_CONTINUE;
+}
+
+void copyPaddedDead(UBYTE* pDest, const UBYTE* pSrc, int numEntries, UBYTE srcDeadBytes, UBYTE destDeadBytes) {
+    UBYTE* pNext = pDest + (numEntries << 1);
+
+    for (int n = 0; n < numEntries; n++) {
+        const UBYTE kind = pSrc[n << 1];
+        const UBYTE value = pSrc[(n << 1) + 1];
+
+        pDest[n << 1] = kind;
+
+        if (kind == DPF_MOD) {
+            pDest[(n << 1) + 1] = pNext - pDest;                    // Compute offset
+            memcpy(pNext, pSrc + value, srcDeadBytes);              // Copy table
+            memset(pNext + srcDeadBytes, 0, destDeadBytes - srcDeadBytes);
+            pNext += destDeadBytes;
+        } else {
+            pDest[(n << 1) + 1] = value;                            // Copy char/index
         }
     }
 }
@@ -112,3 +212,6 @@ const Visitor CopyVisitor = {
     copyDead,
     copyNop,
 };
+
+// Traversal specialized for the CopyVisitor (see DEFINE_VISIT)
+DEFINE_VISIT(visitCopy, copyNormal, copyString, copyDead, copyNop)
@@ -1,10 +1,25 @@
+#ifndef COPY_H
+#define COPY_H
+
 #include "../visit.h"
+#include "../intern.h"
 #include <proto/keymap.h>
 
 typedef struct {
     ULONG* pKmEntry;
     UBYTE* pBuffer;
     UBYTE deadCharTableBytes;
+    InternTable* pIntern;       // If not NULL, identical string/dead tables are shared (see finishMeasure())
 } CopyContext;
 
+// Copies a dead table to 'pDest', giving each DPF_MOD entry its own table padded from
+// 'srcDeadBytes' to 'destDeadBytes' with zeros.  (The padding is only indexed by dead keys
+// the source table was not sized for, which produce no char.)  The copy takes
+// (numEntries << 1) + (DPF_MOD entries) * destDeadBytes bytes.
+void copyPaddedDead(UBYTE* pDest, const UBYTE* pSrc, int numEntries, UBYTE srcDeadBytes, UBYTE destDeadBytes);
+
 extern const Visitor CopyVisitor;
+
+DECLARE_VISIT(visitCopy)
+
+#endif
@@ -0,0 +1,126 @@
+#include "fingerprint.h"
+#include "measure.h"
+#include "../keymaptable.h"
+#include <exec/types.h>
+#include <proto/keymap.h>
+#include <assert.h>
+
+// Same shift-add step as the InternTable (h * 33 + b), which avoids 32-bit multiplies on
+// the 68000.
+#define HASH_STEP(h, b) (((h) << 5) + (h) + (b))
+
+#define FINGERPRINT_SEED 5381
+
+// Hashes four bytes per step (the bytes may be unaligned), which shortens the dependency
+// chain of HASH_STEP()s for long strings.
+static ULONG hashBytes(ULONG hash, const UBYTE* pBytes, int length) {
+    const UBYTE* pStop = pBytes + (length & ~3);
+
+    for (; pBytes < pStop; pBytes += 4) {
+        const ULONG word = ((ULONG) pBytes[0] << 24) | ((ULONG) pBytes[1] << 16) | ((ULONG) pBytes[2] << 8) | pBytes[3];
+        hash = HASH_STEP(hash, word);
+    }
+
+    for (int i = 0; i < (length & 3); i++) {
+        hash = HASH_STEP(hash, pBytes[i]);
+    }
+
+    return hash;
+}
+
+static ULONG hashEntry(ULONG hash, UBYTE kmType, ULONG kmEntry) {
+    hash = HASH_STEP(hash, kmType);
+    hash = HASH_STEP(hash, (UBYTE) kmEntry);
+    hash = HASH_STEP(hash, (UBYTE)(kmEntry >> 8));
+    hash = HASH_STEP(hash, (UBYTE)(kmEntry >> 16));
+    return HASH_STEP(hash, (UBYTE)(kmEntry >> 24));
+}
+
+// 'Normal' and 'KCF_NOP' keys hash their kmType and kmEntry.
+BOOL fingerprintNormal(void* pContext, UBYTE rawKey, UBYTE kmType, ULONG kmEntry) {
+    FingerprintContext* pFingerprint = pContext;
+    pFingerprint->hash = hashEntry(pFingerprint->hash, kmType, kmEntry);
+    return VISIT_CONTINUE;
+}
+
+BOOL fingerprintNop(void* pContext, UBYTE rawKey, UBYTE kmType, ULONG kmEntry) {
+    FingerprintContext* pFingerprint = pContext;
+    pFingerprint->hash = hashEntry(pFingerprint->hash, kmType, kmEntry);
+    return VISIT_CONTINUE;
+}
+
+// 'KCF_STRING' keys hash the number of entries and the length and chars of each string
+// (but not the offsets).
+BOOL fingerprintString(void* pContext, UBYTE rawKey, int numEntries, const UBYTE* pTable) {
+    FingerprintContext* pFingerprint = pContext;
+    ULONG hash = HASH_STEP(pFingerprint->hash, KCF_STRING | numEntries);
+
+    for (int n = 0; n < numEntries; n++) {
+        const UBYTE len = *(pTable + (n << 1));
+        const UBYTE off = *(pTable + (n << 1) + 1);
+
+        hash = HASH_STEP(hash, len);
+        hash = hashBytes(hash, pTable + off, len);
+    }
+
+    pFingerprint->hash = hash;
+    return VISIT_CONTINUE;
+}
+
+// 'KCF_DEAD' keys hash the kind of each entry, and the char/dead index or the contents of
+// the DPF_MOD table (but not its offset).
+BOOL fingerprintDead(void* pContext, UBYTE rawKey, int numEntries, const UBYTE* pTable) {
+    FingerprintContext* pFingerprint = pContext;
+    ULONG hash = HASH_STEP(pFingerprint->hash, KCF_DEAD | numEntries);
+
+    for (int n = 0; n < numEntries; n++) {
+        const UBYTE kind = *(pTable + (n << 1));
+        const UBYTE value = *(pTable + (n << 1) + 1);
+
+        hash = HASH_STEP(hash, kind);
+
+        if (kind == DPF_MOD) {
+            hash = hashBytes(hash, pTable + value, pFingerprint->deadCharTableBytes);
+        } else {
+            hash = HASH_STEP(hash, value);
+        }
+    }
+
+    pFingerprint->hash = hash;
+    return VISIT_CONTINUE;
+}
+
+const Visitor FingerprintVisitor = {
+    fingerprintNormal,
+    fingerprintString,
+    fingerprintDead,
+    fingerprintNop,
+};
+
+// Traversal specialized for the FingerprintVisitor (see DEFINE_VISIT)
+DEFINE_VISIT(visitFingerprint, fingerprintNormal, fingerprintString, fingerprintDead, fingerprintNop)
+
+ULONG fingerprintKeymap(struct KeyMap* pKeyMap) {
+    // The DPF_MOD table length is needed to hash the dead tables.
+    FingerprintContext fingerprint;
+    fingerprint.hash = FINGERPRINT_SEED;
+    fingerprint.deadCharTableBytes = measureDeadCharTableBytes(pKeyMap);
+
+    visitFingerprint(pKeyMap, &fingerprint);
+
+    ULONG hash = fingerprint.hash;
+    hash = hashBytes(hash, pKeyMap->km_LoCapsable, LO_CAPS_BYTE_SIZE);
+    hash = hashBytes(hash, pKeyMap->km_LoRepeatable, LO_REPS_BYTE_SIZE);
+    hash = hashBytes(hash, pKeyMap->km_HiCapsable, HI_CAPS_BYTE_SIZE);
+    hash = hashBytes(hash, pKeyMap->km_HiRepeatable, HI_REPS_BYTE_SIZE);
+    return hash;
+}
+
+ULONG fingerprintKeys(struct KeyMap* pKeyMap, const KeyFilter* pFilter, UBYTE deadCharTableBytes) {
+    FingerprintContext fingerprint;
+    fingerprint.hash = FINGERPRINT_SEED;
+    fingerprint.deadCharTableBytes = deadCharTableBytes;
+
+    visitKeys(pKeyMap, pFilter, &fingerprint, FingerprintVisitor);
+    return fingerprint.hash;
+}
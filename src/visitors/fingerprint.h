@@ -0,0 +1,27 @@
+#ifndef FINGERPRINT_H
+#define FINGERPRINT_H
+
+#include "../visit.h"
+#include <proto/keymap.h>
+
+typedef struct {
+    ULONG hash;
+    UBYTE deadCharTableBytes;   // Size of each DPF_MOD table (from the MeasureVisitor)
+} FingerprintContext;
+
+// Returns a hash of the content of 'pKeyMap': the kmTypes, normal kmEntries, string/dead
+// table contents, and capsable/repeatable bits.  Table addresses and offsets are not
+// included, so a keymap and its copies have the same fingerprint.
+ULONG fingerprintKeymap(struct KeyMap* pKeyMap);
+
+// Returns a hash of the content of the keys of 'pKeyMap' selected by 'pFilter' (without the
+// capsable/repeatable bits), visiting only those keys.  'deadCharTableBytes' is the size of
+// each DPF_MOD table (see measureDeadCharTableBytes()).  Comparing the hashes of the same
+// keys of two keymaps tells whether those keys differ.
+ULONG fingerprintKeys(struct KeyMap* pKeyMap, const KeyFilter* pFilter, UBYTE deadCharTableBytes);
+
+extern const Visitor FingerprintVisitor;
+
+DECLARE_VISIT(visitFingerprint)
+
+#endif
@@ -0,0 +1,274 @@
+#include "flatten.h"
+#include "measure.h"
+#include "../keyset.h"
+#include <exec/types.h>
+#include <proto/exec.h>
+#include <proto/keymap.h>
+#include <assert.h>
+#include <string.h>
+
+#define VANILLA_CONTROL_MASK 0x9F   // KC_VANILLA: control clears bits 5 and 6
+
+typedef struct {
+    FlatTable* pTable;
+    struct KeyMap* pKeyMap;
+    UBYTE* pNext;                   // Next free byte in the pool
+    KeySet capsable;                // Capsable keys of 'pKeyMap'
+    KeySet repeatable;              // Repeatable keys of 'pKeyMap'
+} FlattenContext;
+
+UBYTE calcEntryIndex(UBYTE kmType, UBYTE quals) {
+    // Entries are ordered by the supported qualifiers, with shift as the least significant
+    // bit, then alt, then control.  (e.g., for KCF_SHIFT | KCF_CONTROL: none, shift, control,
+    // control + shift.)
+    UBYTE index = 0;
+    UBYTE bit = 1;
+
+    if (kmType & KCF_SHIFT) {
+        if (quals & KCF_SHIFT) { index |= bit; }
+        bit <<= 1;
+    }
+    if (kmType & KCF_ALT) {
+        if (quals & KCF_ALT) { index |= bit; }
+        bit <<= 1;
+    }
+    if (kmType & KCF_CONTROL) {
+        if (quals & KCF_CONTROL) { index |= bit; }
+    }
+
+    return index;
+}
+
+UBYTE calcEntryQuals(UBYTE kmType, UBYTE index) {
+    UBYTE quals = 0;
+    UBYTE bit = 1;
+
+    if (kmType & KCF_SHIFT) {
+        if (index & bit) { quals |= KCF_SHIFT; }
+        bit <<= 1;
+    }
+    if (kmType & KCF_ALT) {
+        if (index & bit) { quals |= KCF_ALT; }
+        bit <<= 1;
+    }
+    if (kmType & KCF_CONTROL) {
+        if (index & bit) { quals |= KCF_CONTROL; }
+    }
+
+    return quals;
+}
+
+static UBYTE getType(const struct KeyMap* pKeyMap, UBYTE rawKey) {
+    return rawKey < LO_MAP_LENGTH
+        ? pKeyMap->km_LoKeyMapTypes[rawKey]
+        : pKeyMap->km_HiKeyMapTypes[rawKey - LO_MAP_LENGTH];
+}
+
+// Returns the shift/alt/control qualifiers in effect for qualifier combination 'quals'.
+// (Caps lock acts as shift on capsable keys.)
+static UBYTE effectiveQuals(UBYTE quals, BOOL capsable) {
+    UBYTE effective = quals & (FQ_SHIFT | FQ_ALT | FQ_CONTROL);
+    if ((quals & FQ_CAPSLOCK) && capsable) {
+        effective |= FQ_SHIFT;
+    }
+    return effective;
+}
+
+static UBYTE keyFlags(FlattenContext* pFlatten, UBYTE rawKey) {
+    return hasKey(&pFlatten->repeatable, rawKey)
+        ? FSF_REPEATABLE
+        : 0;
+}
+
+static BOOL isCapsable(FlattenContext* pFlatten, UBYTE rawKey) {
+    return hasKey(&pFlatten->capsable, rawKey);
+}
+
+static UWORD poolOffset(FlattenContext* pFlatten, const UBYTE* pBytes) {
+    return (UWORD)(pBytes - pFlatten->pTable->pBytes);
+}
+
+// 'Normal' keys append their four kmEntry bytes to the pool (followed by the four bytes
+// with bits 5 and 6 cleared for KC_VANILLA keys) and each slot points at one of them.
+BOOL flattenNormal(void* pContext, UBYTE rawKey, UBYTE kmType, ULONG kmEntry) {
+    FlattenContext* pFlatten = pContext;
+    FlatSlot* pSlot = pFlatten->pTable->slots[rawKey];
+    const BOOL capsable = isCapsable(pFlatten, rawKey);
+    const UBYTE flags = keyFlags(pFlatten, rawKey);
+    const BOOL vanilla = (kmType & KC_VANILLA) == KC_VANILLA;
+
+    UBYTE* pBytes = pFlatten->pNext;
+    for (int i = 0; i < 4; i++) {
+        pBytes[i] = (UBYTE)(kmEntry >> (i << 3));
+        if (vanilla) {
+            pBytes[i + 4] = pBytes[i] & VANILLA_CONTROL_MASK;
+        }
+    }
+    pFlatten->pNext += vanilla ? 8 : 4;
+
+    for (UBYTE quals = 0; quals < FLAT_QUALS; quals++, pSlot++) {
+        const UBYTE effective = effectiveQuals(quals, capsable);
+        const UBYTE index = vanilla
+            ? calcEntryIndex(KCF_SHIFT | KCF_ALT, effective) + ((effective & FQ_CONTROL) ? 4 : 0)
+            : calcEntryIndex(kmType, effective);
+
+        pSlot->offset = poolOffset(pFlatten, pBytes + index);
+        pSlot->length = 1;
+        pSlot->flags = flags;
+    }
+    return VISIT_CONTINUE;
+}
+
+// 'KCF_NOP' keys produce no output.
+BOOL flattenNop(void* pContext, UBYTE rawKey, UBYTE kmType, ULONG kmEntry) {
+    FlattenContext* pFlatten = pContext;
+    FlatSlot* pSlot = pFlatten->pTable->slots[rawKey];
+    const UBYTE flags = keyFlags(pFlatten, rawKey);
+
+    for (UBYTE quals = 0; quals < FLAT_QUALS; quals++, pSlot++) {
+        pSlot->offset = 0;
+        pSlot->length = 0;
+        pSlot->flags = flags;
+    }
+    return VISIT_CONTINUE;
+}
+
+// 'KCF_STRING' keys append the chars of each entry to the pool, so the string offsets
+// are resolved ahead of time.  The chars are laid out as in a copy (see planStringLayout()),
+// so entries that share chars in the source share them in the pool, which then holds
+// exactly the 'stringBytes' measured for the keymap.
+BOOL flattenString(void* pContext, UBYTE rawKey, int numEntries, const UBYTE* pSrcTable) {
+    FlattenContext* pFlatten = pContext;
+    FlatSlot* pSlot = pFlatten->pTable->slots[rawKey];
+    const UBYTE kmType = getType(pFlatten->pKeyMap, rawKey);
+    const BOOL capsable = isCapsable(pFlatten, rawKey);
+    const UBYTE flags = keyFlags(pFlatten, rawKey);
+
+    // (buildFlatTable() rejects keymaps with tables that have no layout.)
+    StringLayout layout;
+    planStringLayout(pSrcTable, numEntries, &layout);
+
+    UWORD offsets[8];
+    UBYTE lengths[8];
+
+    for (int n = 0; n < numEntries; n++) {
+        const UBYTE len = *(pSrcTable + (n << 1));
+        const UBYTE off = *(pSrcTable + (n << 1) + 1);
+        UBYTE* pChars = pFlatten->pNext + (layout.offsets[n] - (numEntries << 1));
+
+        offsets[n] = poolOffset(pFlatten, pChars);
+        lengths[n] = len;
+        memcpy(pChars, pSrcTable + off, len);
+    }
+    pFlatten->pNext += layout.charBytes;
+
+    for (UBYTE quals = 0; quals < FLAT_QUALS; quals++, pSlot++) {
+        const UBYTE index = calcEntryIndex(kmType, effectiveQuals(quals, capsable));
+
+        pSlot->offset = offsets[index];
+        pSlot->length = lengths[index];
+        pSlot->flags = flags;
+    }
+    return VISIT_CONTINUE;
+}
+
+// 'KCF_DEAD' keys append one byte per entry to the pool (the char for kind 0, the dead
+// key value for DPF_DEAD), and a copy of the dead char table for DPF_MOD.
+BOOL flattenDead(void* pContext, UBYTE rawKey, int numEntries, const UBYTE* pSrcTable) {
+    FlattenContext* pFlatten = pContext;
+    FlatSlot* pSlot = pFlatten->pTable->slots[rawKey];
+    const UBYTE kmType = getType(pFlatten->pKeyMap, rawKey);
+    const BOOL capsable = isCapsable(pFlatten, rawKey);
+    const UBYTE flags = keyFlags(pFlatten, rawKey);
+
+    FlatSlot entries[8];
+
+    for (int n = 0; n < numEntries; n++) {
+        const UBYTE kind = *(pSrcTable + (n << 1));
+        const UBYTE value = *(pSrcTable + (n << 1) + 1);
+        FlatSlot* pEntry = &entries[n];
+
+        pEntry->offset = poolOffset(pFlatten, pFlatten->pNext);
+
+        switch (kind) {
+            case 0:
+                *(pFlatten->pNext++) = value;
+                pEntry->length = 1;
+                pEntry->flags = flags;
+                break;
+            case DPF_DEAD:
+                *(pFlatten->pNext++) = value;
+                pEntry->length = 0;
+                pEntry->flags = flags | FSF_DEAD;
+                break;
+            default: {
+                assert(kind == DPF_MOD);
+                const UBYTE len = pFlatten->pTable->deadCharTableBytes;
+                memcpy(pFlatten->pNext, pSrcTable + value, len);
+                pFlatten->pNext += len;
+                pEntry->length = 1;
+                pEntry->flags = flags | FSF_MOD;
+                break;
+            }
+        }
+    }
+
+    for (UBYTE quals = 0; quals < FLAT_QUALS; quals++, pSlot++) {
+        *pSlot = entries[calcEntryIndex(kmType, effectiveQuals(quals, capsable))];
+    }
+    return VISIT_CONTINUE;
+}
+
+// Traversal specialized for flattening (see DEFINE_VISIT)
+DEFINE_VISIT(visitFlatten, flattenNormal, flattenString, flattenDead, flattenNop)
+
+FlatTable* buildFlatTable(struct KeyMap* pKeyMap) {
+    Sizes sizes = { 0 };
+    visitMeasure(pKeyMap, &sizes);
+    if (sizes.overflowTables > 0) {
+        return NULL;
+    }
+
+    // Pool space: up to 8 bytes per normal key, the string chars (as packed by a copy), one
+    // byte per dead entry, and a copy of each DPF_MOD table.
+    const ULONG poolSize = (FLAT_KEYS << 3)
+        + sizes.stringBytes
+        + sizes.deadEntries
+        + sizes.deadCharTableBytes * sizes.modEntries;
+
+    if (poolSize > 0x10000) {
+        return NULL;
+    }
+
+    const ULONG blockSize = sizeof(FlatTable) + poolSize;
+    FlatTable* pTable = AllocMem(blockSize, MEMF_CLEAR | MEMF_PUBLIC);
+    if (pTable == NULL) {
+        return NULL;
+    }
+
+    pTable->pBytes = (UBYTE*)(pTable + 1);
+    pTable->blockSize = blockSize;
+    pTable->deadCharTableBytes = sizes.deadCharTableBytes;
+
+    FlattenContext flatten;
+    flatten.pTable = pTable;
+    flatten.pKeyMap = pKeyMap;
+    flatten.pNext = pTable->pBytes;
+    loadCapsable(&flatten.capsable, pKeyMap);
+    loadRepeatable(&flatten.repeatable, pKeyMap);
+
+    visitFlatten(pKeyMap, &flatten);
+    assert(flatten.pNext <= pTable->pBytes + poolSize);
+
+    return pTable;
+}
+
+void freeFlatTable(FlatTable* pTable) {
+    FreeMem(pTable, pTable->blockSize);
+}
+
+UBYTE translateKey(const FlatTable* pTable, UBYTE rawKey, UBYTE quals, const UBYTE** ppBytes) {
+    const FlatSlot* pSlot = FLAT_SLOT(pTable, rawKey, quals);
+    *ppBytes = pTable->pBytes + pSlot->offset;
+    return pSlot->length;
+}
@@ -0,0 +1,62 @@
+#ifndef FLATTEN_H
+#define FLATTEN_H
+
+#include "../visit.h"
+#include "../keymaptable.h"
+#include <proto/keymap.h>
+
+#define FLAT_KEYS   (LO_MAP_LENGTH + HI_MAP_LENGTH)    // Raw keys 0x00-0x77
+#define FLAT_QUALS  16                                  // Combinations of the FQ_* qualifiers
+
+// Qualifier bits used to index a FlatTable.  (Shift/alt/control match the KCF_* bits.)
+#define FQ_SHIFT        KCF_SHIFT
+#define FQ_ALT          KCF_ALT
+#define FQ_CONTROL      KCF_CONTROL
+#define FQ_CAPSLOCK     0x08
+
+// FlatSlot flags
+#define FSF_REPEATABLE  0x01    // Key repeats when held
+#define FSF_DEAD        0x02    // DPF_DEAD: no output, the dead key value is at 'offset'
+#define FSF_MOD         0x04    // DPF_MOD: 'offset' is the start of the dead char table (the
+                                // unprefixed char is the first byte, so 'length' is 1)
+
+// Describes the output of one raw key with one qualifier combination.  The output is the
+// 'length' bytes starting at 'offset' in the FlatTable's byte pool.
+typedef struct {
+    UWORD offset;
+    UBYTE length;
+    UBYTE flags;
+} FlatSlot;
+
+// A flattened keymap: every raw key/qualifier combination is resolved ahead of time, so
+// translating a key is a single table lookup that never depends on the key type.  Caps
+// lock is resolved using the capsable bits (it acts as shift on capsable keys).
+typedef struct {
+    FlatSlot slots[FLAT_KEYS][FLAT_QUALS];
+    UBYTE* pBytes;                  // Byte pool (follows the FlatTable in the same block)
+    ULONG blockSize;                // Size of the block holding the table and pool
+    UBYTE deadCharTableBytes;       // Size of each DPF_MOD table in the pool
+} FlatTable;
+
+#define FLAT_SLOT(pTable, rawKey, quals) (&(pTable)->slots[(rawKey)][(quals) & (FLAT_QUALS - 1)])
+
+// Builds a FlatTable for 'pKeyMap'.  Returns NULL if the allocation fails, the byte pool
+// would exceed the 64KB addressable by a FlatSlot, or a string table has no layout (see
+// planStringLayout()).
+FlatTable* buildFlatTable(struct KeyMap* pKeyMap);
+
+void freeFlatTable(FlatTable* pTable);
+
+// Returns the number of bytes produced by 'rawKey' with 'quals' (FQ_* bits) and sets
+// '*ppBytes' to them.
+UBYTE translateKey(const FlatTable* pTable, UBYTE rawKey, UBYTE quals, const UBYTE** ppBytes);
+
+// Returns the index of the string/dead table entry (or normal kmEntry byte) selected by
+// 'quals' for a key of type 'kmType'.  Qualifiers not supported by the key are ignored.
+UBYTE calcEntryIndex(UBYTE kmType, UBYTE quals);
+
+// The inverse of calcEntryIndex(): returns the qualifiers that select entry 'index' of a key
+// of type 'kmType'.
+UBYTE calcEntryQuals(UBYTE kmType, UBYTE index);
+
+#endif
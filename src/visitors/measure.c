@@ -2,25 +2,52 @@
 #include <assert.h>
 #include "measure.h"
 
-void measureNop(void* pContext, UBYTE rawKey, UBYTE kmType, ULONG kmEntry) { }
+#define NUM_KEYS (LO_MAP_LENGTH + HI_MAP_LENGTH)
 
-void measureString(void* pContext, UBYTE rawKey, int numEntries, const UBYTE* pKmEntry) {
+BOOL measureNop(void* pContext, UBYTE rawKey, UBYTE kmType, ULONG kmEntry) { return VISIT_CONTINUE; }
+
+BOOL measureString(void* pContext, UBYTE rawKey, int numEntries, const UBYTE* pKmEntry) {
     Sizes* pSizes = pContext;
 
+    // When deduplicating, a string table identical to one already counted is shared.
+    if (pSizes->pIntern != NULL) {
+        BOOL added;
+        internTable(pSizes->pIntern, /* isDead: */ FALSE, numEntries, pKmEntry, &added);
+        if (!added) {
+            return VISIT_CONTINUE;
+        }
+    }
+
     // Count the number of KCF_STRING entries.  Each will need 2B (len/offset) reserved
     // for the string table.
     pSizes->stringEntries += numEntries;
 
-    // Sum the string lengths for all entries for this key.
-    for (int n = 0; n < numEntries; n++) {
-        pSizes->stringBytes += *pKmEntry;   // Add the entry's string length
-        pKmEntry += 2;                      // Skip to the next string length
+    // Add the bytes of chars for all entries for this key.  (Usually the sum of the string
+    // lengths, but long strings may need to be packed to fit their 8-bit offsets.)
+    StringLayout layout;
+    if (!planStringLayout(pKmEntry, numEntries, &layout)) {
+        pSizes->overflowTables++;
+        return VISIT_CONTINUE;
     }
+    pSizes->stringBytes += layout.charBytes;
+    return VISIT_CONTINUE;
 }
 
-void measureDead(void* pContext, UBYTE rawKey, int numEntries, const UBYTE* pKmEntry) {
+BOOL measureDead(void* pContext, UBYTE rawKey, int numEntries, const UBYTE* pKmEntry) {
     Sizes* pSizes = pContext;
 
+    // When deduplicating, queue the dead table to be interned by finishMeasure().
+    if (pSizes->pIntern != NULL) {
+        InternTable* pIntern = pSizes->pIntern;
+        pIntern->pPendingDead[pIntern->numPending] = pKmEntry;
+        pIntern->pendingEntries[pIntern->numPending++] = numEntries;
+    }
+
+    // Record the key, so that finishMeasure() plans the DPF_MOD tables without visiting
+    // every other key again.  (The bit is set in place, as addKey() would, since this runs
+    // for every dead key of every measure.)
+    pSizes->deadKeys.words[rawKey >> 5] |= 1UL << (rawKey & 31);
+
     // Count the number of KCF_DEAD entries.  Each will need 2B (kind/value) reserved
     // for the string table.
     pSizes->deadEntries += numEntries;
@@ -30,8 +57,6 @@ void measureDead(void* pContext, UBYTE rawKey, int numEntries, const UBYTE* pKmE
     //
     // Scan DPF_MOD entries to calculate the number of dead tables required.
     for (int n = 0; n < numEntries; n++) {
-        int deadIndex;
-
         UBYTE kind = *(pKmEntry++);
         UBYTE value = *(pKmEntry++);
 
@@ -57,6 +82,68 @@ void measureDead(void* pContext, UBYTE rawKey, int numEntries, const UBYTE* pKmE
                 break;
         }
     }
+    return VISIT_CONTINUE;
+}
+
+void addModTableBytes(Sizes* pSizes, const UBYTE* pTable, int numEntries) {
+    const int bytes = calcModTableBytes(pTable, numEntries, pSizes->deadCharTableBytes);
+    if (bytes < 0) {
+        pSizes->overflowTables++;
+        return;
+    }
+    pSizes->deadTableBytes += bytes;
+}
+
+// Sums the planned DPF_MOD table bytes of each dead key.  (Only pfnDead is called; see
+// finishMeasure().)
+static BOOL planDead(void* pContext, UBYTE rawKey, int numEntries, const UBYTE* pKmEntry) {
+    addModTableBytes(pContext, pKmEntry, numEntries);
+    return VISIT_CONTINUE;
+}
+
+static const Visitor PlanVisitor = {
+    NULL,
+    NULL,
+    planDead,
+    NULL,
+};
+
+void finishMeasure(Sizes* pSizes, struct KeyMap* pKeyMap) {
+    InternTable* pIntern = pSizes->pIntern;
+    pSizes->deadTableBytes = 0;
+
+    if (pIntern == NULL) {
+        KeyFilter deadKeys;
+        initKeyFilter(&deadKeys, VISIT_DEAD);
+        deadKeys.keys = pSizes->deadKeys;
+        visitKeys(pKeyMap, &deadKeys, pSizes, PlanVisitor);
+        return;
+    }
+
+    // When deduplicating, every dead table was queued by measureDead().  Intern them and
+    // discount the ones that duplicate a table already counted.
+    pIntern->deadCharTableBytes = pSizes->deadCharTableBytes;
+
+    for (int i = 0; i < pIntern->numPending; i++) {
+        const UBYTE* pTable = pIntern->pPendingDead[i];
+        const int numEntries = pIntern->pendingEntries[i];
+
+        BOOL added;
+        internTable(pIntern, /* isDead: */ TRUE, numEntries, pTable, &added);
+        if (added) {
+            addModTableBytes(pSizes, pTable, numEntries);
+            continue;
+        }
+
+        pSizes->deadEntries -= numEntries;
+        for (int n = 0; n < numEntries; n++) {
+            if (*(pTable + (n << 1)) == DPF_MOD) {
+                pSizes->modEntries--;
+            }
+        }
+    }
+
+    pIntern->numPending = 0;
 }
 
 const Visitor MeasureVisitor = {
@@ -65,3 +152,18 @@ const Visitor MeasureVisitor = {
     measureDead,
     measureNop,
 };
+
+UBYTE measureDeadCharTableBytes(struct KeyMap* pKeyMap) {
+    // Only the KCF_DEAD keys are visited: the other handlers of the MeasureVisitor are never
+    // called, and neither are the kmEntries of the other keys read.
+    KeyFilter deadKeys;
+    initKeyFilter(&deadKeys, VISIT_DEAD);
+    selectKeys(&deadKeys, 0, NUM_KEYS - 1);
+
+    Sizes sizes = { 0 };
+    visitKeys(pKeyMap, &deadKeys, &sizes, MeasureVisitor);
+    return sizes.deadCharTableBytes;
+}
+
+// Traversal specialized for the MeasureVisitor (see DEFINE_VISIT)
+DEFINE_VISIT(visitMeasure, measureNop, measureString, measureDead, measureNop)
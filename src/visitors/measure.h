@@ -1,4 +1,9 @@
+#ifndef MEASURE_H
+#define MEASURE_H
+
 #include "../visit.h"
+#include "../intern.h"
+#include "../layout.h"
 
 typedef struct {
     int stringEntries;
@@ -6,6 +11,29 @@ typedef struct {
     int deadEntries;
     int modEntries;
     int deadCharTableBytes;
+    int deadTableBytes;         // Exact size of the copied DPF_MOD tables (see planDeadRuns())
+    int overflowTables;         // Tables that no layout fits within 8-bit offsets (see layout.h)
+    KeySet deadKeys;            // KCF_DEAD keys measured (their tables are planned by finishMeasure())
+    InternTable* pIntern;       // If not NULL, identical string/dead tables are only counted once
 } Sizes;
 
+// Completes a measurement of 'pKeyMap' once the whole keymap has been visited.  Now that
+// the size of the DPF_MOD tables is known, this computes 'deadTableBytes', counts the dead
+// tables that do not fit in 'overflowTables', and (when deduplicating) removes duplicate
+// dead tables.  A keymap with 'overflowTables' cannot be copied.
+void finishMeasure(Sizes* pSizes, struct KeyMap* pKeyMap);
+
+// Adds the planned DPF_MOD table bytes of one dead table to 'pSizes' (or counts it in
+// 'overflowTables' if it does not fit), as finishMeasure() does for each of 'deadKeys'
+// when not deduplicating.  'deadCharTableBytes' must already be final.
+void addModTableBytes(Sizes* pSizes, const UBYTE* pTable, int numEntries);
+
+// Returns the size of each DPF_MOD table of 'pKeyMap' (Sizes.deadCharTableBytes), measuring
+// only its KCF_DEAD keys.
+UBYTE measureDeadCharTableBytes(struct KeyMap* pKeyMap);
+
 extern const Visitor MeasureVisitor;
+
+DECLARE_VISIT(visitMeasure)
+
+#endif
@@ -1,83 +1,333 @@
 #include "print.h"
 #include "measure.h"
 #include "../keymaptable.h"
+#include "../keyset.h"
 #include <exec/types.h>
 #include <proto/keymap.h>
 #include <stdio.h>
+#include <string.h>
 #include <assert.h>
 
+static void writeStdout(const char* pChars, ULONG length) {
+    fwrite(pChars, 1, length, stdout);
+}
+
+void beginPrint(PrintContext* pPrint, struct KeyMap* pKeyMap, UBYTE format, UBYTE deadCharTableBytes) {
+    pPrint->pKeyMap = pKeyMap;
+    pPrint->pfnSink = writeStdout;
+    pPrint->deadCharTableBytes = deadCharTableBytes;
+    pPrint->format = format;
+    pPrint->used = 0;
+}
+
+void endPrint(PrintContext* pPrint) {
+    if (pPrint->used > 0) {
+        pPrint->pfnSink(pPrint->buffer, pPrint->used);
+        pPrint->used = 0;
+    }
+}
+
+static void appendChar(PrintContext* pPrint, char ch) {
+    if (pPrint->used == PRINT_BUFFER_SIZE) {
+        endPrint(pPrint);
+    }
+    pPrint->buffer[pPrint->used++] = ch;
+}
+
+static void appendString(PrintContext* pPrint, const char* pStr) {
+    while (*pStr != '\0') {
+        appendChar(pPrint, *(pStr++));
+    }
+}
+
+// Appends 'value' in hex without leading zeros (like printf("%lx")).
+static void appendHex(PrintContext* pPrint, ULONG value) {
+    static const char digits[] = "0123456789abcdef";
+    char chars[sizeof(ULONG) << 1];
+    int i = 0;
+
+    do {
+        chars[i++] = digits[value & 0xF];
+        value >>= 4;
+    } while (value != 0);
+
+    while (i > 0) {
+        appendChar(pPrint, chars[--i]);
+    }
+}
+
+// The decimal digits of every byte value.  The JSON format prints each char as a number,
+// and a lookup (rather than a divu per digit, which is slow on the 68000) is most of the
+// cost of printing one.
+static const char byteDigits[256][4] = {
+    "0",   "1",   "2",   "3",   "4",   "5",   "6",   "7",   "8",   "9",
+    "10",  "11",  "12",  "13",  "14",  "15",  "16",  "17",  "18",  "19",
+    "20",  "21",  "22",  "23",  "24",  "25",  "26",  "27",  "28",  "29",
+    "30",  "31",  "32",  "33",  "34",  "35",  "36",  "37",  "38",  "39",
+    "40",  "41",  "42",  "43",  "44",  "45",  "46",  "47",  "48",  "49",
+    "50",  "51",  "52",  "53",  "54",  "55",  "56",  "57",  "58",  "59",
+    "60",  "61",  "62",  "63",  "64",  "65",  "66",  "67",  "68",  "69",
+    "70",  "71",  "72",  "73",  "74",  "75",  "76",  "77",  "78",  "79",
+    "80",  "81",  "82",  "83",  "84",  "85",  "86",  "87",  "88",  "89",
+    "90",  "91",  "92",  "93",  "94",  "95",  "96",  "97",  "98",  "99",
+    "100", "101", "102", "103", "104", "105", "106", "107", "108", "109",
+    "110", "111", "112", "113", "114", "115", "116", "117", "118", "119",
+    "120", "121", "122", "123", "124", "125", "126", "127", "128", "129",
+    "130", "131", "132", "133", "134", "135", "136", "137", "138", "139",
+    "140", "141", "142", "143", "144", "145", "146", "147", "148", "149",
+    "150", "151", "152", "153", "154", "155", "156", "157", "158", "159",
+    "160", "161", "162", "163", "164", "165", "166", "167", "168", "169",
+    "170", "171", "172", "173", "174", "175", "176", "177", "178", "179",
+    "180", "181", "182", "183", "184", "185", "186", "187", "188", "189",
+    "190", "191", "192", "193", "194", "195", "196", "197", "198", "199",
+    "200", "201", "202", "203", "204", "205", "206", "207", "208", "209",
+    "210", "211", "212", "213", "214", "215", "216", "217", "218", "219",
+    "220", "221", "222", "223", "224", "225", "226", "227", "228", "229",
+    "230", "231", "232", "233", "234", "235", "236", "237", "238", "239",
+    "240", "241", "242", "243", "244", "245", "246", "247", "248", "249",
+    "250", "251", "252", "253", "254", "255",
+};
+
+// Appends 'value' in decimal.  All 4 bytes of the digits are copied (so the buffer must
+// have room for them), but only the digits count as used.
+static void appendByte(PrintContext* pPrint, UBYTE value) {
+    if (pPrint->used > PRINT_BUFFER_SIZE - 4) {
+        endPrint(pPrint);
+    }
+
+    memcpy(pPrint->buffer + pPrint->used, byteDigits[value], 4);
+    pPrint->used += 1 + (value >= 10) + (value >= 100);
+}
+
+static void appendDecimal(PrintContext* pPrint, ULONG value) {
+    if (value <= 0xFF) {
+        appendByte(pPrint, value);
+        return;
+    }
+
+    char chars[10];
+    int i = 0;
+
+    do {
+        chars[i++] = (char)('0' + value % 10);
+        value /= 10;
+    } while (value != 0);
+
+    while (i > 0) {
+        appendChar(pPrint, chars[--i]);
+    }
+}
+
+static UBYTE getType(const struct KeyMap* pKeyMap, UBYTE rawKey) {
+    return rawKey < LO_MAP_LENGTH
+        ? pKeyMap->km_LoKeyMapTypes[rawKey]
+        : pKeyMap->km_HiKeyMapTypes[rawKey - LO_MAP_LENGTH];
+}
+
 BOOL isPrintable(UBYTE ch) {
     return ((0x1F < ch) && (ch < 0x7F));     // ASCII printable (excludes 7F = DEL)
 }
 
-void printChar(char ch) {
+void printChar(PrintContext* pPrint, char ch) {
     if (isPrintable((UBYTE) ch)) {
-        printf("%c", ch);
+        appendChar(pPrint, ch);
     } else {
-        printf("{0x%x}", (UBYTE) ch);
+        appendString(pPrint, "{0x");
+        appendHex(pPrint, (UBYTE) ch);
+        appendChar(pPrint, '}');
+    }
+}
+
+void printChars(PrintContext* pPrint, const char* pCh, UBYTE len) {
+    appendChar(pPrint, '\'');
+    for (int i = 0; i < len; i++) {
+        printChar(pPrint, *(pCh++));
     }
+    appendString(pPrint, "' ");
 }
 
-void printChars(char* pCh, UBYTE len) {
-    printf("'");
+// The JSON format describes each key with one object per line:
+//
+//  {"key":32,"kmType":7,"caps":1,"rep":1,"type":"normal","chars":[97,65,225,193]}
+//  {"key":80,"kmType":65,"caps":0,"rep":0,"type":"string","strings":[[155,48,126],[155,49,48,126]]}
+//  {"key":37,"kmType":35,"caps":1,"rep":1,"type":"dead","dead":[{"mod":[104,...]},{"dead":1},{"char":72}]}
+//  {"key":95,"kmType":128,"caps":0,"rep":0,"type":"nop"}
+//
+// Chars are numbers, so no escaping is needed and the output does not depend on the
+// kmEntry addresses.
+static void printJsonKey(PrintContext* pPrint, UBYTE rawKey, const char* pType) {
+    const struct KeyMap* pKeyMap = pPrint->pKeyMap;
+
+    appendString(pPrint, "{\"key\":");
+    appendDecimal(pPrint, rawKey);
+    appendString(pPrint, ",\"kmType\":");
+    appendDecimal(pPrint, getType(pKeyMap, rawKey));
+    appendString(pPrint, ",\"caps\":");
+    appendDecimal(pPrint, testKeyBit(pKeyMap->km_LoCapsable, pKeyMap->km_HiCapsable, rawKey));
+    appendString(pPrint, ",\"rep\":");
+    appendDecimal(pPrint, testKeyBit(pKeyMap->km_LoRepeatable, pKeyMap->km_HiRepeatable, rawKey));
+    appendString(pPrint, ",\"type\":\"");
+    appendString(pPrint, pType);
+    appendChar(pPrint, '"');
+}
+
+static void printJsonChars(PrintContext* pPrint, const UBYTE* pCh, UBYTE len) {
+    appendChar(pPrint, '[');
     for (int i = 0; i < len; i++) {
-        printChar(*(pCh++));
+        if (i > 0) {
+            appendChar(pPrint, ',');
+        }
+        appendByte(pPrint, pCh[i]);
     }
-    printf("' ");
+    appendChar(pPrint, ']');
 }
 
-void printNormal(void* pContext, UBYTE rawKey, UBYTE kmType, ULONG kmEntry) {
-    printf("%x: '", rawKey);
-    printChar((char) kmEntry);
-    printChar((char) (kmEntry >> 8));
-    printChar((char) (kmEntry >> 16));
-    printChar((char) (kmEntry >> 24));
-    printf("'\n");
+BOOL printNormal(void* pContext, UBYTE rawKey, UBYTE kmType, ULONG kmEntry) {
+    PrintContext* pPrint = pContext;
+
+    if (pPrint->format == PRINT_JSON) {
+        const UBYTE chars[4] = { (UBYTE) kmEntry, (UBYTE)(kmEntry >> 8), (UBYTE)(kmEntry >> 16), (UBYTE)(kmEntry >> 24) };
+        printJsonKey(pPrint, rawKey, "normal");
+        appendString(pPrint, ",\"chars\":");
+        printJsonChars(pPrint, chars, 4);
+        appendString(pPrint, "}\n");
+        return VISIT_CONTINUE;
+    }
+
+    appendHex(pPrint, rawKey);
+    appendString(pPrint, ": '");
+    printChar(pPrint, (char) kmEntry);
+    printChar(pPrint, (char) (kmEntry >> 8));
+    printChar(pPrint, (char) (kmEntry >> 16));
+    printChar(pPrint, (char) (kmEntry >> 24));
+    appendString(pPrint, "'\n");
+    return VISIT_CONTINUE;
 }
 
-void printNop(void* pContext, UBYTE rawKey, UBYTE kmType, ULONG kmEntry) {
-    printf("%x: (Nop) %lx\n", rawKey, kmEntry);
+BOOL printNop(void* pContext, UBYTE rawKey, UBYTE kmType, ULONG kmEntry) {
+    PrintContext* pPrint = pContext;
+
+    if (pPrint->format == PRINT_JSON) {
+        printJsonKey(pPrint, rawKey, "nop");
+        appendString(pPrint, "}\n");
+        return VISIT_CONTINUE;
+    }
+
+    appendHex(pPrint, rawKey);
+    appendString(pPrint, ": (Nop) ");
+    appendHex(pPrint, kmEntry);
+    appendChar(pPrint, '\n');
+    return VISIT_CONTINUE;
 }
 
-void printString(void* pContext, UBYTE rawKey, int numEntries, const UBYTE* pKmEntry) {
-    printf("%x: (String n=%d) ", rawKey, numEntries);
+BOOL printString(void* pContext, UBYTE rawKey, int numEntries, const UBYTE* pKmEntry) {
+    PrintContext* pPrint = pContext;
     const UBYTE* pDescStart = pKmEntry;
+
+    if (pPrint->format == PRINT_JSON) {
+        printJsonKey(pPrint, rawKey, "string");
+        appendString(pPrint, ",\"strings\":[");
+        for (int n = 0; n < numEntries; n++) {
+            UBYTE len = *(pKmEntry++);
+            const UBYTE* pCh = pDescStart + *(pKmEntry++);
+            if (n > 0) {
+                appendChar(pPrint, ',');
+            }
+            printJsonChars(pPrint, pCh, len);
+        }
+        appendString(pPrint, "]}\n");
+        return VISIT_CONTINUE;
+    }
+
+    appendHex(pPrint, rawKey);
+    appendString(pPrint, ": (String n=");
+    appendDecimal(pPrint, numEntries);
+    appendString(pPrint, ") ");
     for (int n = 0; n < numEntries; n++) {
         UBYTE len = *(pKmEntry++);
-        char* pCh = (char*)(pDescStart + *(pKmEntry++));
-        printf("len=%u ", len);
-        printChars(pCh, len);
+        const char* pCh = (const char*)(pDescStart + *(pKmEntry++));
+        appendString(pPrint, "len=");
+        appendDecimal(pPrint, len);
+        appendChar(pPrint, ' ');
+        printChars(pPrint, pCh, len);
     }
-    printf("\n");
+    appendChar(pPrint, '\n');
+    return VISIT_CONTINUE;
 }
 
-void printDead(void* pContext, UBYTE rawKey, int numEntries, const UBYTE* pTable) {
+static void printJsonDead(PrintContext* pPrint, UBYTE rawKey, int numEntries, const UBYTE* pTable) {
     const UBYTE* pStart = pTable;
-    printf("%x: (DEAD @%p, n=%d) ", rawKey, (void*) pStart, numEntries);
+
+    printJsonKey(pPrint, rawKey, "dead");
+    appendString(pPrint, ",\"dead\":[");
     for (int n = 0; n < numEntries; n++) {
         const UBYTE kind = *(pTable++);
+        const UBYTE value = *(pTable++);
+
+        if (n > 0) {
+            appendChar(pPrint, ',');
+        }
+
         switch (kind) {
             case 0:
-                printf("NONE '");
-                printChar(*(pTable++));
-                printf("' ");
+                appendString(pPrint, "{\"char\":");
+                appendDecimal(pPrint, value);
                 break;
             case DPF_DEAD:
-                printf("DEAD %u ", *(pTable++));
+                appendString(pPrint, "{\"dead\":");
+                appendDecimal(pPrint, value);
+                break;
+            default:
+                assert(kind == DPF_MOD);
+                appendString(pPrint, "{\"mod\":");
+                printJsonChars(pPrint, pStart + value, pPrint->deadCharTableBytes);
+                break;
+        }
+        appendChar(pPrint, '}');
+    }
+    appendString(pPrint, "]}\n");
+}
+
+BOOL printDead(void* pContext, UBYTE rawKey, int numEntries, const UBYTE* pTable) {
+    PrintContext* pPrint = pContext;
+
+    if (pPrint->format == PRINT_JSON) {
+        printJsonDead(pPrint, rawKey, numEntries, pTable);
+        return VISIT_CONTINUE;
+    }
+
+    const UBYTE* pStart = pTable;
+    appendHex(pPrint, rawKey);
+    appendString(pPrint, ": (DEAD @0x");
+    appendHex(pPrint, (ULONG) pStart);
+    appendString(pPrint, ", n=");
+    appendDecimal(pPrint, numEntries);
+    appendString(pPrint, ") ");
+    for (int n = 0; n < numEntries; n++) {
+        const UBYTE kind = *(pTable++);
+        switch (kind) {
+            case 0:
+                appendString(pPrint, "NONE '");
+                printChar(pPrint, *(pTable++));
+                appendString(pPrint, "' ");
+                break;
+            case DPF_DEAD:
+                appendString(pPrint, "DEAD ");
+                appendDecimal(pPrint, *(pTable++));
+                appendChar(pPrint, ' ');
                 break;
             default:
                 assert(kind == DPF_MOD);
                 const UBYTE offset = *(pTable++);
-                printf("MOD +%u ", offset);
-                if (pContext != NULL) {
-                    const Sizes* pSizes = (Sizes*) pContext;
-                    char* pCh = (char*) pStart + offset;
-                    printChars(pCh, pSizes->deadCharTableBytes);
-                }
+                appendString(pPrint, "MOD +");
+                appendDecimal(pPrint, offset);
+                appendChar(pPrint, ' ');
+                printChars(pPrint, (const char*) pStart + offset, pPrint->deadCharTableBytes);
                 break;
         }
     }
-    printf("\n");
+    appendChar(pPrint, '\n');
+    return VISIT_CONTINUE;
 }
 
 void printKeymapAddresses(struct KeyMap* pKeymap) {
@@ -98,3 +348,6 @@ const Visitor PrintVisitor = {
     printDead,
     printNop,
 };
+
+// Traversal specialized for the PrintVisitor (see DEFINE_VISIT)
+DEFINE_VISIT(visitPrint, printNormal, printString, printDead, printNop)
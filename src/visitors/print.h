@@ -1,5 +1,38 @@
+#ifndef PRINT_H
+#define PRINT_H
+
 #include "../visit.h"
 
+#define PRINT_BUFFER_SIZE 4096
+
+// Output formats
+#define PRINT_TEXT  0       // Human-readable, one line per key
+#define PRINT_JSON  1       // One JSON object per key per line (see printJson*())
+
+// Receives each full buffer of formatted output.  (The default writes to stdout.)
+typedef void (*PrintSink)(const char* pChars, ULONG length);
+
+// The PrintVisitor formats into 'buffer' and only passes it to 'pfnSink' when full (and
+// at endPrint()), rather than writing each char to the console.
+typedef struct {
+    struct KeyMap* pKeyMap;         // Keymap being printed (for kmTypes and capsable/repeatable bits)
+    PrintSink pfnSink;
+    UBYTE deadCharTableBytes;       // Size of each DPF_MOD table (from the MeasureVisitor)
+    UBYTE format;                   // PRINT_TEXT or PRINT_JSON
+    UWORD used;                     // Number of chars in 'buffer'
+    char buffer[PRINT_BUFFER_SIZE];
+} PrintContext;
+
+// Prepares 'pPrint' for printing 'pKeyMap' with visitPrint() or the PrintVisitor.
+void beginPrint(PrintContext* pPrint, struct KeyMap* pKeyMap, UBYTE format, UBYTE deadCharTableBytes);
+
+// Flushes any buffered output.
+void endPrint(PrintContext* pPrint);
+
 void printKeymapAddresses(struct KeyMap* pKeymap);
 
 extern const Visitor PrintVisitor;
+
+DECLARE_VISIT(visitPrint)
+
+#endif
@@ -0,0 +1,286 @@
+#include "reverse.h"
+#include "flatten.h"
+#include "measure.h"
+#include <exec/types.h>
+#include <proto/exec.h>
+#include <proto/keymap.h>
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define VANILLA_CONTROL_MASK 0x9F   // KC_VANILLA: control clears bits 5 and 6
+#define MAX_DEAD_INDEX 0x0F         // DP_2DINDEXMASK
+
+typedef struct {
+    struct KeyMap* pKeyMap;
+    KeyStroke* pNext;                       // Next free KeyStroke
+    UBYTE deadCharTableBytes;
+    UBYTE deadKeys[MAX_DEAD_INDEX + 1];     // Raw key of the first DPF_DEAD key for each index
+    UBYTE deadQuals[MAX_DEAD_INDEX + 1];
+} ReverseContext;
+
+static UBYTE getType(const struct KeyMap* pKeyMap, UBYTE rawKey) {
+    return rawKey < LO_MAP_LENGTH
+        ? pKeyMap->km_LoKeyMapTypes[rawKey]
+        : pKeyMap->km_HiKeyMapTypes[rawKey - LO_MAP_LENGTH];
+}
+
+static void addChar(ReverseContext* pReverse, UBYTE ch, UBYTE rawKey, UBYTE quals, UBYTE deadKey) {
+    KeyStroke* pStroke = pReverse->pNext++;
+    pStroke->pString = NULL;
+    pStroke->length = 1;
+    pStroke->ch = ch;
+    pStroke->rawKey = rawKey;
+    pStroke->quals = quals;
+    pStroke->deadKey = deadKey;
+    pStroke->deadQuals = 0;
+}
+
+// 'Normal' keys add one stroke per kmEntry byte (plus the control variants of KC_VANILLA keys).
+BOOL reverseNormal(void* pContext, UBYTE rawKey, UBYTE kmType, ULONG kmEntry) {
+    ReverseContext* pReverse = pContext;
+    const BOOL vanilla = (kmType & KC_VANILLA) == KC_VANILLA;
+    const UBYTE entryType = vanilla
+        ? (KCF_SHIFT | KCF_ALT)
+        : kmType;
+    const int numEntries = calcNumEntries(entryType);
+
+    for (int n = 0; n < numEntries; n++) {
+        const UBYTE ch = (UBYTE)(kmEntry >> (n << 3));
+        const UBYTE quals = calcEntryQuals(entryType, n);
+
+        addChar(pReverse, ch, rawKey, quals, NO_DEAD_KEY);
+        if (vanilla) {
+            addChar(pReverse, ch & VANILLA_CONTROL_MASK, rawKey, quals | FQ_CONTROL, NO_DEAD_KEY);
+        }
+    }
+    return VISIT_CONTINUE;
+}
+
+// 'KCF_NOP' keys produce no output.
+BOOL reverseNop(void* pContext, UBYTE rawKey, UBYTE kmType, ULONG kmEntry) { return VISIT_CONTINUE; }
+
+// 'KCF_STRING' keys add one stroke per non-empty string, referencing the keymap's chars.
+BOOL reverseString(void* pContext, UBYTE rawKey, int numEntries, const UBYTE* pSrcTable) {
+    ReverseContext* pReverse = pContext;
+    const UBYTE kmType = getType(pReverse->pKeyMap, rawKey);
+
+    for (int n = 0; n < numEntries; n++) {
+        const UBYTE len = *(pSrcTable + (n << 1));
+        const UBYTE off = *(pSrcTable + (n << 1) + 1);
+        const UBYTE quals = calcEntryQuals(kmType, n);
+
+        if (len == 0) {
+            continue;
+        }
+
+        if (len == 1) {
+            addChar(pReverse, *(pSrcTable + off), rawKey, quals, NO_DEAD_KEY);
+        } else {
+            KeyStroke* pStroke = pReverse->pNext++;
+            pStroke->pString = pSrcTable + off;
+            pStroke->length = len;
+            pStroke->ch = 0;
+            pStroke->rawKey = rawKey;
+            pStroke->quals = quals;
+            pStroke->deadKey = NO_DEAD_KEY;
+            pStroke->deadQuals = 0;
+        }
+    }
+    return VISIT_CONTINUE;
+}
+
+// 'KCF_DEAD' keys add a stroke for kind 0 chars and one stroke per DPF_MOD table char.
+// Table chars prefixed by a dead key temporarily hold the dead key index in 'deadKey' until
+// all DPF_DEAD keys have been seen (see resolveDeadKeys()).  DPF_DEAD keys are recorded by
+// index.
+BOOL reverseDead(void* pContext, UBYTE rawKey, int numEntries, const UBYTE* pSrcTable) {
+    ReverseContext* pReverse = pContext;
+    const UBYTE kmType = getType(pReverse->pKeyMap, rawKey);
+
+    for (int n = 0; n < numEntries; n++) {
+        const UBYTE kind = *(pSrcTable + (n << 1));
+        const UBYTE value = *(pSrcTable + (n << 1) + 1);
+        const UBYTE quals = calcEntryQuals(kmType, n);
+
+        switch (kind) {
+            case 0:
+                addChar(pReverse, value, rawKey, quals, NO_DEAD_KEY);
+                break;
+            case DPF_DEAD: {
+                const UBYTE index = value & DP_2DINDEXMASK;
+                if (pReverse->deadKeys[index] == NO_DEAD_KEY) {
+                    pReverse->deadKeys[index] = rawKey;
+                    pReverse->deadQuals[index] = quals;
+                }
+                break;
+            }
+            default: {
+                assert(kind == DPF_MOD);
+                const UBYTE* pDeadTable = pSrcTable + value;
+
+                // Entry 0 is the unprefixed char.  Entries 1..15 follow a single dead key.
+                // (Double-dead combinations are not indexed.)
+                UBYTE len = pReverse->deadCharTableBytes;
+                if (len > MAX_DEAD_INDEX + 1) {
+                    len = MAX_DEAD_INDEX + 1;
+                }
+
+                addChar(pReverse, pDeadTable[0], rawKey, quals, NO_DEAD_KEY);
+                for (UBYTE i = 1; i < len; i++) {
+                    addChar(pReverse, pDeadTable[i], rawKey, quals, /* deadKey: */ i);
+                }
+                break;
+            }
+        }
+    }
+    return VISIT_CONTINUE;
+}
+
+// Traversal specialized for building the reverse index (see DEFINE_VISIT)
+DEFINE_VISIT(visitReverse, reverseNormal, reverseString, reverseDead, reverseNop)
+
+// Replaces the dead key index of prefixed strokes with the raw key/qualifiers of the
+// DPF_DEAD key, dropping strokes whose index no dead key produces.  Returns the new end.
+static KeyStroke* resolveDeadKeys(ReverseContext* pReverse, KeyStroke* pStart) {
+    KeyStroke* pOut = pStart;
+
+    for (KeyStroke* pStroke = pStart; pStroke < pReverse->pNext; pStroke++) {
+        const UBYTE index = pStroke->deadKey;
+
+        if (index != NO_DEAD_KEY) {
+            if (pReverse->deadKeys[index] == NO_DEAD_KEY) {
+                continue;
+            }
+            pStroke->deadKey = pReverse->deadKeys[index];
+            pStroke->deadQuals = pReverse->deadQuals[index];
+        }
+
+        *(pOut++) = *pStroke;
+    }
+
+    return pOut;
+}
+
+static const UBYTE* strokeChars(const KeyStroke* pStroke) {
+    return pStroke->pString != NULL
+        ? pStroke->pString
+        : &pStroke->ch;
+}
+
+// Number of keys/qualifiers that must be pressed (a dead key counts as a key press).
+static int strokeCost(const KeyStroke* pStroke) {
+    int cost = ((pStroke->quals & FQ_SHIFT) != 0)
+        + ((pStroke->quals & FQ_ALT) != 0)
+        + ((pStroke->quals & FQ_CONTROL) != 0);
+
+    if (pStroke->deadKey != NO_DEAD_KEY) {
+        cost += 4;
+    }
+
+    return cost;
+}
+
+static int compareChars(const UBYTE* pLeft, UBYTE leftLength, const UBYTE* pRight, UBYTE rightLength) {
+    const int result = memcmp(pLeft, pRight, leftLength < rightLength ? leftLength : rightLength);
+    return result != 0
+        ? result
+        : (int) leftLength - (int) rightLength;
+}
+
+// Orders strokes by their chars, then from simplest to most complex.
+static int compareStrokes(const void* pLeft, const void* pRight) {
+    const KeyStroke* pL = pLeft;
+    const KeyStroke* pR = pRight;
+
+    int result = compareChars(strokeChars(pL), pL->length, strokeChars(pR), pR->length);
+    if (result == 0) { result = strokeCost(pL) - strokeCost(pR); }
+    if (result == 0) { result = (int) pL->rawKey - (int) pR->rawKey; }
+    if (result == 0) { result = (int) pL->quals - (int) pR->quals; }
+    return result;
+}
+
+ReverseIndex* buildReverseIndex(struct KeyMap* pKeyMap) {
+    Sizes sizes = { 0 };
+    visitMeasure(pKeyMap, &sizes);
+
+    // At most 8 strokes per key, plus up to 15 dead key prefixed strokes per DPF_MOD table.
+    const UBYTE prefixed = sizes.deadCharTableBytes > MAX_DEAD_INDEX
+        ? MAX_DEAD_INDEX
+        : (sizes.deadCharTableBytes > 0 ? sizes.deadCharTableBytes - 1 : 0);
+    const ULONG capacity = (FLAT_KEYS << 3) + sizes.modEntries * prefixed;
+    const ULONG blockSize = sizeof(ReverseIndex) + capacity * sizeof(KeyStroke);
+
+    ReverseIndex* pIndex = AllocMem(blockSize, MEMF_CLEAR | MEMF_PUBLIC);
+    if (pIndex == NULL) {
+        return NULL;
+    }
+
+    pIndex->pStrokes = (KeyStroke*)(pIndex + 1);
+    pIndex->blockSize = blockSize;
+
+    ReverseContext reverse;
+    reverse.pKeyMap = pKeyMap;
+    reverse.pNext = pIndex->pStrokes;
+    reverse.deadCharTableBytes = sizes.deadCharTableBytes;
+    memset(reverse.deadKeys, NO_DEAD_KEY, sizeof(reverse.deadKeys));
+    memset(reverse.deadQuals, 0, sizeof(reverse.deadQuals));
+
+    visitReverse(pKeyMap, &reverse);
+    assert(reverse.pNext <= pIndex->pStrokes + capacity);
+
+    pIndex->numStrokes = resolveDeadKeys(&reverse, pIndex->pStrokes) - pIndex->pStrokes;
+    qsort(pIndex->pStrokes, pIndex->numStrokes, sizeof(KeyStroke), compareStrokes);
+
+    // Single chars sort before any longer string beginning with the same char, so a
+    // backwards scan leaves the first (simplest) stroke for each char in 'charIndex'.
+    for (ULONG i = pIndex->numStrokes; i > 0; i--) {
+        const KeyStroke* pStroke = &pIndex->pStrokes[i - 1];
+        if (pStroke->length == 1) {
+            pIndex->charIndex[pStroke->ch] = (UWORD) i;
+        }
+    }
+
+    return pIndex;
+}
+
+void freeReverseIndex(ReverseIndex* pIndex) {
+    FreeMem(pIndex, pIndex->blockSize);
+}
+
+const KeyStroke* findChar(const ReverseIndex* pIndex, UBYTE ch) {
+    const UWORD i = pIndex->charIndex[ch];
+    return i != 0
+        ? &pIndex->pStrokes[i - 1]
+        : NULL;
+}
+
+const KeyStroke* findString(const ReverseIndex* pIndex, const UBYTE* pChars, UBYTE length) {
+    if (length == 1) {
+        return findChar(pIndex, *pChars);
+    }
+
+    // Find the first stroke whose chars are not less than 'pChars'.
+    ULONG lo = 0;
+    ULONG hi = pIndex->numStrokes;
+
+    while (lo < hi) {
+        const ULONG mid = (lo + hi) >> 1;
+        const KeyStroke* pStroke = &pIndex->pStrokes[mid];
+
+        if (compareChars(strokeChars(pStroke), pStroke->length, pChars, length) < 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+
+    if (lo < pIndex->numStrokes) {
+        const KeyStroke* pStroke = &pIndex->pStrokes[lo];
+        if (compareChars(strokeChars(pStroke), pStroke->length, pChars, length) == 0) {
+            return pStroke;
+        }
+    }
+
+    return NULL;
+}
@@ -0,0 +1,46 @@
+#ifndef REVERSE_H
+#define REVERSE_H
+
+#include "../visit.h"
+#include <proto/keymap.h>
+
+#define NO_DEAD_KEY 0xFF
+
+// A key press (optionally preceded by a dead key) that produces a char or string.
+// Qualifiers are FQ_* bits (see flatten.h).
+typedef struct {
+    const UBYTE* pString;   // KCF_STRING chars in the keymap (NULL for single char entries)
+    UBYTE length;           // Number of chars produced
+    UBYTE ch;               // The char produced by single char entries
+    UBYTE rawKey;
+    UBYTE quals;
+    UBYTE deadKey;          // Raw key of the dead key to press first (NO_DEAD_KEY if none)
+    UBYTE deadQuals;        // Qualifiers for 'deadKey'
+} KeyStroke;
+
+// A reverse index maps chars and strings back to the key strokes that produce them.  It
+// covers normal keys, KCF_STRING sequences, and DPF_MOD dead key combinations (single dead
+// keys only).  KeyStrokes are sorted by the chars they produce, with the simplest stroke
+// (fewest qualifiers, no dead key, lowest raw key) first.
+//
+// String entries reference the chars in the keymap, so the keymap must outlive the index.
+typedef struct {
+    KeyStroke* pStrokes;
+    ULONG numStrokes;
+    UWORD charIndex[0x100];     // 1 + index of the first stroke producing each single char (0 if none)
+    ULONG blockSize;
+} ReverseIndex;
+
+// Builds a reverse index for 'pKeyMap'.  Returns NULL if the allocation fails.
+ReverseIndex* buildReverseIndex(struct KeyMap* pKeyMap);
+
+void freeReverseIndex(ReverseIndex* pIndex);
+
+// Returns the simplest key stroke producing 'ch', or NULL if there is none.  (O(1))
+const KeyStroke* findChar(const ReverseIndex* pIndex, UBYTE ch);
+
+// Returns the simplest key stroke producing exactly the 'length' chars at 'pChars', or NULL
+// if there is none.  (Binary search)
+const KeyStroke* findString(const ReverseIndex* pIndex, const UBYTE* pChars, UBYTE length);
+
+#endif